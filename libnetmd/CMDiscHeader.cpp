@@ -15,17 +15,39 @@
  * You should have received a copy of the GNU General Public License
  */
 #include <algorithm>
+#include <climits>
+#include <cstdio>
 #include <cstring>
 #include <regex>
 #include <sstream>
 #include "CMDiscHeader.h"
 
+namespace
+{
+    //! initial capacity of the serialized header (grows if needed)
+    constexpr size_t HEADER_RESERVE = 1024;
+
+    //--------------------------------------------------------------------------
+    //! @brief      sort key of a group: disc title first, empty groups last
+    //!
+    //! @param[in]  g     group
+    //!
+    //! @return     sort key
+    //--------------------------------------------------------------------------
+    inline int groupKey(const CMDiscHeader::Group_t& g)
+    {
+        return (g.mFirst == -1) ? INT_MAX : g.mFirst;
+    }
+}
+
 //-----------------------------------------------------------------------------
 //! @brief      Constructs a new instance.
 //-----------------------------------------------------------------------------
 CMDiscHeader::CMDiscHeader() : mGroupId(0), 
-    mpCStringHeader(nullptr), mpLastString(nullptr)
+    mpLastString(nullptr), mStoredSize(-1), mDirty(true)
 {
+    mHeader.reserve(HEADER_RESERVE);
+
     // add title entry
     mGroups.push_back({mGroupId++, 0, -1, ""});
 }
@@ -36,8 +58,9 @@ CMDiscHeader::CMDiscHeader() : mGroupId(0),
 //! @param[in]  header  The RAW disc header as string
 //-----------------------------------------------------------------------------
 CMDiscHeader::CMDiscHeader(const std::string& header) : mGroupId(0), 
-    mpCStringHeader(nullptr), mpLastString(nullptr)
+    mpLastString(nullptr), mStoredSize(-1), mDirty(true)
 {
+    mHeader.reserve(HEADER_RESERVE);
     fromString(header);
 }
 
@@ -46,12 +69,6 @@ CMDiscHeader::CMDiscHeader(const std::string& header) : mGroupId(0),
 //-----------------------------------------------------------------------------
 CMDiscHeader::~CMDiscHeader()
 {
-    if (mpCStringHeader != nullptr)
-    {
-        free(mpCStringHeader);
-        mpCStringHeader = nullptr;
-    }
-
     if (mpLastString != nullptr)
     {
         free(mpLastString);
@@ -136,6 +153,10 @@ int CMDiscHeader::fromString(const std::string& header)
         }
     }
 
+    // from here on groups are kept sorted
+    std::stable_sort(mGroups.begin(), mGroups.end(), &CMDiscHeader::groupCompare);
+    mDirty = true;
+
     if ((ret = sanityCheck(mGroups)) == 0)
     {
         listGroups();
@@ -155,12 +176,14 @@ int CMDiscHeader::sanityCheck(const Groups_t& grps) const
 {
     int last = 0, ret = 0;
 
-    Groups_t tmpGrps = grps;
-
-    std::sort(tmpGrps.begin(), tmpGrps.end(), 
-        &CMDiscHeader::groupCompare);
+    if (!std::is_sorted(grps.begin(), grps.end(), &CMDiscHeader::groupCompare))
+    {
+        Groups_t tmpGrps = grps;
+        std::stable_sort(tmpGrps.begin(), tmpGrps.end(), &CMDiscHeader::groupCompare);
+        return sanityCheck(tmpGrps);
+    }
 
-    for(const auto& g : tmpGrps)
+    for(const auto& g : grps)
     {
         if ((g.mFirst == 0) && (g.mLast != -1))
         {
@@ -203,64 +226,63 @@ int CMDiscHeader::sanityCheck(const Groups_t& grps) const
 //-----------------------------------------------------------------------------
 bool CMDiscHeader::groupCompare(const Group_t& a, const Group_t& b)
 {
-    // empty groups (first == -1) must be last
-    return ((a.mFirst < b.mFirst) && (a.mFirst != -1));
+    // disc title (first == 0) first, empty groups (first == -1) last
+    return groupKey(a) < groupKey(b);
 }
 
 //-----------------------------------------------------------------------------
-//! @brief      Returns a string representation of the object.
-//!
-//! @return     String representation of the object.
+//! @brief      build the header string if groups changed since last time;
+//!             groups are sorted already, the buffer is reused
 //-----------------------------------------------------------------------------
-std::string CMDiscHeader::toString()
+void CMDiscHeader::serialize()
 {
-    std::ostringstream oss;
+    char num[16];
 
-    if (mpCStringHeader != nullptr)
+    if (!mDirty)
     {
-        free(mpCStringHeader);
-        mpCStringHeader = nullptr;
+        return;
     }
 
-    Groups_t tmpGrps = mGroups;
+    mHeader.clear();
 
-    Group_t& title = tmpGrps.at(0);
+    const Group_t& title = mGroups.at(0);
 
-    if (title.mFirst == 0)
+    if ((title.mFirst == 0) && (mGroups.size() == 1))
     {
-        if (tmpGrps.size() == 1)
-        {
-            mpCStringHeader = strdup(title.mName.c_str());
-            return title.mName;
-        }
-        else
-        {
-            oss << "0;" << title.mName << "//";
-            tmpGrps.erase(tmpGrps.begin());
-        }
+        mHeader.append(title.mName);
     }
-
-    std::sort(tmpGrps.begin(), tmpGrps.end(), 
-        &CMDiscHeader::groupCompare);
-
-    for (const auto& g : tmpGrps)
+    else
     {
-        if (g.mFirst != -1)
+        for (const auto& g : mGroups)
         {
-            oss << g.mFirst;
-        }
+            if (g.mFirst != -1)
+            {
+                snprintf(num, sizeof(num), "%d", static_cast<int>(g.mFirst));
+                mHeader.append(num);
+            }
 
-        if (g.mLast != -1)
-        {
-            oss << "-" << g.mLast;
-        }
+            if (g.mLast != -1)
+            {
+                snprintf(num, sizeof(num), "-%d", static_cast<int>(g.mLast));
+                mHeader.append(num);
+            }
 
-        oss << ";" << g.mName << "//";
+            mHeader.append(1, ';').append(g.mName).append("//");
+        }
     }
 
-    mpCStringHeader = strdup(oss.str().c_str());
+    mDirty = false;
+}
 
-    return oss.str();
+//-----------------------------------------------------------------------------
+//! @brief      Returns a string representation of the object.
+//!
+//! @return     String representation of the object.
+//-----------------------------------------------------------------------------
+std::string CMDiscHeader::toString()
+{
+    serialize();
+    return mHeader;
 }
 
 //-----------------------------------------------------------------------------
@@ -275,12 +297,16 @@ std::string CMDiscHeader::toString()
 int CMDiscHeader::addGroup(const std::string& name, int16_t first, int16_t last)
 {
     Groups_t tmpGrps = mGroups;
-    tmpGrps.push_back({mGroupId++, first, last, name});
+    Group_t  group   = {mGroupId++, first, last, name};
+
+    // keep groups sorted
+    tmpGrps.insert(std::upper_bound(tmpGrps.begin(), tmpGrps.end(), group, &CMDiscHeader::groupCompare), group);
 
     if (sanityCheck(tmpGrps) == 0)
     {
         netmd_log(NETMD_LOG_VERBOSE, "Sanity check for 'addGroup()' successful!\n", mGroupId);
-        mGroups = tmpGrps;
+        mGroups.swap(tmpGrps);
+        mDirty = true;
         return mGroupId - 1;
     }
     else
@@ -345,14 +371,20 @@ int CMDiscHeader::addTrackToGroup(int gid, int16_t track)
     int16_t first, last;
     bool changed = false;
 
-    for (auto& g : tmpGrps)
+    for (auto it = tmpGrps.begin(); it != tmpGrps.end(); it++)
     {
+        Group_t& g = *it;
+
         if (g.mGid == gid)
         {
             if ((g.mFirst == -1) && (g.mLast == -1))
             {
-                g.mFirst = track;
-                changed  = true;
+                // an empty group sorts last, move it to its new position
+                Group_t group = g;
+                group.mFirst  = track;
+                tmpGrps.erase(it);
+                tmpGrps.insert(std::upper_bound(tmpGrps.begin(), tmpGrps.end(), group, &CMDiscHeader::groupCompare), group);
+                changed = true;
                 break;
             }
 
@@ -375,7 +407,8 @@ int CMDiscHeader::addTrackToGroup(int gid, int16_t track)
 
     if (changed && (sanityCheck(tmpGrps) == 0))
     {
-        mGroups = tmpGrps;
+        mGroups.swap(tmpGrps);
+        mDirty = true;
         return 0;
     }
 
@@ -444,7 +477,8 @@ int CMDiscHeader::delTrackFromGroup(int gid, int16_t track)
 
     if (changed && (sanityCheck(tmpGrps) == 0))
     {
-        mGroups = tmpGrps;
+        mGroups.swap(tmpGrps);
+        mDirty = true;
         return 0;
     }
 
@@ -505,7 +539,8 @@ int CMDiscHeader::delTrack(int16_t track)
 
     if (changed && (sanityCheck(tmpGrps) == 0))
     {
-        mGroups = tmpGrps;
+        mGroups.swap(tmpGrps);
+        mDirty = true;
         return 0;
     }
 
@@ -531,6 +566,7 @@ int CMDiscHeader::delGroup(int gid)
         {
             netmd_log(NETMD_LOG_VERBOSE, "Delete group %d, name: '%s'\n", cit->mGid, cit->mName.c_str());
             mGroups.erase(cit);
+            mDirty = true;
             ret = 0;
             break;
         }
@@ -549,6 +585,7 @@ int CMDiscHeader::delGroup(int gid)
 int CMDiscHeader::setDiscTitle(const std::string& title)
 {
     mGroups.at(0).mName = title;
+    mDirty = true;
     return 0;
 }
 
@@ -584,6 +621,7 @@ int CMDiscHeader::renameGroup(int gid, const std::string& title)
         if (g.mGid == gid)
         {
             g.mName = title;
+            mDirty  = true;
             return 0;
         }
     }
@@ -592,13 +630,14 @@ int CMDiscHeader::renameGroup(int gid, const std::string& title)
 }
 
 //-----------------------------------------------------------------------------
-//! @brief      return the C string header
+//! @brief      return the C string header (only rebuilt after changes)
 //!
 //! @return     C string with MD header data
 //-----------------------------------------------------------------------------
 const char* CMDiscHeader::stringHeader()
 {
-    return mpCStringHeader;
+    serialize();
+    return mHeader.c_str();
 }
 
 //-----------------------------------------------------------------------------
@@ -677,11 +716,118 @@ int CMDiscHeader::unGroup(int16_t track)
 //! @return     const reference to groups
 //-----------------------------------------------------------------------------
 CMDiscHeader::Groups_t CMDiscHeader::groups() const
+{
+    // groups are kept sorted
+    return mGroups;
+}
+
+//-----------------------------------------------------------------------------
+//! @brief      set size of the header as it is stored on the device
+//!
+//! @param[in]  sz    The size (-1 -> unknown)
+//-----------------------------------------------------------------------------
+void CMDiscHeader::setStoredSize(int sz)
+{
+    mStoredSize = sz;
+}
+
+//-----------------------------------------------------------------------------
+//! @brief      get size of the header as it is stored on the device
+//!
+//! @return     size of stored header; -1 -> unknown
+//-----------------------------------------------------------------------------
+int CMDiscHeader::storedSize() const
+{
+    return mStoredSize;
+}
+
+//-----------------------------------------------------------------------------
+//! @brief      take over groups and group ids of another header (e.g. to
+//!             roll back to a saved copy); the stored size is kept
+//!
+//! @param[in]  other  header to copy groups from
+//-----------------------------------------------------------------------------
+void CMDiscHeader::assignGroups(const CMDiscHeader& other)
+{
+    mGroups  = other.mGroups;
+    mGroupId = other.mGroupId;
+    mDirty   = true;
+}
+
+//-----------------------------------------------------------------------------
+//! @brief      move group ranges after tracks were reordered; if the tracks
+//!             of a group aren't adjacent anymore, the group keeps the
+//!             longest adjacent run, the other tracks become ungrouped
+//!
+//! @param[in]  newPos  new track number for each old track (index = old - 1)
+//!
+//! @return     0 -> ok; -1 -> error
+//-----------------------------------------------------------------------------
+int CMDiscHeader::remapTracks(const std::vector<int16_t>& newPos)
 {
     Groups_t tmpGrps = mGroups;
-    std::sort(tmpGrps.begin(), tmpGrps.end(), 
-        &CMDiscHeader::groupCompare);
-    return tmpGrps;
+    int16_t last;
+    std::vector<int16_t> pos;
+    size_t best, bestLen, run;
+
+    for (auto& g : tmpGrps)
+    {
+        // skip disc title and empty groups
+        if (g.mFirst < 1)
+        {
+            continue;
+        }
+
+        last = (g.mLast == -1) ? g.mFirst : g.mLast;
+        pos.clear();
+
+        for (int16_t t = g.mFirst; t <= last; t++)
+        {
+            pos.push_back((t <= static_cast<int16_t>(newPos.size())) ? newPos[t - 1] : t);
+        }
+
+        std::sort(pos.begin(), pos.end());
+
+        // find longest run of adjacent tracks
+        best    = 0;
+        bestLen = 1;
+        run     = 0;
+
+        for (size_t i = 1; i < pos.size(); i++)
+        {
+            if (pos[i] != (pos[i - 1] + 1))
+            {
+                run = i;
+            }
+
+            if ((i - run + 1) > bestLen)
+            {
+                best    = run;
+                bestLen = i - run + 1;
+            }
+        }
+
+        if (bestLen < pos.size())
+        {
+            netmd_log(NETMD_LOG_WARNING, "Tracks of group '%s' aren't adjacent anymore, %d track(s) ungrouped!\n",
+                      g.mName.c_str(), static_cast<int>(pos.size() - bestLen));
+        }
+
+        g.mFirst = pos[best];
+        g.mLast  = (bestLen > 1) ? pos[best + bestLen - 1] : -1;
+    }
+
+    // reordering may change the group order
+    std::stable_sort(tmpGrps.begin(), tmpGrps.end(), &CMDiscHeader::groupCompare);
+
+    if (sanityCheck(tmpGrps) == 0)
+    {
+        mGroups.swap(tmpGrps);
+        mDirty = true;
+        return 0;
+    }
+
+    return -1;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -724,7 +870,6 @@ const char* md_header_to_string(HndMdHdr hdl)
     CMDiscHeader* pMDH = static_cast<CMDiscHeader*>(hdl);
     if (pMDH != nullptr)
     {
-        static_cast<void>(pMDH->toString());
         return pMDH->stringHeader();
     }
     return "";
@@ -1010,3 +1155,101 @@ void md_header_free_groups(MDGroups** groups)
         *groups = nullptr;
     }
 }
+
+//------------------------------------------------------------------------------
+//! @brief      set size of the header as it is stored on the device
+//!             (netmd_write_disc_header() needs it for the write request)
+//!
+//! @param[in]  hdl   The MD header handle
+//! @param[in]  sz    The size (-1 -> unknown, will be read from device)
+//------------------------------------------------------------------------------
+void md_header_set_stored_size(HndMdHdr hdl, int sz)
+{
+    CMDiscHeader* pMDH = static_cast<CMDiscHeader*>(hdl);
+    if (pMDH != nullptr)
+    {
+        pMDH->setStoredSize(sz);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      get size of the header as it is stored on the device
+//!
+//! @param[in]  hdl   The MD header handle
+//!
+//! @return     size of stored header; -1 -> unknown
+//------------------------------------------------------------------------------
+int md_header_stored_size(HndMdHdr hdl)
+{
+    CMDiscHeader* pMDH = static_cast<CMDiscHeader*>(hdl);
+    if (pMDH != nullptr)
+    {
+        return pMDH->storedSize();
+    }
+    return -1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      move group ranges after tracks were reordered
+//!
+//! @param[in]  hdl     The MD header handle
+//! @param[in]  newPos  new track number for each old track (index = old - 1)
+//! @param[in]  count   number of entries in newPos
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int md_header_remap_tracks(HndMdHdr hdl, const int16_t* newPos, int count)
+{
+    CMDiscHeader* pMDH = static_cast<CMDiscHeader*>(hdl);
+    if ((pMDH != nullptr) && (newPos != nullptr) && (count > 0))
+    {
+        return pMDH->remapTracks(std::vector<int16_t>(newPos, newPos + count));
+    }
+    return -1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      create a copy of a MD header (free with free_md_header())
+//!
+//! @param[in]  hdl   The MD header handle
+//!
+//! @return     handle of copy; NULL -> error
+//------------------------------------------------------------------------------
+HndMdHdr md_header_clone(HndMdHdr hdl)
+{
+    CMDiscHeader* pMDH = static_cast<CMDiscHeader*>(hdl);
+    CMDiscHeader* pCopy;
+
+    if (pMDH == nullptr)
+    {
+        return nullptr;
+    }
+
+    pCopy = new CMDiscHeader();
+    pCopy->assignGroups(*pMDH);
+    pCopy->setStoredSize(pMDH->storedSize());
+    return static_cast<HndMdHdr>(pCopy);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      roll a MD header back to a copy made with md_header_clone();
+//!             group ids are the ones of the copy, the stored size is kept
+//!
+//! @param[in]  hdl   The MD header handle
+//! @param[in]  src   The copy
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int md_header_restore(HndMdHdr hdl, HndMdHdr src)
+{
+    CMDiscHeader* pMDH = static_cast<CMDiscHeader*>(hdl);
+    CMDiscHeader* pSrc = static_cast<CMDiscHeader*>(src);
+
+    if ((pMDH == nullptr) || (pSrc == nullptr))
+    {
+        return -1;
+    }
+
+    pMDH->assignGroups(*pSrc);
+    return 0;
+}
@@ -166,9 +166,10 @@ public:
     std::string trackGroup(int16_t track, int16_t* pGid);
 
     //-----------------------------------------------------------------------------
-    //! @brief      return the C string header
+    //! @brief      return the C string header; it's only serialized again
+    //!             if groups / titles changed since the last call
     //!
-    //! @return     C string with MD header data
+    //! @return     C string with MD header data (valid until next change)
     //-----------------------------------------------------------------------------
     const char* stringHeader();
 
@@ -205,6 +206,39 @@ public:
     //-----------------------------------------------------------------------------
     Groups_t groups() const;
 
+    //-----------------------------------------------------------------------------
+    //! @brief      set size of the header as it is stored on the device
+    //!
+    //! @param[in]  sz    The size (-1 -> unknown)
+    //-----------------------------------------------------------------------------
+    void setStoredSize(int sz);
+
+    //-----------------------------------------------------------------------------
+    //! @brief      get size of the header as it is stored on the device
+    //!
+    //! @return     size of stored header; -1 -> unknown
+    //-----------------------------------------------------------------------------
+    int storedSize() const;
+
+    //-----------------------------------------------------------------------------
+    //! @brief      move group ranges after tracks were reordered; if the tracks
+    //!             of a group aren't adjacent anymore, the group keeps the
+    //!             longest adjacent run, the other tracks become ungrouped
+    //!
+    //! @param[in]  newPos  new track number for each old track (index = old - 1)
+    //!
+    //! @return     0 -> ok; -1 -> error
+    //-----------------------------------------------------------------------------
+    int remapTracks(const std::vector<int16_t>& newPos);
+
+    //-----------------------------------------------------------------------------
+    //! @brief      take over groups and group ids of another header (e.g. to
+    //!             roll back to a saved copy); the stored size is kept
+    //!
+    //! @param[in]  other  header to copy groups from
+    //-----------------------------------------------------------------------------
+    void assignGroups(const CMDiscHeader& other);
+
 protected:
     //-----------------------------------------------------------------------------
     //! @brief      check groups / tracks for sanity
@@ -215,11 +249,18 @@ protected:
     //-----------------------------------------------------------------------------
     int sanityCheck(const Groups_t& grps) const;
 
+    //-----------------------------------------------------------------------------
+    //! @brief      build the header string if groups changed since last time
+    //-----------------------------------------------------------------------------
+    void serialize();
+
 private:
-    Groups_t     mGroups;
+    Groups_t     mGroups;           //!< groups, sorted by first track
     int          mGroupId;
-    char*        mpCStringHeader;
     char*        mpLastString;
+    int          mStoredSize;
+    std::string  mHeader;           //!< serialized header (reused buffer)
+    bool         mDirty;            //!< groups changed since last serialize()
 };
 
 extern "C" {
@@ -399,6 +440,55 @@ MDGroups* md_header_groups(HndMdHdr hdl);
 //------------------------------------------------------------------------------
 void md_header_free_groups(MDGroups** groups);
 
+//------------------------------------------------------------------------------
+//! @brief      set size of the header as it is stored on the device
+//!             (netmd_write_disc_header() needs it for the write request)
+//!
+//! @param[in]  hdl   The MD header handle
+//! @param[in]  sz    The size (-1 -> unknown, will be read from device)
+//------------------------------------------------------------------------------
+void md_header_set_stored_size(HndMdHdr hdl, int sz);
+
+//------------------------------------------------------------------------------
+//! @brief      get size of the header as it is stored on the device
+//!
+//! @param[in]  hdl   The MD header handle
+//!
+//! @return     size of stored header; -1 -> unknown
+//------------------------------------------------------------------------------
+int md_header_stored_size(HndMdHdr hdl);
+
+//------------------------------------------------------------------------------
+//! @brief      move group ranges after tracks were reordered
+//!
+//! @param[in]  hdl     The MD header handle
+//! @param[in]  newPos  new track number for each old track (index = old - 1)
+//! @param[in]  count   number of entries in newPos
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int md_header_remap_tracks(HndMdHdr hdl, const int16_t* newPos, int count);
+
+//------------------------------------------------------------------------------
+//! @brief      create a copy of a MD header (free with free_md_header())
+//!
+//! @param[in]  hdl   The MD header handle
+//!
+//! @return     handle of copy; NULL -> error
+//------------------------------------------------------------------------------
+HndMdHdr md_header_clone(HndMdHdr hdl);
+
+//------------------------------------------------------------------------------
+//! @brief      roll a MD header back to a copy made with md_header_clone();
+//!             group ids are the ones of the copy, the stored size is kept
+//!
+//! @param[in]  hdl   The MD header handle
+//! @param[in]  src   The copy
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int md_header_restore(HndMdHdr hdl, HndMdHdr src);
+
 /* copy end */
 
 #ifdef __cplusplus
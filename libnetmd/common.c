@@ -30,6 +30,8 @@
 #include "const.h"
 #include "log.h"
 #include "utils.h"
+#include "netmd_trace.h"
+#include "netmd_dev.h"
 
 #define NETMD_POLL_TIMEOUT 1000	/* miliseconds */
 #define NETMD_SEND_TIMEOUT 1000
@@ -37,21 +39,6 @@
 #define NETMD_RECV_TRIES 30
 #define NETMD_SYNC_TRIES 5
 
-//! @brief factory write
-static int _s_factory = 0;
-
-//------------------------------------------------------------------------------
-//! @brief      enable / disable factory write
-//!
-//! @param      devh    The devh
-//! @param      enable  1 to enable factory write, 0 to disable
-//------------------------------------------------------------------------------
-void netmd_set_factory_write(int enable)
-{
-    netmd_log(NETMD_LOG_DEBUG, "Set factory write to %s!\n", enable ? "0xff" : "0x80");
-    _s_factory = enable;
-}
-
 /*
   polls to see if minidisc wants to send data
 
@@ -68,9 +55,11 @@ int netmd_poll(libusb_device_handle *dev, unsigned char *buf, int tries, uint16_
        Unsure if just increasing limit is good practice, so set sleep time to
        grow back to 1s if it retries more than 10x. Testing with 780 shows this
        works for track transfers, typically hitting 15 loop iterations.
+       The sleep ladder comes from the device profile.
     */
+    const netmd_dev_profile *prof = netmd_dev_profile_get((netmd_dev_handle *)dev);
     int i;
-    int sleepytime = 5;
+    unsigned sleepytime = prof->poll_first_ms;
 
     for (i = 0; i < tries; i++) {
         /* send a poll message */
@@ -80,6 +69,7 @@ int netmd_poll(libusb_device_handle *dev, unsigned char *buf, int tries, uint16_
                             LIBUSB_RECIPIENT_INTERFACE, 0x01, 0, 0, buf, 4,
                             NETMD_POLL_TIMEOUT) < 0) {
             netmd_log(NETMD_LOG_ERROR, "netmd_poll: libusb_control_transfer failed\n");
+            netmd_trace_error(dev, NETMDERR_USB);
             return NETMDERR_USB;
         }
 
@@ -89,13 +79,15 @@ int netmd_poll(libusb_device_handle *dev, unsigned char *buf, int tries, uint16_
 
         if (i > 0) {
             netmd_sleep(sleepytime);
-            sleepytime = 100;
+            sleepytime = prof->poll_ms;
         }
-        if (i > 10) {
-          sleepytime = 1000;
+        if (i > (int)prof->poll_slow_after) {
+          sleepytime = prof->poll_slow_ms;
         }
     }
 
+    netmd_trace(NETMD_TRACE_POLL, dev, (buf[3] << 8) | buf[2], buf, 4);
+
     if (fullLength != NULL)
     {
         /* we might receive more than 255 bytes */
@@ -110,6 +102,12 @@ int netmd_exch_message(netmd_dev_handle *devh, unsigned char *cmd,
                        const size_t cmdlen, unsigned char *rsp)
 {
     int len;
+
+    /* command and response must not interleave with other threads */
+    if (netmd_dev_lock(devh) != NETMD_NO_ERROR) {
+        return NETMDERR_USB;
+    }
+
     netmd_send_message(devh, cmd, cmdlen);
     len = netmd_recv_message(devh, rsp);
 
@@ -121,6 +119,7 @@ int netmd_exch_message(netmd_dev_handle *devh, unsigned char *cmd,
       netmd_log(NETMD_LOG_DEBUG, "Response code:\n");
       netmd_log_hex(NETMD_LOG_DEBUG, &rsp[0], 1);
     }
+    netmd_dev_unlock(devh);
 
     // Verify the command's return state here.
     if(rsp[0] == 0x0a || rsp[0] == 0x08){
@@ -144,11 +143,20 @@ int netmd_exch_message_ex(netmd_dev_handle *devh, unsigned char *cmd,
                           const size_t cmdlen, unsigned char **rspPtr)
 {
     int len = 0;
+
+    *rspPtr = NULL;
+
+    if (netmd_dev_lock(devh) != NETMD_NO_ERROR)
+    {
+        return NETMDERR_USB;
+    }
+
     netmd_send_message(devh, cmd, cmdlen);
     len = netmd_recv_message_ex(devh, rspPtr);
 
     if (*rspPtr == NULL)
     {
+        netmd_dev_unlock(devh);
         return -1;
     }
 
@@ -164,6 +172,7 @@ int netmd_exch_message_ex(netmd_dev_handle *devh, unsigned char *cmd,
 
         if (*rspPtr == NULL)
         {
+            netmd_dev_unlock(devh);
             return -1;
         }
         rsp = *rspPtr;
@@ -171,6 +180,41 @@ int netmd_exch_message_ex(netmd_dev_handle *devh, unsigned char *cmd,
         netmd_log_hex(NETMD_LOG_DEBUG, &rsp[0], 1);
     }
 
+    netmd_dev_unlock(devh);
+    return len;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      exchange command / response into a caller provided buffer
+//!
+//! @param[in]  devh     device handle
+//! @param[in]  cmd      command
+//! @param[in]  cmdlen   command length
+//! @param[out] rsp      response buffer
+//! @param[in]  rspsize  size of response buffer
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+int netmd_exch_message_buf(netmd_dev_handle *devh, unsigned char *cmd,
+                           const size_t cmdlen, unsigned char *rsp, size_t rspsize)
+{
+    int len;
+
+    if (netmd_dev_lock(devh) != NETMD_NO_ERROR)
+    {
+        return NETMDERR_USB;
+    }
+
+    netmd_send_message(devh, cmd, cmdlen);
+    len = netmd_recv_message_buf(devh, rsp, rspsize);
+
+    if ((len > 0) && (rsp[0] == NETMD_STATUS_INTERIM))
+    {
+        netmd_log(NETMD_LOG_DEBUG, "Re-reading:\n");
+        len = netmd_recv_message_buf(devh, rsp, rspsize);
+    }
+
+    netmd_dev_unlock(devh);
     return len;
 }
 
@@ -187,19 +231,25 @@ int netmd_send_message(netmd_dev_handle *devh, unsigned char *cmd,
     len = netmd_poll(dev, pollbuf, 1, NULL);
     if (len != 0) {
         netmd_log(NETMD_LOG_ERROR, "netmd_exch_message: netmd_poll failed\n");
+        netmd_trace_error(dev, (len > 0) ? NETMDERR_NOTREADY : len);
         return (len > 0) ? NETMDERR_NOTREADY : len;
     }
 
     /* send data */
     netmd_log(NETMD_LOG_DEBUG, "Command:\n");
     netmd_log_hex(NETMD_LOG_DEBUG, cmd, cmdlen);
-    if (libusb_control_transfer(dev, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR |
-                        LIBUSB_RECIPIENT_INTERFACE, _s_factory ? 0xff : 0x80, 0, 0, cmd, (int)cmdlen,
-                        NETMD_SEND_TIMEOUT) < 0) {
+    if ((len = libusb_control_transfer(dev, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR |
+                        LIBUSB_RECIPIENT_INTERFACE, netmd_dev_factory_write(devh) ? 0xff : 0x80, 0, 0, cmd, (int)cmdlen,
+                        NETMD_SEND_TIMEOUT)) < 0) {
         netmd_log(NETMD_LOG_ERROR, "netmd_exch_message: libusb_control_transfer failed\n");
+        netmd_trace(NETMD_TRACE_CMD, dev, len, cmd, cmdlen);
+        netmd_trace_error(dev, NETMDERR_USB);
         return NETMDERR_USB;
     }
 
+    netmd_trace(NETMD_TRACE_CMD, dev, 0, cmd, cmdlen);
+
+    netmd_dev_count_cmd(devh);
     return 0;
 }
 
@@ -215,6 +265,7 @@ int netmd_recv_message(netmd_dev_handle *devh, unsigned char* rsp)
     len = netmd_poll(dev, pollbuf, NETMD_RECV_TRIES, NULL);
     if (len <= 0) {
         netmd_log(NETMD_LOG_ERROR, "netmd_exch_message: netmd_poll failed\n");
+        netmd_trace_error(dev, (len == 0) ? NETMDERR_TIMEOUT : len);
         return (len == 0) ? NETMDERR_TIMEOUT : len;
     }
 
@@ -223,9 +274,12 @@ int netmd_recv_message(netmd_dev_handle *devh, unsigned char* rsp)
                         LIBUSB_RECIPIENT_INTERFACE, pollbuf[1], 0, 0, rsp, len,
                         NETMD_RECV_TIMEOUT) < 0) {
         netmd_log(NETMD_LOG_ERROR, "netmd_exch_message: libusb_control_transfer failed\n");
+        netmd_trace_error(dev, NETMDERR_USB);
         return NETMDERR_USB;
     }
 
+    netmd_trace(NETMD_TRACE_RSP, dev, len, rsp, (size_t)len);
+
     netmd_log(NETMD_LOG_DEBUG, "Response:\n");
     netmd_log_hex(NETMD_LOG_DEBUG, rsp, (size_t)len);
 
@@ -256,6 +310,7 @@ int netmd_recv_message_ex(netmd_dev_handle *devh, unsigned char** rspPtr)
     if (ret <= 0) 
     {
         netmd_log(NETMD_LOG_ERROR, "netmd_exch_message: netmd_poll failed\n");
+        netmd_trace_error(dev, (ret == 0) ? NETMDERR_TIMEOUT : ret);
         return (ret == 0) ? NETMDERR_TIMEOUT : ret;
     }
 
@@ -266,9 +321,12 @@ int netmd_recv_message_ex(netmd_dev_handle *devh, unsigned char** rspPtr)
                         LIBUSB_RECIPIENT_INTERFACE, pollbuf[1], 0, 0, *rspPtr, fullLength,
                         NETMD_RECV_TIMEOUT) < 0) {
         netmd_log(NETMD_LOG_ERROR, "netmd_exch_message: libusb_control_transfer failed\n");
+        netmd_trace_error(dev, NETMDERR_USB);
         return NETMDERR_USB;
     }
 
+    netmd_trace(NETMD_TRACE_RSP, dev, fullLength, *rspPtr, (size_t)fullLength);
+
     netmd_log(NETMD_LOG_DEBUG, "Response:\n");
     netmd_log_hex(NETMD_LOG_DEBUG, *rspPtr, (size_t)fullLength);
 
@@ -276,6 +334,58 @@ int netmd_recv_message_ex(netmd_dev_handle *devh, unsigned char** rspPtr)
     return fullLength;
 }
 
+//------------------------------------------------------------------------------
+//! @brief      receive a message into a caller provided buffer
+//!
+//! @param[in]  devh     device handle
+//! @param[out] rsp      response buffer
+//! @param[in]  rspsize  size of response buffer
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+int netmd_recv_message_buf(netmd_dev_handle *devh, unsigned char* rsp, size_t rspsize)
+{
+    unsigned char pollbuf[4];
+    uint16_t fullLength = 0;
+    libusb_device_handle *dev;
+
+    dev = (libusb_device_handle *)devh;
+
+    /* poll for data that minidisc wants to send */
+    int ret = netmd_poll(dev, pollbuf, NETMD_RECV_TRIES, &fullLength);
+    if (ret <= 0)
+    {
+        netmd_log(NETMD_LOG_ERROR, "netmd_exch_message: netmd_poll failed\n");
+        netmd_trace_error(dev, (ret == 0) ? NETMDERR_TIMEOUT : ret);
+        return (ret == 0) ? NETMDERR_TIMEOUT : ret;
+    }
+
+    if (fullLength > rspsize)
+    {
+        netmd_log(NETMD_LOG_ERROR, "netmd_exch_message: response (%u bytes) exceeds buffer (%zu bytes)\n",
+                  fullLength, rspsize);
+        netmd_trace_error(dev, NETMDERR_USB);
+        return NETMDERR_USB;
+    }
+
+    /* receive data */
+    if (libusb_control_transfer(dev, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR |
+                        LIBUSB_RECIPIENT_INTERFACE, pollbuf[1], 0, 0, rsp, fullLength,
+                        NETMD_RECV_TIMEOUT) < 0) {
+        netmd_log(NETMD_LOG_ERROR, "netmd_exch_message: libusb_control_transfer failed\n");
+        netmd_trace_error(dev, NETMDERR_USB);
+        return NETMDERR_USB;
+    }
+
+    netmd_trace(NETMD_TRACE_RSP, dev, fullLength, rsp, (size_t)fullLength);
+
+    netmd_log(NETMD_LOG_DEBUG, "Response:\n");
+    netmd_log_hex(NETMD_LOG_DEBUG, rsp, (size_t)fullLength);
+
+    /* return length */
+    return fullLength;
+}
+
 /* Wait for the device to respond to a command (any command). Some
  * devices need to be given a bit of "breathing room" to avoid USB
  * interface crashes, which is what this does.
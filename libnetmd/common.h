@@ -11,6 +11,9 @@
 */
 typedef libusb_device_handle *netmd_dev_handle;
 
+/** largest response a device can announce (16 bit length) */
+#define NETMD_MAX_RSP_SIZE 0xffff
+
 /**
   polls to see if minidisc wants to send data
 
@@ -46,6 +49,21 @@ int netmd_exch_message(netmd_dev_handle *dev, unsigned char *cmd,
 int netmd_exch_message_ex(netmd_dev_handle *devh, unsigned char *cmd,
                           const size_t cmdlen, unsigned char **rspPtr);
 
+//------------------------------------------------------------------------------
+//! @brief      exchange command / response into a caller provided buffer;
+//!             no allocation, the buffer can be reused for every exchange
+//!
+//! @param[in]  devh     device handle
+//! @param[in]  cmd      command
+//! @param[in]  cmdlen   command length
+//! @param[out] rsp      response buffer
+//! @param[in]  rspsize  size of response buffer (NETMD_MAX_RSP_SIZE fits all)
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+int netmd_exch_message_buf(netmd_dev_handle *devh, unsigned char *cmd,
+                           const size_t cmdlen, unsigned char *rsp, size_t rspsize);
+
 /**
   Function to send a command to the minidisc player.
 
@@ -65,6 +83,17 @@ int netmd_send_message(netmd_dev_handle *dev, unsigned char *cmd,
 */
 int netmd_recv_message(netmd_dev_handle *dev, unsigned char *rsp);
 
+//------------------------------------------------------------------------------
+//! @brief      receive a message into a caller provided buffer
+//!
+//! @param[in]  devh     device handle
+//! @param[out] rsp      response buffer
+//! @param[in]  rspsize  size of response buffer
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+int netmd_recv_message_buf(netmd_dev_handle *devh, unsigned char* rsp, size_t rspsize);
+
 //------------------------------------------------------------------------------
 //! @brief      receive a message (extended version)
 //!
@@ -85,14 +114,6 @@ int netmd_recv_message_ex(netmd_dev_handle *devh, unsigned char** rspPtr);
 */
 int netmd_wait_for_sync(netmd_dev_handle* dev);
 
-//------------------------------------------------------------------------------
-//! @brief      enable / disable factory write
-//!
-//! @param      devh    The devh
-//! @param      enable  1 to enable factory write, 0 to disable
-//------------------------------------------------------------------------------
-void netmd_set_factory_write(int enable);
-
 /* copy end */
 
 #endif /* LIBNETMD_COMMON_H */
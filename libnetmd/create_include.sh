@@ -1,7 +1,7 @@
 #!/bin/bash
 
 FNAME=include/libnetmd.h
-HEADERS=("const.h" "error.h" "log.h" "common.h" "CMDiscHeader.h" "libnetmd_intern.h" "netmd_dev.h" "netmd_transfer.h" "patch.h" "secure.h" "trackinformation.h" "utils.h" "playercontrol.h")
+HEADERS=("const.h" "error.h" "log.h" "common.h" "CMDiscHeader.h" "libnetmd_intern.h" "netmd_dev.h" "secure.h" "netmd_pcm.h" "netmd_transfer.h" "netmd_queue.h" "patch.h" "trackinformation.h" "utils.h" "playercontrol.h" "netmd_txn.h" "netmd_trace.h" "netmd_monitor.h")
 
 cat << EOF > ${FNAME}
 /*
@@ -28,7 +28,9 @@ typedef enum {
 
     NETMD_DES_ERROR,
 
-    NETMD_USE_HOTPLUG
+    NETMD_USE_HOTPLUG,
+
+    NETMD_CANCELLED
 
 } netmd_error;
 
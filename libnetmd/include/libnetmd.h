@@ -143,7 +143,9 @@ typedef enum {
 
     NETMD_DES_ERROR,
 
-    NETMD_USE_HOTPLUG
+    NETMD_USE_HOTPLUG,
+
+    NETMD_CANCELLED
 
 } netmd_error;
 
@@ -183,6 +185,40 @@ typedef enum {
         NETMD_LOG_ALL
 } netmd_loglevel;
 
+/**
+   Log levels above this one are compiled out completely (e.g. build with
+   -DNETMD_LOG_COMPILED_LEVEL=NETMD_LOG_WARNING for a release without
+   verbose and debug logging).
+*/
+#ifndef NETMD_LOG_COMPILED_LEVEL
+#define NETMD_LOG_COMPILED_LEVEL NETMD_LOG_ALL
+#endif
+
+/**
+   Internal: current log level, exported only so the level check in
+   netmd_log() can be inlined. Read it with netmd_get_log_level(), set it
+   with netmd_set_log_level().
+*/
+extern netmd_loglevel netmd_log_level_cur;
+
+/**
+   Gets the global log level as set by netmd_set_log_level().
+
+   @return current log level
+*/
+static inline netmd_loglevel netmd_get_log_level(void)
+{
+    return netmd_log_level_cur;
+}
+
+/**
+   Check if messages of a log level are shown.
+
+   @param level Log level to check.
+*/
+#define netmd_log_enabled(level) \
+    (((level) <= NETMD_LOG_COMPILED_LEVEL) && ((level) <= netmd_get_log_level()))
+
 /**
    Sets the global log level.
 
@@ -208,6 +244,17 @@ void netmd_log_hex(netmd_loglevel level, const unsigned char* const data, const
 */
 void netmd_log(netmd_loglevel level, const char* const fmt, ...);
 
+/*
+   netmd_log() and netmd_log_hex() check the log level before the call, so
+   arguments of filtered messages aren't evaluated at all. The functions
+   can still be called directly, e.g. (netmd_log)(level, fmt, ...).
+*/
+#define netmd_log(level, ...) \
+    do { if (netmd_log_enabled(level)) (netmd_log)((level), __VA_ARGS__); } while (0)
+
+#define netmd_log_hex(level, data, len) \
+    do { if (netmd_log_enabled(level)) (netmd_log_hex)((level), (data), (len)); } while (0)
+
 /**
  * @brief      Sets the log file descriptor
  *
@@ -222,6 +269,9 @@ void netmd_log_set_fd(FILE* fdid);
 */
 typedef libusb_device_handle *netmd_dev_handle;
 
+/** largest response a device can announce (16 bit length) */
+#define NETMD_MAX_RSP_SIZE 0xffff
+
 /**
   polls to see if minidisc wants to send data
 
@@ -257,6 +307,21 @@ int netmd_exch_message(netmd_dev_handle *dev, unsigned char *cmd,
 int netmd_exch_message_ex(netmd_dev_handle *devh, unsigned char *cmd,
                           const size_t cmdlen, unsigned char **rspPtr);
 
+//------------------------------------------------------------------------------
+//! @brief      exchange command / response into a caller provided buffer;
+//!             no allocation, the buffer can be reused for every exchange
+//!
+//! @param[in]  devh     device handle
+//! @param[in]  cmd      command
+//! @param[in]  cmdlen   command length
+//! @param[out] rsp      response buffer
+//! @param[in]  rspsize  size of response buffer (NETMD_MAX_RSP_SIZE fits all)
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+int netmd_exch_message_buf(netmd_dev_handle *devh, unsigned char *cmd,
+                           const size_t cmdlen, unsigned char *rsp, size_t rspsize);
+
 /**
   Function to send a command to the minidisc player.
 
@@ -276,6 +341,17 @@ int netmd_send_message(netmd_dev_handle *dev, unsigned char *cmd,
 */
 int netmd_recv_message(netmd_dev_handle *dev, unsigned char *rsp);
 
+//------------------------------------------------------------------------------
+//! @brief      receive a message into a caller provided buffer
+//!
+//! @param[in]  devh     device handle
+//! @param[out] rsp      response buffer
+//! @param[in]  rspsize  size of response buffer
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+int netmd_recv_message_buf(netmd_dev_handle *devh, unsigned char* rsp, size_t rspsize);
+
 //------------------------------------------------------------------------------
 //! @brief      receive a message (extended version)
 //!
@@ -296,14 +372,6 @@ int netmd_recv_message_ex(netmd_dev_handle *devh, unsigned char** rspPtr);
 */
 int netmd_wait_for_sync(netmd_dev_handle* dev);
 
-//------------------------------------------------------------------------------
-//! @brief      enable / disable factory write
-//!
-//! @param      devh    The devh
-//! @param      enable  1 to enable factory write, 0 to disable
-//------------------------------------------------------------------------------
-void netmd_set_factory_write(int enable);
-
 
 //! define a MD Header handle
 typedef void* HndMdHdr;
@@ -475,6 +543,55 @@ MDGroups* md_header_groups(HndMdHdr hdl);
 //------------------------------------------------------------------------------
 void md_header_free_groups(MDGroups** groups);
 
+//------------------------------------------------------------------------------
+//! @brief      set size of the header as it is stored on the device
+//!             (netmd_write_disc_header() needs it for the write request)
+//!
+//! @param[in]  hdl   The MD header handle
+//! @param[in]  sz    The size (-1 -> unknown, will be read from device)
+//------------------------------------------------------------------------------
+void md_header_set_stored_size(HndMdHdr hdl, int sz);
+
+//------------------------------------------------------------------------------
+//! @brief      get size of the header as it is stored on the device
+//!
+//! @param[in]  hdl   The MD header handle
+//!
+//! @return     size of stored header; -1 -> unknown
+//------------------------------------------------------------------------------
+int md_header_stored_size(HndMdHdr hdl);
+
+//------------------------------------------------------------------------------
+//! @brief      move group ranges after tracks were reordered
+//!
+//! @param[in]  hdl     The MD header handle
+//! @param[in]  newPos  new track number for each old track (index = old - 1)
+//! @param[in]  count   number of entries in newPos
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int md_header_remap_tracks(HndMdHdr hdl, const int16_t* newPos, int count);
+
+//------------------------------------------------------------------------------
+//! @brief      create a copy of a MD header (free with free_md_header())
+//!
+//! @param[in]  hdl   The MD header handle
+//!
+//! @return     handle of copy; NULL -> error
+//------------------------------------------------------------------------------
+HndMdHdr md_header_clone(HndMdHdr hdl);
+
+//------------------------------------------------------------------------------
+//! @brief      roll a MD header back to a copy made with md_header_clone();
+//!             group ids are the ones of the copy, the stored size is kept
+//!
+//! @param[in]  hdl   The MD header handle
+//! @param[in]  src   The copy
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int md_header_restore(HndMdHdr hdl, HndMdHdr src);
+
 
 /**
    Data about a group, start track, finish track and name. Used to generate disc
@@ -581,6 +698,19 @@ int netmd_request_track_time(netmd_dev_handle* dev, const uint16_t track, struct
 */
 int netmd_set_title(netmd_dev_handle* dev, const uint16_t track, const char* const buffer);
 
+/**
+   Writes title for the specified track without reading the old title and
+   without any handshake. The title descriptor must already be open for
+   write (see netmd_cache_toc).
+
+   @param dev pointer to device returned by netmd_open
+   @param track Zero based index of track your requesting.
+   @param buffer buffer holding the name.
+   @param oldsize size of the title which is replaced (0 if untitled)
+   @return returns 0 for fail 1 for success.
+*/
+int netmd_write_title(netmd_dev_handle* dev, const uint16_t track, const char* const buffer, int oldsize);
+
 /**
    Moves track around the disc.
 
@@ -612,10 +742,33 @@ int netmd_set_group_title(netmd_dev_handle* dev, HndMdHdr md, unsigned int group
 */
 int netmd_initialize_disc_info(netmd_dev_handle* devh, HndMdHdr* md);
 
+//------------------------------------------------------------------------------
+//! @brief      get disc header, it is read from the device on first use only;
+//!             use this instead of netmd_initialize_disc_info() if not every
+//!             code path needs the header
+//!
+//! @param[in]     devh  device handle
+//! @param[in/out] md    pointer to header handle (NULL -> not yet loaded)
+//!
+//! @return     header handle (NULL if it can't be read)
+//------------------------------------------------------------------------------
+HndMdHdr netmd_disc_header(netmd_dev_handle* devh, HndMdHdr* md);
+
 void print_groups(HndMdHdr md);
 
 int netmd_create_group(netmd_dev_handle* dev, HndMdHdr md, char* name, int first, int last);
 
+//------------------------------------------------------------------------------
+//! @brief      write the raw disc header (disc title and groups); a loaded
+//!             header handle doesn't know about it, so recreate it or at
+//!             least update its stored size (md_header_set_stored_size())
+//!
+//! @param[in]  dev           device handle
+//! @param[in]  title         raw disc header
+//! @param[in]  title_length  size of title
+//!
+//! @return     < 0 -> error
+//------------------------------------------------------------------------------
 int netmd_set_disc_title(netmd_dev_handle* dev, char* title, size_t title_length);
 
 /**
@@ -648,7 +801,9 @@ int netmd_pull_track_from_group(netmd_dev_handle* dev, HndMdHdr md, const uint16
 int netmd_delete_group(netmd_dev_handle* dev, HndMdHdr md, const unsigned int group);
 
 /**
-   Creates disc header out of groups and writes it to disc
+   Creates disc header out of groups and writes it to disc. The size of the
+   header stored on the device is taken from md (see md_header_stored_size).
+   It is only read from the device if unknown.
 
    @param devh pointer to device returned by netmd_open
    @param md pointer to minidisc structure
@@ -756,6 +911,37 @@ struct netmd_devices {
     int otf_conv;
 };
 
+/* wire formats for netmd_dev_profile.wireformats */
+#define NETMD_PROFILE_WF_PCM     0x01
+#define NETMD_PROFILE_WF_105KBPS 0x02
+#define NETMD_PROFILE_WF_LP2     0x04
+#define NETMD_PROFILE_WF_LP4     0x08
+#define NETMD_PROFILE_WF_ALL     0x0f
+
+/**
+  Transport settings and quirks of a device family. Profiles are looked up by
+  vendor / product id when the device is opened and applied by the transport
+  (polling, packet size, bulk timeout, acquire / release on upload). The
+  default profile holds the values libnetmd always used. Use
+  netmd_dev_profile_set() to tune a deck.
+*/
+typedef struct netmd_dev_profile {
+    const char *name;           /* profile name (for logs) */
+    size_t max_chunk;           /* max. bulk packet size on upload */
+    unsigned poll_first_ms;     /* sleep after first unsuccessful poll */
+    unsigned poll_ms;           /* sleep between following polls */
+    unsigned poll_slow_ms;      /* sleep when device is still busy ... */
+    unsigned poll_slow_after;   /* ... after that many polls */
+    unsigned bulk_timeout_ms;   /* bulk transfer timeout */
+    unsigned wireformats;       /* supported NETMD_PROFILE_WF_* */
+    int need_acquire;           /* acquire / release device around upload */
+    size_t start_chunk;         /* adaptive upload: first chunk size, grows up
+                                   to max_chunk (0 -> off, one bulk per packet;
+                                   all built-in profiles) */
+    unsigned bulk_retries;      /* retries of a timed out / stalled chunk
+                                   (0 in all built-in profiles) */
+} netmd_dev_profile;
+
 /**
   Intialises the netmd device layer, scans the USB and fills in a list of
   supported devices.
@@ -798,48 +984,282 @@ netmd_error netmd_close(netmd_dev_handle* dev);
 */
 void netmd_clean(netmd_device **device_list);
 
+/**
+  Get the transport profile for an opened device. Devices not listed in the
+  profile table get a conservative default profile.
 
-//------------------------------------------------------------------------------
-//! @brief      send audio file to netmd device
-//!
-//! @param      devh[in]     device handle
-//! @param      filename[in] audio track file name
-//! @param      in_title[in] track title
-//! @param      otf[in]      on the fly convert flag
-//!
-//! @return     netmd_error
-//! @see        betmd_error
-//------------------------------------------------------------------------------
-netmd_error netmd_send_track(netmd_dev_handle *devh, const char *filename, const char *in_title, unsigned char otf);
+  @param devh Pointer to device returned by netmd_open (may be NULL).
+  @return profile (never NULL)
+*/
+const netmd_dev_profile* netmd_dev_profile_get(netmd_dev_handle* devh);
 
+/**
+  Override the transport profile for a vendor / product id, e.g. to tune a
+  deck which isn't in the profile table. Open handles pick up the change
+  with their next profile lookup.
 
-//------------------------------------------------------------------------------
-//! @brief      appy SP patch
-//!
-//! @param[in]  devh         device handle
-//! @param[in]  chan_no      number of audio channels (1: mono, 2: stereo)
-//!
-//! @return     netmd_error
-//! @see        netmd_error
-//------------------------------------------------------------------------------
-netmd_error netmd_apply_sp_patch(netmd_dev_handle *devh, int chan_no);
+  @param idVendor USB vendor id
+  @param idProduct USB product id (0 -> all products of vendor)
+  @param profile profile, must stay valid; NULL removes the override
+  @return NETMD_NO_ERROR or NETMD_ERROR if the override table is full
+*/
+netmd_error netmd_dev_profile_set(int idVendor, int idProduct, const netmd_dev_profile* profile);
 
-//------------------------------------------------------------------------------
-//! @brief      undo SP upload patch
-//!
-//! @param[in]  devh  device handle
-//------------------------------------------------------------------------------
-void netmd_undo_sp_patch(netmd_dev_handle *devh);
+/**
+  Check if a device profile supports a wire format.
 
-//------------------------------------------------------------------------------
-//! @brief      check if device supports sp upload
-//!
-//! @param[in]  devh  device handle
-//!
-//! @return     0 -> no support; esle
-//------------------------------------------------------------------------------
-int netmd_dev_supports_sp_upload(netmd_dev_handle *devh);
+  @param profile device profile
+  @param wireformat netmd_wireformat value
+  @return 1 -> supported; 0 -> not supported
+*/
+int netmd_dev_profile_wireformat(const netmd_dev_profile* profile, int wireformat);
+
+/**
+  Lock a device for exclusive use by the calling thread. The lock is
+  recursive; every command exchange takes it, so commands from several
+  threads never interleave on the wire. Take it around command sequences
+  which must not be split (e.g. open descriptor, query, close). Any
+  number of devices can be locked; netmd_close() waits for the lock.
+
+  @param devh Pointer to device returned by netmd_open.
+  @return NETMD_NO_ERROR or NETMD_ERROR
+*/
+netmd_error netmd_dev_lock(netmd_dev_handle* devh);
+
+/**
+  Unlock a device locked with netmd_dev_lock().
+
+  @param devh Pointer to device returned by netmd_open.
+*/
+void netmd_dev_unlock(netmd_dev_handle* devh);
+
+/**
+  Enable / disable factory write for a device: while enabled, commands to
+  this device are sent with request type 0xff instead of 0x80. Other
+  devices aren't affected. Hold the device lock for the whole factory
+  window, so other threads don't send normal commands inside it.
+
+  @param devh Pointer to device returned by netmd_open.
+  @param enable 1 to enable factory write, 0 to disable
+*/
+void netmd_set_factory_write(netmd_dev_handle* devh, int enable);
+
+/**
+  Check if factory write is enabled for a device.
+
+  @param devh Pointer to device returned by netmd_open.
+  @return 1 -> enabled; 0 -> disabled
+*/
+int netmd_dev_factory_write(netmd_dev_handle* devh);
+
+/**
+  Count a command sent to a device (see netmd_cmd_count()).
+
+  @param devh Pointer to device returned by netmd_open.
+*/
+void netmd_dev_count_cmd(netmd_dev_handle* devh);
+
+/**
+  Get the number of commands sent to a device so far. Use the difference
+  of two calls to count the commands an operation needs; commands other
+  threads send to other devices don't count.
+
+  @param devh Pointer to device returned by netmd_open.
+  @return command count
+*/
+unsigned long netmd_cmd_count(netmd_dev_handle* devh);
+
+/**
+  Remember the size of a track title as stored on disc. Title writes need
+  the size of the title they replace; with a known size the old title
+  isn't read first. netmd_request_title(), netmd_write_title() and track
+  uploads keep the sizes up to date, deleting or moving tracks and erasing
+  the disc forget them. Call netmd_dev_title_sizes_clear() if the disc
+  was changed.
+
+  @param devh Pointer to device returned by netmd_open.
+  @param track Zero based track number.
+  @param size title size in bytes (0 -> untitled; -1 -> unknown)
+*/
+void netmd_dev_title_size_set(netmd_dev_handle* devh, uint16_t track, int size);
+
+/**
+  Get the cached size of a track title (see netmd_dev_title_size_set()).
+
+  @param devh Pointer to device returned by netmd_open.
+  @param track Zero based track number.
+  @return title size in bytes; -1 -> unknown
+*/
+int netmd_dev_title_size(netmd_dev_handle* devh, uint16_t track);
+
+/**
+  Forget all cached title sizes of a device (e.g. after a disc change).
+
+  @param devh Pointer to device returned by netmd_open.
+*/
+void netmd_dev_title_sizes_clear(netmd_dev_handle* devh);
+
+/**
+  Get the crypto context of a device, created on first use and freed
+  when the device is closed (see netmd_crypto_get()).
+
+  @param devh Pointer to device returned by netmd_open.
+  @return crypto context; NULL on error
+*/
+struct netmd_crypto* netmd_dev_crypto(netmd_dev_handle* devh);
+
+
+/**
+   Crypto context: DES / 3DES cipher handles which are opened and keyed
+   once and reused for all tracks of a session. Each device handle gets
+   one on first use (see netmd_crypto_get()); it's freed by netmd_close().
+   A context must not be used by several threads at the same time; the
+   library uses a device's context with the device locked only.
+*/
+typedef struct netmd_crypto netmd_crypto;
+
+/**
+   Create a crypto context not bound to a device.
+
+   @return crypto context; NULL on error
+*/
+netmd_crypto* netmd_crypto_open(void);
+
+/**
+   Free a crypto context created with netmd_crypto_open().
+
+   @param crypto pointer to crypto context, set to NULL
+*/
+void netmd_crypto_close(netmd_crypto** crypto);
+
+/**
+   Get the crypto context of a device handle, created on first use.
+
+   @param dev device handle
+   @return crypto context; NULL on error
+*/
+netmd_crypto* netmd_crypto_get(netmd_dev_handle* dev);
+
+/**
+   Calculate the session key from the exchanged nonces (retail MAC).
+
+   @param crypto crypto context
+   @param rootkey root key (16 bytes)
+   @param hostnonce host nonce (8 bytes)
+   @param devnonce device nonce (8 bytes)
+   @param sessionkey buffer for session key (8 bytes)
+   @return 0 -> ok; -1 -> error
+*/
+int netmd_crypto_session_key(netmd_crypto* crypto, const unsigned char* rootkey,
+                             const unsigned char* hostnonce, const unsigned char* devnonce,
+                             unsigned char* sessionkey);
+
+/**
+   Track transfer progress as passed to the progress callback.
+*/
+typedef struct {
+    /** bytes transferred so far */
+    uint64_t done;
+
+    /** bytes to transfer */
+    uint64_t total;
+
+    /** transfer rate in bytes/s since the last report */
+    double rate;
+
+    /** time since the transfer started in us */
+    uint64_t elapsed_us;
+} netmd_progress;
+
+/**
+   Progress callback, called from the transferring thread.
+
+   @param ctx callback context
+   @param progress current progress
+*/
+typedef void (*netmd_progress_cb)(void* ctx, const netmd_progress* progress);
+
+/**
+   Statistics of one upload chunk (bulk transfer), passed to the chunk
+   callback after every try.
+*/
+typedef struct {
+    /** chunk size in bytes */
+    size_t size;
+
+    /** bytes the device took */
+    size_t transferred;
+
+    /** duration of the bulk transfer(s) in us */
+    uint64_t duration_us;
+
+    /** retries so far */
+    unsigned retries;
+
+    /** libusb result */
+    int result;
+} netmd_chunk_stat;
+
+/**
+   Chunk callback, called from the transferring thread.
+
+   @param ctx callback context
+   @param stat chunk statistics
+*/
+typedef void (*netmd_chunk_cb)(void* ctx, const netmd_chunk_stat* stat);
+
+/**
+   Progress and cancel control for track transfers. Initialize with
+   netmd_transfer_ctl_init(); netmd_transfer_cancel() may be called from
+   any thread (and from a signal handler). Cancellation is checked
+   between bulk transfers; an aborted transfer returns NETMD_CANCELLED.
+*/
+typedef struct {
+    /** progress callback (may be NULL) */
+    netmd_progress_cb cb;
+
+    /** callback context */
+    void* ctx;
+
+    /** min. time between two callbacks in ms (0 -> after every packet) */
+    unsigned int interval_ms;
+
+    /** upload chunk callback (may be NULL), e.g. to find a deck's best
+        chunk size; gets the same context as the progress callback */
+    netmd_chunk_cb chunk_cb;
+
+    /** cancel flag, set by netmd_transfer_cancel() */
+    int cancel;
+
+    /** internal: time stamps and bytes of the last report */
+    uint64_t start_us, last_us, last_done;
+} netmd_transfer_ctl;
+
+/**
+   Initialize a transfer control.
+
+   @param ctl transfer control
+   @param cb progress callback (may be NULL)
+   @param ctx callback context
+   @param interval_ms min. time between two callbacks in ms
+*/
+void netmd_transfer_ctl_init(netmd_transfer_ctl* ctl, netmd_progress_cb cb, void* ctx,
+                             unsigned int interval_ms);
+
+/**
+   Request to abort the transfer using this control.
+
+   @param ctl transfer control
+*/
+void netmd_transfer_cancel(netmd_transfer_ctl* ctl);
+
+/**
+   Check if the transfer was cancelled.
 
+   @param ctl transfer control (may be NULL)
+   @return 1 -> cancelled; 0 -> not cancelled
+*/
+int netmd_transfer_cancelled(netmd_transfer_ctl* ctl);
 
 /**
    linked list to store a list of 16-byte keys
@@ -986,9 +1406,33 @@ netmd_error netmd_secure_send_track(netmd_dev_handle *dev,
                                     uint16_t *track, unsigned char *uuid,
                                     unsigned char *content_id);
 
+/**
+   Like netmd_secure_send_track(), with progress and cancel control.
+
+   @param ctl transfer control (may be NULL)
+*/
+netmd_error netmd_secure_send_track_ex(netmd_dev_handle *dev,
+                                       netmd_wireformat wireformat,
+                                       unsigned char discformat,
+                                       unsigned int frames,
+                                       netmd_track_packets *packets,
+                                       size_t packet_length,
+                                       unsigned char *sessionkey,
+                                       uint16_t *track, unsigned char *uuid,
+                                       unsigned char *content_id,
+                                       netmd_transfer_ctl *ctl);
+
 netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
                                     FILE* file);
 
+/**
+   Like netmd_secure_recv_track(), with progress and cancel control.
+
+   @param ctl transfer control (may be NULL)
+*/
+netmd_error netmd_secure_recv_track_ex(netmd_dev_handle *dev, uint16_t track,
+                                       FILE* file, netmd_transfer_ctl *ctl);
+
 
 /**
    Commit a track. The idea is that this command tells the device hat the license
@@ -1027,27 +1471,505 @@ netmd_error netmd_prepare_packets(unsigned char* data, size_t data_lenght,
                                   size_t *packet_count, unsigned int *frames, size_t channels, size_t *packet_length,
                                   unsigned char *key_encryption_key, netmd_wireformat format);
 
-void netmd_cleanup_packets(netmd_track_packets **packets);
+/**
+   Like netmd_prepare_packets(), but with a device specific packet size
+   (see netmd_dev_profile.max_chunk); rounded down to a multiple of 16384.
 
-netmd_error netmd_secure_set_track_protection(netmd_dev_handle *dev,
-                                              unsigned char mode);
+   @param crypto crypto context to reuse (NULL -> temporary context)
+*/
+netmd_error netmd_prepare_packets_ex(unsigned char* data, size_t data_length,
+                                     netmd_track_packets **packets,
+                                     size_t *packet_count, unsigned int *frames, size_t channels, size_t *packet_length,
+                                     unsigned char *key_encryption_key, netmd_wireformat format, size_t max_chunk,
+                                     netmd_crypto *crypto);
 
+/** packets prepared from data arriving in blocks */
+typedef struct netmd_packet_writer netmd_packet_writer;
 
 /**
-   Get the bitrate used to encode a specific track.
+   Start preparing packets from data arriving in blocks (e.g. converted
+   PCM), so the plain data never has to be held in full. The packets are
+   the same netmd_prepare_packets_ex() builds from one buffer.
 
-   @param dev pointer to device returned by netmd_open
-   @param track Zero based index of track your requesting.
-   @param data pointer to store the hex code representing the bitrate.
+   @param key_encryption_key key encryption key (8 bytes)
+   @param format wire format
+   @param channels NETMD_CHANNELS_MONO or NETMD_CHANNELS_STEREO
+   @param max_chunk packet size, see netmd_prepare_packets_ex()
+   @param crypto crypto context to reuse (NULL -> temporary context)
+   @return writer; NULL -> error
 */
-int netmd_request_track_bitrate(netmd_dev_handle*dev, const uint16_t track,
-                                unsigned char* encoding, unsigned char* channel);
+netmd_packet_writer* netmd_packet_writer_open(unsigned char *key_encryption_key, netmd_wireformat format,
+                                              size_t channels, size_t max_chunk, netmd_crypto *crypto);
 
 /**
-   Get the flags used for a specific track.
+   Append data; full packets are encrypted right away.
 
-   @param dev pointer to device returned by netmd_open
-   @param track Zero based index of track your requesting.
+   @param w writer
+   @param data data in wire format (device byte order)
+   @param length data length in bytes
+   @return NETMD_NO_ERROR; errors stick until netmd_packet_writer_close()
+*/
+netmd_error netmd_packet_writer_add(netmd_packet_writer *w, const unsigned char *data, size_t length);
+
+/**
+   Pad and encrypt the last packet, hand over the packet list and free the
+   writer.
+
+   @param w pointer to writer, set to NULL
+   @param packets buffer for the packet list (NULL -> discard packets)
+   @param packet_count buffer for the number of packets (may be NULL)
+   @param frames buffer for the number of frames (may be NULL)
+   @param packet_length buffer for the total length (may be NULL)
+   @return NETMD_NO_ERROR; on error no packets are handed over
+*/
+netmd_error netmd_packet_writer_close(netmd_packet_writer **w, netmd_track_packets **packets,
+                                      size_t *packet_count, unsigned int *frames, size_t *packet_length);
+
+void netmd_cleanup_packets(netmd_track_packets **packets);
+
+netmd_error netmd_secure_set_track_protection(netmd_dev_handle *dev,
+                                              unsigned char mode);
+
+
+/*
+ * Streaming PCM conversion for uploads: wave files which aren't 44.1 kHz /
+ * 16 bit (e.g. 48 kHz or 24 bit masters) are resampled with a polyphase
+ * FIR filter and requantized to 16 bit with TPDF dither. Output is in
+ * device byte order (big endian), so no extra byte swap is needed. The
+ * converter works on blocks of any size with a fixed amount of state.
+ */
+
+//! device sample rate
+#define NETMD_PCM_RATE 44100u
+
+//! filter taps per polyphase branch (per 48 kHz input, multiple of 4)
+#define NETMD_PCM_TAPS 64u
+
+//! input sample formats (little endian, interleaved)
+typedef enum {
+    NETMD_PCM_S16,      //!< 16 bit signed
+    NETMD_PCM_S24,      //!< 24 bit signed, packed
+    NETMD_PCM_S32,      //!< 32 bit signed
+    NETMD_PCM_F32,      //!< 32 bit float
+} netmd_pcm_format;
+
+//! wave file info as found by netmd_pcm_wav_probe()
+typedef struct {
+    unsigned int     rate;       //!< sample rate
+    size_t           channels;   //!< channels (1 or 2)
+    netmd_pcm_format format;     //!< sample format
+    size_t           frame_size; //!< bytes per input frame
+    size_t           frames;     //!< frames in data chunk
+    int              convert;    //!< 1 -> device can't take it as is
+} netmd_pcm_info;
+
+//! conversion context (opaque)
+typedef struct netmd_pcm_conv netmd_pcm_conv;
+
+//------------------------------------------------------------------------------
+//! @brief      parse a wave file header; on success the file is positioned
+//!             at the start of the sample data
+//!
+//! @param[in]  f     open wave file
+//! @param[out] info  wave info
+//!
+//! @return     0 -> ok; -1 -> no wave PCM file or format not supported
+//------------------------------------------------------------------------------
+int netmd_pcm_wav_probe(FILE* f, netmd_pcm_info* info);
+
+//------------------------------------------------------------------------------
+//! @brief      create a converter to 44.1 kHz / 16 bit big endian
+//!
+//! @param[in]  rate      input sample rate
+//! @param[in]  channels  channels (1 or 2)
+//! @param[in]  format    input sample format
+//!
+//! @return     converter; NULL -> error
+//------------------------------------------------------------------------------
+netmd_pcm_conv* netmd_pcm_conv_open(unsigned int rate, size_t channels, netmd_pcm_format format);
+
+//------------------------------------------------------------------------------
+//! @brief      number of output frames for a given input length
+//!
+//! @param[in]  conv       converter
+//! @param[in]  in_frames  input frames
+//!
+//! @return     output frames
+//------------------------------------------------------------------------------
+uint64_t netmd_pcm_conv_out_frames(const netmd_pcm_conv* conv, uint64_t in_frames);
+
+//------------------------------------------------------------------------------
+//! @brief      convert a block; stops if the input is used up or the output
+//!             is full
+//!
+//! @param[in]  conv        converter
+//! @param[in]  in          input samples
+//! @param[in]  in_frames   input frames
+//! @param[out] consumed    input frames used
+//! @param[out] out         output buffer (16 bit big endian)
+//! @param[in]  out_frames  output buffer size in frames
+//!
+//! @return     frames written to output
+//------------------------------------------------------------------------------
+size_t netmd_pcm_conv_run(netmd_pcm_conv* conv, const unsigned char* in, size_t in_frames, size_t* consumed,
+                          unsigned char* out, size_t out_frames);
+
+//------------------------------------------------------------------------------
+//! @brief      drain the filter after the last input block; call until it
+//!             returns 0
+//!
+//! @param[in]  conv        converter
+//! @param[out] out         output buffer (16 bit big endian)
+//! @param[in]  out_frames  output buffer size in frames
+//!
+//! @return     frames written to output
+//------------------------------------------------------------------------------
+size_t netmd_pcm_conv_flush(netmd_pcm_conv* conv, unsigned char* out, size_t out_frames);
+
+//------------------------------------------------------------------------------
+//! @brief      free converter
+//!
+//! @param[in]  conv  pointer to converter (set to NULL)
+//------------------------------------------------------------------------------
+void netmd_pcm_conv_close(netmd_pcm_conv** conv);
+
+
+/** @brief audio patch type */
+typedef enum
+{
+    apt_no_patch, /**< no patch needed         */
+    apt_wave,     /**< wave endianess patch    */
+    apt_sp        /**< atrac1 SP padding patch */
+} audio_patch_t;
+
+//------------------------------------------------------------------------------
+//! @brief      check audio file header
+//!
+//! @param[in]  file        file data
+//! @param[in]  fsize       file size
+//! @param[out] wireformat  wire format
+//! @param[out] diskformat  disc format
+//! @param[out] conversion  needed audio patch
+//! @param[out] channels    channels
+//! @param[out] headersize  header size
+//!
+//! @return     1 -> supported; 0 -> not supported
+//------------------------------------------------------------------------------
+int netmd_audio_supported(const unsigned char * file, size_t fsize, netmd_wireformat * wireformat, unsigned char * diskformat,
+                          audio_patch_t * conversion, size_t * channels, size_t * headersize);
+
+//------------------------------------------------------------------------------
+//! @brief      find data chunk in wave file
+//!
+//! @param[in]  data    file data
+//! @param[in]  offset  search start
+//! @param[in]  len     file size
+//!
+//! @return     position of "data" chunk; 0 -> not found
+//------------------------------------------------------------------------------
+size_t netmd_wav_data_position(const unsigned char * data, size_t offset, size_t len);
+
+//------------------------------------------------------------------------------
+//! @brief      swap bytes of 16 bit PCM samples (wave is little endian,
+//!             the device wants big endian)
+//!
+//! @param[in]  data    sample data (swapped in place)
+//! @param[in]  size    data size in bytes
+//------------------------------------------------------------------------------
+void netmd_pcm_byteswap(unsigned char * data, size_t size);
+
+//------------------------------------------------------------------------------
+//! @brief      send audio file to netmd device
+//!
+//! @param      devh[in]     device handle
+//! @param      filename[in] audio track file name
+//! @param      in_title[in] track title
+//! @param      otf[in]      on the fly convert flag
+//!
+//! @return     netmd_error
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_send_track(netmd_dev_handle *devh, const char *filename, const char *in_title, unsigned char otf);
+
+//------------------------------------------------------------------------------
+//! @brief      send audio file to netmd device with progress reports; the
+//!             upload can be cancelled through the transfer control. An
+//!             aborted upload leaves the secure session and removes SP
+//!             patches, so the device can be used right away.
+//!
+//! @param      devh[in]     device handle
+//! @param      filename[in] audio track file name
+//! @param      in_title[in] track title
+//! @param      otf[in]      on the fly convert flag
+//! @param      ctl[in]      transfer control (may be NULL)
+//!
+//! @return     netmd_error (NETMD_CANCELLED if cancelled)
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_send_track_ex(netmd_dev_handle *devh, const char *filename, const char *in_title, unsigned char otf,
+                                netmd_transfer_ctl *ctl);
+
+//------------------------------------------------------------------------------
+//! @brief      track prepared for upload (opaque), see netmd_prepare_track()
+//------------------------------------------------------------------------------
+typedef struct netmd_prepared_track netmd_prepared_track;
+
+//------------------------------------------------------------------------------
+//! @brief      estimate the memory needed while preparing an audio file
+//!             (source data and encrypted packets are held at the same time)
+//!
+//! @param      filename[in] audio track file name
+//!
+//! @return     bytes; 0 -> file can't be read
+//------------------------------------------------------------------------------
+size_t netmd_prepare_track_estimate(const char *filename);
+
+//------------------------------------------------------------------------------
+//! @brief      prepare an audio file for upload: read, convert, check and
+//!             encrypt it; there is no device access, so this can run for
+//!             the next tracks while one is sent
+//!
+//! @param      filename[in]   audio track file name
+//! @param      in_title[in]   track title (NULL -> file name)
+//! @param      otf[in]        on the fly convert flag
+//! @param      max_chunk[in]  max. packet size (see device profile)
+//! @param      crypto[in]     crypto context (NULL -> temporary one)
+//! @param      prepared[out]  prepared track
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_prepare_track(const char *filename, const char *in_title, unsigned char otf, size_t max_chunk,
+                                netmd_crypto *crypto, netmd_prepared_track **prepared);
+
+//------------------------------------------------------------------------------
+//! @brief      bytes held by a prepared track
+//!
+//! @param      prepared[in]  prepared track
+//!
+//! @return     bytes
+//------------------------------------------------------------------------------
+size_t netmd_prepared_track_size(const netmd_prepared_track *prepared);
+
+//------------------------------------------------------------------------------
+//! @brief      free a prepared track
+//!
+//! @param      prepared[in]  pointer to prepared track (set to NULL)
+//------------------------------------------------------------------------------
+void netmd_prepared_track_free(netmd_prepared_track **prepared);
+
+//------------------------------------------------------------------------------
+//! @brief      send a track prepared with netmd_prepare_track(); the device
+//!             is locked for the whole transfer
+//!
+//! @param      devh[in]     device handle
+//! @param      prepared[in] prepared track
+//! @param      ctl[in]      transfer control (may be NULL)
+//!
+//! @return     netmd_error (NETMD_CANCELLED if cancelled)
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_send_prepared_track(netmd_dev_handle *devh, const netmd_prepared_track *prepared,
+                                      netmd_transfer_ctl *ctl);
+
+
+/*
+ * Upload queue: a pool of worker threads prepares (reads, converts and
+ * encrypts) the next tracks while the calling thread sends the prepared
+ * ones to the device in queue order. Prepared tracks wait in memory until
+ * they are sent; a worker doesn't start a track if that would exceed the
+ * memory budget. The next track in order is always allowed, so a track
+ * larger than the budget still gets through (just without overlap).
+ */
+
+//! default memory budget for prepared tracks
+#define NETMD_QUEUE_MEM_BUDGET (512u * 1024u * 1024u)
+
+//! max. worker threads
+#define NETMD_QUEUE_MAX_THREADS 16
+
+//! upload queue (opaque)
+typedef struct netmd_upload_queue netmd_upload_queue_t;
+
+//! queue statistics
+typedef struct {
+    size_t   sent;          //!< tracks sent
+    size_t   failed;        //!< tracks not prepared or not sent
+    unsigned threads;       //!< worker threads used
+    uint64_t prepare_us;    //!< time spent preparing (all workers)
+    uint64_t send_us;       //!< time spent sending
+    uint64_t wait_us;       //!< time the upload waited for a worker
+    size_t   peak_mem;      //!< max. memory held by the queue
+} netmd_queue_stats_t;
+
+//------------------------------------------------------------------------------
+//! @brief      track done callback; called from the thread running
+//!             netmd_upload_queue_run()
+//!
+//! @param[in]  ctx       context as given to netmd_upload_queue_run()
+//! @param[in]  index     queue index
+//! @param[in]  filename  audio file
+//! @param[in]  err       result of prepare and send
+//------------------------------------------------------------------------------
+typedef void (*netmd_queue_cb)(void* ctx, size_t index, const char* filename, netmd_error err);
+
+//------------------------------------------------------------------------------
+//! @brief      create an upload queue
+//!
+//! @param[in]  threads     worker threads (0 -> one per CPU)
+//! @param[in]  mem_budget  memory budget in bytes (0 -> default)
+//!
+//! @return     queue; NULL -> error
+//------------------------------------------------------------------------------
+netmd_upload_queue_t* netmd_upload_queue_open(unsigned threads, size_t mem_budget);
+
+//------------------------------------------------------------------------------
+//! @brief      add an audio file to the queue
+//!
+//! @param[in]  q         queue
+//! @param[in]  filename  audio file
+//! @param[in]  title     track title (NULL -> file name)
+//! @param[in]  otf       on the fly convert flag
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_upload_queue_add(netmd_upload_queue_t* q, const char* filename, const char* title, unsigned char otf);
+
+//------------------------------------------------------------------------------
+//! @brief      upload all queued tracks; returns when all tracks are done or
+//!             the transfer was cancelled. The queue is empty afterwards.
+//!             SP patches are applied once for the whole queue.
+//!
+//! @param[in]  q     queue
+//! @param[in]  devh  device handle
+//! @param[in]  ctl   transfer control (may be NULL)
+//! @param[in]  cb    track done callback (may be NULL)
+//! @param[in]  ctx   callback context
+//!
+//! @return     NETMD_NO_ERROR if all tracks were sent; NETMD_CANCELLED if
+//!             cancelled; NETMD_ERROR if a track failed
+//------------------------------------------------------------------------------
+netmd_error netmd_upload_queue_run(netmd_upload_queue_t* q, netmd_dev_handle* devh, netmd_transfer_ctl* ctl,
+                                   netmd_queue_cb cb, void* ctx);
+
+//------------------------------------------------------------------------------
+//! @brief      get queue statistics (summed over all runs)
+//!
+//! @param[in]  q      queue
+//! @param[out] stats  statistics
+//------------------------------------------------------------------------------
+void netmd_upload_queue_stats(netmd_upload_queue_t* q, netmd_queue_stats_t* stats);
+
+//------------------------------------------------------------------------------
+//! @brief      free an upload queue
+//!
+//! @param[in]  q  pointer to queue (set to NULL)
+//------------------------------------------------------------------------------
+void netmd_upload_queue_close(netmd_upload_queue_t** q);
+
+
+//! max. bytes per memory read request (size is a byte in the request)
+#define NETMD_MEM_READ_MAX 0xff
+
+//! min. bytes per memory read request when falling back to smaller requests
+#define NETMD_MEM_READ_MIN 0x10
+
+//------------------------------------------------------------------------------
+//! @brief      appy SP patch
+//!
+//! @param[in]  devh         device handle
+//! @param[in]  chan_no      number of audio channels (1: mono, 2: stereo)
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_apply_sp_patch(netmd_dev_handle *devh, int chan_no);
+
+//------------------------------------------------------------------------------
+//! @brief      undo SP upload patch
+//!
+//! @param[in]  devh  device handle
+//------------------------------------------------------------------------------
+void netmd_undo_sp_patch(netmd_dev_handle *devh);
+
+//------------------------------------------------------------------------------
+//! @brief      start / end a batch of SP uploads. While a batch is active
+//!             netmd_undo_sp_patch() keeps the patches loaded and the next
+//!             netmd_apply_sp_patch() only verifies them (and rewrites the
+//!             track type patch if the channel count changes). Ending the
+//!             batch removes the patches.
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  enable  1 -> start batch; 0 -> end batch
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_sp_patch_batch(netmd_dev_handle *devh, int enable);
+
+//------------------------------------------------------------------------------
+//! @brief      remove loaded SP patches and drop the cached patch state of
+//!             a device handle (called by netmd_close())
+//!
+//! @param[in]  devh  device handle
+//------------------------------------------------------------------------------
+void netmd_sp_patch_release(netmd_dev_handle *devh);
+
+//------------------------------------------------------------------------------
+//! @brief      remove loaded SP patches after an aborted upload, also in
+//!             batch mode; the next SP upload patches the device again
+//!
+//! @param[in]  devh  device handle
+//------------------------------------------------------------------------------
+void netmd_sp_patch_abort(netmd_dev_handle *devh);
+
+//------------------------------------------------------------------------------
+//! @brief      read a range of device memory (e.g. to dump firmware). The
+//!             range is split into requests of chunk bytes; every reply is
+//!             checked against its checksum and copied straight into buf.
+//!             Memory is opened for read once for all requests; if the
+//!             device fails, it is opened and closed around each request.
+//!             Failed requests are retried and the request size is halved
+//!             (down to NETMD_MEM_READ_MIN) if the device keeps failing.
+//!
+//! @param[in]  devh   device handle
+//! @param[in]  addr   start address
+//! @param[out] buf    buffer for data (at least size bytes)
+//! @param[in]  size   number of bytes to read
+//! @param[in]  chunk  bytes per request (0 -> NETMD_MEM_READ_MAX)
+//! @param[out] done   bytes read, also on error (may be NULL)
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_read_memory(netmd_dev_handle *devh, uint32_t addr, uint8_t* buf, size_t size,
+                              size_t chunk, size_t* done);
+
+//------------------------------------------------------------------------------
+//! @brief      check if device supports sp upload
+//!
+//! @param[in]  devh  device handle
+//!
+//! @return     0 -> no support; esle
+//------------------------------------------------------------------------------
+int netmd_dev_supports_sp_upload(netmd_dev_handle *devh);
+
+
+/**
+   Get the bitrate used to encode a specific track.
+
+   @param dev pointer to device returned by netmd_open
+   @param track Zero based index of track your requesting.
+   @param data pointer to store the hex code representing the bitrate.
+*/
+int netmd_request_track_bitrate(netmd_dev_handle*dev, const uint16_t track,
+                                unsigned char* encoding, unsigned char* channel);
+
+/**
+   Get the flags used for a specific track.
+
+   @param dev pointer to device returned by netmd_open
+   @param track Zero based index of track your requesting.
    @param data pointer to store the hex code representing the codec.
 */
 int netmd_request_track_flags(netmd_dev_handle* dev, const uint16_t track, unsigned char* data);
@@ -1282,6 +2204,19 @@ unsigned int netmd_calculate_checksum(unsigned char data[], size_t size);
 //------------------------------------------------------------------------------
 uint8_t* netmd_format_query(const char* format, const netmd_query_data_t argv[], int argc, size_t* query_sz);
 
+//------------------------------------------------------------------------------
+//! @brief      format a netmd device query into a caller provided buffer
+//!
+//! @param[in]  format    format string
+//! @param[in]  argv      arguments array
+//! @param[in]  argc      argument count
+//! @param[out] out       query buffer
+//! @param[in]  size      size of query buffer
+//!
+//! @return     query size; 0 on error
+//------------------------------------------------------------------------------
+size_t netmd_format_query_buf(const char* format, const netmd_query_data_t argv[], int argc, uint8_t* out, size_t size);
+
 //------------------------------------------------------------------------------
 //! @brief      scan data for format options
 //!
@@ -1440,6 +2375,25 @@ netmd_error netmd_get_track(netmd_dev_handle* dev, uint16_t *track);
 */
 netmd_error netmd_get_position(netmd_dev_handle* dev, netmd_time* time);
 
+/**
+   Gets the currently playing track and the position within it with one
+   command exchange.
+
+   @param dev Handle to the open minidisc player.
+   @param track Pointer where to save the current track (may be NULL).
+   @param time Pointer to save the current time to (may be NULL).
+*/
+netmd_error netmd_get_track_position(netmd_dev_handle* dev, uint16_t *track,
+                                     netmd_time* time);
+
+/**
+   Gets the operating status (playing, paused, stopped, ...).
+
+   @param dev Handle to the open minidisc player.
+   @param status Pointer to save the status to (NETMD_OPERATING_STATUS_*).
+*/
+netmd_error netmd_get_operating_status(netmd_dev_handle* dev, uint16_t *status);
+
 /**
    Gets the used, total and available disc capacity (total and available
    capacity depend on current recording settings)
@@ -1451,6 +2405,473 @@ netmd_error netmd_get_position(netmd_dev_handle* dev, netmd_time* time);
 netmd_error netmd_get_disc_capacity(netmd_dev_handle* dev,
                                     netmd_disc_capacity* capacity);
 
+
+//! opaque edit transaction handle
+typedef struct netmd_txn netmd_txn_t;
+
+//! statistics of a committed transaction
+typedef struct {
+    unsigned int  edits;        //!< number of queued edits
+    unsigned long cmds_sent;    //!< commands really sent to the device
+    unsigned long cmds_single;  //!< commands the edits would need one by one
+    unsigned long cmds_saved;   //!< cmds_single - cmds_sent
+} netmd_txn_stats_t;
+
+//! opaque title write session handle
+typedef struct netmd_title_session netmd_title_session_t;
+
+//! one track move as used by netmd_move_track()
+typedef struct {
+    uint16_t start;     //!< zero based track to move
+    uint16_t finish;    //!< zero based destination
+} netmd_track_move_t;
+
+//------------------------------------------------------------------------------
+//! @brief      create an edit transaction. Header edits are applied to md
+//!             right away, device edits are queued until commit. The
+//!             disc header is written once on commit. If a device edit
+//!             fails, md is rebuilt from the edits done before it. Note:
+//!             md is modified even if the transaction is never committed.
+//!
+//! @param[in]  devh  device handle
+//! @param[in]  md    disc header (as read by netmd_initialize_disc_info),
+//!                   may be NULL if only device edits are used
+//!
+//! @return     transaction handle or NULL on error
+//------------------------------------------------------------------------------
+netmd_txn_t* netmd_txn_create(netmd_dev_handle* devh, HndMdHdr md);
+
+//------------------------------------------------------------------------------
+//! @brief      free an edit transaction (queued edits are dropped)
+//!
+//! @param[in/out] txn   pointer to transaction handle
+//------------------------------------------------------------------------------
+void netmd_txn_free(netmd_txn_t** txn);
+
+//------------------------------------------------------------------------------
+//! @brief      queue a track title change
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  zero based track number
+//! @param[in]  title  new track title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_set_title(netmd_txn_t* txn, uint16_t track, const char* title);
+
+//------------------------------------------------------------------------------
+//! @brief      queue a track move
+//!
+//! @param[in]  txn     transaction handle
+//! @param[in]  start   zero based track to move
+//! @param[in]  finish  zero based destination
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_move_track(netmd_txn_t* txn, uint16_t start, uint16_t finish);
+
+//------------------------------------------------------------------------------
+//! @brief      queue a track deletion (groups are updated in header)
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  zero based track number
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_delete_track(netmd_txn_t* txn, uint16_t track);
+
+//------------------------------------------------------------------------------
+//! @brief      set disc title
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  title  new disc title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_set_disc_title(netmd_txn_t* txn, const char* title);
+
+//------------------------------------------------------------------------------
+//! @brief      create a group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  name   group name
+//! @param[in]  first  first track (header numbering, -1 -> empty group)
+//! @param[in]  last   last track (header numbering, -1 -> one track)
+//!
+//! @return     > -1 -> group id; else -> error
+//------------------------------------------------------------------------------
+int netmd_txn_create_group(netmd_txn_t* txn, const char* name, int16_t first, int16_t last);
+
+//------------------------------------------------------------------------------
+//! @brief      rename a group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  gid    group id
+//! @param[in]  title  new group title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_set_group_title(netmd_txn_t* txn, int gid, const char* title);
+
+//------------------------------------------------------------------------------
+//! @brief      delete a group (tracks become ungrouped)
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  gid    group id
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_delete_group(netmd_txn_t* txn, int gid);
+
+//------------------------------------------------------------------------------
+//! @brief      put track into group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  track number (header numbering)
+//! @param[in]  gid    group id
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_put_track_in_group(netmd_txn_t* txn, int16_t track, int gid);
+
+//------------------------------------------------------------------------------
+//! @brief      remove track from group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  track number (header numbering)
+//! @param[in]  gid    group id
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_pull_track_from_group(netmd_txn_t* txn, int16_t track, int gid);
+
+//------------------------------------------------------------------------------
+//! @brief      commit transaction: run queued device edits in one TOC
+//!             cache / sync window and write the disc header once. If a
+//!             device edit fails, the remaining edits are dropped and md
+//!             only keeps the header edits queued before the failed one.
+//!
+//! @param[in]  txn    transaction handle
+//! @param[out] stats  optional buffer for statistics (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_txn_commit(netmd_txn_t* txn, netmd_txn_stats_t* stats);
+
+//------------------------------------------------------------------------------
+//! @brief      plan the minimal move sequence for a new track order; tracks
+//!             building the longest increasing subsequence of order stay
+//!             where they are, all others are moved once
+//!
+//! @param[in]  order  new order: order[i] is the (zero based) current track
+//!                    which should become track i
+//! @param[in]  count  number of tracks (entries in order)
+//! @param[out] moves  buffer for at least count moves
+//!
+//! @return     number of moves; -1 -> error (order is no permutation)
+//------------------------------------------------------------------------------
+int netmd_plan_track_order(const uint16_t* order, uint16_t count, netmd_track_move_t* moves);
+
+//------------------------------------------------------------------------------
+//! @brief      reorder all tracks on disc with a minimal number of moves
+//!             and fix up group ranges with one header write; if a move
+//!             fails, group ranges follow the moves done before
+//!
+//! @param[in]  devh   device handle
+//! @param[in]  md     disc header
+//! @param[in]  order  new order: order[i] is the (zero based) current track
+//!                    which should become track i
+//! @param[in]  count  number of tracks, must match track count on disc
+//! @param[out] stats  optional buffer for statistics (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_set_track_order(netmd_dev_handle* devh, HndMdHdr md, const uint16_t* order,
+                                  uint16_t count, netmd_txn_stats_t* stats);
+
+//------------------------------------------------------------------------------
+//! @brief      delete a set of tracks in one TOC cache / sync window;
+//!             tracks are deleted in descending order, so numbers given
+//!             stay valid. Group ranges are updated and the header is
+//!             written once; if a delete fails, only the ranges of the
+//!             tracks deleted before are updated.
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  md      disc header
+//! @param[in]  tracks  zero based track numbers (any order, duplicates ok)
+//! @param[in]  count   number of entries in tracks
+//! @param[out] stats   optional buffer for statistics (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_delete_tracks(netmd_dev_handle* devh, HndMdHdr md, const uint16_t* tracks,
+                                uint16_t count, netmd_txn_stats_t* stats);
+
+//------------------------------------------------------------------------------
+//! @brief      open a title write session: the title descriptor is opened
+//!             for write once and stays open until the session is closed;
+//!             the device is locked for the session's lifetime
+//!
+//! @param[in]  devh  device handle
+//!
+//! @return     session handle or NULL on error
+//------------------------------------------------------------------------------
+netmd_title_session_t* netmd_title_session_open(netmd_dev_handle* devh);
+
+//------------------------------------------------------------------------------
+//! @brief      write a track title; the old title is only read if its
+//!             size isn't known yet (see netmd_dev_title_size_set())
+//!
+//! @param[in]  ts     session handle
+//! @param[in]  track  zero based track number
+//! @param[in]  title  new track title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_title_session_write(netmd_title_session_t* ts, uint16_t track, const char* title);
+
+//------------------------------------------------------------------------------
+//! @brief      close title write session, unlock the device and free it
+//!
+//! @param[in/out] ts    pointer to session handle
+//! @param[out]    cmds  optional buffer for the number of commands
+//!                      (round trips) the session needed (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_title_session_close(netmd_title_session_t** ts, unsigned long* cmds);
+
+
+/*
+ * Binary protocol trace: a fixed size, lock-free ring buffer holding the
+ * most recent AV/C commands, responses, poll results and bulk transfer
+ * summaries with monotonic time stamps. Recording is cheap (no
+ * formatting, no I/O), so it's on by default. The ring can be dumped on
+ * demand or automatically on error and is decoded offline by netmdtrace.
+ */
+
+//! number of records in the ring (power of two)
+#define NETMD_TRACE_RECORDS 1024
+
+//! max. payload bytes stored per record
+#define NETMD_TRACE_DATA 24
+
+//! dump file magic
+#define NETMD_TRACE_MAGIC "NMDTRC01"
+
+//! trace record types
+typedef enum {
+    NETMD_TRACE_CMD = 1,    //!< AV/C command; value: result
+    NETMD_TRACE_RSP,        //!< AV/C response; value: result
+    NETMD_TRACE_POLL,       //!< poll; value: bytes to read or error, data: poll buffer
+    NETMD_TRACE_BULK_OUT,   //!< bulk write; value: libusb result, data: duration in us (u32)
+    NETMD_TRACE_BULK_IN,    //!< bulk read; value: libusb result, data: duration in us (u32)
+    NETMD_TRACE_ERROR,      //!< error; value: error code
+} netmd_trace_type;
+
+//! one trace record (dumped as is, host byte order)
+typedef struct {
+    uint64_t seq;                       //!< sequence number (0 -> invalid)
+    uint64_t ts_us;                     //!< monotonic time stamp in us
+    uint32_t dev;                       //!< device tag (distinguishes handles)
+    int32_t  value;                     //!< type specific value
+    uint32_t size;                      //!< full payload / transfer size
+    uint16_t type;                      //!< netmd_trace_type
+    uint16_t len;                       //!< bytes stored in data
+    uint8_t  data[NETMD_TRACE_DATA];    //!< payload (truncated)
+} netmd_trace_rec_t;
+
+//! dump file header
+typedef struct {
+    char     magic[8];      //!< NETMD_TRACE_MAGIC
+    uint32_t rec_size;      //!< sizeof(netmd_trace_rec_t)
+    uint32_t count;         //!< number of records following
+} netmd_trace_file_t;
+
+//------------------------------------------------------------------------------
+//! @brief      enable / disable trace recording (enabled by default)
+//!
+//! @param[in]  enable  1 -> enable; 0 -> disable
+//------------------------------------------------------------------------------
+void netmd_trace_enable(int enable);
+
+//------------------------------------------------------------------------------
+//! @brief      add a record to the trace ring; safe to call from several
+//!             threads without locking
+//!
+//! @param[in]  type   record type
+//! @param[in]  devh   device handle (used as tag only, may be NULL)
+//! @param[in]  value  type specific value
+//! @param[in]  data   payload (may be NULL)
+//! @param[in]  size   payload / transfer size
+//------------------------------------------------------------------------------
+void netmd_trace(netmd_trace_type type, const void* devh, int32_t value, const uint8_t* data, size_t size);
+
+//------------------------------------------------------------------------------
+//! @brief      monotonic time stamp as used in trace records
+//!
+//! @return     time in us
+//------------------------------------------------------------------------------
+uint64_t netmd_trace_time_us(void);
+
+//------------------------------------------------------------------------------
+//! @brief      record a bulk transfer summary
+//!
+//! @param[in]  type    NETMD_TRACE_BULK_OUT or NETMD_TRACE_BULK_IN
+//! @param[in]  devh    device handle (used as tag only, may be NULL)
+//! @param[in]  result  libusb result
+//! @param[in]  bytes   transferred bytes
+//! @param[in]  start   start time stamp from netmd_trace_time_us()
+//------------------------------------------------------------------------------
+void netmd_trace_bulk(netmd_trace_type type, const void* devh, int32_t result, size_t bytes, uint64_t start);
+
+//------------------------------------------------------------------------------
+//! @brief      record an error and dump the ring to the file set with
+//!             netmd_trace_set_dump_path() (if any)
+//!
+//! @param[in]  devh   device handle (used as tag only, may be NULL)
+//! @param[in]  err    error code
+//------------------------------------------------------------------------------
+void netmd_trace_error(const void* devh, int32_t err);
+
+//------------------------------------------------------------------------------
+//! @brief      set the file the ring is dumped to on error
+//!
+//! @param[in]  path  file name (NULL -> no dump on error); the string must
+//!                   stay valid
+//------------------------------------------------------------------------------
+void netmd_trace_set_dump_path(const char* path);
+
+//------------------------------------------------------------------------------
+//! @brief      dump the ring (oldest record first) to a stream
+//!
+//! @param[in]  f     stream opened in binary mode
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_trace_dump(FILE* f);
+
+//------------------------------------------------------------------------------
+//! @brief      dump the ring (oldest record first) to a file
+//!
+//! @param[in]  path  file name (overwritten)
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_trace_dump_file(const char* path);
+
+
+/*
+ * Status monitor: one background thread per device polls track, position
+ * and operating status in one cycle at a configurable rate. Subscribers
+ * are called (from the monitor thread) only if something they subscribed
+ * to changed; netmd_monitor_get() returns the last cycle's result without
+ * any device traffic. Each cycle holds the device lock, so it never
+ * interleaves with commands from other threads.
+ */
+
+//! default poll interval
+#define NETMD_MONITOR_INTERVAL_MS 500
+
+//! smallest poll interval accepted
+#define NETMD_MONITOR_MIN_INTERVAL_MS 100
+
+//! max. subscribers per monitor
+#define NETMD_MONITOR_SUBSCRIBERS 8
+
+//! change flags passed to subscribers
+typedef enum {
+    NETMD_MONITOR_TRACK    = 0x01,  //!< current track changed
+    NETMD_MONITOR_POSITION = 0x02,  //!< position changed
+    NETMD_MONITOR_STATE    = 0x04,  //!< operating status changed
+    NETMD_MONITOR_ERROR    = 0x08,  //!< query result changed (ok <-> error)
+    NETMD_MONITOR_ALL      = 0x0f,
+} netmd_monitor_change;
+
+//! device status as seen by the last poll cycle
+typedef struct {
+    uint16_t    track;      //!< current track (zero based)
+    netmd_time  position;   //!< position within track
+    uint16_t    state;      //!< NETMD_OPERATING_STATUS_*
+    netmd_error err;        //!< result of the last cycle
+    uint64_t    cycles;     //!< completed poll cycles
+} netmd_status_t;
+
+//! opaque monitor handle
+typedef struct netmd_monitor netmd_monitor_t;
+
+//------------------------------------------------------------------------------
+//! @brief      subscriber callback, called from the monitor thread
+//!
+//! @param[in]  ctx      subscriber context
+//! @param[in]  status   current status
+//! @param[in]  changed  netmd_monitor_change flags (only subscribed ones)
+//------------------------------------------------------------------------------
+typedef void (*netmd_monitor_cb)(void* ctx, const netmd_status_t* status, unsigned changed);
+
+//------------------------------------------------------------------------------
+//! @brief      start monitoring a device. If the device is monitored
+//!             already, the running monitor is shared (reference counted).
+//!
+//! @param[in]  devh         device handle
+//! @param[in]  interval_ms  poll interval (0 -> NETMD_MONITOR_INTERVAL_MS)
+//!
+//! @return     monitor handle or NULL on error
+//------------------------------------------------------------------------------
+netmd_monitor_t* netmd_monitor_start(netmd_dev_handle* devh, unsigned interval_ms);
+
+//------------------------------------------------------------------------------
+//! @brief      stop monitoring (thread ends with the last reference); if
+//!             called from a subscriber callback, the poll thread ends and
+//!             frees the monitor once the callbacks returned
+//!
+//! @param[in/out] mon   pointer to monitor handle
+//------------------------------------------------------------------------------
+void netmd_monitor_stop(netmd_monitor_t** mon);
+
+//------------------------------------------------------------------------------
+//! @brief      change the poll interval
+//!
+//! @param[in]  mon          monitor handle
+//! @param[in]  interval_ms  poll interval (min. NETMD_MONITOR_MIN_INTERVAL_MS)
+//------------------------------------------------------------------------------
+void netmd_monitor_set_interval(netmd_monitor_t* mon, unsigned interval_ms);
+
+//------------------------------------------------------------------------------
+//! @brief      subscribe to status changes
+//!
+//! @param[in]  mon   monitor handle
+//! @param[in]  mask  netmd_monitor_change flags of interest
+//! @param[in]  cb    callback
+//! @param[in]  ctx   callback context
+//!
+//! @return     subscriber id (>= 0); -1 -> error
+//------------------------------------------------------------------------------
+int netmd_monitor_subscribe(netmd_monitor_t* mon, unsigned mask, netmd_monitor_cb cb, void* ctx);
+
+//------------------------------------------------------------------------------
+//! @brief      remove a subscriber; the callback isn't running anymore when
+//!             this returns (unless called from the callback itself)
+//!
+//! @param[in]  mon   monitor handle
+//! @param[in]  id    subscriber id from netmd_monitor_subscribe()
+//------------------------------------------------------------------------------
+void netmd_monitor_unsubscribe(netmd_monitor_t* mon, int id);
+
+//------------------------------------------------------------------------------
+//! @brief      get the status of the last poll cycle (no device traffic)
+//!
+//! @param[in]  mon     monitor handle
+//! @param[out] status  buffer for status
+//!
+//! @return     0 -> ok; -1 -> no cycle completed yet
+//------------------------------------------------------------------------------
+int netmd_monitor_get(netmd_monitor_t* mon, netmd_status_t* status);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -29,6 +29,7 @@
 #include "libnetmd_intern.h"
 #include "log.h"
 #include "utils.h"
+#include "netmd_trace.h"
 
 /*! list of known codecs (mapped to protocol ID) that can be used in NetMD devices */
 /*! Bertrik: the original interpretation of these numbers as codecs appears incorrect.
@@ -279,12 +280,29 @@ int netmd_request_track_time(netmd_dev_handle* dev, const uint16_t track, struct
 
 int netmd_set_title(netmd_dev_handle* dev, const uint16_t track, const char* const buffer)
 {
-    int ret = 1;
-    unsigned char *title_request = NULL;
     /* handshakes for 780/980/etc */
     unsigned char hs2[] = {0x00, 0x18, 0x08, 0x10, 0x18, 0x02, 0x00, 0x00};
     unsigned char hs3[] = {0x00, 0x18, 0x08, 0x10, 0x18, 0x02, 0x03, 0x00};
+    unsigned char reply[255];
+    int oldsize;
+
+    /* the title update command wants to now how many bytes to replace */
+    if ((oldsize = netmd_dev_title_size(dev, track)) < 0)
+        oldsize = netmd_request_title(dev, track, (char *)reply, sizeof(reply));
+    if(oldsize == -1)
+        oldsize = 0; /* Reading failed -> no title at all, replace 0 bytes */
+
+    /* send handshakes */
+    netmd_exch_message(dev, hs2, 8, reply);
+    netmd_exch_message(dev, hs3, 8, reply);
+
+    return netmd_write_title(dev, track, buffer, oldsize);
+}
 
+int netmd_write_title(netmd_dev_handle* dev, const uint16_t track, const char* const buffer, int oldsize)
+{
+    int ret = 1;
+    unsigned char *title_request = NULL;
     unsigned char title_header[] = {0x00, 0x18, 0x07, 0x02, 0x20, 0x18,
                                     0x02, 0x00, 0x00, 0x30, 0x00, 0x0a,
                                     0x00, 0x50, 0x00, 0x00, 0x0a, 0x00,
@@ -292,14 +310,7 @@ int netmd_set_title(netmd_dev_handle* dev, const uint16_t track, const char* con
     unsigned char reply[255];
     unsigned char *buf;
     size_t size;
-    int oldsize;
-
-    /* the title update command wants to now how many bytes to replace */
-    oldsize = netmd_request_title(dev, track, (char *)reply, sizeof(reply));
-    if(oldsize == -1)
-        oldsize = 0; /* Reading failed -> no title at all, replace 0 bytes */
 
-    
     size = strlen(buffer);
     title_request = malloc(sizeof(char) * (0x15 + size));
     memcpy(title_request, title_header, 0x15);
@@ -310,20 +321,17 @@ int netmd_set_title(netmd_dev_handle* dev, const uint16_t track, const char* con
     title_request[16] = size & 0xff;
     title_request[20] = oldsize & 0xff;
 
-
-    /* send handshakes */
-    netmd_exch_message(dev, hs2, 8, reply);
-    netmd_exch_message(dev, hs3, 8, reply);
-
     ret = netmd_exch_message(dev, title_request, 0x15 + size, reply);
     free(title_request);
 
     if(ret < 0)
     {
-        netmd_log(NETMD_LOG_WARNING, "netmd_set_title: exchange failed, ret=%d\n", ret);
+        netmd_log(NETMD_LOG_WARNING, "netmd_write_title: exchange failed, ret=%d\n", ret);
+        netmd_dev_title_size_set(dev, track, -1);
         return 0;
     }
 
+    netmd_dev_title_size_set(dev, track, (int)size);
     return 1;
 }
 
@@ -347,6 +355,9 @@ int netmd_move_track(netmd_dev_handle* dev, const uint16_t start, const uint16_t
     netmd_exch_message(dev, request, 16, reply);
     ret = netmd_exch_message(dev, request, 16, reply);
 
+    /* titles moved along with the tracks */
+    netmd_dev_title_sizes_clear(dev);
+
     if(ret < 0)
     {
         fprintf(stderr, "bad ret code, returning early\n");
@@ -392,11 +403,31 @@ int netmd_initialize_disc_info(netmd_dev_handle* devh, HndMdHdr* md)
     if (discHeader != NULL)
     {
         *md = create_md_header(discHeader);
+        md_header_set_stored_size(*md, strlen(discHeader));
         free(discHeader);
     }
     return strlen(md_header_to_string(*md));
 }
 
+//------------------------------------------------------------------------------
+//! @brief      get disc header, it is read from the device on first use only;
+//!             use this instead of netmd_initialize_disc_info() if not every
+//!             code path needs the header
+//!
+//! @param[in]     devh  device handle
+//! @param[in/out] md    pointer to header handle (NULL -> not yet loaded)
+//!
+//! @return     header handle (NULL if it can't be read)
+//------------------------------------------------------------------------------
+HndMdHdr netmd_disc_header(netmd_dev_handle* devh, HndMdHdr* md)
+{
+    if (*md == NULL)
+    {
+        netmd_initialize_disc_info(devh, md);
+    }
+    return *md;
+}
+
 void print_groups(HndMdHdr md)
 {
     md_header_list_groups(md);
@@ -504,7 +535,7 @@ static int request_disc_header_size(netmd_dev_handle* devh)
 int netmd_write_disc_header(netmd_dev_handle* devh, HndMdHdr md)
 {
     size_t header_size     = 0;
-    size_t old_header_size = request_disc_header_size(devh);
+    int    old_header_size = md_header_stored_size(md);
     size_t request_size    = 0;
     
     /* new header */
@@ -523,6 +554,14 @@ int netmd_write_disc_header(netmd_dev_handle* devh, HndMdHdr md)
                                  0x00, 0x00, 0x00};
     unsigned char reply[255];
     int ret;
+
+    /* we only have to ask the device if we don't know
+     * what's stored there */
+    if (old_header_size < 0)
+    {
+        old_header_size = request_disc_header_size(devh);
+    }
+
     printf("sending write disc header handshake");
     netmd_exch_message(devh, hs, 8, reply);
     netmd_exch_message(devh, hs2, 8, reply);
@@ -545,6 +584,9 @@ int netmd_write_disc_header(netmd_dev_handle* devh, HndMdHdr md)
     netmd_exch_message(devh, hs2, 8, reply);
     free(request);
 
+    /* remember what is stored now */
+    md_header_set_stored_size(md, (ret < 0) ? -1 : (int)header_size);
+
     return ret;
 }
 
@@ -554,6 +596,7 @@ int netmd_write_track(netmd_dev_handle* devh, char* szFile)
 {
     int ret = 0;
     int transferred = 0;
+    uint64_t t0;
     int fd = open(szFile, O_RDONLY); /* File descriptor to omg file */
     unsigned char *data = malloc(4096); /* Buffer for reading the omg file */
     unsigned char *p = NULL; /* Pointer to index into data */
@@ -709,7 +752,9 @@ int netmd_write_track(netmd_dev_handle* devh, char* szFile)
 
         netmd_log(NETMD_LOG_DEBUG, "Sending %d bytes to md\n", bytes_to_send);
         netmd_log_hex(NETMD_LOG_DEBUG, data, bytes_to_send);
+        t0  = netmd_trace_time_us();
         ret = libusb_bulk_transfer(dev, 0x02, data, (int)bytes_to_send, &transferred, 5000);
+        netmd_trace_bulk(NETMD_TRACE_BULK_OUT, dev, ret, (size_t)transferred, t0);
     } /* End while */
 
     if (ret<0) {
@@ -770,6 +815,8 @@ int netmd_delete_track(netmd_dev_handle* dev, const uint16_t track)
     netmd_copy_word_to_buffer(&buf, track, 0);
     ret = netmd_exch_message(dev, request, 11, reply);
 
+    /* following tracks moved down */
+    netmd_dev_title_sizes_clear(dev);
     return ret;
 }
 
@@ -783,6 +830,7 @@ int netmd_erase_disc(netmd_dev_handle* dev)
 
     ret = netmd_exch_message(dev, request, 6, reply);
 
+    netmd_dev_title_sizes_clear(dev);
     return ret;
 }
 
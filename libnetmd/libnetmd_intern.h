@@ -46,6 +46,7 @@
 #include "CMDiscHeader.h"
 #include "patch.h"
 #include "netmd_transfer.h"
+#include "netmd_txn.h"
 
 /* copy start */
 
@@ -154,6 +155,19 @@ int netmd_request_track_time(netmd_dev_handle* dev, const uint16_t track, struct
 */
 int netmd_set_title(netmd_dev_handle* dev, const uint16_t track, const char* const buffer);
 
+/**
+   Writes title for the specified track without reading the old title and
+   without any handshake. The title descriptor must already be open for
+   write (see netmd_cache_toc).
+
+   @param dev pointer to device returned by netmd_open
+   @param track Zero based index of track your requesting.
+   @param buffer buffer holding the name.
+   @param oldsize size of the title which is replaced (0 if untitled)
+   @return returns 0 for fail 1 for success.
+*/
+int netmd_write_title(netmd_dev_handle* dev, const uint16_t track, const char* const buffer, int oldsize);
+
 /**
    Moves track around the disc.
 
@@ -185,10 +199,33 @@ int netmd_set_group_title(netmd_dev_handle* dev, HndMdHdr md, unsigned int group
 */
 int netmd_initialize_disc_info(netmd_dev_handle* devh, HndMdHdr* md);
 
+//------------------------------------------------------------------------------
+//! @brief      get disc header, it is read from the device on first use only;
+//!             use this instead of netmd_initialize_disc_info() if not every
+//!             code path needs the header
+//!
+//! @param[in]     devh  device handle
+//! @param[in/out] md    pointer to header handle (NULL -> not yet loaded)
+//!
+//! @return     header handle (NULL if it can't be read)
+//------------------------------------------------------------------------------
+HndMdHdr netmd_disc_header(netmd_dev_handle* devh, HndMdHdr* md);
+
 void print_groups(HndMdHdr md);
 
 int netmd_create_group(netmd_dev_handle* dev, HndMdHdr md, char* name, int first, int last);
 
+//------------------------------------------------------------------------------
+//! @brief      write the raw disc header (disc title and groups); a loaded
+//!             header handle doesn't know about it, so recreate it or at
+//!             least update its stored size (md_header_set_stored_size())
+//!
+//! @param[in]  dev           device handle
+//! @param[in]  title         raw disc header
+//! @param[in]  title_length  size of title
+//!
+//! @return     < 0 -> error
+//------------------------------------------------------------------------------
 int netmd_set_disc_title(netmd_dev_handle* dev, char* title, size_t title_length);
 
 /**
@@ -221,7 +258,9 @@ int netmd_pull_track_from_group(netmd_dev_handle* dev, HndMdHdr md, const uint16
 int netmd_delete_group(netmd_dev_handle* dev, HndMdHdr md, const unsigned int group);
 
 /**
-   Creates disc header out of groups and writes it to disc
+   Creates disc header out of groups and writes it to disc. The size of the
+   header stored on the device is taken from md (see md_header_stored_size).
+   It is only read from the device if unknown.
 
    @param devh pointer to device returned by netmd_open
    @param md pointer to minidisc structure
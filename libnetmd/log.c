@@ -27,7 +27,7 @@
 
 #include "log.h"
 
-static netmd_loglevel trace_level = 0;
+netmd_loglevel netmd_log_level_cur = 0;
 static FILE* fd_log = NULL;
 
 /**
@@ -42,75 +42,80 @@ void netmd_log_set_fd(FILE* fdid)
 
 void netmd_set_log_level(netmd_loglevel level)
 {
-    trace_level = level;
+    netmd_log_level_cur = level;
 }
 
 
-void netmd_log_hex(netmd_loglevel level, const unsigned char* const buf, const size_t len)
+/**
+   size of the stack buffer a hex dump is rendered into; one dump line
+   needs 67 bytes, so common commands and responses are written at once
+*/
+#define LOG_HEX_BUFF 4096
+
+void (netmd_log_hex)(netmd_loglevel level, const unsigned char* const buf, const size_t len)
 {
-    size_t i;
-    size_t j = 0;
-    int breakpoint = 0;
+    static const char hex[] = "0123456789abcdef";
+    char   out[LOG_HEX_BUFF];
+    size_t pos = 0;
+    size_t i, j, n;
 
     if (!fd_log)
         fd_log = stdout;
 
-    if (level > trace_level) {
+    if (level > netmd_get_log_level()) {
         return;
     }
 
-    for (i = 0; i < len; i++)
+    for (i = 0; i < len; i += 16)
     {
-        fprintf(fd_log, "%02x ", buf[i] & 0xff);
-        breakpoint++;
-        if(!((i + 1)%16) && i)
+        /* flush if the next line doesn't fit */
+        if ((pos + 67) > sizeof(out))
         {
-            fprintf(fd_log, "\t\t");
-            for(j = ((i+1) - 16); j < ((i+1)/16) * 16; j++)
+            fwrite(out, 1, pos, fd_log);
+            pos = 0;
+        }
+
+        n = ((len - i) < 16) ? (len - i) : 16;
+
+        for (j = 0; j < 16; j++)
+        {
+            if (j < n)
+            {
+                out[pos++] = hex[buf[i + j] >> 4];
+                out[pos++] = hex[buf[i + j] & 0x0f];
+            }
+            else
             {
-                if(buf[j] < 30)
-                    fprintf(fd_log, ".");
-                else
-                    fprintf(fd_log, "%c", buf[j]);
+                out[pos++] = ' ';
+                out[pos++] = ' ';
             }
-            fprintf(fd_log, "\n");
-            breakpoint = 0;
+            out[pos++] = ' ';
         }
-    }
 
-    if(breakpoint == 16)
-    {
-        fprintf(fd_log, "\n");
-        fflush(fd_log);
-        return;
-    }
+        out[pos++] = '\t';
+        out[pos++] = '\t';
 
-    for(; breakpoint < 16; breakpoint++)
-    {
-        fprintf(fd_log, "   ");
-    }
-    fprintf(fd_log, "\t\t");
+        for (j = 0; j < n; j++)
+        {
+            out[pos++] = ((buf[i + j] < 0x20) || (buf[i + j] > 0x7e)) ? '.' : (char)buf[i + j];
+        }
 
-    for(j = len - (len%16); j < len; j++)
-    {
-        if(buf[j] < 30)
-            fprintf(fd_log, ".");
-        else
-            fprintf(fd_log, "%c", buf[j]);
+        out[pos++] = '\n';
     }
-    fprintf(fd_log, "\n");
+
+    fwrite(out, 1, pos, fd_log);
     fflush(fd_log);
 }
 
 
-void netmd_log(netmd_loglevel level, const char* const fmt, ...)
+void (netmd_log)(netmd_loglevel level, const char* const fmt, ...)
 {
     va_list arg;
 
     if (!fd_log)
         fd_log = stdout;
 
-    if (level > trace_level) {
+    if (level > netmd_get_log_level()) {
         return;
     }
 
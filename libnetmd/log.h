@@ -30,6 +30,40 @@ typedef enum {
         NETMD_LOG_ALL
 } netmd_loglevel;
 
+/**
+   Log levels above this one are compiled out completely (e.g. build with
+   -DNETMD_LOG_COMPILED_LEVEL=NETMD_LOG_WARNING for a release without
+   verbose and debug logging).
+*/
+#ifndef NETMD_LOG_COMPILED_LEVEL
+#define NETMD_LOG_COMPILED_LEVEL NETMD_LOG_ALL
+#endif
+
+/**
+   Internal: current log level, exported only so the level check in
+   netmd_log() can be inlined. Read it with netmd_get_log_level(), set it
+   with netmd_set_log_level().
+*/
+extern netmd_loglevel netmd_log_level_cur;
+
+/**
+   Gets the global log level as set by netmd_set_log_level().
+
+   @return current log level
+*/
+static inline netmd_loglevel netmd_get_log_level(void)
+{
+    return netmd_log_level_cur;
+}
+
+/**
+   Check if messages of a log level are shown.
+
+   @param level Log level to check.
+*/
+#define netmd_log_enabled(level) \
+    (((level) <= NETMD_LOG_COMPILED_LEVEL) && ((level) <= netmd_get_log_level()))
+
 /**
    Sets the global log level.
 
@@ -55,6 +89,17 @@ void netmd_log_hex(netmd_loglevel level, const unsigned char* const data, const
 */
 void netmd_log(netmd_loglevel level, const char* const fmt, ...);
 
+/*
+   netmd_log() and netmd_log_hex() check the log level before the call, so
+   arguments of filtered messages aren't evaluated at all. The functions
+   can still be called directly, e.g. (netmd_log)(level, fmt, ...).
+*/
+#define netmd_log(level, ...) \
+    do { if (netmd_log_enabled(level)) (netmd_log)((level), __VA_ARGS__); } while (0)
+
+#define netmd_log_hex(level, data, len) \
+    do { if (netmd_log_enabled(level)) (netmd_log_hex)((level), (data), (len)); } while (0)
+
 /**
  * @brief      Sets the log file descriptor
  *
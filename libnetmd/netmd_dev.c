@@ -23,14 +23,20 @@
 #include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <libusb-1.0/libusb.h>
 
 #include "netmd_dev.h"
 #include "log.h"
 #include "const.h"
+#include "secure.h"
+#include "patch.h"
 
 static libusb_context *ctx = NULL;
 
+/*! tracks with a cached title size (track numbers are 8 bit on disc) */
+#define NETMD_TITLE_SIZES 256
+
 /*! list of known vendor/prod id's for NetMD devices
     patch credit to Thomas Arp, 2011:
     https://lists.fu-berlin.de/pipermail/linux-minidisc/2011-September/msg00027.html
@@ -88,6 +94,123 @@ static struct netmd_devices const known_devices[] =
   
 };
 
+/*! default profile: the values libnetmd always used. 1 MiB packets (larger
+    sizes cause instability in some players especially with ATRAC3 files),
+    poll sleep growing from 5ms over 100ms to 1s after 10 tries,
+    acquire / release around uploads and one bulk transfer per packet
+    without retries. Adaptive chunks and retries are opt-in (see
+    netmd_dev_profile_set()).
+*/
+static const netmd_dev_profile profile_default =
+{
+    "default", 0x00100000U, 5, 100, 1000, 10, 80000, NETMD_PROFILE_WF_ALL, 1, 0, 0
+};
+
+
+/*! profile table; product id 0 matches all products of a vendor,
+    first match wins. No deck needs values of its own yet.
+*/
+static struct {
+    int idVendor;
+    int idProduct;
+    const netmd_dev_profile *profile;
+} const known_profiles[] =
+{
+  {0, 0, NULL} /* terminating entry */
+};
+
+/*! profile overrides set by netmd_dev_profile_set() */
+#define NETMD_PROFILE_OVERRIDES 8
+static struct {
+    int idVendor;
+    int idProduct;
+    const netmd_dev_profile *profile;
+} profile_overrides[NETMD_PROFILE_OVERRIDES];
+
+/*! bumped by netmd_dev_profile_set(); profiles cached in device states
+    are resolved again if their generation differs */
+static unsigned profile_gen = 0;
+
+
+/*! per handle state: device lock, factory write flag and crypto context.
+    A netmd_dev_handle is the libusb handle itself, so the state is kept in
+    a list keyed by handle; there is no limit on open handles.
+*/
+typedef struct netmd_dev_state {
+    struct netmd_dev_state *link;
+    netmd_dev_handle *devh;
+    pthread_mutex_t mutex;      /* device lock (recursive) */
+    pthread_t owner;            /* thread holding the lock ... */
+    unsigned depth;             /* ... and its lock depth (0 -> free) */
+    unsigned refs;              /* 1 while open + threads in lock / unlock */
+    int closed;                 /* netmd_close() was called */
+    int factory;                /* send commands as factory write */
+    unsigned long cmds;         /* commands sent */
+    int idVendor;               /* USB ids the profile is looked up by */
+    int idProduct;
+    const netmd_dev_profile *profile; /* profile resolved at open ... */
+    unsigned profile_gen;       /* ... and the override generation it saw */
+    int16_t titles[NETMD_TITLE_SIZES]; /* stored title sizes (-1 -> unknown) */
+    netmd_crypto *crypto;       /* crypto context (created on demand) */
+} netmd_dev_state;
+
+/*! all device states */
+static netmd_dev_state *dev_states = NULL;
+
+/*! guards dev_states, the profile overrides and the owner / depth / refs /
+    factory / cmds / profile / titles fields */
+static pthread_mutex_t dev_states_guard = PTHREAD_MUTEX_INITIALIZER;
+
+/*! find (or create) the state of an open handle; guard must be held */
+static netmd_dev_state* netmd_dev_state_get(netmd_dev_handle* devh, int create)
+{
+    netmd_dev_state *st;
+    pthread_mutexattr_t attr;
+
+    for (st = dev_states; st != NULL; st = st->link) {
+        if ((st->devh == devh) && !st->closed) {
+            return st;
+        }
+    }
+
+    if (!create || ((st = calloc(1, sizeof(netmd_dev_state))) == NULL)) {
+        return NULL;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&st->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    memset(st->titles, 0xff, sizeof(st->titles));
+
+    st->devh   = devh;
+    st->refs   = 1;
+    st->link   = dev_states;
+    dev_states = st;
+    return st;
+}
+
+/*! drop a reference, free the state with the last one; guard must be held */
+static void netmd_dev_state_put(netmd_dev_state* st)
+{
+    netmd_dev_state **pp;
+
+    if (--st->refs > 0) {
+        return;
+    }
+
+    for (pp = &dev_states; *pp != NULL; pp = &(*pp)->link) {
+        if (*pp == st) {
+            *pp = st->link;
+            break;
+        }
+    }
+
+    netmd_crypto_close(&st->crypto);
+    pthread_mutex_destroy(&st->mutex);
+    free(st);
+}
 
 netmd_error netmd_init(netmd_device **device_list, libusb_context *hctx)
 {
@@ -138,10 +261,39 @@ netmd_error netmd_init(netmd_device **device_list, libusb_context *hctx)
 }
 
 
+/*! look up the profile of a vendor / product id; guard must be held */
+static const netmd_dev_profile* netmd_dev_profile_find(int idVendor, int idProduct)
+{
+    int i;
+
+    for (i = 0; i < NETMD_PROFILE_OVERRIDES; i++)
+    {
+        if ((profile_overrides[i].profile != NULL)
+            && (profile_overrides[i].idVendor == idVendor)
+            && ((profile_overrides[i].idProduct == 0) || (profile_overrides[i].idProduct == idProduct)))
+        {
+            return profile_overrides[i].profile;
+        }
+    }
+
+    for (i = 0; known_profiles[i].profile != NULL; i++)
+    {
+        if ((known_profiles[i].idVendor == idVendor)
+            && ((known_profiles[i].idProduct == 0) || (known_profiles[i].idProduct == idProduct)))
+        {
+            return known_profiles[i].profile;
+        }
+    }
+
+    return &profile_default;
+}
+
 netmd_error netmd_open(netmd_device *dev, netmd_dev_handle **dev_handle)
 {
     int result;
     libusb_device_handle *dh = NULL;
+    struct libusb_device_descriptor desc;
+    netmd_dev_state *st;
 
     result = libusb_open(dev->usb_dev, &dh);
     if (result == 0)
@@ -152,6 +304,24 @@ netmd_error netmd_open(netmd_device *dev, netmd_dev_handle **dev_handle)
     if (result == 0) 
     {
         *dev_handle = (netmd_dev_handle*)dh;
+
+        /* resolve the profile once, the transport asks for it per command */
+        if (libusb_get_device_descriptor(dev->usb_dev, &desc) != 0)
+        {
+            desc.idVendor  = 0;
+            desc.idProduct = 0;
+        }
+
+        pthread_mutex_lock(&dev_states_guard);
+        if ((st = netmd_dev_state_get(*dev_handle, 1)) != NULL)
+        {
+            st->idVendor    = desc.idVendor;
+            st->idProduct   = desc.idProduct;
+            st->profile     = netmd_dev_profile_find(desc.idVendor, desc.idProduct);
+            st->profile_gen = profile_gen;
+        }
+        pthread_mutex_unlock(&dev_states_guard);
+
         return NETMD_NO_ERROR;
     }
     else 
@@ -192,8 +362,32 @@ netmd_error netmd_get_devname(netmd_dev_handle* devh, char *buf, size_t buffsize
 netmd_error netmd_close(netmd_dev_handle* devh)
 {
     int result;
+    int locked;
+    netmd_dev_state *st;
     libusb_device_handle *dev;
 
+    /* wait for command sequences of other threads to finish */
+    locked = (netmd_dev_lock(devh) == NETMD_NO_ERROR);
+
+    netmd_sp_patch_release(devh);
+
+    /* handle is gone; the state is freed once no thread uses it */
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, 0)) != NULL) {
+        st->closed = 1;
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+
+    if (locked) {
+        netmd_dev_unlock(devh);
+    }
+
+    if (st != NULL) {
+        pthread_mutex_lock(&dev_states_guard);
+        netmd_dev_state_put(st);
+        pthread_mutex_unlock(&dev_states_guard);
+    }
+
     dev = (libusb_device_handle *)devh;
     result = libusb_release_interface(dev, 0);
     if (result == 0)
@@ -225,3 +419,239 @@ void netmd_clean(netmd_device **device_list)
 
     libusb_exit(ctx);
 }
+
+const netmd_dev_profile* netmd_dev_profile_get(netmd_dev_handle* devh)
+{
+    const netmd_dev_profile *prof = &profile_default;
+    netmd_dev_state *st;
+
+    if (devh == NULL)
+    {
+        return prof;
+    }
+
+    pthread_mutex_lock(&dev_states_guard);
+    if (((st = netmd_dev_state_get(devh, 0)) != NULL) && (st->profile != NULL))
+    {
+        /* overrides changed since open -> look up again */
+        if (st->profile_gen != profile_gen)
+        {
+            st->profile     = netmd_dev_profile_find(st->idVendor, st->idProduct);
+            st->profile_gen = profile_gen;
+        }
+        prof = st->profile;
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+
+    return prof;
+}
+
+netmd_error netmd_dev_profile_set(int idVendor, int idProduct, const netmd_dev_profile* profile)
+{
+    int i, slot = -1;
+    netmd_error ret = NETMD_NO_ERROR;
+
+    pthread_mutex_lock(&dev_states_guard);
+
+    for (i = 0; i < NETMD_PROFILE_OVERRIDES; i++)
+    {
+        if ((profile_overrides[i].profile != NULL)
+            && (profile_overrides[i].idVendor == idVendor)
+            && (profile_overrides[i].idProduct == idProduct))
+        {
+            slot = i;
+            break;
+        }
+
+        if ((slot == -1) && (profile_overrides[i].profile == NULL))
+        {
+            slot = i;
+        }
+    }
+
+    if (slot == -1)
+    {
+        ret = (profile == NULL) ? NETMD_NO_ERROR : NETMD_ERROR;
+    }
+    else
+    {
+        profile_overrides[slot].idVendor  = idVendor;
+        profile_overrides[slot].idProduct = idProduct;
+        profile_overrides[slot].profile   = profile;
+        profile_gen++;
+    }
+
+    pthread_mutex_unlock(&dev_states_guard);
+    return ret;
+}
+
+int netmd_dev_profile_wireformat(const netmd_dev_profile* profile, int wireformat)
+{
+    unsigned flag;
+
+    switch (wireformat)
+    {
+    case NETMD_WIREFORMAT_PCM:     flag = NETMD_PROFILE_WF_PCM;     break;
+    case NETMD_WIREFORMAT_105KBPS: flag = NETMD_PROFILE_WF_105KBPS; break;
+    case NETMD_WIREFORMAT_LP2:     flag = NETMD_PROFILE_WF_LP2;     break;
+    case NETMD_WIREFORMAT_LP4:     flag = NETMD_PROFILE_WF_LP4;     break;
+    default:                       return 0;
+    }
+
+    return (profile->wireformats & flag) ? 1 : 0;
+}
+
+netmd_error netmd_dev_lock(netmd_dev_handle* devh)
+{
+    netmd_dev_state *st;
+
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, 1)) != NULL) {
+        st->refs++;
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+
+    if (st == NULL) {
+        netmd_log(NETMD_LOG_ERROR, "netmd_dev_lock: can't create device lock\n");
+        return NETMD_ERROR;
+    }
+
+    pthread_mutex_lock(&st->mutex);
+
+    pthread_mutex_lock(&dev_states_guard);
+    st->owner = pthread_self();
+    st->depth++;
+    pthread_mutex_unlock(&dev_states_guard);
+
+    return NETMD_NO_ERROR;
+}
+
+void netmd_dev_unlock(netmd_dev_handle* devh)
+{
+    netmd_dev_state *st;
+
+    /* match by owner, the handle may have been closed meanwhile */
+    pthread_mutex_lock(&dev_states_guard);
+    for (st = dev_states; st != NULL; st = st->link) {
+        if ((st->devh == devh) && (st->depth > 0) && pthread_equal(st->owner, pthread_self())) {
+            st->depth--;
+            pthread_mutex_unlock(&st->mutex);
+            netmd_dev_state_put(st);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+}
+
+void netmd_set_factory_write(netmd_dev_handle* devh, int enable)
+{
+    netmd_dev_state *st;
+
+    netmd_log(NETMD_LOG_DEBUG, "Set factory write to %s!\n", enable ? "0xff" : "0x80");
+
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, enable)) != NULL) {
+        st->factory = enable;
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+}
+
+void netmd_dev_count_cmd(netmd_dev_handle* devh)
+{
+    netmd_dev_state *st;
+
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, 1)) != NULL) {
+        st->cmds++;
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+}
+
+unsigned long netmd_cmd_count(netmd_dev_handle* devh)
+{
+    netmd_dev_state *st;
+    unsigned long ret = 0;
+
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, 0)) != NULL) {
+        ret = st->cmds;
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+
+    return ret;
+}
+
+void netmd_dev_title_size_set(netmd_dev_handle* devh, uint16_t track, int size)
+{
+    netmd_dev_state *st;
+
+    if (track >= NETMD_TITLE_SIZES) {
+        return;
+    }
+
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, size >= 0)) != NULL) {
+        st->titles[track] = (size < 0) ? -1 : (int16_t)(size & 0xff);
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+}
+
+int netmd_dev_title_size(netmd_dev_handle* devh, uint16_t track)
+{
+    netmd_dev_state *st;
+    int ret = -1;
+
+    if (track >= NETMD_TITLE_SIZES) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, 0)) != NULL) {
+        ret = st->titles[track];
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+
+    return ret;
+}
+
+void netmd_dev_title_sizes_clear(netmd_dev_handle* devh)
+{
+    netmd_dev_state *st;
+
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, 0)) != NULL) {
+        memset(st->titles, 0xff, sizeof(st->titles));
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+}
+
+int netmd_dev_factory_write(netmd_dev_handle* devh)
+{
+    netmd_dev_state *st;
+    int ret = 0;
+
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, 0)) != NULL) {
+        ret = st->factory;
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+
+    return ret;
+}
+
+struct netmd_crypto* netmd_dev_crypto(netmd_dev_handle* devh)
+{
+    netmd_dev_state *st;
+    netmd_crypto *c = NULL;
+
+    pthread_mutex_lock(&dev_states_guard);
+    if ((st = netmd_dev_state_get(devh, 1)) != NULL) {
+        if (st->crypto == NULL) {
+            st->crypto = netmd_crypto_open();
+        }
+        c = st->crypto;
+    }
+    pthread_mutex_unlock(&dev_states_guard);
+
+    return c;
+}
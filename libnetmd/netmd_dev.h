@@ -25,6 +25,37 @@ struct netmd_devices {
     int otf_conv;
 };
 
+/* wire formats for netmd_dev_profile.wireformats */
+#define NETMD_PROFILE_WF_PCM     0x01
+#define NETMD_PROFILE_WF_105KBPS 0x02
+#define NETMD_PROFILE_WF_LP2     0x04
+#define NETMD_PROFILE_WF_LP4     0x08
+#define NETMD_PROFILE_WF_ALL     0x0f
+
+/**
+  Transport settings and quirks of a device family. Profiles are looked up by
+  vendor / product id when the device is opened and applied by the transport
+  (polling, packet size, bulk timeout, acquire / release on upload). The
+  default profile holds the values libnetmd always used. Use
+  netmd_dev_profile_set() to tune a deck.
+*/
+typedef struct netmd_dev_profile {
+    const char *name;           /* profile name (for logs) */
+    size_t max_chunk;           /* max. bulk packet size on upload */
+    unsigned poll_first_ms;     /* sleep after first unsuccessful poll */
+    unsigned poll_ms;           /* sleep between following polls */
+    unsigned poll_slow_ms;      /* sleep when device is still busy ... */
+    unsigned poll_slow_after;   /* ... after that many polls */
+    unsigned bulk_timeout_ms;   /* bulk transfer timeout */
+    unsigned wireformats;       /* supported NETMD_PROFILE_WF_* */
+    int need_acquire;           /* acquire / release device around upload */
+    size_t start_chunk;         /* adaptive upload: first chunk size, grows up
+                                   to max_chunk (0 -> off, one bulk per packet;
+                                   all built-in profiles) */
+    unsigned bulk_retries;      /* retries of a timed out / stalled chunk
+                                   (0 in all built-in profiles) */
+} netmd_dev_profile;
+
 /**
   Intialises the netmd device layer, scans the USB and fills in a list of
   supported devices.
@@ -67,6 +98,130 @@ netmd_error netmd_close(netmd_dev_handle* dev);
 */
 void netmd_clean(netmd_device **device_list);
 
+/**
+  Get the transport profile for an opened device. Devices not listed in the
+  profile table get a conservative default profile.
+
+  @param devh Pointer to device returned by netmd_open (may be NULL).
+  @return profile (never NULL)
+*/
+const netmd_dev_profile* netmd_dev_profile_get(netmd_dev_handle* devh);
+
+/**
+  Override the transport profile for a vendor / product id, e.g. to tune a
+  deck which isn't in the profile table. Open handles pick up the change
+  with their next profile lookup.
+
+  @param idVendor USB vendor id
+  @param idProduct USB product id (0 -> all products of vendor)
+  @param profile profile, must stay valid; NULL removes the override
+  @return NETMD_NO_ERROR or NETMD_ERROR if the override table is full
+*/
+netmd_error netmd_dev_profile_set(int idVendor, int idProduct, const netmd_dev_profile* profile);
+
+/**
+  Check if a device profile supports a wire format.
+
+  @param profile device profile
+  @param wireformat netmd_wireformat value
+  @return 1 -> supported; 0 -> not supported
+*/
+int netmd_dev_profile_wireformat(const netmd_dev_profile* profile, int wireformat);
+
+/**
+  Lock a device for exclusive use by the calling thread. The lock is
+  recursive; every command exchange takes it, so commands from several
+  threads never interleave on the wire. Take it around command sequences
+  which must not be split (e.g. open descriptor, query, close). Any
+  number of devices can be locked; netmd_close() waits for the lock.
+
+  @param devh Pointer to device returned by netmd_open.
+  @return NETMD_NO_ERROR or NETMD_ERROR
+*/
+netmd_error netmd_dev_lock(netmd_dev_handle* devh);
+
+/**
+  Unlock a device locked with netmd_dev_lock().
+
+  @param devh Pointer to device returned by netmd_open.
+*/
+void netmd_dev_unlock(netmd_dev_handle* devh);
+
+/**
+  Enable / disable factory write for a device: while enabled, commands to
+  this device are sent with request type 0xff instead of 0x80. Other
+  devices aren't affected. Hold the device lock for the whole factory
+  window, so other threads don't send normal commands inside it.
+
+  @param devh Pointer to device returned by netmd_open.
+  @param enable 1 to enable factory write, 0 to disable
+*/
+void netmd_set_factory_write(netmd_dev_handle* devh, int enable);
+
+/**
+  Check if factory write is enabled for a device.
+
+  @param devh Pointer to device returned by netmd_open.
+  @return 1 -> enabled; 0 -> disabled
+*/
+int netmd_dev_factory_write(netmd_dev_handle* devh);
+
+/**
+  Count a command sent to a device (see netmd_cmd_count()).
+
+  @param devh Pointer to device returned by netmd_open.
+*/
+void netmd_dev_count_cmd(netmd_dev_handle* devh);
+
+/**
+  Get the number of commands sent to a device so far. Use the difference
+  of two calls to count the commands an operation needs; commands other
+  threads send to other devices don't count.
+
+  @param devh Pointer to device returned by netmd_open.
+  @return command count
+*/
+unsigned long netmd_cmd_count(netmd_dev_handle* devh);
+
+/**
+  Remember the size of a track title as stored on disc. Title writes need
+  the size of the title they replace; with a known size the old title
+  isn't read first. netmd_request_title(), netmd_write_title() and track
+  uploads keep the sizes up to date, deleting or moving tracks and erasing
+  the disc forget them. Call netmd_dev_title_sizes_clear() if the disc
+  was changed.
+
+  @param devh Pointer to device returned by netmd_open.
+  @param track Zero based track number.
+  @param size title size in bytes (0 -> untitled; -1 -> unknown)
+*/
+void netmd_dev_title_size_set(netmd_dev_handle* devh, uint16_t track, int size);
+
+/**
+  Get the cached size of a track title (see netmd_dev_title_size_set()).
+
+  @param devh Pointer to device returned by netmd_open.
+  @param track Zero based track number.
+  @return title size in bytes; -1 -> unknown
+*/
+int netmd_dev_title_size(netmd_dev_handle* devh, uint16_t track);
+
+/**
+  Forget all cached title sizes of a device (e.g. after a disc change).
+
+  @param devh Pointer to device returned by netmd_open.
+*/
+void netmd_dev_title_sizes_clear(netmd_dev_handle* devh);
+
+/**
+  Get the crypto context of a device, created on first use and freed
+  when the device is closed (see netmd_crypto_get()).
+
+  @param devh Pointer to device returned by netmd_open.
+  @return crypto context; NULL on error
+*/
+struct netmd_crypto* netmd_dev_crypto(netmd_dev_handle* devh);
+
 /* copy end */
 
 #endif /* LIBNETMD_DEV_H */
@@ -0,0 +1,487 @@
+/* netmd_monitor.c
+ *
+ * Background status monitor (one poll thread per device).
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "netmd_monitor.h"
+#include "netmd_dev.h"
+#include "log.h"
+
+/* max. devices monitored at the same time */
+#define MONITOR_MAX 8
+
+/* clock of the timed wait; immune to wall clock changes where the
+   condition variable clock can be set */
+#ifdef __APPLE__
+#define MONITOR_CLOCK CLOCK_REALTIME
+#else
+#define MONITOR_CLOCK CLOCK_MONOTONIC
+#endif
+
+/** @brief subscriber */
+typedef struct
+{
+    netmd_monitor_cb cb;    /**< callback (NULL -> slot free) */
+    void*            ctx;   /**< callback context             */
+    unsigned         mask;  /**< changes of interest          */
+} monitor_sub_t;
+
+/** @brief device monitor */
+struct netmd_monitor
+{
+    netmd_dev_handle* devh;         /**< device handle                        */
+    pthread_t         thread;       /**< poll thread                          */
+    pthread_mutex_t   lock;         /**< protects all fields below            */
+    pthread_cond_t    wake;         /**< wakes the poll thread                */
+    pthread_mutex_t   dispatch;     /**< held while callbacks run             */
+    unsigned          interval_ms;  /**< poll interval                        */
+    int               refs;         /**< users of this monitor                */
+    int               quit;         /**< poll thread should end               */
+    int               orphan;       /**< stopped in a callback, thread frees  */
+    int               valid;        /**< status holds a completed cycle       */
+    netmd_status_t    status;       /**< last status                          */
+    monitor_sub_t     subs[NETMD_MONITOR_SUBSCRIBERS]; /**< subscribers       */
+};
+
+/** @brief running monitors (one per device) */
+static netmd_monitor_t* _s_monitors[MONITOR_MAX];
+
+/** @brief protects _s_monitors and reference counts */
+static pthread_mutex_t _s_monitors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//------------------------------------------------------------------------------
+//! @brief      clamp a poll interval
+//!
+//! @param[in]  interval_ms  requested interval (0 -> default)
+//!
+//! @return     interval to use
+//------------------------------------------------------------------------------
+static unsigned monitor_interval(unsigned interval_ms)
+{
+    if (interval_ms == 0)
+    {
+        return NETMD_MONITOR_INTERVAL_MS;
+    }
+
+    return (interval_ms < NETMD_MONITOR_MIN_INTERVAL_MS) ? NETMD_MONITOR_MIN_INTERVAL_MS : interval_ms;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      one poll cycle: operating status, track and position are
+//!             queried while the device is locked, so the cycle isn't
+//!             interleaved with commands from other threads
+//!
+//! @param[in]  devh    device handle
+//! @param[out] status  queried status (track / position / state / err)
+//------------------------------------------------------------------------------
+static void monitor_query(netmd_dev_handle* devh, netmd_status_t* status)
+{
+    if ((status->err = netmd_dev_lock(devh)) != NETMD_NO_ERROR)
+    {
+        return;
+    }
+
+    if ((status->err = netmd_get_operating_status(devh, &status->state)) == NETMD_NO_ERROR)
+    {
+        status->err = netmd_get_track_position(devh, &status->track, &status->position);
+    }
+
+    netmd_dev_unlock(devh);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      compare two states
+//!
+//! @param[in]  a   old status
+//! @param[in]  b   new status
+//!
+//! @return     netmd_monitor_change flags
+//------------------------------------------------------------------------------
+static unsigned monitor_changes(const netmd_status_t* a, const netmd_status_t* b)
+{
+    unsigned changed = 0;
+
+    if ((a->err == NETMD_NO_ERROR) != (b->err == NETMD_NO_ERROR))
+    {
+        changed |= NETMD_MONITOR_ERROR;
+    }
+
+    if (b->err != NETMD_NO_ERROR)
+    {
+        return changed;
+    }
+
+    if (a->track != b->track)
+    {
+        changed |= NETMD_MONITOR_TRACK;
+    }
+
+    if (memcmp(&a->position, &b->position, sizeof(netmd_time)))
+    {
+        changed |= NETMD_MONITOR_POSITION;
+    }
+
+    if (a->state != b->state)
+    {
+        changed |= NETMD_MONITOR_STATE;
+    }
+
+    return changed;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      poll thread
+//!
+//! @param[in]  arg   monitor
+//!
+//! @return     NULL
+//------------------------------------------------------------------------------
+static void* monitor_run(void* arg)
+{
+    netmd_monitor_t* mon = (netmd_monitor_t*)arg;
+    monitor_sub_t    subs[NETMD_MONITOR_SUBSCRIBERS];
+    netmd_status_t   cur;
+    struct timespec  ts;
+    unsigned         changed;
+    int              i, orphan;
+
+    memset(&cur, 0, sizeof(cur));
+
+    pthread_mutex_lock(&mon->lock);
+
+    while (!mon->quit)
+    {
+        pthread_mutex_unlock(&mon->lock);
+
+        monitor_query(mon->devh, &cur);
+
+        pthread_mutex_lock(&mon->lock);
+
+        /* the first cycle reports everything */
+        changed = mon->valid ? monitor_changes(&mon->status, &cur) : NETMD_MONITOR_ALL;
+
+        cur.cycles  = mon->status.cycles + 1;
+        mon->status = cur;
+        mon->valid  = 1;
+        memcpy(subs, mon->subs, sizeof(subs));
+
+        if ((cur.err != NETMD_NO_ERROR) && (changed & NETMD_MONITOR_ERROR))
+        {
+            netmd_log(NETMD_LOG_WARNING, "monitor: status query failed: %s\n", netmd_strerror(cur.err));
+        }
+
+        /* subscribers run without the monitor lock held, so they may
+           call any monitor function (and any device function) */
+        if (changed)
+        {
+            pthread_mutex_unlock(&mon->lock);
+            pthread_mutex_lock(&mon->dispatch);
+
+            for (i = 0; i < NETMD_MONITOR_SUBSCRIBERS; i++)
+            {
+                if ((subs[i].cb != NULL) && (changed & subs[i].mask))
+                {
+                    subs[i].cb(subs[i].ctx, &cur, changed & subs[i].mask);
+                }
+            }
+
+            pthread_mutex_unlock(&mon->dispatch);
+            pthread_mutex_lock(&mon->lock);
+        }
+
+        if (mon->quit)
+        {
+            break;
+        }
+
+        clock_gettime(MONITOR_CLOCK, &ts);
+        ts.tv_sec  += mon->interval_ms / 1000;
+        ts.tv_nsec += (long)(mon->interval_ms % 1000) * 1000000L;
+
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        /* woken early on stop or interval change */
+        pthread_cond_timedwait(&mon->wake, &mon->lock, &ts);
+    }
+
+    orphan = mon->orphan;
+    pthread_mutex_unlock(&mon->lock);
+
+    /* last reference dropped by a callback: nobody joins this thread */
+    if (orphan)
+    {
+        pthread_cond_destroy(&mon->wake);
+        pthread_mutex_destroy(&mon->dispatch);
+        pthread_mutex_destroy(&mon->lock);
+        free(mon);
+
+        netmd_log(NETMD_LOG_VERBOSE, "monitor: stopped\n");
+    }
+
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      start monitoring a device. If the device is monitored
+//!             already, the running monitor is shared (reference counted).
+//!
+//! @param[in]  devh         device handle
+//! @param[in]  interval_ms  poll interval (0 -> NETMD_MONITOR_INTERVAL_MS)
+//!
+//! @return     monitor handle or NULL on error
+//------------------------------------------------------------------------------
+netmd_monitor_t* netmd_monitor_start(netmd_dev_handle* devh, unsigned interval_ms)
+{
+    netmd_monitor_t*   mon       = NULL;
+    pthread_condattr_t attr;
+    int                free_slot = -1, i;
+
+    if (devh == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&_s_monitors_lock);
+
+    for (i = 0; i < MONITOR_MAX; i++)
+    {
+        if ((_s_monitors[i] != NULL) && (_s_monitors[i]->devh == devh))
+        {
+            mon = _s_monitors[i];
+            mon->refs++;
+            break;
+        }
+        else if ((_s_monitors[i] == NULL) && (free_slot == -1))
+        {
+            free_slot = i;
+        }
+    }
+
+    if ((mon == NULL) && (free_slot != -1) && ((mon = calloc(1, sizeof(netmd_monitor_t))) != NULL))
+    {
+        mon->devh        = devh;
+        mon->interval_ms = monitor_interval(interval_ms);
+        mon->refs        = 1;
+        pthread_mutex_init(&mon->lock, NULL);
+        pthread_mutex_init(&mon->dispatch, NULL);
+        pthread_condattr_init(&attr);
+#ifndef __APPLE__
+        pthread_condattr_setclock(&attr, MONITOR_CLOCK);
+#endif
+        pthread_cond_init(&mon->wake, &attr);
+        pthread_condattr_destroy(&attr);
+
+        if (pthread_create(&mon->thread, NULL, monitor_run, mon) == 0)
+        {
+            _s_monitors[free_slot] = mon;
+            netmd_log(NETMD_LOG_VERBOSE, "monitor: started, interval %u ms\n", mon->interval_ms);
+        }
+        else
+        {
+            netmd_log(NETMD_LOG_ERROR, "monitor: can't start poll thread\n");
+            pthread_cond_destroy(&mon->wake);
+            pthread_mutex_destroy(&mon->dispatch);
+            pthread_mutex_destroy(&mon->lock);
+            free(mon);
+            mon = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&_s_monitors_lock);
+    return mon;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      stop monitoring (thread ends with the last reference); if
+//!             called from a subscriber callback, the poll thread ends and
+//!             frees the monitor once the callbacks returned
+//!
+//! @param[in/out] mon   pointer to monitor handle
+//------------------------------------------------------------------------------
+void netmd_monitor_stop(netmd_monitor_t** mon)
+{
+    netmd_monitor_t* m;
+    int              last = 0, i;
+
+    if ((mon == NULL) || ((m = *mon) == NULL))
+    {
+        return;
+    }
+
+    *mon = NULL;
+
+    pthread_mutex_lock(&_s_monitors_lock);
+
+    if (--m->refs == 0)
+    {
+        last = 1;
+
+        for (i = 0; i < MONITOR_MAX; i++)
+        {
+            if (_s_monitors[i] == m)
+            {
+                _s_monitors[i] = NULL;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&_s_monitors_lock);
+
+    if (last && pthread_equal(pthread_self(), m->thread))
+    {
+        /* called from a callback: joining ourselves would dead lock and
+           the dispatch loop still uses the monitor */
+        pthread_mutex_lock(&m->lock);
+        m->quit   = 1;
+        m->orphan = 1;
+        pthread_mutex_unlock(&m->lock);
+
+        pthread_detach(m->thread);
+    }
+    else if (last)
+    {
+        pthread_mutex_lock(&m->lock);
+        m->quit = 1;
+        pthread_cond_signal(&m->wake);
+        pthread_mutex_unlock(&m->lock);
+
+        pthread_join(m->thread, NULL);
+
+        pthread_cond_destroy(&m->wake);
+        pthread_mutex_destroy(&m->dispatch);
+        pthread_mutex_destroy(&m->lock);
+        free(m);
+
+        netmd_log(NETMD_LOG_VERBOSE, "monitor: stopped\n");
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      change the poll interval
+//!
+//! @param[in]  mon          monitor handle
+//! @param[in]  interval_ms  poll interval (min. NETMD_MONITOR_MIN_INTERVAL_MS)
+//------------------------------------------------------------------------------
+void netmd_monitor_set_interval(netmd_monitor_t* mon, unsigned interval_ms)
+{
+    if (mon == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&mon->lock);
+    mon->interval_ms = monitor_interval(interval_ms);
+    pthread_cond_signal(&mon->wake);
+    pthread_mutex_unlock(&mon->lock);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      subscribe to status changes
+//!
+//! @param[in]  mon   monitor handle
+//! @param[in]  mask  netmd_monitor_change flags of interest
+//! @param[in]  cb    callback
+//! @param[in]  ctx   callback context
+//!
+//! @return     subscriber id (>= 0); -1 -> error
+//------------------------------------------------------------------------------
+int netmd_monitor_subscribe(netmd_monitor_t* mon, unsigned mask, netmd_monitor_cb cb, void* ctx)
+{
+    int i, id = -1;
+
+    if ((mon == NULL) || (cb == NULL) || ((mask & NETMD_MONITOR_ALL) == 0))
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mon->lock);
+
+    for (i = 0; i < NETMD_MONITOR_SUBSCRIBERS; i++)
+    {
+        if (mon->subs[i].cb == NULL)
+        {
+            mon->subs[i].cb   = cb;
+            mon->subs[i].ctx  = ctx;
+            mon->subs[i].mask = mask & NETMD_MONITOR_ALL;
+            id = i;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&mon->lock);
+    return id;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      remove a subscriber; the callback isn't running anymore when
+//!             this returns (unless called from the callback itself)
+//!
+//! @param[in]  mon   monitor handle
+//! @param[in]  id    subscriber id from netmd_monitor_subscribe()
+//------------------------------------------------------------------------------
+void netmd_monitor_unsubscribe(netmd_monitor_t* mon, int id)
+{
+    if ((mon == NULL) || (id < 0) || (id >= NETMD_MONITOR_SUBSCRIBERS))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&mon->lock);
+    memset(&mon->subs[id], 0, sizeof(monitor_sub_t));
+    pthread_mutex_unlock(&mon->lock);
+
+    /* wait for a running dispatch to finish */
+    if (!pthread_equal(pthread_self(), mon->thread))
+    {
+        pthread_mutex_lock(&mon->dispatch);
+        pthread_mutex_unlock(&mon->dispatch);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      get the status of the last poll cycle (no device traffic)
+//!
+//! @param[in]  mon     monitor handle
+//! @param[out] status  buffer for status
+//!
+//! @return     0 -> ok; -1 -> no cycle completed yet
+//------------------------------------------------------------------------------
+int netmd_monitor_get(netmd_monitor_t* mon, netmd_status_t* status)
+{
+    int ret = -1;
+
+    if ((mon == NULL) || (status == NULL))
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mon->lock);
+
+    if (mon->valid)
+    {
+        *status = mon->status;
+        ret     = 0;
+    }
+
+    pthread_mutex_unlock(&mon->lock);
+    return ret;
+}
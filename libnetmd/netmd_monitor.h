@@ -0,0 +1,135 @@
+/* netmd_monitor.h
+ *
+ * Background status monitor (one poll thread per device).
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef NETMD_MONITOR_H
+#define NETMD_MONITOR_H
+#include <stdint.h>
+#include "common.h"
+#include "error.h"
+#include "playercontrol.h"
+
+/* copy start */
+
+/*
+ * Status monitor: one background thread per device polls track, position
+ * and operating status in one cycle at a configurable rate. Subscribers
+ * are called (from the monitor thread) only if something they subscribed
+ * to changed; netmd_monitor_get() returns the last cycle's result without
+ * any device traffic. Each cycle holds the device lock, so it never
+ * interleaves with commands from other threads.
+ */
+
+//! default poll interval
+#define NETMD_MONITOR_INTERVAL_MS 500
+
+//! smallest poll interval accepted
+#define NETMD_MONITOR_MIN_INTERVAL_MS 100
+
+//! max. subscribers per monitor
+#define NETMD_MONITOR_SUBSCRIBERS 8
+
+//! change flags passed to subscribers
+typedef enum {
+    NETMD_MONITOR_TRACK    = 0x01,  //!< current track changed
+    NETMD_MONITOR_POSITION = 0x02,  //!< position changed
+    NETMD_MONITOR_STATE    = 0x04,  //!< operating status changed
+    NETMD_MONITOR_ERROR    = 0x08,  //!< query result changed (ok <-> error)
+    NETMD_MONITOR_ALL      = 0x0f,
+} netmd_monitor_change;
+
+//! device status as seen by the last poll cycle
+typedef struct {
+    uint16_t    track;      //!< current track (zero based)
+    netmd_time  position;   //!< position within track
+    uint16_t    state;      //!< NETMD_OPERATING_STATUS_*
+    netmd_error err;        //!< result of the last cycle
+    uint64_t    cycles;     //!< completed poll cycles
+} netmd_status_t;
+
+//! opaque monitor handle
+typedef struct netmd_monitor netmd_monitor_t;
+
+//------------------------------------------------------------------------------
+//! @brief      subscriber callback, called from the monitor thread
+//!
+//! @param[in]  ctx      subscriber context
+//! @param[in]  status   current status
+//! @param[in]  changed  netmd_monitor_change flags (only subscribed ones)
+//------------------------------------------------------------------------------
+typedef void (*netmd_monitor_cb)(void* ctx, const netmd_status_t* status, unsigned changed);
+
+//------------------------------------------------------------------------------
+//! @brief      start monitoring a device. If the device is monitored
+//!             already, the running monitor is shared (reference counted).
+//!
+//! @param[in]  devh         device handle
+//! @param[in]  interval_ms  poll interval (0 -> NETMD_MONITOR_INTERVAL_MS)
+//!
+//! @return     monitor handle or NULL on error
+//------------------------------------------------------------------------------
+netmd_monitor_t* netmd_monitor_start(netmd_dev_handle* devh, unsigned interval_ms);
+
+//------------------------------------------------------------------------------
+//! @brief      stop monitoring (thread ends with the last reference); if
+//!             called from a subscriber callback, the poll thread ends and
+//!             frees the monitor once the callbacks returned
+//!
+//! @param[in/out] mon   pointer to monitor handle
+//------------------------------------------------------------------------------
+void netmd_monitor_stop(netmd_monitor_t** mon);
+
+//------------------------------------------------------------------------------
+//! @brief      change the poll interval
+//!
+//! @param[in]  mon          monitor handle
+//! @param[in]  interval_ms  poll interval (min. NETMD_MONITOR_MIN_INTERVAL_MS)
+//------------------------------------------------------------------------------
+void netmd_monitor_set_interval(netmd_monitor_t* mon, unsigned interval_ms);
+
+//------------------------------------------------------------------------------
+//! @brief      subscribe to status changes
+//!
+//! @param[in]  mon   monitor handle
+//! @param[in]  mask  netmd_monitor_change flags of interest
+//! @param[in]  cb    callback
+//! @param[in]  ctx   callback context
+//!
+//! @return     subscriber id (>= 0); -1 -> error
+//------------------------------------------------------------------------------
+int netmd_monitor_subscribe(netmd_monitor_t* mon, unsigned mask, netmd_monitor_cb cb, void* ctx);
+
+//------------------------------------------------------------------------------
+//! @brief      remove a subscriber; the callback isn't running anymore when
+//!             this returns (unless called from the callback itself)
+//!
+//! @param[in]  mon   monitor handle
+//! @param[in]  id    subscriber id from netmd_monitor_subscribe()
+//------------------------------------------------------------------------------
+void netmd_monitor_unsubscribe(netmd_monitor_t* mon, int id);
+
+//------------------------------------------------------------------------------
+//! @brief      get the status of the last poll cycle (no device traffic)
+//!
+//! @param[in]  mon     monitor handle
+//! @param[out] status  buffer for status
+//!
+//! @return     0 -> ok; -1 -> no cycle completed yet
+//------------------------------------------------------------------------------
+int netmd_monitor_get(netmd_monitor_t* mon, netmd_status_t* status);
+
+/* copy end */
+
+#endif // NETMD_MONITOR_H
@@ -0,0 +1,714 @@
+/* netmd_pcm.c
+ *
+ * PCM conversion (sample rate, sample format) for uploads.
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "netmd_pcm.h"
+
+#if defined(__SSE__) || defined(_M_X64)
+    #include <xmmintrin.h>
+    #define PCM_SSE
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define PCM_NEON
+#endif
+
+/* cut off (-6 dB) relative to the lower Nyquist frequency (~20.5 kHz at 44.1 kHz) */
+#define PCM_PASS 0.93
+
+/* Kaiser window beta (~ 90 dB stop band attenuation) */
+#define PCM_BETA 9.0
+
+/* max. interpolation factor (coefficient memory is up * taps floats) */
+#define PCM_MAX_UP 1024u
+
+#define PCM_MIN_RATE 8000u
+#define PCM_MAX_RATE 192000u
+
+/* wave format tags */
+#define WAV_TAG_PCM        0x0001u
+#define WAV_TAG_FLOAT      0x0003u
+#define WAV_TAG_EXTENSIBLE 0xfffeu
+
+/** @brief conversion context */
+struct netmd_pcm_conv {
+    netmd_pcm_format format;    /**< input sample format               */
+    size_t   channels;          /**< channels                          */
+    size_t   frame_size;        /**< bytes per input frame             */
+    unsigned up;                /**< interpolation factor              */
+    unsigned down;              /**< decimation factor                 */
+    size_t   taps;              /**< taps per polyphase branch         */
+    float*   coef;              /**< up branches, time reversed        */
+    float*   hist;              /**< 2 * taps per channel, see push    */
+    size_t   pos;               /**< history write position            */
+    unsigned phase;             /**< branch of the next output         */
+    size_t   need;              /**< input frames until next output    */
+    uint64_t in_count;          /**< input frames so far               */
+    uint64_t out_count;         /**< output frames so far              */
+    uint64_t skip;              /**< output frames to drop (delay)     */
+    uint32_t rng;               /**< dither noise state                */
+    int      dither;            /**< add dither before requantization  */
+};
+
+static inline unsigned int le16(const unsigned char* c)
+{
+    return c[1] * 256U + c[0];
+}
+
+static inline uint32_t le32(const unsigned char* c)
+{
+    return ((uint32_t)c[3] << 24) | ((uint32_t)c[2] << 16) | ((uint32_t)c[1] << 8) | c[0];
+}
+
+//------------------------------------------------------------------------------
+//! @brief      dot product of coefficients and one history window
+//!
+//! @param[in]  c     coefficients
+//! @param[in]  x     samples
+//! @param[in]  n     length
+//!
+//! @return     sum
+//------------------------------------------------------------------------------
+static inline float dot1(const float* c, const float* x, size_t n)
+{
+    size_t i = 0;
+    float  y = 0.0f;
+
+#if defined(PCM_SSE)
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+
+    for (; i + 8 <= n; i += 8)
+    {
+        a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(c + i),     _mm_loadu_ps(x + i)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(c + i + 4), _mm_loadu_ps(x + i + 4)));
+    }
+    a0 = _mm_add_ps(a0, a1);
+    a0 = _mm_add_ps(a0, _mm_movehl_ps(a0, a0));
+    a0 = _mm_add_ss(a0, _mm_shuffle_ps(a0, a0, 1));
+    y  = _mm_cvtss_f32(a0);
+#elif defined(PCM_NEON)
+    float32x4_t a0 = vdupq_n_f32(0.0f), a1 = vdupq_n_f32(0.0f);
+    float32x2_t t;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        a0 = vmlaq_f32(a0, vld1q_f32(c + i),     vld1q_f32(x + i));
+        a1 = vmlaq_f32(a1, vld1q_f32(c + i + 4), vld1q_f32(x + i + 4));
+    }
+    a0 = vaddq_f32(a0, a1);
+    t  = vadd_f32(vget_low_f32(a0), vget_high_f32(a0));
+    y  = vget_lane_f32(vpadd_f32(t, t), 0);
+#endif
+
+    for (; i < n; i++)
+    {
+        y += c[i] * x[i];
+    }
+    return y;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      dot products of coefficients and two history windows
+//!             (stereo: coefficients are loaded once for both channels)
+//!
+//! @param[in]  c     coefficients
+//! @param[in]  x0    samples left
+//! @param[in]  x1    samples right
+//! @param[in]  n     length
+//! @param[out] y0    sum left
+//! @param[out] y1    sum right
+//------------------------------------------------------------------------------
+static inline void dot2(const float* c, const float* x0, const float* x1, size_t n, float* y0, float* y1)
+{
+    size_t i = 0;
+    float  s0 = 0.0f, s1 = 0.0f;
+
+#if defined(PCM_SSE)
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), k;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        k  = _mm_loadu_ps(c + i);
+        a0 = _mm_add_ps(a0, _mm_mul_ps(k, _mm_loadu_ps(x0 + i)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(k, _mm_loadu_ps(x1 + i)));
+    }
+
+    /* transpose sums: lanes 0/1 -> left, 2/3 -> right */
+    k  = _mm_add_ps(_mm_unpacklo_ps(a0, a1), _mm_unpackhi_ps(a0, a1));
+    k  = _mm_add_ps(k, _mm_movehl_ps(k, k));
+    s0 = _mm_cvtss_f32(k);
+    s1 = _mm_cvtss_f32(_mm_shuffle_ps(k, k, 1));
+#elif defined(PCM_NEON)
+    float32x4_t a0 = vdupq_n_f32(0.0f), a1 = vdupq_n_f32(0.0f), k;
+    float32x2_t t0, t1;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        k  = vld1q_f32(c + i);
+        a0 = vmlaq_f32(a0, k, vld1q_f32(x0 + i));
+        a1 = vmlaq_f32(a1, k, vld1q_f32(x1 + i));
+    }
+    t0 = vadd_f32(vget_low_f32(a0), vget_high_f32(a0));
+    t1 = vadd_f32(vget_low_f32(a1), vget_high_f32(a1));
+    t0 = vpadd_f32(t0, t1);
+    s0 = vget_lane_f32(t0, 0);
+    s1 = vget_lane_f32(t0, 1);
+#endif
+
+    for (; i < n; i++)
+    {
+        s0 += c[i] * x0[i];
+        s1 += c[i] * x1[i];
+    }
+    *y0 = s0;
+    *y1 = s1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      zeroth order modified Bessel function (Kaiser window)
+//!
+//! @param[in]  x     argument
+//!
+//! @return     I0(x)
+//------------------------------------------------------------------------------
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0, q = (x * x) / 4.0;
+    int    k;
+
+    for (k = 1; k < 64; k++)
+    {
+        term *= q / ((double)k * k);
+        sum  += term;
+        if (term < (sum * 1e-12))
+        {
+            break;
+        }
+    }
+    return sum;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      design the low pass (windowed sinc at up * rate) and split
+//!             it into polyphase branches
+//!
+//! @param[in]  conv  converter
+//! @param[in]  rate  input sample rate
+//------------------------------------------------------------------------------
+static void design_filter(netmd_pcm_conv* conv, unsigned int rate)
+{
+    /* odd length (last tap stays 0), so the delay is a whole number of
+       samples at the interpolated rate */
+    size_t n = conv->up * conv->taps - 1, m, p, j;
+    double center = (n - 1) / 2.0, f, t, w, sum = 0.0;
+    double lower  = (rate < NETMD_PCM_RATE) ? rate : NETMD_PCM_RATE;
+
+    if (n == 0)
+    {
+        conv->coef[0] = 1.0f;
+        return;
+    }
+
+    /* cut off in cycles per sample at the interpolated rate */
+    f = (PCM_PASS * lower / 2.0) / ((double)conv->up * rate);
+
+    for (m = 0; m < n; m++)
+    {
+        t = m - center;
+        w = 1.0 - ((2.0 * t) / (n - 1)) * ((2.0 * t) / (n - 1));
+        w = bessel_i0(PCM_BETA * sqrt((w > 0.0) ? w : 0.0)) / bessel_i0(PCM_BETA);
+        t = (t == 0.0) ? (2.0 * f) : (sin(2.0 * M_PI * f * t) / (M_PI * t));
+
+        /* branch p = m % up, tap m / up; stored time reversed, so the
+           window runs oldest to newest sample */
+        p = m % conv->up;
+        j = conv->taps - 1 - (m / conv->up);
+        conv->coef[p * conv->taps + j] = (float)(t * w);
+        sum += t * w;
+    }
+
+    /* unity DC gain per branch */
+    for (m = 0; m < n; m++)
+    {
+        conv->coef[m] = (float)(conv->coef[m] * (conv->up / sum));
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      one input sample as float
+//!
+//! @param[in]  format  sample format
+//! @param[in]  p       sample
+//!
+//! @return     sample in [-1, 1)
+//------------------------------------------------------------------------------
+static inline float read_sample(netmd_pcm_format format, const unsigned char* p)
+{
+    uint32_t u;
+    float    f;
+
+    switch (format)
+    {
+    case NETMD_PCM_S16:
+        return (int16_t)le16(p) * (1.0f / 32768.0f);
+    case NETMD_PCM_S24:
+        u = ((uint32_t)p[2] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[0] << 8);
+        return (int32_t)u * (1.0f / 2147483648.0f);
+    case NETMD_PCM_S32:
+        return (int32_t)le32(p) * (1.0f / 2147483648.0f);
+    default:
+        u = le32(p);
+        memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      requantize to 16 bit big endian (device byte order)
+//!
+//! @param[in]  y       sample
+//! @param[in]  dither  add TPDF dither
+//! @param[in]  rng     dither noise state
+//! @param[out] out     2 bytes
+//------------------------------------------------------------------------------
+static inline void write_sample(float y, int dither, uint32_t* rng, unsigned char* out)
+{
+    float    v = y * 32768.0f;
+    uint32_t r;
+    int32_t  s;
+
+    if (dither)
+    {
+        /* TPDF dither, +/- 1 LSB: difference of two uniform values */
+        r  = *rng;
+        r ^= r << 13;
+        r ^= r >> 17;
+        r ^= r << 5;
+        *rng = r;
+        v += ((float)(r & 0xffffu) - (float)(r >> 16)) * (1.0f / 65536.0f);
+    }
+
+    if (v <= -32768.0f)
+    {
+        s = -32768;
+    }
+    else if (v >= 32767.0f)
+    {
+        s = 32767;
+    }
+    else
+    {
+        /* biased, so truncation rounds to nearest */
+        s = (int32_t)(v + 32768.5f) - 32768;
+    }
+
+    out[0] = (unsigned char)((uint16_t)s >> 8);
+    out[1] = (unsigned char)(s & 0xff);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      conversion loop used by run and flush; the state is held in
+//!             locals, so byte stores to the output don't force reloads
+//!
+//! @param[in]  conv        converter
+//! @param[in]  in          input samples (NULL -> silence)
+//! @param[in]  in_frames   input frames (unused for silence)
+//! @param[out] consumed    input frames used
+//! @param[out] out         output buffer
+//! @param[in]  out_frames  output buffer size in frames
+//!
+//! @return     frames written to output
+//------------------------------------------------------------------------------
+static inline size_t convert(netmd_pcm_conv* conv, const unsigned char* in, size_t in_frames, size_t* consumed,
+                             unsigned char* out, size_t out_frames)
+{
+    const netmd_pcm_format format = conv->format;
+    const size_t   taps   = conv->taps;
+    const size_t   stereo = (conv->channels == 2);
+    const size_t   bytes  = conv->frame_size / conv->channels;
+    const unsigned up     = conv->up;
+    const unsigned down   = conv->down;
+    const int      dither = conv->dither;
+    const float*   coef   = conv->coef;
+    float* const   h0     = conv->hist;
+    float* const   h1     = conv->hist + 2 * taps;
+    size_t         pos    = conv->pos;
+    size_t         need   = conv->need;
+    unsigned       phase  = conv->phase;
+    uint64_t       skip   = conv->skip;
+    uint32_t       rng    = conv->rng;
+    size_t         i = 0, o = 0;
+    float          x0 = 0.0f, x1 = 0.0f, y0, y1;
+
+    while (o < out_frames)
+    {
+        /* feed input; every sample is written twice, so the newest 'taps'
+           samples are always contiguous, oldest first at 'pos' */
+        for (; need > 0; need--)
+        {
+            if (in != NULL)
+            {
+                if (i == in_frames)
+                {
+                    break;
+                }
+                x0 = read_sample(format, in + i * conv->frame_size);
+                if (stereo)
+                {
+                    x1 = read_sample(format, in + i * conv->frame_size + bytes);
+                }
+                i++;
+            }
+
+            h0[pos] = h0[pos + taps] = x0;
+            if (stereo)
+            {
+                h1[pos] = h1[pos + taps] = x1;
+            }
+
+            if (++pos == taps)
+            {
+                pos = 0;
+            }
+        }
+
+        if (need > 0)
+        {
+            break;
+        }
+
+        if (skip > 0)
+        {
+            skip--;
+        }
+        else if (stereo)
+        {
+            dot2(coef + phase * taps, h0 + pos, h1 + pos, taps, &y0, &y1);
+            write_sample(y0, dither, &rng, out + o * 4);
+            write_sample(y1, dither, &rng, out + o * 4 + 2);
+            o++;
+        }
+        else
+        {
+            write_sample(dot1(coef + phase * taps, h0 + pos, taps), dither, &rng, out + o * 2);
+            o++;
+        }
+
+        /* next output: 'down' steps at the interpolated rate */
+        for (phase += down; phase >= up; phase -= up)
+        {
+            need++;
+        }
+    }
+
+    conv->pos   = pos;
+    conv->need  = need;
+    conv->phase = phase;
+    conv->skip  = skip;
+    conv->rng   = rng;
+    *consumed   = i;
+    return o;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+    unsigned int t;
+
+    while (b != 0)
+    {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      parse a wave file header; on success the file is positioned
+//!             at the start of the sample data
+//!
+//! @param[in]  f     open wave file
+//! @param[out] info  wave info
+//!
+//! @return     0 -> ok; -1 -> no wave PCM file or format not supported
+//------------------------------------------------------------------------------
+int netmd_pcm_wav_probe(FILE* f, netmd_pcm_info* info)
+{
+    unsigned char hdr[40];
+    unsigned int  tag = 0, fmt_tag = 0, bytes = 0, bits = 0;
+    uint32_t      size;
+    long          pos, end;
+    int           have_fmt = 0;
+
+    memset(info, 0, sizeof(netmd_pcm_info));
+
+    if ((fseek(f, 0, SEEK_END) != 0) || ((end = ftell(f)) < 0) || (fseek(f, 0, SEEK_SET) != 0))
+    {
+        return -1;
+    }
+
+    if ((fread(hdr, 12, 1, f) != 1) || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4))
+    {
+        return -1;
+    }
+
+    while (fread(hdr, 8, 1, f) == 1)
+    {
+        size = le32(hdr + 4);
+
+        if (!memcmp(hdr, "fmt ", 4))
+        {
+            if ((size < 16) || (fread(hdr, (size < sizeof(hdr)) ? size : sizeof(hdr), 1, f) != 1))
+            {
+                return -1;
+            }
+
+            tag            = le16(hdr);
+            fmt_tag        = tag;
+            info->channels = le16(hdr + 2);
+            info->rate     = le32(hdr + 4);
+            bits           = le16(hdr + 14);
+
+            /* sub format GUID starts with the format tag */
+            if ((tag == WAV_TAG_EXTENSIBLE) && (size >= 40))
+            {
+                tag = le16(hdr + 24);
+            }
+
+            if ((info->channels < 1) || (info->channels > 2))
+            {
+                return -1;
+            }
+
+            /* container size; 24 bit in 32 bit container reads as S32 */
+            info->frame_size = le16(hdr + 12);
+            bytes            = info->frame_size / info->channels;
+            have_fmt         = 1;
+
+            if ((size > sizeof(hdr)) && (fseek(f, (long)(size - sizeof(hdr) + (size & 1)), SEEK_CUR) != 0))
+            {
+                return -1;
+            }
+        }
+        else if (!memcmp(hdr, "data", 4))
+        {
+            if (!have_fmt)
+            {
+                return -1;
+            }
+
+            if ((tag == WAV_TAG_PCM) && (bytes == 2))
+            {
+                info->format = NETMD_PCM_S16;
+            }
+            else if ((tag == WAV_TAG_PCM) && (bytes == 3))
+            {
+                info->format = NETMD_PCM_S24;
+            }
+            else if ((tag == WAV_TAG_PCM) && (bytes == 4))
+            {
+                info->format = NETMD_PCM_S32;
+            }
+            else if ((tag == WAV_TAG_FLOAT) && (bytes == 4) && (bits == 32))
+            {
+                info->format = NETMD_PCM_F32;
+            }
+            else
+            {
+                return -1;
+            }
+
+            if ((info->rate < PCM_MIN_RATE) || (info->rate > PCM_MAX_RATE))
+            {
+                return -1;
+            }
+
+            /* size may be bogus for streamed files */
+            if ((pos = ftell(f)) < 0)
+            {
+                return -1;
+            }
+            if (size > (uint32_t)(end - pos))
+            {
+                size = (uint32_t)(end - pos);
+            }
+
+            info->frames  = size / info->frame_size;
+            info->convert = !((fmt_tag == WAV_TAG_PCM) && (info->format == NETMD_PCM_S16)
+                              && (info->rate == NETMD_PCM_RATE));
+            return 0;
+        }
+        else if (fseek(f, (long)(size + (size & 1)), SEEK_CUR) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      create a converter to 44.1 kHz / 16 bit big endian
+//!
+//! @param[in]  rate      input sample rate
+//! @param[in]  channels  channels (1 or 2)
+//! @param[in]  format    input sample format
+//!
+//! @return     converter; NULL -> error
+//------------------------------------------------------------------------------
+netmd_pcm_conv* netmd_pcm_conv_open(unsigned int rate, size_t channels, netmd_pcm_format format)
+{
+    netmd_pcm_conv* conv;
+    unsigned int    g;
+    size_t          center, start;
+
+    if ((rate < PCM_MIN_RATE) || (rate > PCM_MAX_RATE) || (channels < 1) || (channels > 2))
+    {
+        return NULL;
+    }
+
+    if ((conv = calloc(1, sizeof(netmd_pcm_conv))) == NULL)
+    {
+        return NULL;
+    }
+
+    g              = gcd(NETMD_PCM_RATE, rate);
+    conv->up       = NETMD_PCM_RATE / g;
+    conv->down     = rate / g;
+    conv->format   = format;
+    conv->channels = channels;
+
+    switch (format)
+    {
+    case NETMD_PCM_S16: conv->frame_size = 2 * channels; break;
+    case NETMD_PCM_S24: conv->frame_size = 3 * channels; break;
+    default:            conv->frame_size = 4 * channels; break;
+    }
+
+    /* 16 bit at device rate is copied exactly, no dither needed */
+    conv->dither = !((format == NETMD_PCM_S16) && (conv->up == conv->down));
+    conv->rng    = 0x2545f491u;
+
+    if (conv->up == conv->down)
+    {
+        conv->taps = 1;
+    }
+    else
+    {
+        /* keep the transition band width for high input rates */
+        conv->taps = NETMD_PCM_TAPS * ((rate + 47999u) / 48000u);
+    }
+
+    if (conv->up > PCM_MAX_UP)
+    {
+        free(conv);
+        return NULL;
+    }
+
+    conv->coef = calloc(conv->up * conv->taps, sizeof(float));
+    conv->hist = calloc(channels * 2 * conv->taps, sizeof(float));
+
+    if ((conv->coef == NULL) || (conv->hist == NULL))
+    {
+        netmd_pcm_conv_close(&conv);
+        return NULL;
+    }
+
+    design_filter(conv, rate);
+
+    /* Compensate the group delay of the filter (center tap, in samples at
+       the interpolated rate): drop whole output frames and start the
+       phase at the remainder, so output frame 'skip' is at input time 0. */
+    center      = (conv->up * conv->taps - 1) / 2;
+    conv->skip  = center / conv->down;
+    start       = center % conv->down;
+    conv->need  = start / conv->up + 1;
+    conv->phase = start % conv->up;
+    return conv;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      number of output frames for a given input length
+//!
+//! @param[in]  conv       converter
+//! @param[in]  in_frames  input frames
+//!
+//! @return     output frames
+//------------------------------------------------------------------------------
+uint64_t netmd_pcm_conv_out_frames(const netmd_pcm_conv* conv, uint64_t in_frames)
+{
+    return (in_frames * conv->up + conv->down - 1) / conv->down;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      convert a block; stops if the input is used up or the output
+//!             is full
+//!
+//! @param[in]  conv        converter
+//! @param[in]  in          input samples
+//! @param[in]  in_frames   input frames
+//! @param[out] consumed    input frames used
+//! @param[out] out         output buffer (16 bit big endian)
+//! @param[in]  out_frames  output buffer size in frames
+//!
+//! @return     frames written to output
+//------------------------------------------------------------------------------
+size_t netmd_pcm_conv_run(netmd_pcm_conv* conv, const unsigned char* in, size_t in_frames, size_t* consumed,
+                          unsigned char* out, size_t out_frames)
+{
+    size_t o = convert(conv, in, in_frames, consumed, out, out_frames);
+
+    conv->in_count  += *consumed;
+    conv->out_count += o;
+    return o;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      drain the filter after the last input block; call until it
+//!             returns 0
+//!
+//! @param[in]  conv        converter
+//! @param[out] out         output buffer (16 bit big endian)
+//! @param[in]  out_frames  output buffer size in frames
+//!
+//! @return     frames written to output
+//------------------------------------------------------------------------------
+size_t netmd_pcm_conv_flush(netmd_pcm_conv* conv, unsigned char* out, size_t out_frames)
+{
+    uint64_t left = netmd_pcm_conv_out_frames(conv, conv->in_count) - conv->out_count;
+    size_t   used, o;
+
+    o = convert(conv, NULL, 0, &used, out, (left < out_frames) ? (size_t)left : out_frames);
+    conv->out_count += o;
+    return o;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      free converter
+//!
+//! @param[in]  conv  pointer to converter (set to NULL)
+//------------------------------------------------------------------------------
+void netmd_pcm_conv_close(netmd_pcm_conv** conv)
+{
+    if ((conv != NULL) && (*conv != NULL))
+    {
+        free((*conv)->coef);
+        free((*conv)->hist);
+        free(*conv);
+        *conv = NULL;
+    }
+}
@@ -0,0 +1,129 @@
+/* netmd_pcm.h
+ *
+ * PCM conversion (sample rate, sample format) for uploads.
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef NETMD_PCM_H
+#define NETMD_PCM_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* copy start */
+
+/*
+ * Streaming PCM conversion for uploads: wave files which aren't 44.1 kHz /
+ * 16 bit (e.g. 48 kHz or 24 bit masters) are resampled with a polyphase
+ * FIR filter and requantized to 16 bit with TPDF dither. Output is in
+ * device byte order (big endian), so no extra byte swap is needed. The
+ * converter works on blocks of any size with a fixed amount of state.
+ */
+
+//! device sample rate
+#define NETMD_PCM_RATE 44100u
+
+//! filter taps per polyphase branch (per 48 kHz input, multiple of 4)
+#define NETMD_PCM_TAPS 64u
+
+//! input sample formats (little endian, interleaved)
+typedef enum {
+    NETMD_PCM_S16,      //!< 16 bit signed
+    NETMD_PCM_S24,      //!< 24 bit signed, packed
+    NETMD_PCM_S32,      //!< 32 bit signed
+    NETMD_PCM_F32,      //!< 32 bit float
+} netmd_pcm_format;
+
+//! wave file info as found by netmd_pcm_wav_probe()
+typedef struct {
+    unsigned int     rate;       //!< sample rate
+    size_t           channels;   //!< channels (1 or 2)
+    netmd_pcm_format format;     //!< sample format
+    size_t           frame_size; //!< bytes per input frame
+    size_t           frames;     //!< frames in data chunk
+    int              convert;    //!< 1 -> device can't take it as is
+} netmd_pcm_info;
+
+//! conversion context (opaque)
+typedef struct netmd_pcm_conv netmd_pcm_conv;
+
+//------------------------------------------------------------------------------
+//! @brief      parse a wave file header; on success the file is positioned
+//!             at the start of the sample data
+//!
+//! @param[in]  f     open wave file
+//! @param[out] info  wave info
+//!
+//! @return     0 -> ok; -1 -> no wave PCM file or format not supported
+//------------------------------------------------------------------------------
+int netmd_pcm_wav_probe(FILE* f, netmd_pcm_info* info);
+
+//------------------------------------------------------------------------------
+//! @brief      create a converter to 44.1 kHz / 16 bit big endian
+//!
+//! @param[in]  rate      input sample rate
+//! @param[in]  channels  channels (1 or 2)
+//! @param[in]  format    input sample format
+//!
+//! @return     converter; NULL -> error
+//------------------------------------------------------------------------------
+netmd_pcm_conv* netmd_pcm_conv_open(unsigned int rate, size_t channels, netmd_pcm_format format);
+
+//------------------------------------------------------------------------------
+//! @brief      number of output frames for a given input length
+//!
+//! @param[in]  conv       converter
+//! @param[in]  in_frames  input frames
+//!
+//! @return     output frames
+//------------------------------------------------------------------------------
+uint64_t netmd_pcm_conv_out_frames(const netmd_pcm_conv* conv, uint64_t in_frames);
+
+//------------------------------------------------------------------------------
+//! @brief      convert a block; stops if the input is used up or the output
+//!             is full
+//!
+//! @param[in]  conv        converter
+//! @param[in]  in          input samples
+//! @param[in]  in_frames   input frames
+//! @param[out] consumed    input frames used
+//! @param[out] out         output buffer (16 bit big endian)
+//! @param[in]  out_frames  output buffer size in frames
+//!
+//! @return     frames written to output
+//------------------------------------------------------------------------------
+size_t netmd_pcm_conv_run(netmd_pcm_conv* conv, const unsigned char* in, size_t in_frames, size_t* consumed,
+                          unsigned char* out, size_t out_frames);
+
+//------------------------------------------------------------------------------
+//! @brief      drain the filter after the last input block; call until it
+//!             returns 0
+//!
+//! @param[in]  conv        converter
+//! @param[out] out         output buffer (16 bit big endian)
+//! @param[in]  out_frames  output buffer size in frames
+//!
+//! @return     frames written to output
+//------------------------------------------------------------------------------
+size_t netmd_pcm_conv_flush(netmd_pcm_conv* conv, unsigned char* out, size_t out_frames);
+
+//------------------------------------------------------------------------------
+//! @brief      free converter
+//!
+//! @param[in]  conv  pointer to converter (set to NULL)
+//------------------------------------------------------------------------------
+void netmd_pcm_conv_close(netmd_pcm_conv** conv);
+
+/* copy end */
+
+#endif // NETMD_PCM_H
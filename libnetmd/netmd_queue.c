@@ -0,0 +1,537 @@
+/* netmd_queue.c
+ *
+ * Upload queue with pipelined track preparation.
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "netmd_queue.h"
+#include "netmd_transfer.h"
+#include "netmd_trace.h"
+#include "netmd_dev.h"
+#include "patch.h"
+#include "log.h"
+
+#ifdef WIN32
+    #include <windows.h>
+#else
+    #include <unistd.h>
+#endif
+
+/* how often a waiting upload looks at the cancel flag */
+#define QUEUE_POLL_MS 100
+
+/** @brief job state */
+typedef enum
+{
+    JOB_QUEUED,     /**< waiting for a worker */
+    JOB_RUNNING,    /**< worker is preparing  */
+    JOB_READY,      /**< prepared, not sent   */
+    JOB_FAILED,     /**< prepare failed       */
+    JOB_DONE,       /**< handled by upload    */
+} queue_job_state_t;
+
+/** @brief one queued track */
+typedef struct
+{
+    char*                 filename; /**< audio file                        */
+    char*                 title;    /**< title (NULL -> file name)         */
+    unsigned char         otf;      /**< on the fly convert flag           */
+    size_t                estimate; /**< expected memory need              */
+    size_t                reserved; /**< memory accounted for this job     */
+    queue_job_state_t     state;    /**< state                             */
+    netmd_error           err;      /**< prepare result                    */
+    netmd_prepared_track* prep;     /**< prepared track                    */
+} queue_job_t;
+
+/** @brief upload queue */
+struct netmd_upload_queue
+{
+    queue_job_t*        jobs;       /**< queued tracks                        */
+    size_t              count;      /**< number of jobs                       */
+    size_t              size;       /**< allocated jobs                       */
+    unsigned            threads;    /**< max. worker threads                  */
+    size_t              budget;     /**< memory budget                        */
+    size_t              max_chunk;  /**< packet size for this run             */
+    pthread_mutex_t     lock;       /**< protects all fields below            */
+    pthread_cond_t      wake;       /**< job state or memory use changed      */
+    size_t              next;       /**< next job to prepare                  */
+    size_t              used;       /**< memory reserved by jobs              */
+    int                 quit;       /**< workers should end                   */
+    netmd_queue_stats_t stats;      /**< statistics                           */
+};
+
+//------------------------------------------------------------------------------
+//! @brief      number of CPUs online
+//!
+//! @return     CPUs (at least 1)
+//------------------------------------------------------------------------------
+static unsigned queue_cpus(void)
+{
+#ifdef WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (si.dwNumberOfProcessors > 0) ? (unsigned)si.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (unsigned)n : 1;
+#endif
+}
+
+//------------------------------------------------------------------------------
+//! @brief      duplicate a string
+//!
+//! @param[in]  s   string (may be NULL)
+//!
+//! @return     copy; NULL if s is NULL or out of memory
+//------------------------------------------------------------------------------
+static char* queue_strdup(const char* s)
+{
+    char*  d;
+    size_t len;
+
+    if (s == NULL)
+    {
+        return NULL;
+    }
+
+    len = strlen(s) + 1;
+
+    if ((d = malloc(len)) != NULL)
+    {
+        memcpy(d, s, len);
+    }
+
+    return d;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      free all jobs; queue must not be running
+//!
+//! @param[in]  q   queue
+//------------------------------------------------------------------------------
+static void queue_clear(netmd_upload_queue_t* q)
+{
+    size_t i;
+
+    for (i = 0; i < q->count; i++)
+    {
+        netmd_prepared_track_free(&q->jobs[i].prep);
+        free(q->jobs[i].filename);
+        free(q->jobs[i].title);
+    }
+
+    q->count = 0;
+    q->next  = 0;
+    q->used  = 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      account memory for a job (lock held)
+//!
+//! @param[in]  q     queue
+//! @param[in]  job   job
+//! @param[in]  size  new memory use of job
+//------------------------------------------------------------------------------
+static void queue_reserve(netmd_upload_queue_t* q, queue_job_t* job, size_t size)
+{
+    q->used       = q->used - job->reserved + size;
+    job->reserved = size;
+
+    if (q->used > q->stats.peak_mem)
+    {
+        q->stats.peak_mem = q->used;
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      worker thread: prepare jobs in queue order as long as the
+//!             memory budget allows
+//!
+//! @param[in]  arg   queue
+//!
+//! @return     NULL
+//------------------------------------------------------------------------------
+static void* queue_worker(void* arg)
+{
+    netmd_upload_queue_t* q = (netmd_upload_queue_t*)arg;
+    netmd_prepared_track* prep;
+    netmd_crypto*         crypto;
+    queue_job_t*          job;
+    netmd_error           err;
+    uint64_t              start;
+
+    /* own crypto context, so workers don't share cipher handles */
+    crypto = netmd_crypto_open();
+
+    pthread_mutex_lock(&q->lock);
+
+    while (!q->quit && (q->next < q->count))
+    {
+        job = &q->jobs[q->next];
+
+        /* the oldest unsent job always fits, so this can't dead lock */
+        if ((q->used > 0) && ((q->used + job->estimate) > q->budget))
+        {
+            pthread_cond_wait(&q->wake, &q->lock);
+            continue;
+        }
+
+        q->next++;
+        job->state = JOB_RUNNING;
+        queue_reserve(q, job, job->estimate);
+
+        pthread_mutex_unlock(&q->lock);
+
+        prep  = NULL;
+        start = netmd_trace_time_us();
+        err   = netmd_prepare_track(job->filename, job->title, job->otf, q->max_chunk, crypto, &prep);
+
+        pthread_mutex_lock(&q->lock);
+
+        q->stats.prepare_us += netmd_trace_time_us() - start;
+        job->err = err;
+
+        if (err == NETMD_NO_ERROR)
+        {
+            job->prep  = prep;
+            job->state = JOB_READY;
+            queue_reserve(q, job, netmd_prepared_track_size(prep));
+        }
+        else
+        {
+            job->state = JOB_FAILED;
+            queue_reserve(q, job, 0);
+        }
+
+        pthread_cond_broadcast(&q->wake);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    netmd_crypto_close(&crypto);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      wait until a job is prepared (lock held); looks at the cancel
+//!             flag every now and then
+//!
+//! @param[in]  q     queue
+//! @param[in]  job   job
+//! @param[in]  ctl   transfer control (may be NULL)
+//!
+//! @return     0 -> job prepared (or failed); -1 -> cancelled
+//------------------------------------------------------------------------------
+static int queue_wait_job(netmd_upload_queue_t* q, queue_job_t* job, netmd_transfer_ctl* ctl)
+{
+    struct timespec ts;
+    uint64_t        start = netmd_trace_time_us();
+    int             ret   = 0;
+
+    while ((job->state == JOB_QUEUED) || (job->state == JOB_RUNNING))
+    {
+        if (netmd_transfer_cancelled(ctl))
+        {
+            ret = -1;
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += QUEUE_POLL_MS * 1000000L;
+
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&q->wake, &q->lock, &ts);
+    }
+
+    q->stats.wait_us += netmd_trace_time_us() - start;
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      create an upload queue
+//!
+//! @param[in]  threads     worker threads (0 -> one per CPU)
+//! @param[in]  mem_budget  memory budget in bytes (0 -> default)
+//!
+//! @return     queue; NULL -> error
+//------------------------------------------------------------------------------
+netmd_upload_queue_t* netmd_upload_queue_open(unsigned threads, size_t mem_budget)
+{
+    netmd_upload_queue_t* q;
+
+    if ((q = calloc(1, sizeof(netmd_upload_queue_t))) == NULL)
+    {
+        return NULL;
+    }
+
+    if (threads == 0)
+    {
+        threads = queue_cpus();
+    }
+
+    q->threads = (threads > NETMD_QUEUE_MAX_THREADS) ? NETMD_QUEUE_MAX_THREADS : threads;
+    q->budget  = (mem_budget == 0) ? NETMD_QUEUE_MEM_BUDGET : mem_budget;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wake, NULL);
+
+    return q;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      add an audio file to the queue
+//!
+//! @param[in]  q         queue
+//! @param[in]  filename  audio file
+//! @param[in]  title     track title (NULL -> file name)
+//! @param[in]  otf       on the fly convert flag
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_upload_queue_add(netmd_upload_queue_t* q, const char* filename, const char* title, unsigned char otf)
+{
+    queue_job_t* jobs;
+    queue_job_t* job;
+    size_t       size;
+
+    if ((q == NULL) || (filename == NULL))
+    {
+        return -1;
+    }
+
+    if (q->count == q->size)
+    {
+        size = q->size ? (q->size * 2) : 16;
+
+        if ((jobs = realloc(q->jobs, size * sizeof(queue_job_t))) == NULL)
+        {
+            return -1;
+        }
+
+        q->jobs = jobs;
+        q->size = size;
+    }
+
+    job = &q->jobs[q->count];
+    memset(job, 0, sizeof(queue_job_t));
+
+    job->otf      = otf;
+    job->state    = JOB_QUEUED;
+    job->filename = queue_strdup(filename);
+    job->title    = queue_strdup(title);
+
+    if ((job->filename == NULL) || ((title != NULL) && (job->title == NULL)))
+    {
+        free(job->filename);
+        free(job->title);
+        return -1;
+    }
+
+    /* unreadable files fail in the worker and are reported there */
+    job->estimate = netmd_prepare_track_estimate(filename);
+
+    q->count++;
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      upload all queued tracks; returns when all tracks are done or
+//!             the transfer was cancelled. The queue is empty afterwards.
+//!             SP patches are applied once for the whole queue.
+//!
+//! @param[in]  q     queue
+//! @param[in]  devh  device handle
+//! @param[in]  ctl   transfer control (may be NULL)
+//! @param[in]  cb    track done callback (may be NULL)
+//! @param[in]  ctx   callback context
+//!
+//! @return     NETMD_NO_ERROR if all tracks were sent; NETMD_CANCELLED if
+//!             cancelled; NETMD_ERROR if a track failed
+//------------------------------------------------------------------------------
+netmd_error netmd_upload_queue_run(netmd_upload_queue_t* q, netmd_dev_handle* devh, netmd_transfer_ctl* ctl,
+                                   netmd_queue_cb cb, void* ctx)
+{
+    pthread_t                workers[NETMD_QUEUE_MAX_THREADS];
+    const netmd_dev_profile* prof;
+    queue_job_t*             job;
+    netmd_error              err, ret = NETMD_NO_ERROR;
+    unsigned                 i, started = 0;
+    uint64_t                 start;
+    size_t                   idx;
+
+    if ((q == NULL) || (devh == NULL))
+    {
+        return NETMD_ERROR;
+    }
+
+    prof         = netmd_dev_profile_get(devh);
+    q->max_chunk = (prof != NULL) ? prof->max_chunk : 0;
+    q->next      = 0;
+    q->used      = 0;
+    q->quit      = 0;
+
+    /* no more workers than tracks */
+    for (i = 0; (i < q->threads) && (i < q->count); i++)
+    {
+        if (pthread_create(&workers[started], NULL, queue_worker, q) == 0)
+        {
+            started++;
+        }
+    }
+
+    if ((started == 0) && (q->count > 0))
+    {
+        netmd_log(NETMD_LOG_ERROR, "upload queue: can't start worker threads\n");
+        queue_clear(q);
+        return NETMD_ERROR;
+    }
+
+    if (started > q->stats.threads)
+    {
+        q->stats.threads = started;
+    }
+
+    netmd_log(NETMD_LOG_VERBOSE, "upload queue: %zu track(s), %u worker(s), budget %zu bytes\n",
+              q->count, started, q->budget);
+
+    /* SP files: patch once, not for every track */
+    netmd_sp_patch_batch(devh, 1);
+
+    for (idx = 0; idx < q->count; idx++)
+    {
+        job = &q->jobs[idx];
+
+        pthread_mutex_lock(&q->lock);
+
+        if (queue_wait_job(q, job, ctl) != 0)
+        {
+            pthread_mutex_unlock(&q->lock);
+            ret = NETMD_CANCELLED;
+            break;
+        }
+
+        pthread_mutex_unlock(&q->lock);
+
+        start = netmd_trace_time_us();
+
+        if ((err = job->err) == NETMD_NO_ERROR)
+        {
+            err = netmd_send_prepared_track(devh, job->prep, ctl);
+        }
+
+        /* give the memory back, so the next track can be prepared */
+        pthread_mutex_lock(&q->lock);
+
+        q->stats.send_us += netmd_trace_time_us() - start;
+
+        if (err == NETMD_NO_ERROR)
+        {
+            q->stats.sent++;
+        }
+        else
+        {
+            q->stats.failed++;
+        }
+
+        netmd_prepared_track_free(&job->prep);
+        queue_reserve(q, job, 0);
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&q->wake);
+        pthread_mutex_unlock(&q->lock);
+
+        if (err != NETMD_NO_ERROR)
+        {
+            netmd_log(NETMD_LOG_WARNING, "upload queue: %s: %s\n", job->filename, netmd_strerror(err));
+        }
+
+        if (cb != NULL)
+        {
+            cb(ctx, idx, job->filename, err);
+        }
+
+        if (err == NETMD_CANCELLED)
+        {
+            ret = NETMD_CANCELLED;
+            break;
+        }
+        else if (err != NETMD_NO_ERROR)
+        {
+            ret = NETMD_ERROR;
+        }
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->quit = 1;
+    pthread_cond_broadcast(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    netmd_sp_patch_batch(devh, 0);
+
+    /* tracks prepared but not sent (cancelled) */
+    queue_clear(q);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      get queue statistics (summed over all runs)
+//!
+//! @param[in]  q      queue
+//! @param[out] stats  statistics
+//------------------------------------------------------------------------------
+void netmd_upload_queue_stats(netmd_upload_queue_t* q, netmd_queue_stats_t* stats)
+{
+    if ((q == NULL) || (stats == NULL))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    *stats = q->stats;
+    pthread_mutex_unlock(&q->lock);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      free an upload queue
+//!
+//! @param[in]  q  pointer to queue (set to NULL)
+//------------------------------------------------------------------------------
+void netmd_upload_queue_close(netmd_upload_queue_t** q)
+{
+    if ((q == NULL) || (*q == NULL))
+    {
+        return;
+    }
+
+    queue_clear(*q);
+    free((*q)->jobs);
+
+    pthread_cond_destroy(&(*q)->wake);
+    pthread_mutex_destroy(&(*q)->lock);
+
+    free(*q);
+    *q = NULL;
+}
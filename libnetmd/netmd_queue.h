@@ -0,0 +1,123 @@
+/* netmd_queue.h
+ *
+ * Upload queue with pipelined track preparation.
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef NETMD_QUEUE_H
+#define NETMD_QUEUE_H
+#include <stdint.h>
+#include <stddef.h>
+#include "common.h"
+#include "error.h"
+#include "secure.h"
+
+/* copy start */
+
+/*
+ * Upload queue: a pool of worker threads prepares (reads, converts and
+ * encrypts) the next tracks while the calling thread sends the prepared
+ * ones to the device in queue order. Prepared tracks wait in memory until
+ * they are sent; a worker doesn't start a track if that would exceed the
+ * memory budget. The next track in order is always allowed, so a track
+ * larger than the budget still gets through (just without overlap).
+ */
+
+//! default memory budget for prepared tracks
+#define NETMD_QUEUE_MEM_BUDGET (512u * 1024u * 1024u)
+
+//! max. worker threads
+#define NETMD_QUEUE_MAX_THREADS 16
+
+//! upload queue (opaque)
+typedef struct netmd_upload_queue netmd_upload_queue_t;
+
+//! queue statistics
+typedef struct {
+    size_t   sent;          //!< tracks sent
+    size_t   failed;        //!< tracks not prepared or not sent
+    unsigned threads;       //!< worker threads used
+    uint64_t prepare_us;    //!< time spent preparing (all workers)
+    uint64_t send_us;       //!< time spent sending
+    uint64_t wait_us;       //!< time the upload waited for a worker
+    size_t   peak_mem;      //!< max. memory held by the queue
+} netmd_queue_stats_t;
+
+//------------------------------------------------------------------------------
+//! @brief      track done callback; called from the thread running
+//!             netmd_upload_queue_run()
+//!
+//! @param[in]  ctx       context as given to netmd_upload_queue_run()
+//! @param[in]  index     queue index
+//! @param[in]  filename  audio file
+//! @param[in]  err       result of prepare and send
+//------------------------------------------------------------------------------
+typedef void (*netmd_queue_cb)(void* ctx, size_t index, const char* filename, netmd_error err);
+
+//------------------------------------------------------------------------------
+//! @brief      create an upload queue
+//!
+//! @param[in]  threads     worker threads (0 -> one per CPU)
+//! @param[in]  mem_budget  memory budget in bytes (0 -> default)
+//!
+//! @return     queue; NULL -> error
+//------------------------------------------------------------------------------
+netmd_upload_queue_t* netmd_upload_queue_open(unsigned threads, size_t mem_budget);
+
+//------------------------------------------------------------------------------
+//! @brief      add an audio file to the queue
+//!
+//! @param[in]  q         queue
+//! @param[in]  filename  audio file
+//! @param[in]  title     track title (NULL -> file name)
+//! @param[in]  otf       on the fly convert flag
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_upload_queue_add(netmd_upload_queue_t* q, const char* filename, const char* title, unsigned char otf);
+
+//------------------------------------------------------------------------------
+//! @brief      upload all queued tracks; returns when all tracks are done or
+//!             the transfer was cancelled. The queue is empty afterwards.
+//!             SP patches are applied once for the whole queue.
+//!
+//! @param[in]  q     queue
+//! @param[in]  devh  device handle
+//! @param[in]  ctl   transfer control (may be NULL)
+//! @param[in]  cb    track done callback (may be NULL)
+//! @param[in]  ctx   callback context
+//!
+//! @return     NETMD_NO_ERROR if all tracks were sent; NETMD_CANCELLED if
+//!             cancelled; NETMD_ERROR if a track failed
+//------------------------------------------------------------------------------
+netmd_error netmd_upload_queue_run(netmd_upload_queue_t* q, netmd_dev_handle* devh, netmd_transfer_ctl* ctl,
+                                   netmd_queue_cb cb, void* ctx);
+
+//------------------------------------------------------------------------------
+//! @brief      get queue statistics (summed over all runs)
+//!
+//! @param[in]  q      queue
+//! @param[out] stats  statistics
+//------------------------------------------------------------------------------
+void netmd_upload_queue_stats(netmd_upload_queue_t* q, netmd_queue_stats_t* stats);
+
+//------------------------------------------------------------------------------
+//! @brief      free an upload queue
+//!
+//! @param[in]  q  pointer to queue (set to NULL)
+//------------------------------------------------------------------------------
+void netmd_upload_queue_close(netmd_upload_queue_t** q);
+
+/* copy end */
+
+#endif // NETMD_QUEUE_H
@@ -0,0 +1,285 @@
+/* netmd_trace.c
+ *
+ * Binary protocol trace ring.
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "netmd_trace.h"
+
+#ifdef WIN32
+    #include <windows.h>
+#endif
+
+#define TRACE_MASK (NETMD_TRACE_RECORDS - 1)
+
+/* ring size must be a power of two */
+typedef char trace_ring_size_check[(NETMD_TRACE_RECORDS & TRACE_MASK) ? -1 : 1];
+
+/** @brief trace ring */
+static netmd_trace_rec_t _s_ring[NETMD_TRACE_RECORDS];
+
+/** @brief last sequence number handed out */
+static uint64_t _s_seq = 0;
+
+/** @brief recording enabled */
+static int _s_enabled = 1;
+
+/** @brief dump file used on error */
+static const char* _s_dump_path = NULL;
+
+//------------------------------------------------------------------------------
+//! @brief      monotonic time stamp as used in trace records
+//!
+//! @return     time in us
+//------------------------------------------------------------------------------
+uint64_t netmd_trace_time_us(void)
+{
+#ifdef WIN32
+    LARGE_INTEGER cnt, freq;
+    QueryPerformanceCounter(&cnt);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)((cnt.QuadPart * 1000000.0) / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000u) + ((uint64_t)ts.tv_nsec / 1000u);
+#endif
+}
+
+//------------------------------------------------------------------------------
+//! @brief      claim the next record. The sequence counter is bumped and
+//!             the record's seq field is cleared while it's written, so a
+//!             reader can detect torn records.
+//!
+//! @param[out] seq   sequence number of the record
+//!
+//! @return     record; NULL -> recording disabled
+//------------------------------------------------------------------------------
+static netmd_trace_rec_t* trace_begin(uint64_t* seq)
+{
+    netmd_trace_rec_t* rec;
+
+    if (!__atomic_load_n(&_s_enabled, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+
+    *seq = __atomic_add_fetch(&_s_seq, 1, __ATOMIC_RELAXED);
+    rec  = &_s_ring[(*seq - 1) & TRACE_MASK];
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    rec->ts_us = netmd_trace_time_us();
+    return rec;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      publish a record claimed with trace_begin()
+//!
+//! @param[in]  rec   record
+//! @param[in]  seq   sequence number of the record
+//------------------------------------------------------------------------------
+static void trace_end(netmd_trace_rec_t* rec, uint64_t seq)
+{
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      enable / disable trace recording (enabled by default)
+//!
+//! @param[in]  enable  1 -> enable; 0 -> disable
+//------------------------------------------------------------------------------
+void netmd_trace_enable(int enable)
+{
+    __atomic_store_n(&_s_enabled, enable, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      add a record to the trace ring; safe to call from several
+//!             threads without locking
+//!
+//! @param[in]  type   record type
+//! @param[in]  devh   device handle (used as tag only, may be NULL)
+//! @param[in]  value  type specific value
+//! @param[in]  data   payload (may be NULL)
+//! @param[in]  size   payload / transfer size
+//------------------------------------------------------------------------------
+void netmd_trace(netmd_trace_type type, const void* devh, int32_t value, const uint8_t* data, size_t size)
+{
+    netmd_trace_rec_t* rec;
+    uint64_t seq;
+    size_t   len;
+
+    if ((rec = trace_begin(&seq)) == NULL)
+    {
+        return;
+    }
+
+    len        = ((data != NULL) && (size > 0)) ? ((size < NETMD_TRACE_DATA) ? size : NETMD_TRACE_DATA) : 0;
+    rec->dev   = (uint32_t)(((uintptr_t)devh) >> 4);
+    rec->value = value;
+    rec->size  = (uint32_t)size;
+    rec->type  = (uint16_t)type;
+    rec->len   = (uint16_t)len;
+
+    if (len > 0)
+    {
+        memcpy(rec->data, data, len);
+    }
+
+    trace_end(rec, seq);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      record a bulk transfer summary
+//!
+//! @param[in]  type    NETMD_TRACE_BULK_OUT or NETMD_TRACE_BULK_IN
+//! @param[in]  devh    device handle (used as tag only, may be NULL)
+//! @param[in]  result  libusb result
+//! @param[in]  bytes   transferred bytes
+//! @param[in]  start   start time stamp from netmd_trace_time_us()
+//------------------------------------------------------------------------------
+void netmd_trace_bulk(netmd_trace_type type, const void* devh, int32_t result, size_t bytes, uint64_t start)
+{
+    netmd_trace_rec_t* rec;
+    uint64_t seq;
+    uint32_t dur;
+
+    if ((rec = trace_begin(&seq)) == NULL)
+    {
+        return;
+    }
+
+    dur        = (uint32_t)(rec->ts_us - start);
+    rec->dev   = (uint32_t)(((uintptr_t)devh) >> 4);
+    rec->value = result;
+    rec->size  = (uint32_t)bytes;
+    rec->type  = (uint16_t)type;
+    rec->len   = sizeof(dur);
+    memcpy(rec->data, &dur, sizeof(dur));
+
+    trace_end(rec, seq);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      record an error and dump the ring if a dump path is set
+//!
+//! @param[in]  devh   device handle (used as tag only, may be NULL)
+//! @param[in]  err    error code
+//------------------------------------------------------------------------------
+void netmd_trace_error(const void* devh, int32_t err)
+{
+    const char* path;
+
+    netmd_trace(NETMD_TRACE_ERROR, devh, err, NULL, 0);
+
+    if ((path = __atomic_load_n(&_s_dump_path, __ATOMIC_RELAXED)) != NULL)
+    {
+        netmd_trace_dump_file(path);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      set the file the ring is dumped to on error
+//!
+//! @param[in]  path  file name (NULL -> no dump on error)
+//------------------------------------------------------------------------------
+void netmd_trace_set_dump_path(const char* path)
+{
+    __atomic_store_n(&_s_dump_path, path, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      dump the ring (oldest record first) to a stream; records
+//!             which are overwritten while copying are skipped
+//!
+//! @param[in]  f     stream opened in binary mode
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_trace_dump(FILE* f)
+{
+    netmd_trace_rec_t* copy;
+    netmd_trace_file_t hdr;
+    netmd_trace_rec_t  rec;
+    uint64_t last, first, seq;
+    uint32_t count = 0;
+    int      ret   = 0;
+
+    if ((copy = malloc(sizeof(netmd_trace_rec_t) * NETMD_TRACE_RECORDS)) == NULL)
+    {
+        return -1;
+    }
+
+    last  = __atomic_load_n(&_s_seq, __ATOMIC_ACQUIRE);
+    first = (last > NETMD_TRACE_RECORDS) ? (last - NETMD_TRACE_RECORDS + 1) : 1;
+
+    for (seq = first; seq <= last; seq++)
+    {
+        const netmd_trace_rec_t* src = &_s_ring[(seq - 1) & TRACE_MASK];
+
+        if (__atomic_load_n(&src->seq, __ATOMIC_ACQUIRE) != seq)
+        {
+            continue;
+        }
+
+        memcpy(&rec, src, sizeof(rec));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if ((__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq) && (rec.seq == seq))
+        {
+            copy[count++] = rec;
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, NETMD_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.rec_size = sizeof(netmd_trace_rec_t);
+    hdr.count    = count;
+
+    if ((fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        || ((count > 0) && (fwrite(copy, sizeof(netmd_trace_rec_t), count, f) != count))
+        || (fflush(f) != 0))
+    {
+        ret = -1;
+    }
+
+    free(copy);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      dump the ring (oldest record first) to a file
+//!
+//! @param[in]  path  file name (overwritten)
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_trace_dump_file(const char* path)
+{
+    FILE* f;
+    int   ret;
+
+    if ((path == NULL) || ((f = fopen(path, "wb")) == NULL))
+    {
+        return -1;
+    }
+
+    ret = netmd_trace_dump(f);
+    fclose(f);
+    return ret;
+}
@@ -0,0 +1,144 @@
+/* netmd_trace.h
+ *
+ * Binary protocol trace ring.
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef NETMD_TRACE_H
+#define NETMD_TRACE_H
+#include <stdio.h>
+#include <stdint.h>
+
+/* copy start */
+
+/*
+ * Binary protocol trace: a fixed size, lock-free ring buffer holding the
+ * most recent AV/C commands, responses, poll results and bulk transfer
+ * summaries with monotonic time stamps. Recording is cheap (no
+ * formatting, no I/O), so it's on by default. The ring can be dumped on
+ * demand or automatically on error and is decoded offline by netmdtrace.
+ */
+
+//! number of records in the ring (power of two)
+#define NETMD_TRACE_RECORDS 1024
+
+//! max. payload bytes stored per record
+#define NETMD_TRACE_DATA 24
+
+//! dump file magic
+#define NETMD_TRACE_MAGIC "NMDTRC01"
+
+//! trace record types
+typedef enum {
+    NETMD_TRACE_CMD = 1,    //!< AV/C command; value: result
+    NETMD_TRACE_RSP,        //!< AV/C response; value: result
+    NETMD_TRACE_POLL,       //!< poll; value: bytes to read or error, data: poll buffer
+    NETMD_TRACE_BULK_OUT,   //!< bulk write; value: libusb result, data: duration in us (u32)
+    NETMD_TRACE_BULK_IN,    //!< bulk read; value: libusb result, data: duration in us (u32)
+    NETMD_TRACE_ERROR,      //!< error; value: error code
+} netmd_trace_type;
+
+//! one trace record (dumped as is, host byte order)
+typedef struct {
+    uint64_t seq;                       //!< sequence number (0 -> invalid)
+    uint64_t ts_us;                     //!< monotonic time stamp in us
+    uint32_t dev;                       //!< device tag (distinguishes handles)
+    int32_t  value;                     //!< type specific value
+    uint32_t size;                      //!< full payload / transfer size
+    uint16_t type;                      //!< netmd_trace_type
+    uint16_t len;                       //!< bytes stored in data
+    uint8_t  data[NETMD_TRACE_DATA];    //!< payload (truncated)
+} netmd_trace_rec_t;
+
+//! dump file header
+typedef struct {
+    char     magic[8];      //!< NETMD_TRACE_MAGIC
+    uint32_t rec_size;      //!< sizeof(netmd_trace_rec_t)
+    uint32_t count;         //!< number of records following
+} netmd_trace_file_t;
+
+//------------------------------------------------------------------------------
+//! @brief      enable / disable trace recording (enabled by default)
+//!
+//! @param[in]  enable  1 -> enable; 0 -> disable
+//------------------------------------------------------------------------------
+void netmd_trace_enable(int enable);
+
+//------------------------------------------------------------------------------
+//! @brief      add a record to the trace ring; safe to call from several
+//!             threads without locking
+//!
+//! @param[in]  type   record type
+//! @param[in]  devh   device handle (used as tag only, may be NULL)
+//! @param[in]  value  type specific value
+//! @param[in]  data   payload (may be NULL)
+//! @param[in]  size   payload / transfer size
+//------------------------------------------------------------------------------
+void netmd_trace(netmd_trace_type type, const void* devh, int32_t value, const uint8_t* data, size_t size);
+
+//------------------------------------------------------------------------------
+//! @brief      monotonic time stamp as used in trace records
+//!
+//! @return     time in us
+//------------------------------------------------------------------------------
+uint64_t netmd_trace_time_us(void);
+
+//------------------------------------------------------------------------------
+//! @brief      record a bulk transfer summary
+//!
+//! @param[in]  type    NETMD_TRACE_BULK_OUT or NETMD_TRACE_BULK_IN
+//! @param[in]  devh    device handle (used as tag only, may be NULL)
+//! @param[in]  result  libusb result
+//! @param[in]  bytes   transferred bytes
+//! @param[in]  start   start time stamp from netmd_trace_time_us()
+//------------------------------------------------------------------------------
+void netmd_trace_bulk(netmd_trace_type type, const void* devh, int32_t result, size_t bytes, uint64_t start);
+
+//------------------------------------------------------------------------------
+//! @brief      record an error and dump the ring to the file set with
+//!             netmd_trace_set_dump_path() (if any)
+//!
+//! @param[in]  devh   device handle (used as tag only, may be NULL)
+//! @param[in]  err    error code
+//------------------------------------------------------------------------------
+void netmd_trace_error(const void* devh, int32_t err);
+
+//------------------------------------------------------------------------------
+//! @brief      set the file the ring is dumped to on error
+//!
+//! @param[in]  path  file name (NULL -> no dump on error); the string must
+//!                   stay valid
+//------------------------------------------------------------------------------
+void netmd_trace_set_dump_path(const char* path);
+
+//------------------------------------------------------------------------------
+//! @brief      dump the ring (oldest record first) to a stream
+//!
+//! @param[in]  f     stream opened in binary mode
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_trace_dump(FILE* f);
+
+//------------------------------------------------------------------------------
+//! @brief      dump the ring (oldest record first) to a file
+//!
+//! @param[in]  path  file name (overwritten)
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_trace_dump_file(const char* path);
+
+/* copy end */
+
+#endif // NETMD_TRACE_H
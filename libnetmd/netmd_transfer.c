@@ -10,19 +10,18 @@
 #include "const.h"
 #include "libnetmd_intern.h"
 #include "utils.h"
-
-/** @brief audio patch type */
-typedef enum
-{
-    apt_no_patch, /**< no patch needed         */
-    apt_wave,     /**< wave endianess patch    */
-    apt_sp        /**< atrac1 SP padding patch */
-} audio_patch_t;
+#include "netmd_pcm.h"
 
 /* Min "usable" audio file size (1 frame Atrac LP4)
    = 52 (RIFF/WAVE header Atrac LP) + 8 ("data" + length) + 92 (1 frame LP4) */
 #define MIN_WAV_LENGTH 152
 
+/* input block for PCM conversion in frames */
+#define PCM_CONV_BLOCK 4096
+
+/** @brief key encryption key for the data keys */
+static unsigned char _s_kek[] = { 0x14, 0xe3, 0x83, 0x4e, 0xe2, 0xd3, 0xcc, 0xa5 };
+
 static inline unsigned int leword32(const unsigned char * c)
 {
     return (unsigned int)((c[3] << 24U) + (c[2] << 16U) + (c[1] << 8U) + c[0]);
@@ -33,7 +32,20 @@ static inline unsigned int leword16(const unsigned char * c)
     return c[1]*256U+c[0];
 }
 
-static int audio_supported(const unsigned char * file, size_t fsize, netmd_wireformat * wireformat, unsigned char * diskformat, audio_patch_t * conversion, size_t * channels, size_t * headersize)
+//------------------------------------------------------------------------------
+//! @brief      check audio file header
+//!
+//! @param[in]  file        file data
+//! @param[in]  fsize       file size
+//! @param[out] wireformat  wire format
+//! @param[out] diskformat  disc format
+//! @param[out] conversion  needed audio patch
+//! @param[out] channels    channels
+//! @param[out] headersize  header size
+//!
+//! @return     1 -> supported; 0 -> not supported
+//------------------------------------------------------------------------------
+int netmd_audio_supported(const unsigned char * file, size_t fsize, netmd_wireformat * wireformat, unsigned char * diskformat, audio_patch_t * conversion, size_t * channels, size_t * headersize)
 {
     if(strncmp("RIFF", (const char*)file, 4) != 0 || strncmp("WAVE", (const char*)file+8, 4) != 0 || strncmp("fmt ", (const char*)file+12, 4) != 0)
     {
@@ -96,31 +108,16 @@ static int audio_supported(const unsigned char * file, size_t fsize, netmd_wiref
     return 0;
 }
 
-void retailmac(unsigned char *rootkey, unsigned char *hostnonce,
-               unsigned char *devnonce, unsigned char *sessionkey)
-{
-    gcry_cipher_hd_t handle1;
-    gcry_cipher_hd_t handle2;
-
-    unsigned char des3_key[24] = { 0 };
-    unsigned char iv[8] = { 0 };
-
-    gcry_cipher_open(&handle1, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_ECB, 0);
-    gcry_cipher_setkey(handle1, rootkey, 8);
-    gcry_cipher_encrypt(handle1, iv, 8, hostnonce, 8);
-
-    memcpy(des3_key, rootkey, 16);
-    memcpy(des3_key+16, rootkey, 8);
-    gcry_cipher_open(&handle2, GCRY_CIPHER_3DES, GCRY_CIPHER_MODE_CBC, 0);
-    gcry_cipher_setkey(handle2, des3_key, 24);
-    gcry_cipher_setiv(handle2, iv, 8);
-    gcry_cipher_encrypt(handle2, sessionkey, 8, devnonce, 8);
-
-    gcry_cipher_close(handle1);
-    gcry_cipher_close(handle2);
-}
-
-static size_t wav_data_position(const unsigned char * data, size_t offset, size_t len)
+//------------------------------------------------------------------------------
+//! @brief      find data chunk in wave file
+//!
+//! @param[in]  data    file data
+//! @param[in]  offset  search start
+//! @param[in]  len     file size
+//!
+//! @return     position of "data" chunk; 0 -> not found
+//------------------------------------------------------------------------------
+size_t netmd_wav_data_position(const unsigned char * data, size_t offset, size_t len)
 {
     size_t i = offset, pos = 0;
 
@@ -135,48 +132,168 @@ static size_t wav_data_position(const unsigned char * data, size_t offset, size_
     return pos;
 }
 
+//------------------------------------------------------------------------------
+//! @brief      swap bytes of 16 bit PCM samples (wave is little endian,
+//!             the device wants big endian)
+//!
+//! @param[in]  data    sample data (swapped in place)
+//! @param[in]  size    data size in bytes
+//------------------------------------------------------------------------------
+void netmd_pcm_byteswap(unsigned char * data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < size; i += 2)
+    {
+        unsigned char first = data[i];
+        data[i] = data[i + 1];
+        data[i + 1] = first;
+    }
+}
 
-// exported function 
 
 //------------------------------------------------------------------------------
-//! @brief      send audio file to netmd device
+//! @brief      read wave PCM the device can't take as is (sample rate, bit
+//!             depth), convert it to 44.1 kHz / 16 bit in device byte order
+//!             and encrypt it; the file is read and converted in blocks
+//!             which go straight into the packets, so no full copy of the
+//!             audio data is held in memory
+//!
+//! @param[in]  f          wave file, positioned at the sample data
+//! @param[in]  info       wave info
+//! @param[in]  max_chunk  max. packet size (see device profile)
+//! @param[in]  crypto     crypto context (NULL -> temporary one)
+//! @param[out] packets    encrypted packets
+//! @param[out] count      packet count
+//! @param[out] frames     frames on the wire
+//! @param[out] length     bytes in all packets
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+static netmd_error read_converted(FILE* f, const netmd_pcm_info* info, size_t max_chunk, netmd_crypto* crypto,
+                                  netmd_track_packets** packets, size_t* count, unsigned int* frames, size_t* length)
+{
+    netmd_pcm_conv*      conv;
+    netmd_packet_writer* w;
+    unsigned char*       in;
+    unsigned char*       out;
+    size_t               frame = 2 * info->channels, left = info->frames, got, pos, used, done;
+    size_t               channels = (info->channels == 2) ? NETMD_CHANNELS_STEREO : NETMD_CHANNELS_MONO;
+
+    if ((conv = netmd_pcm_conv_open(info->rate, info->channels, info->format)) == NULL) {
+        return NETMD_ERROR;
+    }
+
+    if ((w = netmd_packet_writer_open(_s_kek, NETMD_WIREFORMAT_PCM, channels, max_chunk, crypto)) == NULL) {
+        netmd_pcm_conv_close(&conv);
+        return NETMD_ERROR;
+    }
+
+    in  = malloc(PCM_CONV_BLOCK * info->frame_size);
+    out = malloc(PCM_CONV_BLOCK * frame);
+
+    if ((in == NULL) || (out == NULL)) {
+        free(in);
+        free(out);
+        netmd_pcm_conv_close(&conv);
+        netmd_packet_writer_close(&w, NULL, NULL, NULL, NULL);
+        return NETMD_ERROR;
+    }
+
+    while ((left > 0) && ((got = fread(in, info->frame_size, (left < PCM_CONV_BLOCK) ? left : PCM_CONV_BLOCK, f)) > 0)) {
+        left -= got;
+        for (pos = 0; pos < got; pos += used) {
+            done = netmd_pcm_conv_run(conv, in + pos * info->frame_size, got - pos, &used, out, PCM_CONV_BLOCK);
+            netmd_packet_writer_add(w, out, done * frame);
+            if ((used == 0) && (done == 0)) {
+                break;
+            }
+        }
+    }
+
+    while ((done = netmd_pcm_conv_flush(conv, out, PCM_CONV_BLOCK)) > 0) {
+        netmd_packet_writer_add(w, out, done * frame);
+    }
+
+    if (left > 0) {
+        netmd_log(NETMD_LOG_WARNING, "audio file truncated, %zu frames missing\n", left);
+    }
+
+    free(in);
+    free(out);
+    netmd_pcm_conv_close(&conv);
+    return netmd_packet_writer_close(&w, packets, count, frames, length);
+}
+
+/** @brief audio track ready for upload */
+struct netmd_prepared_track {
+    netmd_track_packets *packets;    /**< encrypted packets              */
+    size_t               packet_count;
+    size_t               packet_length;
+    size_t               size;       /**< bytes held                     */
+    unsigned int         frames;     /**< frames on the wire             */
+    netmd_wireformat     wireformat; /**< wire format                    */
+    unsigned char        discformat; /**< disc format                    */
+    size_t               channels;   /**< channels                       */
+    audio_patch_t        audio_patch;/**< SP upload needs device patch   */
+    char                 title[256]; /**< track title                    */
+};
+
+//------------------------------------------------------------------------------
+//! @brief      estimate the memory needed while preparing an audio file
+//!             (source data and encrypted packets are held at the same time;
+//!             converted PCM only needs the packets)
 //!
-//! @param      devh[in]     device handle
 //! @param      filename[in] audio track file name
-//! @param      in_title[in] track title
-//! @param      otf[in]      on the fly convert flag
+//!
+//! @return     bytes; 0 -> file can't be read
+//------------------------------------------------------------------------------
+size_t netmd_prepare_track_estimate(const char *filename)
+{
+    netmd_pcm_info pcm;
+    struct stat stat_buf;
+    size_t size = 0, conv = 0;
+    FILE *f;
+
+    if (stat(filename, &stat_buf) != 0) {
+        return 0;
+    }
+
+    size = (size_t)stat_buf.st_size;
+
+    /* converted PCM is streamed into the packets, which may be larger
+       than the source (e.g. 32 kHz mono) */
+    if ((f = fopen(filename, "rb")) != NULL) {
+        if ((netmd_pcm_wav_probe(f, &pcm) == 0) && pcm.convert) {
+            conv = (size_t)(((uint64_t)pcm.frames * NETMD_PCM_RATE) / pcm.rate + 1) * 2 * pcm.channels
+                   + PCM_CONV_BLOCK * (pcm.frame_size + 2 * pcm.channels);
+        }
+        fclose(f);
+    }
+
+    return (conv != 0) ? conv : 2 * size;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      prepare an audio file for upload: read, convert, check and
+//!             encrypt it; there is no device access, so this can run for
+//!             the next tracks while one is sent
+//!
+//! @param      filename[in]   audio track file name
+//! @param      in_title[in]   track title (NULL -> file name)
+//! @param      otf[in]        on the fly convert flag
+//! @param      max_chunk[in]  max. packet size (see device profile)
+//! @param      crypto[in]     crypto context (NULL -> temporary one)
+//! @param      prepared[out]  prepared track
 //!
 //! @return     netmd_error
-//! @see        betmd_error
+//! @see        netmd_error
 //------------------------------------------------------------------------------
-netmd_error netmd_send_track(netmd_dev_handle *devh, const char *filename, const char *in_title, unsigned char otf)
+netmd_error netmd_prepare_track(const char *filename, const char *in_title, unsigned char otf, size_t max_chunk,
+                                netmd_crypto *crypto, netmd_prepared_track **prepared)
 {
     netmd_error error;
-    netmd_ekb ekb;
-    unsigned char chain[] = { 0x25, 0x45, 0x06, 0x4d, 0xea, 0xca,
-        0x14, 0xf9, 0x96, 0xbd, 0xc8, 0xa4,
-        0x06, 0xc2, 0x2b, 0x81, 0x49, 0xba,
-        0xf0, 0xdf, 0x26, 0x9d, 0xb7, 0x1d,
-        0x49, 0xba, 0xf0, 0xdf, 0x26, 0x9d,
-        0xb7, 0x1d };
-    unsigned char signature[] = { 0xe8, 0xef, 0x73, 0x45, 0x8d, 0x5b,
-        0x8b, 0xf8, 0xe8, 0xef, 0x73, 0x45,
-        0x8d, 0x5b, 0x8b, 0xf8, 0x38, 0x5b,
-        0x49, 0x36, 0x7b, 0x42, 0x0c, 0x58 };
-    unsigned char rootkey[] = { 0x13, 0x37, 0x13, 0x37, 0x13, 0x37,
-        0x13, 0x37, 0x13, 0x37, 0x13, 0x37,
-        0x13, 0x37, 0x13, 0x37 };
-    netmd_keychain *keychain;
-    netmd_keychain *next;
-    size_t done;
-    unsigned char hostnonce[8] = { 0 };
-    unsigned char devnonce[8] = { 0 };
-    unsigned char sessionkey[8] = { 0 };
-    unsigned char kek[] = { 0x14, 0xe3, 0x83, 0x4e, 0xe2, 0xd3, 0xcc, 0xa5 };
-    unsigned char contentid[] = { 0x01, 0x0F, 0x50, 0x00, 0x00, 0x04,
-        0x00, 0x00, 0x00, 0x48, 0xA2, 0x8D,
-        0x3E, 0x1A, 0x3B, 0x0C, 0x44, 0xAF,
-        0x2f, 0xa0 };
     netmd_track_packets *packets = NULL;
     size_t packet_count = 0;
     size_t packet_length = 0;
@@ -185,109 +302,293 @@ netmd_error netmd_send_track(netmd_dev_handle *devh, const char *filename, const
     size_t data_size;
     FILE *f;
 
-    uint16_t track;
-    unsigned char uuid[8] = { 0 };
-    unsigned char new_contentid[20] = { 0 };
-    char title[256] = { 0 };
-
     size_t headersize, channels;
     unsigned int frames, override_frames = 0;
-    size_t data_position, audio_data_position, audio_data_size, i;
+    size_t data_position, audio_data_position, audio_data_size = 0;
     audio_patch_t audio_patch = apt_no_patch;
-    unsigned char * audio_data;
+    unsigned char * audio_data = NULL;
     netmd_wireformat wireformat;
     unsigned char discformat;
+    netmd_pcm_info pcm;
+    netmd_prepared_track *prep;
+    netmd_track_packets *p;
+    char *titlep;
 
-    /* read source */
-    stat(filename, &stat_buf);
-    if ((data_size = (size_t)stat_buf.st_size) < MIN_WAV_LENGTH) {
-        netmd_log(NETMD_LOG_ERROR, "audio file too small (corrupt or not supported)\n");
+    *prepared = NULL;
+
+    /* wave PCM the device can't take as is (sample rate, bit depth) is
+       converted and encrypted while reading */
+    if ((f = fopen(filename, "rb")) == NULL) {
+        netmd_log(NETMD_LOG_ERROR, "cannot open audio file\n");
         return NETMD_ERROR;
     }
 
-    netmd_log(NETMD_LOG_VERBOSE, "audio file size : %d bytes\n", data_size);
+    if ((netmd_pcm_wav_probe(f, &pcm) == 0) && pcm.convert) {
+        netmd_log(NETMD_LOG_VERBOSE, "converting %d Hz / %d byte PCM to 44100 Hz / 16 bit\n",
+                  pcm.rate, pcm.frame_size / pcm.channels);
+        error = read_converted(f, &pcm, max_chunk, crypto, &packets, &packet_count, &frames, &packet_length);
+        fclose(f);
 
-    /* open audio file */
-    if ((data = (unsigned char *)malloc(data_size + 2048)) == NULL) {      // reserve additional mem for padding if needed
-        netmd_log(NETMD_LOG_ERROR, "error allocating memory for file input\n");
-        return NETMD_ERROR;
+        if ((error != NETMD_NO_ERROR) || (packet_length == 0)) {
+            netmd_log(NETMD_LOG_ERROR, "cannot convert audio file\n");
+            netmd_cleanup_packets(&packets);
+            return NETMD_ERROR;
+        }
+
+        audio_patch     = apt_no_patch;
+        wireformat      = NETMD_WIREFORMAT_PCM;
+        channels        = (pcm.channels == 2) ? NETMD_CHANNELS_STEREO : NETMD_CHANNELS_MONO;
+        discformat      = (pcm.channels == 2) ? NETMD_DISKFORMAT_SP_STEREO : NETMD_DISKFORMAT_SP_MONO;
+        netmd_log(NETMD_LOG_VERBOSE, "converted audio data size: %zu bytes\n", packet_length);
     }
     else {
-        if (!(f = fopen(filename, "rb"))) {
-            netmd_log(NETMD_LOG_ERROR, "cannot open audio file\n");
-            free(data);
+        fclose(f);
 
+        /* read source */
+        stat(filename, &stat_buf);
+        if ((data_size = (size_t)stat_buf.st_size) < MIN_WAV_LENGTH) {
+            netmd_log(NETMD_LOG_ERROR, "audio file too small (corrupt or not supported)\n");
             return NETMD_ERROR;
         }
-    }
 
-    /* copy file to buffer */
-    memset(data, 0, data_size + 8);
-    if ((fread(data, data_size, 1, f)) < 1) {
-        netmd_log(NETMD_LOG_ERROR, "cannot read audio file\n");
-        free(data);
+        netmd_log(NETMD_LOG_VERBOSE, "audio file size : %zu bytes\n", data_size);
 
-        return NETMD_ERROR;
-    }
-    fclose(f);
+        /* open audio file */
+        if ((data = (unsigned char *)malloc(data_size + 2048)) == NULL) {      // reserve additional mem for padding if needed
+            netmd_log(NETMD_LOG_ERROR, "error allocating memory for file input\n");
+            return NETMD_ERROR;
+        }
+        else {
+            if (!(f = fopen(filename, "rb"))) {
+                netmd_log(NETMD_LOG_ERROR, "cannot open audio file\n");
+                free(data);
 
-    /* check contents */
-    if (!audio_supported(data, data_size, &wireformat, &discformat, &audio_patch, &channels, &headersize)) {
-        netmd_log(NETMD_LOG_ERROR, "audio file unknown or not supported\n");
-        free(data);
+                return NETMD_ERROR;
+            }
+        }
 
-        return NETMD_ERROR;
-    }
-    else
-    {
-        netmd_log(NETMD_LOG_VERBOSE, "supported audio file detected\n");
-        if (audio_patch == apt_sp)
+        /* copy file to buffer */
+        memset(data, 0, data_size + 8);
+        if ((fread(data, data_size, 1, f)) < 1) {
+            netmd_log(NETMD_LOG_ERROR, "cannot read audio file\n");
+            free(data);
+
+            return NETMD_ERROR;
+        }
+        fclose(f);
+
+        /* check contents */
+        if (!netmd_audio_supported(data, data_size, &wireformat, &discformat, &audio_patch, &channels, &headersize)) {
+            netmd_log(NETMD_LOG_ERROR, "audio file unknown or not supported\n");
+            free(data);
+
+            return NETMD_ERROR;
+        }
+        else
         {
-            override_frames = (data_size - 2048) / 212;
-            if (netmd_prepare_audio_sp_upload(&data, &data_size) != NETMD_NO_ERROR)
+            netmd_log(NETMD_LOG_VERBOSE, "supported audio file detected\n");
+            if (audio_patch == apt_sp)
+            {
+                override_frames = (data_size - 2048) / 212;
+                if (netmd_prepare_audio_sp_upload(&data, &data_size) != NETMD_NO_ERROR)
+                {
+                    netmd_log(NETMD_LOG_ERROR, "cannot prepare ATRAC1 audio data for SP transfer!\n");
+                    free(data);
+                    return NETMD_ERROR;
+                }
+                else
+                {
+                    // data returned by prepare function has no header
+                    audio_data = data;
+                    audio_data_size = data_size;
+                    netmd_log(NETMD_LOG_VERBOSE, "prepared audio data size: %zu bytes\n", audio_data_size);
+                }
+            }
+            else if ((data_position = netmd_wav_data_position(data, headersize, data_size)) == 0)
             {
-                netmd_log(NETMD_LOG_ERROR, "cannot prepare ATRAC1 audio data for SP transfer!\n");
+                netmd_log(NETMD_LOG_ERROR, "cannot locate audio data in file\n");
                 free(data);
+
                 return NETMD_ERROR;
             }
             else
             {
-                // data returned by prepare function has no header
-                audio_data = data;
-                audio_data_size = data_size;
-                netmd_log(NETMD_LOG_VERBOSE, "prepared audio data size: %d bytes\n", audio_data_size);
+                netmd_log(NETMD_LOG_VERBOSE, "data chunk position at %d\n", data_position);
+                audio_data_position = data_position + 8;
+                audio_data = data + audio_data_position;
+                audio_data_size = leword32(data + (data_position + 4));
+                netmd_log(NETMD_LOG_VERBOSE, "audio data size read from file :           %zu bytes\n", audio_data_size);
+                netmd_log(NETMD_LOG_VERBOSE, "audio data size calculated from file size: %zu bytes\n", data_size - audio_data_position);
             }
         }
-        else if ((data_position = wav_data_position(data, headersize, data_size)) == 0)
-        {
-            netmd_log(NETMD_LOG_ERROR, "cannot locate audio data in file\n");
-            free(data);
+    }
 
-            return NETMD_ERROR;
-        }
-        else
+    if (data != NULL) {
+        /* conversion (byte swapping) for pcm raw data from wav file if needed */
+        if (audio_patch == apt_wave)
         {
-            netmd_log(NETMD_LOG_VERBOSE, "data chunk position at %d\n", data_position);
-            audio_data_position = data_position + 8;
-            audio_data = data + audio_data_position;
-            audio_data_size = leword32(data + (data_position + 4));
-            netmd_log(NETMD_LOG_VERBOSE, "audio data size read from file :           %d bytes\n", audio_data_size);
-            netmd_log(NETMD_LOG_VERBOSE, "audio data size calculated from file size: %d bytes\n", data_size - audio_data_position);
+            netmd_pcm_byteswap(audio_data, audio_data_size);
         }
+
+        /* number of frames will be calculated by netmd_prepare_packets() depending on the wire format and channels */
+        error = netmd_prepare_packets_ex(audio_data, audio_data_size, &packets, &packet_count, &frames, channels, &packet_length, _s_kek, wireformat,
+                                         max_chunk, crypto);
+        netmd_log(NETMD_LOG_VERBOSE, "netmd_prepare_packets : %s\n", netmd_strerror(error));
+
+        /* packets hold a copy of the audio data */
+        free(data);
+        audio_data = NULL;
+    }
+
+    if ((error != NETMD_NO_ERROR) || ((prep = calloc(1, sizeof(netmd_prepared_track))) == NULL)) {
+        netmd_cleanup_packets(&packets);
+        return NETMD_ERROR;
+    }
+
+    if ((discformat == NETMD_DISKFORMAT_SP_STEREO) && (otf != NO_ONTHEFLY_CONVERSION))
+    {
+        discformat = otf;
+    }
+
+    if(override_frames)
+        frames = override_frames;
+
+    prep->packets       = packets;
+    prep->packet_count  = packet_count;
+    prep->packet_length = packet_length;
+    prep->frames        = frames;
+    prep->wireformat    = wireformat;
+    prep->discformat    = discformat;
+    prep->channels      = channels;
+    prep->audio_patch   = audio_patch;
+    prep->size          = sizeof(netmd_prepared_track);
+
+    for (p = packets; p != NULL; p = p->next) {
+        prep->size += sizeof(netmd_track_packets) + p->length + 16;
+    }
+
+    /* set title, use either user-specified title or filename */
+    titlep = prep->title;
+    if (in_title != NULL)
+        strncpy(prep->title, in_title, sizeof(prep->title) - 1);
+    else {
+        strncpy(prep->title, filename, sizeof(prep->title) - 1);
+
+        /* eliminate file extension */
+        char *ext_dot = strrchr(prep->title, '.');
+        if (ext_dot != NULL)
+            *ext_dot = '\0';
+
+        /* eliminate path */
+        char *title_slash = strrchr(prep->title, '/');
+        if (title_slash != NULL)
+            titlep = title_slash + 1;
+    }
+
+    if (titlep != prep->title) {
+        memmove(prep->title, titlep, strlen(titlep) + 1);
+    }
+
+    *prepared = prep;
+    return NETMD_NO_ERROR;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      bytes held by a prepared track
+//!
+//! @param      prepared[in]  prepared track
+//!
+//! @return     bytes
+//------------------------------------------------------------------------------
+size_t netmd_prepared_track_size(const netmd_prepared_track *prepared)
+{
+    return (prepared != NULL) ? prepared->size : 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      free a prepared track
+//!
+//! @param      prepared[in]  pointer to prepared track (set to NULL)
+//------------------------------------------------------------------------------
+void netmd_prepared_track_free(netmd_prepared_track **prepared)
+{
+    if ((prepared != NULL) && (*prepared != NULL)) {
+        netmd_cleanup_packets(&(*prepared)->packets);
+        free(*prepared);
+        *prepared = NULL;
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      send a prepared track to netmd device (device is locked by
+//!             caller)
+//!
+//! @param      devh[in]     device handle
+//! @param      prep[in]     prepared track
+//! @param      ctl[in]      transfer control (may be NULL)
+//!
+//! @return     netmd_error
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+static netmd_error send_prepared(netmd_dev_handle *devh, const netmd_prepared_track *prep, netmd_transfer_ctl *ctl)
+{
+    netmd_error error;
+    netmd_ekb ekb;
+    unsigned char chain[] = { 0x25, 0x45, 0x06, 0x4d, 0xea, 0xca,
+        0x14, 0xf9, 0x96, 0xbd, 0xc8, 0xa4,
+        0x06, 0xc2, 0x2b, 0x81, 0x49, 0xba,
+        0xf0, 0xdf, 0x26, 0x9d, 0xb7, 0x1d,
+        0x49, 0xba, 0xf0, 0xdf, 0x26, 0x9d,
+        0xb7, 0x1d };
+    unsigned char signature[] = { 0xe8, 0xef, 0x73, 0x45, 0x8d, 0x5b,
+        0x8b, 0xf8, 0xe8, 0xef, 0x73, 0x45,
+        0x8d, 0x5b, 0x8b, 0xf8, 0x38, 0x5b,
+        0x49, 0x36, 0x7b, 0x42, 0x0c, 0x58 };
+    unsigned char rootkey[] = { 0x13, 0x37, 0x13, 0x37, 0x13, 0x37,
+        0x13, 0x37, 0x13, 0x37, 0x13, 0x37,
+        0x13, 0x37, 0x13, 0x37 };
+    netmd_keychain *keychain;
+    netmd_keychain *next;
+    size_t done;
+    unsigned char hostnonce[8] = { 0 };
+    unsigned char devnonce[8] = { 0 };
+    unsigned char sessionkey[8] = { 0 };
+    unsigned char contentid[] = { 0x01, 0x0F, 0x50, 0x00, 0x00, 0x04,
+        0x00, 0x00, 0x00, 0x48, 0xA2, 0x8D,
+        0x3E, 0x1A, 0x3B, 0x0C, 0x44, 0xAF,
+        0x2f, 0xa0 };
+
+    uint16_t track;
+    unsigned char uuid[8] = { 0 };
+    unsigned char new_contentid[20] = { 0 };
+    const netmd_dev_profile *profile = netmd_dev_profile_get(devh);
+    netmd_crypto *crypto;
+
+    if (!netmd_dev_profile_wireformat(profile, prep->wireformat)) {
+        netmd_log(NETMD_LOG_ERROR, "wire format 0x%02x not supported by device (profile %s)\n", prep->wireformat, profile->name);
+        return NETMD_ERROR;
+    }
+
+    /* nothing changed on the device yet */
+    if (netmd_transfer_cancelled(ctl)) {
+        return NETMD_CANCELLED;
     }
 
     /* acquire device - needed by Sharp devices, may fail on Sony devices */
-    error = netmd_acquire_dev(devh);
-    netmd_log(NETMD_LOG_VERBOSE, "netmd_acquire_dev: %s\n", netmd_strerror(error));
+    if (profile->need_acquire) {
+        error = netmd_acquire_dev(devh);
+        netmd_log(NETMD_LOG_VERBOSE, "netmd_acquire_dev: %s\n", netmd_strerror(error));
+    }
 
-    if (audio_patch == apt_sp)
+    if (prep->audio_patch == apt_sp)
     {
-        if (netmd_apply_sp_patch(devh, (channels == NETMD_CHANNELS_STEREO) ? 2 : 1) != NETMD_NO_ERROR)
+        if (netmd_apply_sp_patch(devh, (prep->channels == NETMD_CHANNELS_STEREO) ? 2 : 1) != NETMD_NO_ERROR)
         {
             netmd_log(NETMD_LOG_ERROR, "Can't patch NetMD device for SP transfer, exiting!\n");
-            free(data);
             netmd_undo_sp_patch(devh);
-            netmd_release_dev(devh);
+            if (profile->need_acquire) {
+                netmd_release_dev(devh);
+            }
             return NETMD_ERROR;
         }
     }
@@ -344,71 +645,37 @@ netmd_error netmd_send_track(netmd_dev_handle *devh, const char *filename, const
     error = netmd_secure_session_key_exchange(devh, hostnonce, devnonce);
     netmd_log(NETMD_LOG_VERBOSE, "netmd_secure_session_key_exchange : %s\n", netmd_strerror(error));
 
-    /* calculate session key */
-    retailmac(rootkey, hostnonce, devnonce, sessionkey);
-
-    error = netmd_secure_setup_download(devh, contentid, kek, sessionkey);
-    netmd_log(NETMD_LOG_VERBOSE, "netmd_secure_setup_download : %s\n", netmd_strerror(error));
-
-    /* conversion (byte swapping) for pcm raw data from wav file if needed */
-    if (audio_patch == apt_wave)
-    {
-        for (i = 0; i < audio_data_size; i += 2)
-        {
-            unsigned char first = audio_data[i];
-            audio_data[i] = audio_data[i + 1];
-            audio_data[i + 1] = first;
-        }
-    }
-
-    /* number of frames will be calculated by netmd_prepare_packets() depending on the wire format and channels */
-    error = netmd_prepare_packets(audio_data, audio_data_size, &packets, &packet_count, &frames, channels, &packet_length, kek, wireformat);
-    netmd_log(NETMD_LOG_VERBOSE, "netmd_prepare_packets : %s\n", netmd_strerror(error));
-
-    if ((discformat == NETMD_DISKFORMAT_SP_STEREO) && (otf != NO_ONTHEFLY_CONVERSION))
-    {
-        discformat = otf;
+    /* calculate session key; the device's cipher handles are reused for
+       every track, so there's no per track cipher setup */
+    if ((crypto = netmd_crypto_get(devh)) == NULL
+        || netmd_crypto_session_key(crypto, rootkey, hostnonce, devnonce, sessionkey) != 0) {
+        /* without session key the device would reject the download anyway */
+        netmd_log(NETMD_LOG_ERROR, "can't calculate session key\n");
+        error = NETMD_ERROR;
     }
+    else {
+        error = netmd_secure_setup_download(devh, contentid, _s_kek, sessionkey);
+        netmd_log(NETMD_LOG_VERBOSE, "netmd_secure_setup_download : %s\n", netmd_strerror(error));
 
-    if(override_frames)
-        frames = override_frames;
-
-    /* send to device */
-    error = netmd_secure_send_track(devh, wireformat,
-        discformat,
-        frames, packets,
-        packet_length, sessionkey,
-        &track, uuid, new_contentid);
-    netmd_log(NETMD_LOG_VERBOSE, "netmd_secure_send_track : %s\n", netmd_strerror(error));
-
-    /* cleanup */
-    netmd_cleanup_packets(&packets);
-    free(data);
-    audio_data = NULL;
-
-    if (error == NETMD_NO_ERROR) {
-        char *titlep = title;
-
-        /* set title, use either user-specified title or filename */
-        if (in_title != NULL)
-            strncpy(title, in_title, sizeof(title) - 1);
+        /* send to device; cancelled uploads go through the normal cleanup */
+        if (netmd_transfer_cancelled(ctl)) {
+            error = NETMD_CANCELLED;
+        }
         else {
-            strncpy(title, filename, sizeof(title) - 1);
-
-            /* eliminate file extension */
-            char *ext_dot = strrchr(title, '.');
-            if (ext_dot != NULL)
-                *ext_dot = '\0';
-
-            /* eliminate path */
-            char *title_slash = strrchr(title, '/');
-            if (title_slash != NULL)
-                titlep = title_slash + 1;
+            error = netmd_secure_send_track_ex(devh, prep->wireformat,
+                prep->discformat,
+                prep->frames, prep->packets,
+                prep->packet_length, sessionkey,
+                &track, uuid, new_contentid, ctl);
         }
+        netmd_log(NETMD_LOG_VERBOSE, "netmd_secure_send_track : %s\n", netmd_strerror(error));
+    }
 
+    if (error == NETMD_NO_ERROR) {
         netmd_log(NETMD_LOG_VERBOSE, "New Track: %d\n", track);
         netmd_cache_toc(devh);
-        netmd_set_title(devh, track, titlep);
+        netmd_dev_title_size_set(devh, track, 0); /* new track: untitled */
+        netmd_set_title(devh, track, prep->title);
         netmd_sync_toc(devh);
 
         /* commit track */
@@ -418,6 +685,9 @@ netmd_error netmd_send_track(netmd_dev_handle *devh, const char *filename, const
         else
             netmd_log(NETMD_LOG_ERROR, "netmd_secure_commit_track failed : %s\n", netmd_strerror(error));
     }
+    else if (error == NETMD_CANCELLED) {
+        netmd_log(NETMD_LOG_WARNING, "track upload cancelled\n");
+    }
     else {
         netmd_log(NETMD_LOG_ERROR, "netmd_secure_send_track failed : %s\n", netmd_strerror(error));
     }
@@ -430,14 +700,121 @@ netmd_error netmd_send_track(netmd_dev_handle *devh, const char *filename, const
     cleanup_error = netmd_secure_leave_session(devh);
     netmd_log(NETMD_LOG_VERBOSE, "netmd_secure_leave_session : %s\n", netmd_strerror(cleanup_error));
 
-    if (audio_patch == apt_sp)
+    if (prep->audio_patch == apt_sp)
     {
         netmd_undo_sp_patch(devh);
+
+        /* patches may be kept for a batch; not after an aborted upload */
+        if (error == NETMD_CANCELLED)
+        {
+            netmd_sp_patch_abort(devh);
+        }
     }
 
     /* release device - needed by Sharp devices, may fail on Sony devices */
-    cleanup_error = netmd_release_dev(devh);
-    netmd_log(NETMD_LOG_VERBOSE, "netmd_release_dev : %s\n", netmd_strerror(cleanup_error));
+    if (profile->need_acquire) {
+        cleanup_error = netmd_release_dev(devh);
+        netmd_log(NETMD_LOG_VERBOSE, "netmd_release_dev : %s\n", netmd_strerror(cleanup_error));
+    }
 
     return error; /* return error code from the "business logic" */
 }
+
+//------------------------------------------------------------------------------
+//! @brief      send audio file to netmd device (device is locked by caller)
+//!
+//! @param      devh[in]     device handle
+//! @param      filename[in] audio track file name
+//! @param      in_title[in] track title
+//! @param      otf[in]      on the fly convert flag
+//! @param      ctl[in]      transfer control (may be NULL)
+//!
+//! @return     netmd_error
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+static netmd_error send_track(netmd_dev_handle *devh, const char *filename, const char *in_title, unsigned char otf,
+                              netmd_transfer_ctl *ctl)
+{
+    netmd_prepared_track *prep = NULL;
+    netmd_error error;
+
+    if ((error = netmd_prepare_track(filename, in_title, otf, netmd_dev_profile_get(devh)->max_chunk,
+                                     netmd_crypto_get(devh), &prep)) == NETMD_NO_ERROR) {
+        error = send_prepared(devh, prep, ctl);
+        netmd_prepared_track_free(&prep);
+    }
+
+    return error;
+}
+
+// exported function 
+
+//------------------------------------------------------------------------------
+//! @brief      send audio file to netmd device; the device is locked for
+//!             the whole transfer, so other threads can't interrupt the
+//!             secure session
+//!
+//! @param      devh[in]     device handle
+//! @param      filename[in] audio track file name
+//! @param      in_title[in] track title
+//! @param      otf[in]      on the fly convert flag
+//!
+//! @return     netmd_error
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_send_track(netmd_dev_handle *devh, const char *filename, const char *in_title, unsigned char otf)
+{
+    return netmd_send_track_ex(devh, filename, in_title, otf, NULL);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      send audio file to netmd device with progress reports; the
+//!             upload can be cancelled through the transfer control
+//!
+//! @param      devh[in]     device handle
+//! @param      filename[in] audio track file name
+//! @param      in_title[in] track title
+//! @param      otf[in]      on the fly convert flag
+//! @param      ctl[in]      transfer control (may be NULL)
+//!
+//! @return     netmd_error (NETMD_CANCELLED if cancelled)
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_send_track_ex(netmd_dev_handle *devh, const char *filename, const char *in_title, unsigned char otf,
+                                netmd_transfer_ctl *ctl)
+{
+    netmd_error ret;
+
+    if ((ret = netmd_dev_lock(devh)) == NETMD_NO_ERROR)
+    {
+        ret = send_track(devh, filename, in_title, otf, ctl);
+        netmd_dev_unlock(devh);
+    }
+
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      send a track prepared with netmd_prepare_track(); the device
+//!             is locked for the whole transfer
+//!
+//! @param      devh[in]     device handle
+//! @param      prepared[in] prepared track
+//! @param      ctl[in]      transfer control (may be NULL)
+//!
+//! @return     netmd_error (NETMD_CANCELLED if cancelled)
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_send_prepared_track(netmd_dev_handle *devh, const netmd_prepared_track *prepared,
+                                      netmd_transfer_ctl *ctl)
+{
+    netmd_error ret;
+
+    if ((ret = netmd_dev_lock(devh)) == NETMD_NO_ERROR)
+    {
+        ret = send_prepared(devh, prepared, ctl);
+        netmd_dev_unlock(devh);
+    }
+
+    return ret;
+}
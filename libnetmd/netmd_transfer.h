@@ -2,9 +2,54 @@
 #define NETMD_TRANSFER_H
 #include "common.h"
 #include "error.h"
+#include "secure.h"
 
 /* copy start */
 
+/** @brief audio patch type */
+typedef enum
+{
+    apt_no_patch, /**< no patch needed         */
+    apt_wave,     /**< wave endianess patch    */
+    apt_sp        /**< atrac1 SP padding patch */
+} audio_patch_t;
+
+//------------------------------------------------------------------------------
+//! @brief      check audio file header
+//!
+//! @param[in]  file        file data
+//! @param[in]  fsize       file size
+//! @param[out] wireformat  wire format
+//! @param[out] diskformat  disc format
+//! @param[out] conversion  needed audio patch
+//! @param[out] channels    channels
+//! @param[out] headersize  header size
+//!
+//! @return     1 -> supported; 0 -> not supported
+//------------------------------------------------------------------------------
+int netmd_audio_supported(const unsigned char * file, size_t fsize, netmd_wireformat * wireformat, unsigned char * diskformat,
+                          audio_patch_t * conversion, size_t * channels, size_t * headersize);
+
+//------------------------------------------------------------------------------
+//! @brief      find data chunk in wave file
+//!
+//! @param[in]  data    file data
+//! @param[in]  offset  search start
+//! @param[in]  len     file size
+//!
+//! @return     position of "data" chunk; 0 -> not found
+//------------------------------------------------------------------------------
+size_t netmd_wav_data_position(const unsigned char * data, size_t offset, size_t len);
+
+//------------------------------------------------------------------------------
+//! @brief      swap bytes of 16 bit PCM samples (wave is little endian,
+//!             the device wants big endian)
+//!
+//! @param[in]  data    sample data (swapped in place)
+//! @param[in]  size    data size in bytes
+//------------------------------------------------------------------------------
+void netmd_pcm_byteswap(unsigned char * data, size_t size);
+
 //------------------------------------------------------------------------------
 //! @brief      send audio file to netmd device
 //!
@@ -18,6 +63,87 @@
 //------------------------------------------------------------------------------
 netmd_error netmd_send_track(netmd_dev_handle *devh, const char *filename, const char *in_title, unsigned char otf);
 
+//------------------------------------------------------------------------------
+//! @brief      send audio file to netmd device with progress reports; the
+//!             upload can be cancelled through the transfer control. An
+//!             aborted upload leaves the secure session and removes SP
+//!             patches, so the device can be used right away.
+//!
+//! @param      devh[in]     device handle
+//! @param      filename[in] audio track file name
+//! @param      in_title[in] track title
+//! @param      otf[in]      on the fly convert flag
+//! @param      ctl[in]      transfer control (may be NULL)
+//!
+//! @return     netmd_error (NETMD_CANCELLED if cancelled)
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_send_track_ex(netmd_dev_handle *devh, const char *filename, const char *in_title, unsigned char otf,
+                                netmd_transfer_ctl *ctl);
+
+//------------------------------------------------------------------------------
+//! @brief      track prepared for upload (opaque), see netmd_prepare_track()
+//------------------------------------------------------------------------------
+typedef struct netmd_prepared_track netmd_prepared_track;
+
+//------------------------------------------------------------------------------
+//! @brief      estimate the memory needed while preparing an audio file
+//!             (source data and encrypted packets are held at the same time)
+//!
+//! @param      filename[in] audio track file name
+//!
+//! @return     bytes; 0 -> file can't be read
+//------------------------------------------------------------------------------
+size_t netmd_prepare_track_estimate(const char *filename);
+
+//------------------------------------------------------------------------------
+//! @brief      prepare an audio file for upload: read, convert, check and
+//!             encrypt it; there is no device access, so this can run for
+//!             the next tracks while one is sent
+//!
+//! @param      filename[in]   audio track file name
+//! @param      in_title[in]   track title (NULL -> file name)
+//! @param      otf[in]        on the fly convert flag
+//! @param      max_chunk[in]  max. packet size (see device profile)
+//! @param      crypto[in]     crypto context (NULL -> temporary one)
+//! @param      prepared[out]  prepared track
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_prepare_track(const char *filename, const char *in_title, unsigned char otf, size_t max_chunk,
+                                netmd_crypto *crypto, netmd_prepared_track **prepared);
+
+//------------------------------------------------------------------------------
+//! @brief      bytes held by a prepared track
+//!
+//! @param      prepared[in]  prepared track
+//!
+//! @return     bytes
+//------------------------------------------------------------------------------
+size_t netmd_prepared_track_size(const netmd_prepared_track *prepared);
+
+//------------------------------------------------------------------------------
+//! @brief      free a prepared track
+//!
+//! @param      prepared[in]  pointer to prepared track (set to NULL)
+//------------------------------------------------------------------------------
+void netmd_prepared_track_free(netmd_prepared_track **prepared);
+
+//------------------------------------------------------------------------------
+//! @brief      send a track prepared with netmd_prepare_track(); the device
+//!             is locked for the whole transfer
+//!
+//! @param      devh[in]     device handle
+//! @param      prepared[in] prepared track
+//! @param      ctl[in]      transfer control (may be NULL)
+//!
+//! @return     netmd_error (NETMD_CANCELLED if cancelled)
+//! @see        betmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_send_prepared_track(netmd_dev_handle *devh, const netmd_prepared_track *prepared,
+                                      netmd_transfer_ctl *ctl);
+
 /* copy end */
 
 #endif // NETMD_TRANSFER_H
\ No newline at end of file
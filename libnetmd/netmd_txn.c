@@ -0,0 +1,1146 @@
+/* netmd_txn.c
+ *
+ * Batched metadata transactions and title sessions.
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "netmd_txn.h"
+#include "libnetmd_intern.h"
+#include "log.h"
+
+/* Commands an edit costs if done on its own through the single edit API.
+   Used to tell how many commands a transaction saved. */
+#define TXN_CMDS_TITLE   6  /* cache, read title, 2 handshakes, write, sync */
+#define TXN_CMDS_MOVE    3  /* handshake, 2 move requests */
+#define TXN_CMDS_DELETE  3  /* cache, delete, sync */
+#define TXN_CMDS_HEADER  5  /* 3 handshakes, write, close */
+
+/** @brief queued edit type */
+typedef enum
+{
+    txn_title,         /**< set track title            */
+    txn_move,          /**< move track                 */
+    txn_delete,        /**< delete track               */
+    txn_disc_title,    /**< header: set disc title     */
+    txn_add_group,     /**< header: create group       */
+    txn_rename_group,  /**< header: rename group       */
+    txn_del_group,     /**< header: delete group       */
+    txn_put_track,     /**< header: put track in group */
+    txn_pull_track,    /**< header: remove from group  */
+    txn_remap          /**< header: remap after moves  */
+} txn_op_type_t;
+
+/** @brief queued edit; header edits are applied to md right away and
+ *         logged here, so the header can be rebuilt if a device edit fails */
+typedef struct
+{
+    txn_op_type_t type;   /**< edit type                              */
+    uint16_t      track;  /**< zero based track; tracks (txn_remap)   */
+    uint16_t      dest;   /**< move destination                       */
+    char*         title;  /**< track, disc or group title             */
+    int           gid;    /**< group id                               */
+    int16_t       first;  /**< first track (header numbering)         */
+    int16_t       last;   /**< last track (header numbering)          */
+    size_t        moves;  /**< index of first move (txn_remap)        */
+} txn_op_t;
+
+/** @brief edit transaction */
+struct netmd_txn
+{
+    netmd_dev_handle* devh;         /**< device handle                 */
+    HndMdHdr          md;           /**< disc header                   */
+    HndMdHdr          snap;         /**< header as of last commit      */
+    txn_op_t*         ops;          /**< queued edits                  */
+    size_t            op_count;     /**< number of queued edits        */
+    size_t            op_alloc;     /**< allocated edit slots          */
+    size_t            dev_ops;      /**< number of queued device edits */
+    unsigned int      hdr_edits;    /**< number of header edits        */
+    unsigned long     cmds_single;  /**< costs of edits one by one     */
+};
+
+/** @brief title write session */
+struct netmd_title_session
+{
+    netmd_dev_handle* devh;                       /**< device handle            */
+    unsigned long     cmd_start;                  /**< command count at open    */
+    unsigned int      titles;                     /**< titles written           */
+    int               errors;                     /**< failed writes            */
+};
+
+//------------------------------------------------------------------------------
+//! @brief      add a device edit to the queue
+//!
+//! @param[in]  txn   transaction handle
+//! @param[in]  op    edit to add (title will be owned by txn)
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int txn_queue(netmd_txn_t* txn, const txn_op_t* op)
+{
+    if (txn->op_count == txn->op_alloc)
+    {
+        size_t    sz  = txn->op_alloc ? (txn->op_alloc * 2) : 16;
+        txn_op_t* tmp = realloc(txn->ops, sz * sizeof(txn_op_t));
+
+        if (tmp == NULL)
+        {
+            netmd_log(NETMD_LOG_ERROR, "Can't allocate memory for transaction!\n");
+            return -1;
+        }
+
+        txn->ops      = tmp;
+        txn->op_alloc = sz;
+    }
+
+    txn->ops[txn->op_count++] = *op;
+
+    if ((op->type == txn_title) || (op->type == txn_move) || (op->type == txn_delete))
+    {
+        txn->dev_ops++;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      remap group ranges for the queued moves in [from, to)
+//!
+//! @param[in]  md     disc header
+//! @param[in]  ops    queued edits
+//! @param[in]  from   index of first move
+//! @param[in]  to     index behind last move to take
+//! @param[in]  count  number of tracks
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int txn_remap_moves(HndMdHdr md, const txn_op_t* ops, size_t from, size_t to, uint16_t count)
+{
+    int       ret     = -1;
+    uint16_t* cur     = malloc(count * sizeof(uint16_t));
+    int16_t*  new_pos = malloc(count * sizeof(int16_t));
+    uint16_t  p, f, x;
+    size_t    i;
+
+    if ((cur == NULL) || (new_pos == NULL))
+    {
+        goto cleanup;
+    }
+
+    /* replay moves on the current layout (cur[pos] = old track) */
+    for (p = 0; p < count; p++)
+    {
+        cur[p] = p;
+    }
+
+    for (i = from; i < to; i++)
+    {
+        if (ops[i].type != txn_move)
+        {
+            continue;
+        }
+
+        p = ops[i].track;
+        f = ops[i].dest;
+
+        if ((p >= count) || (f >= count))
+        {
+            goto cleanup;
+        }
+
+        x = cur[p];
+        if (p < f)
+        {
+            memmove(&cur[p], &cur[p + 1], (f - p) * sizeof(uint16_t));
+        }
+        else
+        {
+            memmove(&cur[f + 1], &cur[f], (p - f) * sizeof(uint16_t));
+        }
+        cur[f] = x;
+    }
+
+    /* header counts tracks starting with 1 */
+    for (p = 0; p < count; p++)
+    {
+        new_pos[cur[p]] = p + 1;
+    }
+
+    ret = md_header_remap_tracks(md, new_pos, count);
+
+cleanup:
+    free(cur);
+    free(new_pos);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      apply the header part of a queued edit
+//!
+//! @param[in]  md    disc header
+//! @param[in]  ops   queued edits
+//! @param[in]  idx   index of edit to apply
+//! @param[in]  done  device edits before this index are done
+//!                   (only moves before done are remapped)
+//!
+//! @return     result of the header function (0 / group id -> ok)
+//------------------------------------------------------------------------------
+static int txn_header_apply(HndMdHdr md, const txn_op_t* ops, size_t idx, size_t done)
+{
+    const txn_op_t* op = &ops[idx];
+
+    switch (op->type)
+    {
+    case txn_delete:
+        /* header counts tracks starting with 1 */
+        return md_header_del_track(md, op->track + 1);
+
+    case txn_disc_title:
+        return md_header_set_disc_title(md, op->title);
+
+    case txn_add_group:
+        return md_header_add_group(md, op->title, op->first, op->last);
+
+    case txn_rename_group:
+        return md_header_rename_group(md, op->gid, op->title);
+
+    case txn_del_group:
+        return md_header_del_group(md, op->gid);
+
+    case txn_put_track:
+        /* this might fail if track is ungrouped */
+        md_header_del_track_from_group(md, op->gid, op->first);
+        return md_header_add_track_to_group(md, op->gid, op->first);
+
+    case txn_pull_track:
+        return md_header_del_track_from_group(md, op->gid, op->first);
+
+    case txn_remap:
+        return txn_remap_moves(md, ops, op->moves, (done < idx) ? done : idx, op->track);
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      log a header edit and apply it to the disc header
+//!
+//! @param[in]  txn   transaction handle
+//! @param[in]  op    edit to add (title will be owned by txn)
+//!
+//! @return     result of the header function (0 / group id -> ok)
+//------------------------------------------------------------------------------
+static int txn_header_op(netmd_txn_t* txn, const txn_op_t* op)
+{
+    if (txn_queue(txn, op) != 0)
+    {
+        free(op->title);
+        return -1;
+    }
+
+    return txn_header_apply(txn->md, txn->ops, txn->op_count - 1, txn->op_count - 1);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      rebuild the disc header after a failed device edit: roll
+//!             back to the last commit and apply the header parts of the
+//!             edits done before the failed one; moves are remapped as
+//!             far as they were done
+//!
+//! @param[in]  txn     transaction handle
+//! @param[in]  failed  index of the failed edit
+//------------------------------------------------------------------------------
+static void txn_header_rebuild(netmd_txn_t* txn, size_t failed)
+{
+    size_t i;
+
+    if (md_header_restore(txn->md, txn->snap) != 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < failed; i++)
+    {
+        txn_header_apply(txn->md, txn->ops, i, failed);
+    }
+
+    /* a remap comes behind its moves */
+    for (i = failed + 1; i < txn->op_count; i++)
+    {
+        if ((txn->ops[i].type == txn_remap) && (txn->ops[i].moves <= failed))
+        {
+            txn_header_apply(txn->md, txn->ops, i, failed);
+            break;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      account a header edit
+//!
+//! @param[in]  txn   transaction handle
+//! @param[in]  ret   result of the header function (0 / group id -> ok)
+//!
+//! @return     ret
+//------------------------------------------------------------------------------
+static int txn_header_edit(netmd_txn_t* txn, int ret)
+{
+    if (ret > -1)
+    {
+        txn->hdr_edits++;
+        txn->cmds_single += TXN_CMDS_HEADER;
+    }
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      compare function to sort track numbers descending
+//!
+//! @param[in]  a     track a
+//! @param[in]  b     track b
+//!
+//! @return     < 0 if a is larger than b
+//------------------------------------------------------------------------------
+static int txn_track_desc(const void* a, const void* b)
+{
+    return (int)*(const uint16_t*)b - (int)*(const uint16_t*)a;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      create an edit transaction. Header edits are applied to md
+//!             right away, device edits are queued until commit. The
+//!             disc header is written once on commit. If a device edit
+//!             fails, md is rebuilt from the edits done before it. Note:
+//!             md is modified even if the transaction is never committed.
+//!
+//! @param[in]  devh  device handle
+//! @param[in]  md    disc header (as read by netmd_initialize_disc_info),
+//!                   may be NULL if only device edits are used
+//!
+//! @return     transaction handle or NULL on error
+//------------------------------------------------------------------------------
+netmd_txn_t* netmd_txn_create(netmd_dev_handle* devh, HndMdHdr md)
+{
+    netmd_txn_t* txn;
+
+    if (devh == NULL)
+    {
+        return NULL;
+    }
+
+    if ((txn = calloc(1, sizeof(netmd_txn_t))) != NULL)
+    {
+        txn->devh = devh;
+        txn->md   = md;
+
+        if ((md != NULL) && ((txn->snap = md_header_clone(md)) == NULL))
+        {
+            free(txn);
+            txn = NULL;
+        }
+    }
+
+    return txn;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      free an edit transaction (queued edits are dropped)
+//!
+//! @param[in/out] txn   pointer to transaction handle
+//------------------------------------------------------------------------------
+void netmd_txn_free(netmd_txn_t** txn)
+{
+    size_t i;
+
+    if ((txn != NULL) && (*txn != NULL))
+    {
+        for (i = 0; i < (*txn)->op_count; i++)
+        {
+            free((*txn)->ops[i].title);
+        }
+
+        free((*txn)->ops);
+        free_md_header(&(*txn)->snap);
+        free(*txn);
+        *txn = NULL;
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      queue a track title change
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  zero based track number
+//! @param[in]  title  new track title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_set_title(netmd_txn_t* txn, uint16_t track, const char* title)
+{
+    txn_op_t op = {txn_title, track, 0, NULL, 0, 0, 0, 0};
+
+    if ((txn == NULL) || (title == NULL) || ((op.title = strdup(title)) == NULL))
+    {
+        return -1;
+    }
+
+    if (txn_queue(txn, &op) != 0)
+    {
+        free(op.title);
+        return -1;
+    }
+
+    txn->cmds_single += TXN_CMDS_TITLE;
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      queue a track move
+//!
+//! @param[in]  txn     transaction handle
+//! @param[in]  start   zero based track to move
+//! @param[in]  finish  zero based destination
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_move_track(netmd_txn_t* txn, uint16_t start, uint16_t finish)
+{
+    txn_op_t op = {txn_move, start, finish, NULL, 0, 0, 0, 0};
+
+    if ((txn == NULL) || (txn_queue(txn, &op) != 0))
+    {
+        return -1;
+    }
+
+    txn->cmds_single += TXN_CMDS_MOVE;
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      queue a track deletion (groups are updated in header)
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  zero based track number
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_delete_track(netmd_txn_t* txn, uint16_t track)
+{
+    txn_op_t op = {txn_delete, track, 0, NULL, 0, 0, 0, 0};
+
+    if ((txn == NULL) || (txn_queue(txn, &op) != 0))
+    {
+        return -1;
+    }
+
+    txn->cmds_single += TXN_CMDS_DELETE;
+
+    /* group ranges are shifted right away, see txn_header_rebuild() */
+    txn_header_edit(txn, txn_header_apply(txn->md, txn->ops, txn->op_count - 1, txn->op_count - 1));
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      set disc title
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  title  new disc title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_set_disc_title(netmd_txn_t* txn, const char* title)
+{
+    txn_op_t op = {txn_disc_title, 0, 0, NULL, 0, 0, 0, 0};
+
+    if ((txn == NULL) || (title == NULL) || ((op.title = strdup(title)) == NULL))
+    {
+        return -1;
+    }
+    return txn_header_edit(txn, txn_header_op(txn, &op));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      create a group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  name   group name
+//! @param[in]  first  first track (header numbering, -1 -> empty group)
+//! @param[in]  last   last track (header numbering, -1 -> one track)
+//!
+//! @return     > -1 -> group id; else -> error
+//------------------------------------------------------------------------------
+int netmd_txn_create_group(netmd_txn_t* txn, const char* name, int16_t first, int16_t last)
+{
+    txn_op_t op = {txn_add_group, 0, 0, NULL, 0, first, last, 0};
+
+    if ((txn == NULL) || (name == NULL) || ((op.title = strdup(name)) == NULL))
+    {
+        return -1;
+    }
+    return txn_header_edit(txn, txn_header_op(txn, &op));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      rename a group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  gid    group id
+//! @param[in]  title  new group title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_set_group_title(netmd_txn_t* txn, int gid, const char* title)
+{
+    txn_op_t op = {txn_rename_group, 0, 0, NULL, gid, 0, 0, 0};
+
+    if ((txn == NULL) || (title == NULL) || ((op.title = strdup(title)) == NULL))
+    {
+        return -1;
+    }
+    return txn_header_edit(txn, txn_header_op(txn, &op));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      delete a group (tracks become ungrouped)
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  gid    group id
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_delete_group(netmd_txn_t* txn, int gid)
+{
+    txn_op_t op = {txn_del_group, 0, 0, NULL, gid, 0, 0, 0};
+
+    if (txn == NULL)
+    {
+        return -1;
+    }
+    return txn_header_edit(txn, txn_header_op(txn, &op));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      put track into group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  track number (header numbering)
+//! @param[in]  gid    group id
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_put_track_in_group(netmd_txn_t* txn, int16_t track, int gid)
+{
+    txn_op_t op = {txn_put_track, 0, 0, NULL, gid, track, 0, 0};
+
+    if (txn == NULL)
+    {
+        return -1;
+    }
+    return txn_header_edit(txn, txn_header_op(txn, &op));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      remove track from group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  track number (header numbering)
+//! @param[in]  gid    group id
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_pull_track_from_group(netmd_txn_t* txn, int16_t track, int gid)
+{
+    txn_op_t op = {txn_pull_track, 0, 0, NULL, gid, track, 0, 0};
+
+    if (txn == NULL)
+    {
+        return -1;
+    }
+    return txn_header_edit(txn, txn_header_op(txn, &op));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      write a track title (TOC must be cached); the old title is
+//!             only read if the device handle doesn't know its size
+//!
+//! @param[in]  devh   device handle
+//! @param[in]  track  zero based track number
+//! @param[in]  title  new track title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int txn_write_title(netmd_dev_handle* devh, uint16_t track, const char* title)
+{
+    char old_title[255];
+    int  oldsize = netmd_dev_title_size(devh, track);
+    int  cached  = (oldsize >= 0);
+
+    if (!cached)
+    {
+        oldsize = netmd_request_title(devh, track, old_title, sizeof(old_title));
+    }
+
+    if (oldsize == -1)
+    {
+        oldsize = 0; /* no title at all, replace 0 bytes */
+    }
+
+    if (netmd_write_title(devh, track, title, oldsize))
+    {
+        return 0;
+    }
+
+    /* cached size may be stale (e.g. disc edited elsewhere) -> ask once more */
+    if (cached && ((oldsize = netmd_request_title(devh, track, old_title, sizeof(old_title))) >= 0))
+    {
+        return netmd_write_title(devh, track, title, oldsize) ? 0 : -1;
+    }
+
+    return -1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      run one queued device edit (TOC must be cached)
+//!
+//! @param[in]  txn   transaction handle
+//! @param[in]  op    edit to run
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int txn_run_op(netmd_txn_t* txn, const txn_op_t* op)
+{
+    switch (op->type)
+    {
+    case txn_title:
+        /* descriptor is already open for write -> no handshakes needed */
+        return txn_write_title(txn->devh, op->track, op->title);
+
+    case txn_move:
+        return netmd_move_track(txn->devh, op->track, op->dest) ? 0 : -1;
+
+    case txn_delete:
+        if (netmd_delete_track(txn->devh, op->track) < 0)
+        {
+            return -1;
+        }
+        netmd_wait_for_sync(txn->devh);
+        return 0;
+
+    default:
+        /* header edit, written once at the end */
+        break;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      commit transaction: run queued device edits in one TOC
+//!             cache / sync window and write the disc header once; the
+//!             device is locked for the whole commit. If a device edit
+//!             fails, the remaining edits are dropped and md only keeps
+//!             the header edits queued before the failed one.
+//!
+//! @param[in]  txn    transaction handle
+//! @param[out] stats  optional buffer for statistics (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_txn_commit(netmd_txn_t* txn, netmd_txn_stats_t* stats)
+{
+    netmd_error       err   = NETMD_NO_ERROR;
+    unsigned long     start;
+    netmd_txn_stats_t st;
+    size_t            i, failed = 0;
+    int               write_hdr;
+
+    if (txn == NULL)
+    {
+        return NETMD_ERROR;
+    }
+
+    start = netmd_cmd_count(txn->devh);
+
+    /* other threads must not send commands inside the TOC cache window */
+    if (netmd_dev_lock(txn->devh) != NETMD_NO_ERROR)
+    {
+        return NETMD_ERROR;
+    }
+
+    if (txn->dev_ops > 0)
+    {
+        netmd_cache_toc(txn->devh);
+
+        for (i = 0; i < txn->op_count; i++)
+        {
+            if (txn_run_op(txn, &txn->ops[i]) != 0)
+            {
+                netmd_log(NETMD_LOG_ERROR, "Transaction: edit #%u failed, stop here!\n", (unsigned)i);
+                err    = NETMD_COMMAND_FAILED_UNKNOWN_ERROR;
+                failed = i;
+                break;
+            }
+        }
+
+        netmd_sync_toc(txn->devh);
+    }
+
+    write_hdr = (txn->hdr_edits > 0);
+
+    /* header edits behind the failed edit are dropped, those of
+       edits not done are taken back */
+    if ((err != NETMD_NO_ERROR) && (txn->snap != NULL))
+    {
+        txn_header_rebuild(txn, failed);
+        write_hdr = strcmp(md_header_to_string(txn->md), md_header_to_string(txn->snap)) != 0;
+    }
+
+    if (write_hdr && (netmd_write_disc_header(txn->devh, txn->md) < 0))
+    {
+        err = NETMD_COMMAND_FAILED_UNKNOWN_ERROR;
+    }
+
+    netmd_dev_unlock(txn->devh);
+
+    st.edits       = txn->dev_ops + txn->hdr_edits;
+    st.cmds_sent   = netmd_cmd_count(txn->devh) - start;
+    st.cmds_single = txn->cmds_single;
+    st.cmds_saved  = (st.cmds_single > st.cmds_sent) ? (st.cmds_single - st.cmds_sent) : 0;
+
+    netmd_log(NETMD_LOG_VERBOSE, "Transaction: %u edit(s), %lu command(s) sent, %lu saved.\n",
+              st.edits, st.cmds_sent, st.cmds_saved);
+
+    if (stats != NULL)
+    {
+        *stats = st;
+    }
+
+    /* all queued edits are done (or dropped) */
+    for (i = 0; i < txn->op_count; i++)
+    {
+        free(txn->ops[i].title);
+    }
+    txn->op_count    = 0;
+    txn->dev_ops     = 0;
+    txn->hdr_edits   = 0;
+    txn->cmds_single = 0;
+
+    if (txn->snap != NULL)
+    {
+        md_header_restore(txn->snap, txn->md);
+    }
+
+    return err;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      plan the minimal move sequence for a new track order; tracks
+//!             building the longest increasing subsequence of order stay
+//!             where they are, all others are moved once
+//!
+//! @param[in]  order  new order: order[i] is the (zero based) current track
+//!                    which should become track i
+//! @param[in]  count  number of tracks (entries in order)
+//! @param[out] moves  buffer for at least count moves
+//!
+//! @return     number of moves; -1 -> error (order is no permutation)
+//------------------------------------------------------------------------------
+int netmd_plan_track_order(const uint16_t* order, uint16_t count, netmd_track_move_t* moves)
+{
+    int       ret  = -1;
+    uint16_t* len  = NULL;  /* LIS length ending at i    */
+    int32_t*  prev = NULL;  /* LIS predecessor of i      */
+    uint16_t* cur  = NULL;  /* current layout (track ids) */
+    uint8_t*  keep = NULL;  /* stays in place            */
+    int32_t   i, j, best = -1, p, q;
+    uint16_t  x, finish;
+
+    if ((order == NULL) || (moves == NULL))
+    {
+        return -1;
+    }
+
+    len  = malloc(count * sizeof(uint16_t));
+    prev = malloc(count * sizeof(int32_t));
+    cur  = malloc(count * sizeof(uint16_t));
+    keep = calloc(count, sizeof(uint8_t));
+
+    if (count && ((len == NULL) || (prev == NULL) || (cur == NULL) || (keep == NULL)))
+    {
+        netmd_log(NETMD_LOG_ERROR, "Can't allocate memory for track order!\n");
+        goto cleanup;
+    }
+
+    /* check for a valid permutation (keep used as marker) */
+    for (i = 0; i < count; i++)
+    {
+        if ((order[i] >= count) || keep[order[i]])
+        {
+            netmd_log(NETMD_LOG_ERROR, "Invalid track order at position %d!\n", (int)i);
+            goto cleanup;
+        }
+        keep[order[i]] = 1;
+    }
+
+    memset(keep, 0, count);
+
+    /* longest increasing subsequence - O(n^2) is fine for up to 254 tracks */
+    for (i = 0; i < count; i++)
+    {
+        len[i]  = 1;
+        prev[i] = -1;
+
+        for (j = 0; j < i; j++)
+        {
+            if ((order[j] < order[i]) && ((len[j] + 1) > len[i]))
+            {
+                len[i]  = len[j] + 1;
+                prev[i] = j;
+            }
+        }
+
+        if ((best == -1) || (len[i] > len[best]))
+        {
+            best = i;
+        }
+    }
+
+    for (i = best; i != -1; i = prev[i])
+    {
+        keep[i] = 1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        cur[i] = i;
+    }
+
+    /* put every other track right behind its new predecessor */
+    ret = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (keep[i])
+        {
+            continue;
+        }
+
+        x = order[i];
+
+        for (p = 0; cur[p] != x; p++) ;
+
+        q = -1;
+        if (i > 0)
+        {
+            for (q = 0; cur[q] != order[i - 1]; q++) ;
+        }
+
+        finish = (p > q) ? (q + 1) : q;
+
+        if (p == finish)
+        {
+            continue;
+        }
+
+        if (p < finish)
+        {
+            memmove(&cur[p], &cur[p + 1], (finish - p) * sizeof(uint16_t));
+        }
+        else
+        {
+            memmove(&cur[finish + 1], &cur[finish], (p - finish) * sizeof(uint16_t));
+        }
+        cur[finish] = x;
+
+        moves[ret].start  = p;
+        moves[ret].finish = finish;
+        ret++;
+    }
+
+cleanup:
+    free(len);
+    free(prev);
+    free(cur);
+    free(keep);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      reorder all tracks on disc with a minimal number of moves
+//!             and fix up group ranges with one header write; if a move
+//!             fails, group ranges follow the moves done before
+//!
+//! @param[in]  devh   device handle
+//! @param[in]  md     disc header
+//! @param[in]  order  new order: order[i] is the (zero based) current track
+//!                    which should become track i
+//! @param[in]  count  number of tracks, must match track count on disc
+//! @param[out] stats  optional buffer for statistics (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_set_track_order(netmd_dev_handle* devh, HndMdHdr md, const uint16_t* order,
+                                  uint16_t count, netmd_txn_stats_t* stats)
+{
+    netmd_error         err     = NETMD_ERROR;
+    netmd_txn_t*        txn     = NULL;
+    netmd_track_move_t* moves   = NULL;
+    char*               old_hdr = NULL;
+    uint16_t            tc      = 0;
+    txn_op_t            remap   = {txn_remap, count, 0, NULL, 0, 0, 0, 0};
+    int                 i, mc;
+
+    if ((order == NULL) || (count == 0))
+    {
+        return NETMD_ERROR;
+    }
+
+    if ((netmd_request_track_count(devh, &tc) != 0) || (tc != count))
+    {
+        netmd_log(NETMD_LOG_ERROR, "Track order must contain all %d tracks!\n", (int)tc);
+        return NETMD_ERROR;
+    }
+
+    moves = malloc(count * sizeof(netmd_track_move_t));
+
+    if ((moves == NULL) || ((txn = netmd_txn_create(devh, md)) == NULL))
+    {
+        goto cleanup;
+    }
+
+    if ((mc = netmd_plan_track_order(order, count, moves)) < 0)
+    {
+        goto cleanup;
+    }
+
+    netmd_log(NETMD_LOG_VERBOSE, "Reorder %d tracks with %d move(s).\n", (int)count, mc);
+
+    remap.moves = txn->op_count;
+
+    for (i = 0; i < mc; i++)
+    {
+        if (netmd_txn_move_track(txn, moves[i].start, moves[i].finish) != 0)
+        {
+            goto cleanup;
+        }
+    }
+
+    old_hdr = strdup(md_header_to_string(md));
+
+    /* queued behind the moves: if one fails, only the moves done are
+       remapped, see txn_header_rebuild() */
+    if (txn_header_op(txn, &remap) == 0)
+    {
+        /* only write header if groups have changed */
+        if ((old_hdr == NULL) || strcmp(old_hdr, md_header_to_string(md)))
+        {
+            txn_header_edit(txn, 0);
+        }
+    }
+    else
+    {
+        netmd_log(NETMD_LOG_WARNING, "Can't update groups for new track order!\n");
+    }
+
+    err = netmd_txn_commit(txn, stats);
+
+cleanup:
+    netmd_txn_free(&txn);
+    free(moves);
+    free(old_hdr);
+    return err;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      delete a set of tracks in one TOC cache / sync window;
+//!             tracks are deleted in descending order, so numbers given
+//!             stay valid. Group ranges are updated and the header is
+//!             written once; if a delete fails, only the ranges of the
+//!             tracks deleted before are updated.
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  md      disc header
+//! @param[in]  tracks  zero based track numbers (any order, duplicates ok)
+//! @param[in]  count   number of entries in tracks
+//! @param[out] stats   optional buffer for statistics (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_delete_tracks(netmd_dev_handle* devh, HndMdHdr md, const uint16_t* tracks,
+                                uint16_t count, netmd_txn_stats_t* stats)
+{
+    netmd_error  err    = NETMD_ERROR;
+    netmd_txn_t* txn    = NULL;
+    uint16_t*    sorted = NULL;
+    uint16_t     tc     = 0;
+    int          i;
+
+    if ((tracks == NULL) || (count == 0))
+    {
+        return NETMD_ERROR;
+    }
+
+    if (netmd_request_track_count(devh, &tc) != 0)
+    {
+        return NETMD_ERROR;
+    }
+
+    if ((sorted = malloc(count * sizeof(uint16_t))) == NULL)
+    {
+        return NETMD_ERROR;
+    }
+
+    memcpy(sorted, tracks, count * sizeof(uint16_t));
+    qsort(sorted, count, sizeof(uint16_t), txn_track_desc);
+
+    if (sorted[0] >= tc)
+    {
+        netmd_log(NETMD_LOG_ERROR, "Invalid track number %d (disc has %d tracks)!\n", (int)sorted[0], (int)tc);
+        goto cleanup;
+    }
+
+    if ((txn = netmd_txn_create(devh, md)) == NULL)
+    {
+        goto cleanup;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        /* skip duplicates */
+        if ((i > 0) && (sorted[i] == sorted[i - 1]))
+        {
+            continue;
+        }
+
+        netmd_log(NETMD_LOG_VERBOSE, "Delete track %d\n", (int)sorted[i]);
+
+        if (netmd_txn_delete_track(txn, sorted[i]) != 0)
+        {
+            /* nothing was deleted -> take back group shifts */
+            txn_header_rebuild(txn, 0);
+            goto cleanup;
+        }
+    }
+
+    err = netmd_txn_commit(txn, stats);
+
+cleanup:
+    netmd_txn_free(&txn);
+    free(sorted);
+    return err;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      open a title write session: the title descriptor is opened
+//!             for write once and stays open until the session is closed;
+//!             the device is locked for the session's lifetime
+//!
+//! @param[in]  devh  device handle
+//!
+//! @return     session handle or NULL on error
+//------------------------------------------------------------------------------
+netmd_title_session_t* netmd_title_session_open(netmd_dev_handle* devh)
+{
+    netmd_title_session_t* ts;
+
+    if ((devh == NULL) || ((ts = calloc(1, sizeof(netmd_title_session_t))) == NULL))
+    {
+        return NULL;
+    }
+
+    if (netmd_dev_lock(devh) != NETMD_NO_ERROR)
+    {
+        free(ts);
+        return NULL;
+    }
+
+    ts->devh      = devh;
+    ts->cmd_start = netmd_cmd_count(devh);
+
+    netmd_cache_toc(devh);
+
+    return ts;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      write a track title; the old title is only read if its
+//!             size isn't known yet
+//!
+//! @param[in]  ts     session handle
+//! @param[in]  track  zero based track number
+//! @param[in]  title  new track title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_title_session_write(netmd_title_session_t* ts, uint16_t track, const char* title)
+{
+    if ((ts == NULL) || (title == NULL))
+    {
+        return -1;
+    }
+
+    if (txn_write_title(ts->devh, track, title) != 0)
+    {
+        ts->errors++;
+        return -1;
+    }
+
+    ts->titles++;
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      close title write session, unlock the device and free it
+//!
+//! @param[in/out] ts    pointer to session handle
+//! @param[out]    cmds  optional buffer for the number of commands
+//!                      (round trips) the session needed (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_title_session_close(netmd_title_session_t** ts, unsigned long* cmds)
+{
+    netmd_error   err;
+    unsigned long sent;
+
+    if ((ts == NULL) || (*ts == NULL))
+    {
+        return NETMD_ERROR;
+    }
+
+    netmd_sync_toc((*ts)->devh);
+
+    sent = netmd_cmd_count((*ts)->devh) - (*ts)->cmd_start;
+    err  = (*ts)->errors ? NETMD_COMMAND_FAILED_UNKNOWN_ERROR : NETMD_NO_ERROR;
+
+    netmd_log(NETMD_LOG_VERBOSE, "Title session: %u title(s) written, %lu command(s) sent, %u failed.\n",
+              (*ts)->titles, sent, (unsigned)(*ts)->errors);
+
+    if (cmds != NULL)
+    {
+        *cmds = sent;
+    }
+
+    netmd_dev_unlock((*ts)->devh);
+
+    free(*ts);
+    *ts = NULL;
+
+    return err;
+}
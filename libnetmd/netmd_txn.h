@@ -0,0 +1,267 @@
+/* netmd_txn.h
+ *
+ * Batched metadata transactions and title sessions.
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef NETMD_TXN_H
+#define NETMD_TXN_H
+#include <stdint.h>
+#include "common.h"
+#include "error.h"
+#include "CMDiscHeader.h"
+
+/* copy start */
+
+//! opaque edit transaction handle
+typedef struct netmd_txn netmd_txn_t;
+
+//! statistics of a committed transaction
+typedef struct {
+    unsigned int  edits;        //!< number of queued edits
+    unsigned long cmds_sent;    //!< commands really sent to the device
+    unsigned long cmds_single;  //!< commands the edits would need one by one
+    unsigned long cmds_saved;   //!< cmds_single - cmds_sent
+} netmd_txn_stats_t;
+
+//! opaque title write session handle
+typedef struct netmd_title_session netmd_title_session_t;
+
+//! one track move as used by netmd_move_track()
+typedef struct {
+    uint16_t start;     //!< zero based track to move
+    uint16_t finish;    //!< zero based destination
+} netmd_track_move_t;
+
+//------------------------------------------------------------------------------
+//! @brief      create an edit transaction. Header edits are applied to md
+//!             right away, device edits are queued until commit. The
+//!             disc header is written once on commit. If a device edit
+//!             fails, md is rebuilt from the edits done before it. Note:
+//!             md is modified even if the transaction is never committed.
+//!
+//! @param[in]  devh  device handle
+//! @param[in]  md    disc header (as read by netmd_initialize_disc_info),
+//!                   may be NULL if only device edits are used
+//!
+//! @return     transaction handle or NULL on error
+//------------------------------------------------------------------------------
+netmd_txn_t* netmd_txn_create(netmd_dev_handle* devh, HndMdHdr md);
+
+//------------------------------------------------------------------------------
+//! @brief      free an edit transaction (queued edits are dropped)
+//!
+//! @param[in/out] txn   pointer to transaction handle
+//------------------------------------------------------------------------------
+void netmd_txn_free(netmd_txn_t** txn);
+
+//------------------------------------------------------------------------------
+//! @brief      queue a track title change
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  zero based track number
+//! @param[in]  title  new track title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_set_title(netmd_txn_t* txn, uint16_t track, const char* title);
+
+//------------------------------------------------------------------------------
+//! @brief      queue a track move
+//!
+//! @param[in]  txn     transaction handle
+//! @param[in]  start   zero based track to move
+//! @param[in]  finish  zero based destination
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_move_track(netmd_txn_t* txn, uint16_t start, uint16_t finish);
+
+//------------------------------------------------------------------------------
+//! @brief      queue a track deletion (groups are updated in header)
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  zero based track number
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_delete_track(netmd_txn_t* txn, uint16_t track);
+
+//------------------------------------------------------------------------------
+//! @brief      set disc title
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  title  new disc title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_set_disc_title(netmd_txn_t* txn, const char* title);
+
+//------------------------------------------------------------------------------
+//! @brief      create a group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  name   group name
+//! @param[in]  first  first track (header numbering, -1 -> empty group)
+//! @param[in]  last   last track (header numbering, -1 -> one track)
+//!
+//! @return     > -1 -> group id; else -> error
+//------------------------------------------------------------------------------
+int netmd_txn_create_group(netmd_txn_t* txn, const char* name, int16_t first, int16_t last);
+
+//------------------------------------------------------------------------------
+//! @brief      rename a group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  gid    group id
+//! @param[in]  title  new group title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_set_group_title(netmd_txn_t* txn, int gid, const char* title);
+
+//------------------------------------------------------------------------------
+//! @brief      delete a group (tracks become ungrouped)
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  gid    group id
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_delete_group(netmd_txn_t* txn, int gid);
+
+//------------------------------------------------------------------------------
+//! @brief      put track into group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  track number (header numbering)
+//! @param[in]  gid    group id
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_put_track_in_group(netmd_txn_t* txn, int16_t track, int gid);
+
+//------------------------------------------------------------------------------
+//! @brief      remove track from group
+//!
+//! @param[in]  txn    transaction handle
+//! @param[in]  track  track number (header numbering)
+//! @param[in]  gid    group id
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_txn_pull_track_from_group(netmd_txn_t* txn, int16_t track, int gid);
+
+//------------------------------------------------------------------------------
+//! @brief      commit transaction: run queued device edits in one TOC
+//!             cache / sync window and write the disc header once. If a
+//!             device edit fails, the remaining edits are dropped and md
+//!             only keeps the header edits queued before the failed one.
+//!
+//! @param[in]  txn    transaction handle
+//! @param[out] stats  optional buffer for statistics (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_txn_commit(netmd_txn_t* txn, netmd_txn_stats_t* stats);
+
+//------------------------------------------------------------------------------
+//! @brief      plan the minimal move sequence for a new track order; tracks
+//!             building the longest increasing subsequence of order stay
+//!             where they are, all others are moved once
+//!
+//! @param[in]  order  new order: order[i] is the (zero based) current track
+//!                    which should become track i
+//! @param[in]  count  number of tracks (entries in order)
+//! @param[out] moves  buffer for at least count moves
+//!
+//! @return     number of moves; -1 -> error (order is no permutation)
+//------------------------------------------------------------------------------
+int netmd_plan_track_order(const uint16_t* order, uint16_t count, netmd_track_move_t* moves);
+
+//------------------------------------------------------------------------------
+//! @brief      reorder all tracks on disc with a minimal number of moves
+//!             and fix up group ranges with one header write; if a move
+//!             fails, group ranges follow the moves done before
+//!
+//! @param[in]  devh   device handle
+//! @param[in]  md     disc header
+//! @param[in]  order  new order: order[i] is the (zero based) current track
+//!                    which should become track i
+//! @param[in]  count  number of tracks, must match track count on disc
+//! @param[out] stats  optional buffer for statistics (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_set_track_order(netmd_dev_handle* devh, HndMdHdr md, const uint16_t* order,
+                                  uint16_t count, netmd_txn_stats_t* stats);
+
+//------------------------------------------------------------------------------
+//! @brief      delete a set of tracks in one TOC cache / sync window;
+//!             tracks are deleted in descending order, so numbers given
+//!             stay valid. Group ranges are updated and the header is
+//!             written once; if a delete fails, only the ranges of the
+//!             tracks deleted before are updated.
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  md      disc header
+//! @param[in]  tracks  zero based track numbers (any order, duplicates ok)
+//! @param[in]  count   number of entries in tracks
+//! @param[out] stats   optional buffer for statistics (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_delete_tracks(netmd_dev_handle* devh, HndMdHdr md, const uint16_t* tracks,
+                                uint16_t count, netmd_txn_stats_t* stats);
+
+//------------------------------------------------------------------------------
+//! @brief      open a title write session: the title descriptor is opened
+//!             for write once and stays open until the session is closed;
+//!             the device is locked for the session's lifetime
+//!
+//! @param[in]  devh  device handle
+//!
+//! @return     session handle or NULL on error
+//------------------------------------------------------------------------------
+netmd_title_session_t* netmd_title_session_open(netmd_dev_handle* devh);
+
+//------------------------------------------------------------------------------
+//! @brief      write a track title; the old title is only read if its
+//!             size isn't known yet (see netmd_dev_title_size_set())
+//!
+//! @param[in]  ts     session handle
+//! @param[in]  track  zero based track number
+//! @param[in]  title  new track title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_title_session_write(netmd_title_session_t* ts, uint16_t track, const char* title);
+
+//------------------------------------------------------------------------------
+//! @brief      close title write session, unlock the device and free it
+//!
+//! @param[in/out] ts    pointer to session handle
+//! @param[out]    cmds  optional buffer for the number of commands
+//!                      (round trips) the session needed (may be NULL)
+//!
+//! @return     NETMD_NO_ERROR on success
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_title_session_close(netmd_title_session_t** ts, unsigned long* cmds);
+
+/* copy end */
+
+#endif // NETMD_TXN_H
@@ -0,0 +1,498 @@
+/**
+ * Copyright (C) 2021 Jo2003 (olenka.joerg@gmail.com)
+ * This file is part of netmd
+ *
+ * cd2netmd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cd2netmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+#include <cstring>
+#include <thread>
+#ifdef _WIN32
+    #include <winsock2.h>
+#else
+    #include <sys/time.h>
+#endif
+#include "netmdco.h"
+
+namespace
+{
+    //! same values as the blocking transport (see common.c)
+    constexpr unsigned POLL_TIMEOUT = 1000;
+    constexpr unsigned SEND_TIMEOUT = 1000;
+    constexpr unsigned RECV_TIMEOUT = 1000;
+    constexpr int      RECV_TRIES   = 30;
+
+    //! vendor requests to the NetMD interface
+    constexpr uint8_t REQ_VENDOR = static_cast<uint8_t>(LIBUSB_REQUEST_TYPE_VENDOR)
+                                 | static_cast<uint8_t>(LIBUSB_RECIPIENT_INTERFACE);
+    constexpr uint8_t REQ_IN     = static_cast<uint8_t>(LIBUSB_ENDPOINT_IN) | REQ_VENDOR;
+    constexpr uint8_t REQ_OUT    = static_cast<uint8_t>(LIBUSB_ENDPOINT_OUT) | REQ_VENDOR;
+
+    //! bulk endpoints
+    constexpr uint8_t EP_BULK_OUT = 0x02;
+    constexpr uint8_t EP_BULK_IN  = 0x81;
+}
+
+namespace netmd
+{
+
+//------------------------------------------------------------------------------
+// Reactor
+//------------------------------------------------------------------------------
+Reactor::Reactor(libusb_context* ctx)
+    : mpCtx(ctx)
+{
+}
+
+//------------------------------------------------------------------------------
+//! @brief      start a task and keep it until it's done
+//!
+//! @param[in]  task  task to run
+//------------------------------------------------------------------------------
+void Reactor::spawn(Task<void> task)
+{
+    mPending++;
+    runDetached(this, std::move(task));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      await a spawned task, its frame is freed when done
+//!
+//! @param[in]  r     reactor
+//! @param[in]  task  task
+//------------------------------------------------------------------------------
+Reactor::Detached_t Reactor::runDetached(Reactor* r, Task<void> task)
+{
+    co_await task;
+    r->mPending--;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      resume a coroutine at a given time
+//!
+//! @param[in]  when  time point
+//! @param[in]  h     coroutine
+//------------------------------------------------------------------------------
+void Reactor::at(Clock::time_point when, std::coroutine_handle<> h)
+{
+    mTimers.push(Timer_t{when, mSeq++, h});
+}
+
+//------------------------------------------------------------------------------
+//! @brief      run until all spawned tasks are done
+//!
+//! @return     0 -> ok; -1 -> stalled
+//------------------------------------------------------------------------------
+int Reactor::run()
+{
+    while (mPending > 0)
+    {
+        Clock::time_point now = Clock::now();
+
+        while (!mTimers.empty() && (mTimers.top().mWhen <= now))
+        {
+            mReady.push_back(mTimers.top().mH);
+            mTimers.pop();
+        }
+
+        // coroutines posted while resuming run in the next round
+        for (size_t n = mReady.size(); n > 0; n--)
+        {
+            std::coroutine_handle<> h = mReady.front();
+            mReady.pop_front();
+            h.resume();
+        }
+
+        if ((mPending == 0) || !mReady.empty())
+        {
+            continue;
+        }
+
+        if (mTimers.empty() && ((mInFlight == 0) || (mpCtx == nullptr)))
+        {
+            // nothing will ever wake up the remaining tasks
+            netmd_log(NETMD_LOG_ERROR, "Reactor stalled with %zu task(s) left!\n", mPending);
+            return -1;
+        }
+
+        wait(mTimers.empty() ? (now + std::chrono::seconds(1)) : mTimers.top().mWhen);
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      wait for transfer completions or the next timer
+//!
+//! @param[in]  until  next timer
+//------------------------------------------------------------------------------
+void Reactor::wait(Clock::time_point until)
+{
+    if ((mpCtx != nullptr) && (mInFlight > 0))
+    {
+        long long us = std::chrono::duration_cast<std::chrono::microseconds>(until - Clock::now()).count();
+        struct timeval tv;
+
+        us         = (us < 0) ? 0 : us;
+        tv.tv_sec  = static_cast<long>(us / 1000000);
+        tv.tv_usec = static_cast<long>(us % 1000000);
+        libusb_handle_events_timeout_completed(mpCtx, &tv, nullptr);
+    }
+    else
+    {
+        std::this_thread::sleep_until(until);
+    }
+}
+
+//------------------------------------------------------------------------------
+// UsbTransport
+//------------------------------------------------------------------------------
+UsbTransport::UsbTransport(Reactor& reactor, netmd_dev_handle* devh)
+    : mReactor(reactor), mpDevh(devh), mpProfile(netmd_dev_profile_get(devh)),
+      mpCtrl(libusb_alloc_transfer(0)), mpBulk(libusb_alloc_transfer(0)),
+      mCtrlBuf(LIBUSB_CONTROL_SETUP_SIZE + NETMD_MAX_RSP_SIZE)
+{
+}
+
+UsbTransport::~UsbTransport()
+{
+    libusb_free_transfer(mpCtrl);
+    libusb_free_transfer(mpBulk);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      map libusb transfer status to result
+//!
+//! @param[in]  t     transfer
+//!
+//! @return     < 0 -> NETMDERR_*; else -> transferred bytes
+//------------------------------------------------------------------------------
+int UsbTransport::result(const libusb_transfer* t)
+{
+    switch (t->status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED: return t->actual_length;
+    case LIBUSB_TRANSFER_TIMED_OUT: return NETMDERR_TIMEOUT;
+    default:                        return NETMDERR_USB;
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      submit a control transfer; data goes through the transport's
+//!             buffer since it has to follow the setup packet
+//!
+//! @return     0 -> submitted; < 0 -> error
+//------------------------------------------------------------------------------
+int UsbTransport::control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+                          MutableByteView data, unsigned timeout, Transfer_t& xfer)
+{
+    if ((mpCtrl == nullptr) || (mpCtrlX != nullptr) || (data.size() > NETMD_MAX_RSP_SIZE))
+    {
+        return NETMDERR_USB;
+    }
+
+    libusb_fill_control_setup(mCtrlBuf.data(), requestType, request, value, index,
+                              static_cast<uint16_t>(data.size()));
+
+    if (!(requestType & LIBUSB_ENDPOINT_IN) && !data.empty())
+    {
+        memcpy(mCtrlBuf.data() + LIBUSB_CONTROL_SETUP_SIZE, data.data(), data.size());
+    }
+
+    libusb_fill_control_transfer(mpCtrl, reinterpret_cast<libusb_device_handle*>(mpDevh), mCtrlBuf.data(),
+                                 onControl, this, timeout);
+
+    mCtrlData = data;
+    mpCtrlX   = &xfer;
+
+    if (libusb_submit_transfer(mpCtrl) != 0)
+    {
+        mpCtrlX = nullptr;
+        return NETMDERR_USB;
+    }
+
+    mReactor.started();
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      submit a bulk transfer, straight from / into the caller's data
+//!
+//! @return     0 -> submitted; < 0 -> error
+//------------------------------------------------------------------------------
+int UsbTransport::bulk(uint8_t endpoint, MutableByteView data, unsigned timeout, Transfer_t& xfer)
+{
+    if ((mpBulk == nullptr) || (mpBulkX != nullptr))
+    {
+        return NETMDERR_USB;
+    }
+
+    libusb_fill_bulk_transfer(mpBulk, reinterpret_cast<libusb_device_handle*>(mpDevh), endpoint,
+                              data.data(), static_cast<int>(data.size()), onBulk, this, timeout);
+
+    mpBulkX = &xfer;
+
+    if (libusb_submit_transfer(mpBulk) != 0)
+    {
+        mpBulkX = nullptr;
+        return NETMDERR_USB;
+    }
+
+    mReactor.started();
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      control transfer completion (called from libusb event handling)
+//!
+//! @param[in]  t     transfer
+//------------------------------------------------------------------------------
+void LIBUSB_CALL UsbTransport::onControl(libusb_transfer* t)
+{
+    UsbTransport* self = static_cast<UsbTransport*>(t->user_data);
+    Transfer_t*   x    = self->mpCtrlX;
+
+    self->mpCtrlX = nullptr;
+    x->mResult    = result(t);
+
+    if ((x->mResult > 0) && (self->mCtrlBuf[0] & LIBUSB_ENDPOINT_IN))
+    {
+        x->mResult = (static_cast<size_t>(x->mResult) > self->mCtrlData.size())
+            ? static_cast<int>(self->mCtrlData.size()) : x->mResult;
+        memcpy(self->mCtrlData.data(), libusb_control_transfer_get_data(t), static_cast<size_t>(x->mResult));
+    }
+
+    self->mReactor.done(x->mWaiter);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      bulk transfer completion (called from libusb event handling)
+//!
+//! @param[in]  t     transfer
+//------------------------------------------------------------------------------
+void LIBUSB_CALL UsbTransport::onBulk(libusb_transfer* t)
+{
+    UsbTransport* self = static_cast<UsbTransport*>(t->user_data);
+    Transfer_t*   x    = self->mpBulkX;
+
+    self->mpBulkX = nullptr;
+    x->mResult    = result(t);
+    self->mReactor.done(x->mWaiter);
+}
+
+//------------------------------------------------------------------------------
+// AsyncDevice
+//------------------------------------------------------------------------------
+AsyncDevice::AsyncDevice(Reactor& reactor, Transport& transport)
+    : mReactor(reactor), mTransport(transport)
+{
+}
+
+//------------------------------------------------------------------------------
+//! @brief      submit the transfer; don't suspend if it can't be submitted
+//!
+//! @param[in]  h     awaiting coroutine
+//!
+//! @return     true -> suspended; false -> failed, result is set
+//------------------------------------------------------------------------------
+bool AsyncDevice::XferAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    int ret;
+
+    mX.mWaiter = h;
+    ret = mBulk ? mT.bulk(mType, mData, mTimeout, mX)
+                : mT.control(mType, mRequest, 0, 0, mData, mTimeout, mX);
+
+    if (ret < 0)
+    {
+        mX.mResult = ret;
+        return false;
+    }
+    return true;
+}
+
+AsyncDevice::XferAwaiter AsyncDevice::controlIn(uint8_t request, MutableByteView data, unsigned timeout)
+{
+    return XferAwaiter{mTransport, false, REQ_IN, request, data, timeout, {}};
+}
+
+AsyncDevice::XferAwaiter AsyncDevice::controlOut(uint8_t request, ByteView data, unsigned timeout)
+{
+    return XferAwaiter{mTransport, false, REQ_OUT, request,
+                       MutableByteView(const_cast<uint8_t*>(data.data()), data.size()), timeout, {}};
+}
+
+//------------------------------------------------------------------------------
+//! @brief      poll until the device has data (see netmd_poll()); the
+//!             back-off sleeps are reactor timers
+//!
+//! @param[out] buf         poll buffer (4 bytes)
+//! @param[in]  tries       max. polls
+//! @param[out] fullLength  announced data size (may be nullptr)
+//!
+//! @return     < 0 -> error; else -> announced data size (0 -> nothing)
+//------------------------------------------------------------------------------
+Task<int> AsyncDevice::poll(uint8_t* buf, int tries, uint16_t* fullLength)
+{
+    const netmd_dev_profile* prof = mTransport.profile();
+    unsigned sleepytime = prof->poll_first_ms;
+    uint16_t len;
+
+    for (int i = 0; i < tries; i++)
+    {
+        memset(buf, 0, 4);
+
+        if (co_await controlIn(0x01, MutableByteView(buf, 4), POLL_TIMEOUT) < 0)
+        {
+            co_return NETMDERR_USB;
+        }
+
+        if (buf[0] != 0)
+        {
+            break;
+        }
+
+        if (i > 0)
+        {
+            co_await mReactor.sleep(sleepytime);
+            sleepytime = prof->poll_ms;
+        }
+        if (i > static_cast<int>(prof->poll_slow_after))
+        {
+            sleepytime = prof->poll_slow_ms;
+        }
+    }
+
+    len = static_cast<uint16_t>((buf[3] << 8) | buf[2]);
+
+    if (fullLength != nullptr)
+    {
+        *fullLength = len;
+    }
+
+    co_return (buf[0] != 0) ? len : 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      send a command
+//!
+//! @param[in]  cmd   command
+//!
+//! @return     < 0 -> error; else -> sent bytes
+//------------------------------------------------------------------------------
+Task<int> AsyncDevice::send(ByteView cmd)
+{
+    uint8_t pollbuf[4];
+    int     len;
+
+    // device must not have pending data
+    if ((len = co_await poll(pollbuf, 1, nullptr)) != 0)
+    {
+        co_return (len > 0) ? NETMDERR_NOTREADY : len;
+    }
+
+    if ((len = co_await controlOut(0x80, cmd, SEND_TIMEOUT)) < 0)
+    {
+        co_return NETMDERR_USB;
+    }
+
+    co_return len;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      receive a response
+//!
+//! @param[out] rsp   response buffer
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+Task<int> AsyncDevice::recv(MutableByteView rsp)
+{
+    uint8_t  pollbuf[4];
+    uint16_t fullLength = 0;
+    int      ret;
+
+    if ((ret = co_await poll(pollbuf, RECV_TRIES, &fullLength)) <= 0)
+    {
+        co_return (ret == 0) ? NETMDERR_TIMEOUT : ret;
+    }
+
+    if (fullLength > rsp.size())
+    {
+        netmd_log(NETMD_LOG_ERROR, "AsyncDevice: response (%u bytes) exceeds buffer (%zu bytes)\n",
+                  fullLength, rsp.size());
+        co_return NETMDERR_USB;
+    }
+
+    if (co_await controlIn(pollbuf[1], rsp.subspan(0, fullLength), RECV_TIMEOUT) < 0)
+    {
+        co_return NETMDERR_USB;
+    }
+
+    co_return fullLength;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      exchange command / response; interim responses are re-read
+//!
+//! @param[in]  cmd   command
+//! @param[out] rsp   response buffer
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+Task<int> AsyncDevice::exchange(ByteView cmd, MutableByteView rsp)
+{
+    int len;
+
+    if ((len = co_await send(cmd)) < 0)
+    {
+        co_return len;
+    }
+
+    len = co_await recv(rsp);
+
+    if ((len > 0) && (rsp[0] == NETMD_STATUS_INTERIM))
+    {
+        len = co_await recv(rsp);
+    }
+
+    co_return len;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      bulk send to the device
+//!
+//! @param[in]  data  data to send
+//!
+//! @return     < 0 -> error; else -> sent bytes
+//------------------------------------------------------------------------------
+Task<int> AsyncDevice::bulkSend(ByteView data)
+{
+    co_return co_await XferAwaiter{mTransport, true, EP_BULK_OUT, 0,
+                                   MutableByteView(const_cast<uint8_t*>(data.data()), data.size()),
+                                   mTransport.profile()->bulk_timeout_ms, {}};
+}
+
+//------------------------------------------------------------------------------
+//! @brief      bulk receive from the device
+//!
+//! @param[out] data  receive buffer
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+Task<int> AsyncDevice::bulkRecv(MutableByteView data)
+{
+    co_return co_await XferAwaiter{mTransport, true, EP_BULK_IN, 0, data,
+                                   mTransport.profile()->bulk_timeout_ms, {}};
+}
+
+} // namespace netmd
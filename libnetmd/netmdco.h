@@ -0,0 +1,405 @@
+/**
+ * Copyright (C) 2021 Jo2003 (olenka.joerg@gmail.com)
+ * This file is part of netmd
+ *
+ * cd2netmd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cd2netmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+#ifndef NETMD_CO_H
+    #define NETMD_CO_H
+#ifdef __cplusplus
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <queue>
+#include <utility>
+#include <vector>
+#include "netmdpp.h"
+
+//------------------------------------------------------------------------------
+//! C++20 coroutine layer: device I/O as awaitables on top of asynchronous
+//! transfers, driven by a single threaded reactor. Poll back-off sleeps are
+//! reactor timers, so one thread can drive many devices at once.
+//!
+//! Everything here runs on the thread calling Reactor::run(); only one
+//! operation may be in flight per AsyncDevice. Don't use the blocking C API
+//! on a handle while an AsyncDevice drives it.
+//------------------------------------------------------------------------------
+namespace netmd
+{
+
+class Reactor;
+
+namespace detail
+{
+    //--------------------------------------------------------------------------
+    //! @brief      promise part shared by all Task types
+    //--------------------------------------------------------------------------
+    struct PromiseBase
+    {
+        //! resumes the awaiting coroutine when the task is done
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+
+            template <typename P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+            {
+                std::coroutine_handle<> c = h.promise().mContinuation;
+                return c ? c : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { mException = std::current_exception(); }
+
+        void rethrow()
+        {
+            if (mException)
+            {
+                std::rethrow_exception(mException);
+            }
+        }
+
+        std::coroutine_handle<> mContinuation;
+        std::exception_ptr      mException;
+    };
+
+    template <typename T>
+    struct Promise : PromiseBase
+    {
+        void return_value(T value) { mValue = std::move(value); }
+        T result() { rethrow(); return std::move(mValue); }
+
+        T mValue{};
+    };
+
+    template <>
+    struct Promise<void> : PromiseBase
+    {
+        void return_void() {}
+        void result() { rethrow(); }
+    };
+}
+
+//------------------------------------------------------------------------------
+//! @brief      lazily started coroutine; runs when awaited (or spawned on a
+//!             reactor) and resumes the awaiting coroutine when done
+//------------------------------------------------------------------------------
+template <typename T = void>
+class [[nodiscard]] Task
+{
+public:
+    struct promise_type : detail::Promise<T>
+    {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    Task() = default;
+    explicit Task(Handle h) : mH(h) {}
+    ~Task() { if (mH) mH.destroy(); }
+    Task(Task&& other) noexcept : mH(std::exchange(other.mH, nullptr)) {}
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (mH) mH.destroy();
+            mH = std::exchange(other.mH, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    bool await_ready() const noexcept { return !mH || mH.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        mH.promise().mContinuation = awaiting;
+        return mH;
+    }
+
+    T await_resume() { return mH.promise().result(); }
+
+private:
+    Handle mH;
+};
+
+//------------------------------------------------------------------------------
+//! @brief      single threaded event loop: ready queue, timers and (if a
+//!             libusb context is given) libusb event handling
+//------------------------------------------------------------------------------
+class Reactor
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    //--------------------------------------------------------------------------
+    //! @brief      Constructs a new instance.
+    //!
+    //! @param[in]  ctx   libusb context to handle events for (nullptr -> no
+    //!                   USB transfers, e.g. simulated devices)
+    //--------------------------------------------------------------------------
+    explicit Reactor(libusb_context* ctx = nullptr);
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    //--------------------------------------------------------------------------
+    //! @brief      start a task; it runs until its first suspension right away
+    //!             and is owned by the reactor until it's done
+    //!
+    //! @param[in]  task  task to run
+    //--------------------------------------------------------------------------
+    void spawn(Task<void> task);
+
+    //--------------------------------------------------------------------------
+    //! @brief      run until all spawned tasks are done
+    //!
+    //! @return     0 -> ok; -1 -> stalled (tasks left without anything to
+    //!             wait for)
+    //--------------------------------------------------------------------------
+    int run();
+
+    //--------------------------------------------------------------------------
+    //! @brief      resume a coroutine from the loop
+    //!
+    //! @param[in]  h     coroutine
+    //--------------------------------------------------------------------------
+    void post(std::coroutine_handle<> h) { mReady.push_back(h); }
+
+    //--------------------------------------------------------------------------
+    //! @brief      resume a coroutine at a given time
+    //!
+    //! @param[in]  when  time point
+    //! @param[in]  h     coroutine
+    //--------------------------------------------------------------------------
+    void at(Clock::time_point when, std::coroutine_handle<> h);
+
+    //--------------------------------------------------------------------------
+    //! @brief      transfer book keeping; a transport calls started() on
+    //!             submit and done() from its completion
+    //--------------------------------------------------------------------------
+    void started() { mInFlight++; }
+    void done(std::coroutine_handle<> h) { mInFlight--; post(h); }
+
+    //--------------------------------------------------------------------------
+    //! @brief      awaitable sleep
+    //!
+    //! @param[in]  ms    sleep time in ms
+    //--------------------------------------------------------------------------
+    auto sleep(unsigned ms)
+    {
+        struct Awaiter
+        {
+            Reactor&          mR;
+            Clock::time_point mWhen;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { mR.at(mWhen, h); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{*this, Clock::now() + std::chrono::milliseconds(ms)};
+    }
+
+    libusb_context* context() const { return mpCtx; }
+
+private:
+    //! one timer
+    struct Timer_t
+    {
+        Clock::time_point       mWhen;
+        uint64_t                mSeq;   //!< keeps FIFO order for equal times
+        std::coroutine_handle<> mH;
+
+        bool operator>(const Timer_t& o) const
+        {
+            return (mWhen > o.mWhen) || ((mWhen == o.mWhen) && (mSeq > o.mSeq));
+        }
+    };
+
+    //! fire and forget wrapper around spawned tasks
+    struct Detached_t
+    {
+        struct promise_type
+        {
+            Detached_t get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    static Detached_t runDetached(Reactor* r, Task<void> task);
+
+    void wait(Clock::time_point until);
+
+    libusb_context*                     mpCtx;
+    std::deque<std::coroutine_handle<>> mReady;
+    std::priority_queue<Timer_t, std::vector<Timer_t>, std::greater<Timer_t>> mTimers;
+    uint64_t                            mSeq      = 0;
+    size_t                              mPending  = 0;
+    size_t                              mInFlight = 0;
+};
+
+//------------------------------------------------------------------------------
+//! @brief      state of one asynchronous transfer
+//------------------------------------------------------------------------------
+struct Transfer_t
+{
+    int                     mResult = 0;    //!< < 0 -> NETMDERR_*; else bytes
+    std::coroutine_handle<> mWaiter;        //!< coroutine to resume
+};
+
+//------------------------------------------------------------------------------
+//! @brief      asynchronous transfers of one device; completions are passed
+//!             to Reactor::done() on the reactor thread
+//------------------------------------------------------------------------------
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+
+    //--------------------------------------------------------------------------
+    //! @brief      submit a control transfer (direction from requestType)
+    //!
+    //! @return     0 -> submitted; < 0 -> NETMDERR_* (nothing submitted)
+    //--------------------------------------------------------------------------
+    virtual int control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+                        MutableByteView data, unsigned timeout, Transfer_t& xfer) = 0;
+
+    //--------------------------------------------------------------------------
+    //! @brief      submit a bulk transfer (direction from endpoint)
+    //!
+    //! @return     0 -> submitted; < 0 -> NETMDERR_* (nothing submitted)
+    //--------------------------------------------------------------------------
+    virtual int bulk(uint8_t endpoint, MutableByteView data, unsigned timeout, Transfer_t& xfer) = 0;
+
+    //--------------------------------------------------------------------------
+    //! @brief      transport tuning of the device (poll back-off, timeouts)
+    //--------------------------------------------------------------------------
+    virtual const netmd_dev_profile* profile() const = 0;
+};
+
+//------------------------------------------------------------------------------
+//! @brief      transport using libusb asynchronous transfers; the reactor
+//!             must have been created with the libusb context
+//------------------------------------------------------------------------------
+class UsbTransport : public Transport
+{
+public:
+    UsbTransport(Reactor& reactor, netmd_dev_handle* devh);
+    ~UsbTransport() override;
+    UsbTransport(const UsbTransport&) = delete;
+    UsbTransport& operator=(const UsbTransport&) = delete;
+
+    int control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+                MutableByteView data, unsigned timeout, Transfer_t& xfer) override;
+    int bulk(uint8_t endpoint, MutableByteView data, unsigned timeout, Transfer_t& xfer) override;
+    const netmd_dev_profile* profile() const override { return mpProfile; }
+
+private:
+    static void LIBUSB_CALL onControl(libusb_transfer* t);
+    static void LIBUSB_CALL onBulk(libusb_transfer* t);
+    static int result(const libusb_transfer* t);
+
+    Reactor&                 mReactor;
+    netmd_dev_handle*        mpDevh;
+    const netmd_dev_profile* mpProfile;
+    libusb_transfer*         mpCtrl   = nullptr;
+    libusb_transfer*         mpBulk   = nullptr;
+    Transfer_t*              mpCtrlX  = nullptr;
+    Transfer_t*              mpBulkX  = nullptr;
+    MutableByteView          mCtrlData;
+    std::vector<uint8_t>     mCtrlBuf;      //!< setup packet + data
+};
+
+//------------------------------------------------------------------------------
+//! @brief      NetMD protocol (poll, command / response, bulk data) as
+//!             coroutines on a transport
+//------------------------------------------------------------------------------
+class AsyncDevice
+{
+public:
+    AsyncDevice(Reactor& reactor, Transport& transport);
+
+    //--------------------------------------------------------------------------
+    //! @brief      exchange command / response (see netmd_exch_message_buf())
+    //!
+    //! @param[in]  cmd   command
+    //! @param[out] rsp   response buffer (NETMD_MAX_RSP_SIZE fits all)
+    //!
+    //! @return     < 0 -> error; else -> received bytes
+    //--------------------------------------------------------------------------
+    Task<int> exchange(ByteView cmd, MutableByteView rsp);
+
+    //--------------------------------------------------------------------------
+    //! @brief      send a command (see netmd_send_message())
+    //--------------------------------------------------------------------------
+    Task<int> send(ByteView cmd);
+
+    //--------------------------------------------------------------------------
+    //! @brief      receive a response (see netmd_recv_message_buf())
+    //--------------------------------------------------------------------------
+    Task<int> recv(MutableByteView rsp);
+
+    //--------------------------------------------------------------------------
+    //! @brief      bulk send to the device (track upload data)
+    //!
+    //! @return     < 0 -> error; else -> sent bytes
+    //--------------------------------------------------------------------------
+    Task<int> bulkSend(ByteView data);
+
+    //--------------------------------------------------------------------------
+    //! @brief      bulk receive from the device (track download data)
+    //!
+    //! @return     < 0 -> error; else -> received bytes
+    //--------------------------------------------------------------------------
+    Task<int> bulkRecv(MutableByteView data);
+
+private:
+    //! awaitable control / bulk transfer
+    struct XferAwaiter
+    {
+        Transport&      mT;
+        bool            mBulk;
+        uint8_t         mType;      //!< request type / endpoint
+        uint8_t         mRequest;
+        MutableByteView mData;
+        unsigned        mTimeout;
+        Transfer_t      mX;
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h);
+        int await_resume() const noexcept { return mX.mResult; }
+    };
+
+    XferAwaiter controlIn(uint8_t request, MutableByteView data, unsigned timeout);
+    XferAwaiter controlOut(uint8_t request, ByteView data, unsigned timeout);
+    Task<int> poll(uint8_t* buf, int tries, uint16_t* fullLength);
+
+    Reactor&   mReactor;
+    Transport& mTransport;
+};
+
+} // namespace netmd
+
+#endif // __cplusplus
+#endif // NETMD_CO_H
@@ -0,0 +1,756 @@
+/**
+ * Copyright (C) 2021 Jo2003 (olenka.joerg@gmail.com)
+ * This file is part of netmd
+ *
+ * cd2netmd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cd2netmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <gcrypt.h>
+#include "netmdpp.h"
+
+namespace
+{
+    //! command buffer size (same as netmd_format_query())
+    constexpr size_t CMD_BUFF_SZ = 2048;
+
+    //! EKB used for uploads (see send_track())
+    constexpr uint32_t EKB_ID    = 0x26422642;
+    constexpr uint32_t EKB_DEPTH = 9;
+
+    const unsigned char EKB_CHAIN[] = {
+        0x25, 0x45, 0x06, 0x4d, 0xea, 0xca, 0x14, 0xf9,
+        0x96, 0xbd, 0xc8, 0xa4, 0x06, 0xc2, 0x2b, 0x81,
+        0x49, 0xba, 0xf0, 0xdf, 0x26, 0x9d, 0xb7, 0x1d,
+        0x49, 0xba, 0xf0, 0xdf, 0x26, 0x9d, 0xb7, 0x1d
+    };
+
+    const unsigned char EKB_SIGNATURE[] = {
+        0xe8, 0xef, 0x73, 0x45, 0x8d, 0x5b, 0x8b, 0xf8,
+        0xe8, 0xef, 0x73, 0x45, 0x8d, 0x5b, 0x8b, 0xf8,
+        0x38, 0x5b, 0x49, 0x36, 0x7b, 0x42, 0x0c, 0x58
+    };
+
+    const unsigned char ROOT_KEY[] = {
+        0x13, 0x37, 0x13, 0x37, 0x13, 0x37, 0x13, 0x37,
+        0x13, 0x37, 0x13, 0x37, 0x13, 0x37, 0x13, 0x37
+    };
+
+    unsigned char KEK[] = { 0x14, 0xe3, 0x83, 0x4e, 0xe2, 0xd3, 0xcc, 0xa5 };
+
+    unsigned char CONTENT_ID[] = {
+        0x01, 0x0F, 0x50, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x48,
+        0xA2, 0x8D, 0x3E, 0x1A, 0x3B, 0x0C, 0x44, 0xAF, 0x2f, 0xa0
+    };
+
+    //--------------------------------------------------------------------------
+    //! @brief      grow a scratch buffer if needed
+    //!
+    //! @param[in]  buf   buffer
+    //! @param[in]  size  needed size
+    //!
+    //! @return     true -> ok; false -> out of memory
+    //--------------------------------------------------------------------------
+    bool reserve(std::vector<uint8_t>& buf, size_t size)
+    {
+        if (buf.size() < size)
+        {
+            try
+            {
+                buf.resize(size);
+            }
+            catch (const std::bad_alloc&)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+namespace netmd
+{
+
+//------------------------------------------------------------------------------
+// Captures
+//------------------------------------------------------------------------------
+Captures::~Captures()
+{
+    clear();
+}
+
+Captures::Captures(Captures&& other) noexcept
+    : mpArgv(other.mpArgv), mArgc(other.mArgc)
+{
+    other.mpArgv = nullptr;
+    other.mArgc  = 0;
+}
+
+Captures& Captures::operator=(Captures&& other) noexcept
+{
+    if (this != &other)
+    {
+        clear();
+        std::swap(mpArgv, other.mpArgv);
+        std::swap(mArgc, other.mArgc);
+    }
+    return *this;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      scan a response, previous captures are dropped
+//!
+//! @param[in]  data    response
+//! @param[in]  format  format string (see netmd_scan_query())
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int Captures::scan(ByteView data, const char* format)
+{
+    clear();
+    return netmd_scan_query(data.data(), data.size(), format, &mpArgv, &mArgc);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      drop captures
+//------------------------------------------------------------------------------
+void Captures::clear()
+{
+    if (mpArgv != nullptr)
+    {
+        for (int i = 0; i < mArgc; i++)
+        {
+            if (mpArgv[i].tp == netmd_fmt_barray)
+            {
+                free(mpArgv[i].data.pu8);
+            }
+        }
+        free(mpArgv);
+        mpArgv = nullptr;
+    }
+    mArgc = 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      captured byte array (empty view if no byte array)
+//!
+//! @param[in]  idx   capture index
+//!
+//! @return     view
+//------------------------------------------------------------------------------
+ByteView Captures::bytes(size_t idx) const
+{
+    if ((idx >= size()) || (mpArgv[idx].tp != netmd_fmt_barray))
+    {
+        return ByteView();
+    }
+    return ByteView(mpArgv[idx].data.pu8, mpArgv[idx].size);
+}
+
+//------------------------------------------------------------------------------
+// Device
+//------------------------------------------------------------------------------
+Device::~Device()
+{
+    close();
+}
+
+Device::Device(Device&& other) noexcept
+    : mpList(other.mpList), mpHandle(other.mpHandle),
+      mCmd(std::move(other.mCmd)), mRsp(std::move(other.mRsp)), mScratch(std::move(other.mScratch))
+{
+    memcpy(mName, other.mName, sizeof(mName));
+    other.mpList   = nullptr;
+    other.mpHandle = nullptr;
+    other.mName[0] = '\0';
+}
+
+Device& Device::operator=(Device&& other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+        std::swap(mpList, other.mpList);
+        std::swap(mpHandle, other.mpHandle);
+        std::swap(mName, other.mName);
+        std::swap(mCmd, other.mCmd);
+        std::swap(mRsp, other.mRsp);
+        std::swap(mScratch, other.mScratch);
+    }
+    return *this;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      find and open a device; an opened device is closed first
+//!
+//! @param[in]  index  index in the list of found devices
+//! @param[in]  ctx    libusb context (nullptr -> default)
+//!
+//! @return     NETMD_NO_ERROR on success
+//------------------------------------------------------------------------------
+netmd_error Device::open(unsigned index, libusb_context* ctx)
+{
+    netmd_device* pDev;
+    netmd_error   err;
+
+    close();
+
+    if ((err = netmd_init(&mpList, ctx)) != NETMD_NO_ERROR)
+    {
+        return err;
+    }
+
+    for (pDev = mpList; (pDev != nullptr) && (index > 0); index--)
+    {
+        pDev = pDev->link;
+    }
+
+    if (pDev == nullptr)
+    {
+        close();
+        return NETMD_USB_OPEN_ERROR;
+    }
+
+    if ((err = netmd_open(pDev, &mpHandle)) != NETMD_NO_ERROR)
+    {
+        mpHandle = nullptr;
+        close();
+        return err;
+    }
+
+    if (netmd_get_devname(mpHandle, mName, sizeof(mName)) != NETMD_NO_ERROR)
+    {
+        mName[0] = '\0';
+    }
+
+    return NETMD_NO_ERROR;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      close the device (done by the destructor as well)
+//------------------------------------------------------------------------------
+void Device::close()
+{
+    if (mpHandle != nullptr)
+    {
+        netmd_close(mpHandle);
+        mpHandle = nullptr;
+    }
+
+    if (mpList != nullptr)
+    {
+        netmd_clean(&mpList);
+        mpList = nullptr;
+    }
+
+    mName[0] = '\0';
+}
+
+//------------------------------------------------------------------------------
+//! @brief      exchange command / response into the response buffer
+//!
+//! @param[in]  cmd   command
+//! @param[out] rsp   response view (valid until the next exchange)
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+int Device::exchange(ByteView cmd, ByteView& rsp)
+{
+    int ret;
+
+    rsp = ByteView();
+
+    if ((mpHandle == nullptr) || !reserve(mRsp, NETMD_MAX_RSP_SIZE))
+    {
+        return NETMDERR_USB;
+    }
+
+    if ((ret = netmd_exch_message_buf(mpHandle, const_cast<uint8_t*>(cmd.data()), cmd.size(),
+                                      mRsp.data(), mRsp.size())) > 0)
+    {
+        rsp = ByteView(mRsp.data(), static_cast<size_t>(ret));
+    }
+
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      format a query into the command buffer and exchange it
+//!
+//! @param[out] rsp     response view (valid until the next exchange)
+//! @param[in]  format  format string
+//! @param[in]  args    query arguments
+//!
+//! @return     < 0 -> error; else -> received bytes
+//------------------------------------------------------------------------------
+int Device::query(ByteView& rsp, const char* format, Span<const netmd_query_data_t> args)
+{
+    size_t sz;
+
+    rsp = ByteView();
+
+    if (!reserve(mCmd, CMD_BUFF_SZ))
+    {
+        return NETMDERR_USB;
+    }
+
+    if ((sz = netmd_format_query_buf(format, args.data(), static_cast<int>(args.size()),
+                                     mCmd.data(), mCmd.size())) == 0)
+    {
+        return NETMDERR_CMD_INVALID;
+    }
+
+    return exchange(ByteView(mCmd.data(), sz), rsp);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      general purpose scratch buffer; it only grows
+//!
+//! @param[in]  size  needed size
+//!
+//! @return     view of 'size' bytes (empty on allocation failure)
+//------------------------------------------------------------------------------
+MutableByteView Device::scratch(size_t size)
+{
+    if (!reserve(mScratch, size))
+    {
+        return MutableByteView();
+    }
+    return MutableByteView(mScratch.data(), size);
+}
+
+//------------------------------------------------------------------------------
+// Session
+//------------------------------------------------------------------------------
+Session::Session(Device& dev)
+    : mpDev(&dev)
+{
+}
+
+Session::~Session()
+{
+    close();
+}
+
+Session::Session(Session&& other) noexcept
+    : mpDev(other.mpDev), mOpen(other.mOpen), mLocked(other.mLocked), mAcquired(other.mAcquired)
+{
+    memcpy(mSessionKey, other.mSessionKey, sizeof(mSessionKey));
+    memset(other.mSessionKey, 0, sizeof(other.mSessionKey));
+    other.mOpen     = false;
+    other.mLocked   = false;
+    other.mAcquired = false;
+}
+
+Session& Session::operator=(Session&& other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+        mpDev     = other.mpDev;
+        mOpen     = other.mOpen;
+        mLocked   = other.mLocked;
+        mAcquired = other.mAcquired;
+        memcpy(mSessionKey, other.mSessionKey, sizeof(mSessionKey));
+        memset(other.mSessionKey, 0, sizeof(other.mSessionKey));
+        other.mOpen     = false;
+        other.mLocked   = false;
+        other.mAcquired = false;
+    }
+    return *this;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      enter the secure session and exchange the session key
+//!
+//! @return     NETMD_NO_ERROR on success
+//------------------------------------------------------------------------------
+netmd_error Session::open()
+{
+    netmd_dev_handle* devh = mpDev->handle();
+    netmd_keychain    chain[sizeof(EKB_CHAIN) / 16];
+    netmd_ekb         ekb;
+    netmd_crypto*     crypto;
+    unsigned char     hostnonce[8] = {0};
+    unsigned char     devnonce[8]  = {0};
+    netmd_error       err;
+
+    if (mOpen)
+    {
+        return NETMD_NO_ERROR;
+    }
+
+    if (devh == nullptr)
+    {
+        return NETMD_USB_OPEN_ERROR;
+    }
+
+    // nothing else talks to the device while the session is open
+    netmd_dev_lock(devh);
+    mLocked = true;
+
+    if (netmd_dev_profile_get(devh)->need_acquire)
+    {
+        netmd_acquire_dev(devh);
+        mAcquired = true;
+    }
+
+    // a stale session may be left over, so this can fail
+    netmd_secure_leave_session(devh);
+    netmd_secure_set_track_protection(devh, 0x01);
+
+    if ((err = netmd_secure_enter_session(devh)) != NETMD_NO_ERROR)
+    {
+        close();
+        return err;
+    }
+    mOpen = true;
+
+    // EKB key chain on the stack, no allocation needed
+    for (size_t i = 0; i < (sizeof(chain) / sizeof(chain[0])); i++)
+    {
+        chain[i].key  = reinterpret_cast<char*>(const_cast<unsigned char*>(&EKB_CHAIN[i * 16]));
+        chain[i].next = ((i + 1) < (sizeof(chain) / sizeof(chain[0]))) ? &chain[i + 1] : nullptr;
+    }
+
+    ekb.id        = EKB_ID;
+    ekb.depth     = EKB_DEPTH;
+    ekb.chain     = chain;
+    ekb.signature = reinterpret_cast<char*>(const_cast<unsigned char*>(EKB_SIGNATURE));
+
+    if ((err = netmd_secure_send_key_data(devh, &ekb)) != NETMD_NO_ERROR)
+    {
+        close();
+        return err;
+    }
+
+    gcry_create_nonce(hostnonce, sizeof(hostnonce));
+
+    if ((err = netmd_secure_session_key_exchange(devh, hostnonce, devnonce)) != NETMD_NO_ERROR)
+    {
+        close();
+        return err;
+    }
+
+    if (((crypto = netmd_crypto_get(devh)) == nullptr)
+        || (netmd_crypto_session_key(crypto, ROOT_KEY, hostnonce, devnonce, mSessionKey) != 0))
+    {
+        close();
+        return NETMD_DES_ERROR;
+    }
+
+    return NETMD_NO_ERROR;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      forget session key and leave the session
+//------------------------------------------------------------------------------
+void Session::close()
+{
+    netmd_dev_handle* devh = mpDev->handle();
+
+    if (mOpen)
+    {
+        netmd_secure_session_key_forget(devh);
+        netmd_secure_leave_session(devh);
+        memset(mSessionKey, 0, sizeof(mSessionKey));
+        mOpen = false;
+    }
+
+    if (mAcquired)
+    {
+        netmd_release_dev(devh);
+        mAcquired = false;
+    }
+
+    if (mLocked)
+    {
+        netmd_dev_unlock(devh);
+        mLocked = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+// TrackUpload
+//------------------------------------------------------------------------------
+TrackUpload::TrackUpload(Session& session)
+    : mpSession(&session)
+{
+}
+
+TrackUpload::~TrackUpload()
+{
+    release();
+}
+
+TrackUpload::TrackUpload(TrackUpload&& other) noexcept
+    : mpSession(other.mpSession), mpPackets(other.mpPackets), mPacketCount(other.mPacketCount),
+      mPacketLength(other.mPacketLength), mFrames(other.mFrames), mWireformat(other.mWireformat),
+      mSent(other.mSent), mTrack(other.mTrack)
+{
+    memcpy(mUuid, other.mUuid, sizeof(mUuid));
+    memcpy(mContentId, other.mContentId, sizeof(mContentId));
+    other.mpPackets    = nullptr;
+    other.mPacketCount = 0;
+    other.mSent        = false;
+}
+
+TrackUpload& TrackUpload::operator=(TrackUpload&& other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        mpSession     = other.mpSession;
+        mpPackets     = other.mpPackets;
+        mPacketCount  = other.mPacketCount;
+        mPacketLength = other.mPacketLength;
+        mFrames       = other.mFrames;
+        mWireformat   = other.mWireformat;
+        mSent         = other.mSent;
+        mTrack        = other.mTrack;
+        memcpy(mUuid, other.mUuid, sizeof(mUuid));
+        memcpy(mContentId, other.mContentId, sizeof(mContentId));
+        other.mpPackets    = nullptr;
+        other.mPacketCount = 0;
+        other.mSent        = false;
+    }
+    return *this;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      free the packet list
+//------------------------------------------------------------------------------
+void TrackUpload::release()
+{
+    if (mpPackets != nullptr)
+    {
+        netmd_cleanup_packets(&mpPackets);
+        mpPackets = nullptr;
+    }
+    mPacketCount = 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      set up the download and encrypt the audio data
+//!
+//! @param[in]  audio       raw audio data in wire format
+//! @param[in]  wireformat  wire format
+//! @param[in]  channels    NETMD_CHANNELS_MONO / NETMD_CHANNELS_STEREO
+//!
+//! @return     NETMD_NO_ERROR on success
+//------------------------------------------------------------------------------
+netmd_error TrackUpload::prepare(MutableByteView audio, netmd_wireformat wireformat, size_t channels)
+{
+    netmd_dev_handle* devh = mpSession->device().handle();
+    netmd_error       err;
+
+    release();
+    mSent = false;
+
+    if (!mpSession->isOpen())
+    {
+        return NETMD_ERROR;
+    }
+
+    if (!netmd_dev_profile_wireformat(netmd_dev_profile_get(devh), wireformat))
+    {
+        return NETMD_NOT_IMPLEMENTED;
+    }
+
+    if ((err = netmd_secure_setup_download(devh, CONTENT_ID, KEK, mpSession->sessionKey())) != NETMD_NO_ERROR)
+    {
+        return err;
+    }
+
+    mWireformat = wireformat;
+
+    if ((err = netmd_prepare_packets_ex(audio.data(), audio.size(), &mpPackets, &mPacketCount, &mFrames,
+                                        channels, &mPacketLength, KEK, wireformat,
+                                        netmd_dev_profile_get(devh)->max_chunk,
+                                        netmd_crypto_get(devh))) != NETMD_NO_ERROR)
+    {
+        release();
+    }
+
+    return err;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      send prepared packets; the packet list is freed afterwards
+//!
+//! @param[in]  discformat  disc format
+//! @param[in]  ctl         transfer control (may be nullptr)
+//! @param[in]  frames      frame count (0 -> from prepare())
+//!
+//! @return     NETMD_NO_ERROR on success
+//------------------------------------------------------------------------------
+netmd_error TrackUpload::send(unsigned char discformat, netmd_transfer_ctl* ctl, unsigned frames)
+{
+    netmd_error err;
+
+    if (mpPackets == nullptr)
+    {
+        return NETMD_ERROR;
+    }
+
+    if (netmd_transfer_cancelled(ctl))
+    {
+        err = NETMD_CANCELLED;
+    }
+    else
+    {
+        err = netmd_secure_send_track_ex(mpSession->device().handle(), mWireformat, discformat,
+                                         frames ? frames : mFrames, mpPackets, mPacketLength,
+                                         mpSession->sessionKey(), &mTrack, mUuid, mContentId, ctl);
+    }
+
+    release();
+    mSent = (err == NETMD_NO_ERROR);
+    return err;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      title and commit the sent track
+//!
+//! @param[in]  title  track title (nullptr -> none)
+//!
+//! @return     NETMD_NO_ERROR on success
+//------------------------------------------------------------------------------
+netmd_error TrackUpload::commit(const char* title)
+{
+    netmd_dev_handle* devh = mpSession->device().handle();
+
+    if (!mSent)
+    {
+        return NETMD_ERROR;
+    }
+
+    if (title != nullptr)
+    {
+        netmd_cache_toc(devh);
+        netmd_set_title(devh, mTrack, title);
+        netmd_sync_toc(devh);
+    }
+
+    mSent = false;
+    return netmd_secure_commit_track(devh, mTrack, mpSession->sessionKey());
+}
+
+//------------------------------------------------------------------------------
+// DiscHeader
+//------------------------------------------------------------------------------
+DiscHeader::DiscHeader(const char* content)
+    : mHdl(create_md_header(content))
+{
+}
+
+DiscHeader::~DiscHeader()
+{
+    free_md_header(&mHdl);
+}
+
+DiscHeader::DiscHeader(DiscHeader&& other) noexcept
+    : mHdl(other.mHdl)
+{
+    other.mHdl = nullptr;
+}
+
+DiscHeader& DiscHeader::operator=(DiscHeader&& other) noexcept
+{
+    if (this != &other)
+    {
+        free_md_header(&mHdl);
+        mHdl       = other.mHdl;
+        other.mHdl = nullptr;
+    }
+    return *this;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      read the header from the device
+//!
+//! @param[in]  dev   device
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int DiscHeader::load(Device& dev)
+{
+    if (!dev)
+    {
+        return -1;
+    }
+
+    netmd_initialize_disc_info(dev.handle(), &mHdl);
+    return (mHdl != nullptr) ? 0 : -1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      write the header to the device
+//!
+//! @param[in]  dev   device
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int DiscHeader::store(Device& dev)
+{
+    if (!dev || (mHdl == nullptr))
+    {
+        return -1;
+    }
+
+    return (netmd_write_disc_header(dev.handle(), mHdl) < 0) ? -1 : 0;
+}
+
+const char* DiscHeader::toString() const
+{
+    return mHdl ? md_header_to_string(mHdl) : nullptr;
+}
+
+const char* DiscHeader::title() const
+{
+    return mHdl ? md_header_disc_title(mHdl) : nullptr;
+}
+
+int DiscHeader::setTitle(const char* title)
+{
+    return mHdl ? md_header_set_disc_title(mHdl, title) : -1;
+}
+
+int DiscHeader::addGroup(const char* name, int16_t first, int16_t last)
+{
+    return mHdl ? md_header_add_group(mHdl, name, first, last) : -1;
+}
+
+int DiscHeader::delGroup(int gid)
+{
+    return mHdl ? md_header_del_group(mHdl, gid) : -1;
+}
+
+int DiscHeader::renameGroup(int gid, const char* name)
+{
+    return mHdl ? md_header_rename_group(mHdl, gid, name) : -1;
+}
+
+int DiscHeader::addTrackToGroup(int gid, int16_t track)
+{
+    return mHdl ? md_header_add_track_to_group(mHdl, gid, track) : -1;
+}
+
+int DiscHeader::delTrackFromGroup(int gid, int16_t track)
+{
+    return mHdl ? md_header_del_track_from_group(mHdl, gid, track) : -1;
+}
+
+} // namespace netmd
@@ -0,0 +1,395 @@
+/**
+ * Copyright (C) 2021 Jo2003 (olenka.joerg@gmail.com)
+ * This file is part of netmd
+ *
+ * cd2netmd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cd2netmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+#ifndef NETMD_PP_H
+    #define NETMD_PP_H
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "libnetmd.h"
+
+//------------------------------------------------------------------------------
+//! C++17 layer over libnetmd: handles are owned by move-only objects and
+//! released in their destructors. Buffers the C core would allocate per
+//! call are kept as scratch storage in the Device object and reused;
+//! results are returned as views into that storage, valid until the next
+//! call on the same device.
+//------------------------------------------------------------------------------
+namespace netmd
+{
+
+//------------------------------------------------------------------------------
+//! @brief      non owning view on contiguous data (std::span replacement)
+//------------------------------------------------------------------------------
+template <typename T>
+class Span
+{
+public:
+    constexpr Span() noexcept : mpData(nullptr), mSize(0) {}
+    constexpr Span(T* data, size_t size) noexcept : mpData(data), mSize(size) {}
+
+    template <size_t N>
+    constexpr Span(T (&arr)[N]) noexcept : mpData(arr), mSize(N) {}
+
+    //! any container with data() and size(), e.g. std::vector, std::array
+    template <typename C, typename = std::enable_if_t<
+        std::is_convertible<decltype(std::declval<C&>().data()), T*>::value>>
+    constexpr Span(C& c) noexcept : mpData(c.data()), mSize(c.size()) {}
+
+    //! Span<T> -> Span<const T>
+    template <typename U, typename = std::enable_if_t<std::is_convertible<U*, T*>::value>>
+    constexpr Span(const Span<U>& other) noexcept : mpData(other.data()), mSize(other.size()) {}
+
+    constexpr T* data() const noexcept { return mpData; }
+    constexpr size_t size() const noexcept { return mSize; }
+    constexpr bool empty() const noexcept { return mSize == 0; }
+    constexpr T* begin() const noexcept { return mpData; }
+    constexpr T* end() const noexcept { return mpData + mSize; }
+    constexpr T& operator[](size_t idx) const noexcept { return mpData[idx]; }
+
+    //--------------------------------------------------------------------------
+    //! @brief      part of this view (clipped to the view's size)
+    //!
+    //! @param[in]  offset  first element
+    //! @param[in]  count   number of elements (default: up to the end)
+    //!
+    //! @return     view
+    //--------------------------------------------------------------------------
+    constexpr Span subspan(size_t offset, size_t count = static_cast<size_t>(-1)) const noexcept
+    {
+        offset = (offset > mSize) ? mSize : offset;
+        count  = (count > (mSize - offset)) ? (mSize - offset) : count;
+        return Span(mpData + offset, count);
+    }
+
+private:
+    T*     mpData;
+    size_t mSize;
+};
+
+using ByteView        = Span<const uint8_t>;
+using MutableByteView = Span<uint8_t>;
+
+//------------------------------------------------------------------------------
+//! @brief      query argument helpers for Device::query()
+//------------------------------------------------------------------------------
+inline netmd_query_data_t arg8(uint8_t v)   { netmd_query_data_t d; d.data.u8  = v; d.size = 1; return d; }
+inline netmd_query_data_t arg16(uint16_t v) { netmd_query_data_t d; d.data.u16 = v; d.size = 2; return d; }
+inline netmd_query_data_t arg32(uint32_t v) { netmd_query_data_t d; d.data.u32 = v; d.size = 4; return d; }
+inline netmd_query_data_t arg64(uint64_t v) { netmd_query_data_t d; d.data.u64 = v; d.size = 8; return d; }
+inline netmd_query_data_t argBytes(ByteView v)
+{
+    netmd_query_data_t d;
+    d.data.pu8 = const_cast<uint8_t*>(v.data());
+    d.size     = v.size();
+    return d;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      values captured by netmd_scan_query(); frees them when
+//!             destroyed or rescanned
+//------------------------------------------------------------------------------
+class Captures
+{
+public:
+    Captures() = default;
+    ~Captures();
+    Captures(Captures&& other) noexcept;
+    Captures& operator=(Captures&& other) noexcept;
+    Captures(const Captures&) = delete;
+    Captures& operator=(const Captures&) = delete;
+
+    //--------------------------------------------------------------------------
+    //! @brief      scan a response, previous captures are dropped
+    //!
+    //! @param[in]  data    response
+    //! @param[in]  format  format string (see netmd_scan_query())
+    //!
+    //! @return     0 -> ok; -1 -> error
+    //--------------------------------------------------------------------------
+    int scan(ByteView data, const char* format);
+
+    //--------------------------------------------------------------------------
+    //! @brief      drop captures
+    //--------------------------------------------------------------------------
+    void clear();
+
+    size_t size() const { return static_cast<size_t>(mArgc); }
+    const netmd_capture_data_t& operator[](size_t idx) const { return mpArgv[idx]; }
+
+    uint8_t  u8(size_t idx) const  { return mpArgv[idx].data.u8; }
+    uint16_t u16(size_t idx) const { return mpArgv[idx].data.u16; }
+    uint32_t u32(size_t idx) const { return mpArgv[idx].data.u32; }
+    uint64_t u64(size_t idx) const { return mpArgv[idx].data.u64; }
+
+    //--------------------------------------------------------------------------
+    //! @brief      captured byte array (empty view if no byte array)
+    //!
+    //! @param[in]  idx   capture index
+    //!
+    //! @return     view
+    //--------------------------------------------------------------------------
+    ByteView bytes(size_t idx) const;
+
+private:
+    netmd_capture_data_t* mpArgv = nullptr;
+    int                   mArgc  = 0;
+};
+
+//------------------------------------------------------------------------------
+//! @brief      an opened NetMD device with its scratch storage
+//------------------------------------------------------------------------------
+class Device
+{
+public:
+    Device() = default;
+    ~Device();
+    Device(Device&& other) noexcept;
+    Device& operator=(Device&& other) noexcept;
+    Device(const Device&) = delete;
+    Device& operator=(const Device&) = delete;
+
+    //--------------------------------------------------------------------------
+    //! @brief      find and open a device; an opened device is closed first
+    //!
+    //! @param[in]  index  index in the list of found devices
+    //! @param[in]  ctx    libusb context (nullptr -> default)
+    //!
+    //! @return     NETMD_NO_ERROR on success
+    //--------------------------------------------------------------------------
+    netmd_error open(unsigned index = 0, libusb_context* ctx = nullptr);
+
+    //--------------------------------------------------------------------------
+    //! @brief      close the device (done by the destructor as well)
+    //--------------------------------------------------------------------------
+    void close();
+
+    bool isOpen() const { return mpHandle != nullptr; }
+    explicit operator bool() const { return isOpen(); }
+
+    //--------------------------------------------------------------------------
+    //! @brief      C handle, for everything not wrapped here
+    //--------------------------------------------------------------------------
+    netmd_dev_handle* handle() const { return mpHandle; }
+
+    //--------------------------------------------------------------------------
+    //! @brief      device name as read on open()
+    //--------------------------------------------------------------------------
+    const char* name() const { return mName; }
+
+    //--------------------------------------------------------------------------
+    //! @brief      exchange command / response; the response is received
+    //!             into the device's response buffer
+    //!
+    //! @param[in]  cmd   command
+    //! @param[out] rsp   response view (valid until the next exchange)
+    //!
+    //! @return     < 0 -> error; else -> received bytes
+    //--------------------------------------------------------------------------
+    int exchange(ByteView cmd, ByteView& rsp);
+
+    //--------------------------------------------------------------------------
+    //! @brief      format a query (see netmd_format_query()) into the
+    //!             device's command buffer and exchange it
+    //!
+    //! @param[out] rsp     response view (valid until the next exchange)
+    //! @param[in]  format  format string
+    //! @param[in]  args    query arguments (see arg8() ...)
+    //!
+    //! @return     < 0 -> error; else -> received bytes
+    //--------------------------------------------------------------------------
+    int query(ByteView& rsp, const char* format, Span<const netmd_query_data_t> args = {});
+
+    //--------------------------------------------------------------------------
+    //! @brief      general purpose scratch buffer (e.g. audio data); it only
+    //!             grows, so repeated use doesn't allocate
+    //!
+    //! @param[in]  size  needed size
+    //!
+    //! @return     view of 'size' bytes (empty on allocation failure)
+    //--------------------------------------------------------------------------
+    MutableByteView scratch(size_t size);
+
+private:
+    netmd_device*         mpList   = nullptr;
+    netmd_dev_handle*     mpHandle = nullptr;
+    char                  mName[64] = {0};
+    std::vector<uint8_t>  mCmd;
+    std::vector<uint8_t>  mRsp;
+    std::vector<uint8_t>  mScratch;
+};
+
+//------------------------------------------------------------------------------
+//! @brief      secure session for track uploads: enter, EKB, session key;
+//!             left (and the device unlocked) when destroyed. The device is
+//!             locked for the whole session; the lock belongs to the thread
+//!             which called open(), so close() / destroy (and move) an open
+//!             session on that thread only. TrackUploads refer to the
+//!             Session object: don't move it while uploads use it.
+//------------------------------------------------------------------------------
+class Session
+{
+public:
+    explicit Session(Device& dev);
+    ~Session();
+    Session(Session&& other) noexcept;
+    Session& operator=(Session&& other) noexcept;
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    //--------------------------------------------------------------------------
+    //! @brief      enter the secure session and exchange the session key
+    //!
+    //! @return     NETMD_NO_ERROR on success
+    //--------------------------------------------------------------------------
+    netmd_error open();
+
+    //--------------------------------------------------------------------------
+    //! @brief      forget session key and leave the session (done by the
+    //!             destructor as well)
+    //--------------------------------------------------------------------------
+    void close();
+
+    bool isOpen() const { return mOpen; }
+    Device& device() const { return *mpDev; }
+    unsigned char* sessionKey() { return mSessionKey; }
+
+private:
+    Device*       mpDev;
+    bool          mOpen   = false;
+    bool          mLocked = false;
+    bool          mAcquired = false;
+    unsigned char mSessionKey[8] = {0};
+};
+
+//------------------------------------------------------------------------------
+//! @brief      one track upload within a session; owns the packet list
+//------------------------------------------------------------------------------
+class TrackUpload
+{
+public:
+    explicit TrackUpload(Session& session);
+    ~TrackUpload();
+    TrackUpload(TrackUpload&& other) noexcept;
+    TrackUpload& operator=(TrackUpload&& other) noexcept;
+    TrackUpload(const TrackUpload&) = delete;
+    TrackUpload& operator=(const TrackUpload&) = delete;
+
+    //--------------------------------------------------------------------------
+    //! @brief      set up the download and encrypt the audio data
+    //!
+    //! @param[in]  audio       raw audio data in wire format (PCM byte
+    //!                         swapped already)
+    //! @param[in]  wireformat  wire format
+    //! @param[in]  channels    NETMD_CHANNELS_MONO / NETMD_CHANNELS_STEREO
+    //!
+    //! @return     NETMD_NO_ERROR on success
+    //--------------------------------------------------------------------------
+    netmd_error prepare(MutableByteView audio, netmd_wireformat wireformat, size_t channels);
+
+    //--------------------------------------------------------------------------
+    //! @brief      send prepared packets; the packet list is freed afterwards
+    //!
+    //! @param[in]  discformat  disc format
+    //! @param[in]  ctl         transfer control (may be nullptr)
+    //! @param[in]  frames      frame count (0 -> from prepare())
+    //!
+    //! @return     NETMD_NO_ERROR on success
+    //--------------------------------------------------------------------------
+    netmd_error send(unsigned char discformat, netmd_transfer_ctl* ctl = nullptr, unsigned frames = 0);
+
+    //--------------------------------------------------------------------------
+    //! @brief      title and commit the sent track
+    //!
+    //! @param[in]  title  track title (nullptr -> none)
+    //!
+    //! @return     NETMD_NO_ERROR on success
+    //--------------------------------------------------------------------------
+    netmd_error commit(const char* title);
+
+    uint16_t track() const { return mTrack; }
+    ByteView uuid() const { return ByteView(mUuid, sizeof(mUuid)); }
+    ByteView contentId() const { return ByteView(mContentId, sizeof(mContentId)); }
+
+private:
+    void release();
+
+    Session*             mpSession;
+    netmd_track_packets* mpPackets    = nullptr;
+    size_t               mPacketCount = 0;
+    size_t               mPacketLength = 0;
+    unsigned             mFrames      = 0;
+    netmd_wireformat     mWireformat  = NETMD_WIREFORMAT_PCM;
+    bool                 mSent        = false;
+    uint16_t             mTrack       = 0;
+    uint8_t              mUuid[8]     = {0};
+    uint8_t              mContentId[20] = {0};
+};
+
+//------------------------------------------------------------------------------
+//! @brief      disc header (title and groups); owns the header handle
+//------------------------------------------------------------------------------
+class DiscHeader
+{
+public:
+    DiscHeader() = default;
+    explicit DiscHeader(const char* content);
+    ~DiscHeader();
+    DiscHeader(DiscHeader&& other) noexcept;
+    DiscHeader& operator=(DiscHeader&& other) noexcept;
+    DiscHeader(const DiscHeader&) = delete;
+    DiscHeader& operator=(const DiscHeader&) = delete;
+
+    //--------------------------------------------------------------------------
+    //! @brief      read the header from the device
+    //!
+    //! @param[in]  dev   device
+    //!
+    //! @return     0 -> ok; -1 -> error
+    //--------------------------------------------------------------------------
+    int load(Device& dev);
+
+    //--------------------------------------------------------------------------
+    //! @brief      write the header to the device
+    //!
+    //! @param[in]  dev   device
+    //!
+    //! @return     0 -> ok; -1 -> error
+    //--------------------------------------------------------------------------
+    int store(Device& dev);
+
+    HndMdHdr handle() const { return mHdl; }
+    explicit operator bool() const { return mHdl != nullptr; }
+
+    const char* toString() const;
+    const char* title() const;
+    int setTitle(const char* title);
+    int addGroup(const char* name, int16_t first, int16_t last);
+    int delGroup(int gid);
+    int renameGroup(int gid, const char* name);
+    int addTrackToGroup(int gid, int16_t track);
+    int delTrackFromGroup(int gid, int16_t track);
+
+private:
+    HndMdHdr mHdl = nullptr;
+};
+
+} // namespace netmd
+
+#endif // __cplusplus
+#endif // NETMD_PP_H
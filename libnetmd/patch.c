@@ -16,6 +16,7 @@
  */
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
 #include "patch.h"
 #include "utils.h"
 #include "log.h"
@@ -24,6 +25,7 @@
 // defines
 #define PERIPHERAL_BASE 0x03802000ul
 #define MAX_PATCH 8
+#define MAX_PATCH_STATES 8
 
 // types
 
@@ -92,6 +94,19 @@ typedef struct
     uint8_t data[4];
 } patch_data_t;
 
+//! @brief cached patch state of one device handle
+typedef struct
+{
+    netmd_dev_handle* devh;             //!< owner (NULL -> unused)
+    sony_dev_info_t   devcode;          //!< cached device code
+    int               devcode_valid;    //!< device code was queried
+    int               safety;           //!< safety patch known to be loaded
+    int               patched;          //!< SP upload patches are loaded
+    int               chan_no;          //!< channels of loaded track type patch
+    int               batch;            //!< keep patched between uploads
+    patch_id_t        used[MAX_PATCH];  //!< patch slot usage
+} patch_state_t;
+
 // static values
 
 //! @brief patch address table
@@ -120,26 +135,110 @@ static patch_payload_entry_t patch_payload_tab[] = {
 //! @brief patch payload table size
 static const size_t patch_payload_tab_size = sizeof(patch_payload_tab) / sizeof(patch_payload_tab[0]);
 
-//! @brief patch areas used
-static patch_id_t used_patches[MAX_PATCH] = {PID_UNUSED,};
+//! @brief patch state per device handle
+static patch_state_t _s_states[MAX_PATCH_STATES];
 
-//! @brief used for exchang
-static uint8_t _s_buff[255];
+//! @brief protects _s_states (lookup, creation, release)
+static pthread_mutex_t _s_states_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // internal functions
 
+//------------------------------------------------------------------------------
+//! @brief      find the patch state of a device handle
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  create  1 -> create state if there is none
+//!
+//! @return     NULL -> not found / no free state; else -> patch state
+//------------------------------------------------------------------------------
+static patch_state_t* patch_state(netmd_dev_handle *devh, int create)
+{
+    patch_state_t* free_st = NULL;
+    patch_state_t* ret     = NULL;
+
+    pthread_mutex_lock(&_s_states_lock);
+
+    for (int i = 0; i < MAX_PATCH_STATES; i++)
+    {
+        if (_s_states[i].devh == devh)
+        {
+            ret = &_s_states[i];
+            break;
+        }
+
+        // a state of a device which isn't patched can be reused
+        if ((free_st == NULL) && ((_s_states[i].devh == NULL) || (!_s_states[i].patched && !_s_states[i].batch)))
+        {
+            free_st = &_s_states[i];
+        }
+    }
+
+    if ((ret == NULL) && create && (free_st != NULL))
+    {
+        memset(free_st, 0, sizeof(patch_state_t));
+        free_st->devh    = devh;
+        free_st->devcode = SDI_UNKNOWN;
+        ret = free_st;
+    }
+
+    pthread_mutex_unlock(&_s_states_lock);
+
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      forget everything known about loaded patches (e.g. after the
+//!             device lost them)
+//!
+//! @param[in]  st    patch state
+//------------------------------------------------------------------------------
+static void patch_state_reset(patch_state_t* st)
+{
+    st->safety  = 0;
+    st->patched = 0;
+    st->chan_no = 0;
+
+    for (int i = 0; i < MAX_PATCH; i++)
+    {
+        st->used[i] = PID_UNUSED;
+    }
+}
+
 //------------------------------------------------------------------------------
 //! @brief      get next free patch area
 //!
+//! @param[in]  st    patch state
+//! @param[in]  pid   patch id
+//!
 //! @return     -1 -> no more free | > -1 -> free patch index
 //------------------------------------------------------------------------------
-static int get_next_free_patch(patch_id_t pid)
+static int get_next_free_patch(patch_state_t* st, patch_id_t pid)
+{
+    for (int i = 0; i < MAX_PATCH; i++)
+    {
+        if (st->used[i] == PID_UNUSED)
+        {
+            st->used[i] = pid;
+            return i;
+        }
+    }
+    return -1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      get patch slot used by a patch
+//!
+//! @param[in]  st    patch state
+//! @param[in]  pid   patch id
+//!
+//! @return     -1 -> not used | > -1 -> patch index
+//------------------------------------------------------------------------------
+static int get_used_patch(const patch_state_t* st, patch_id_t pid)
 {
     for (int i = 0; i < MAX_PATCH; i++)
     {
-        if (used_patches[i] == PID_UNUSED)
+        if (st->used[i] == pid)
         {
-            used_patches[i] = pid;
             return i;
         }
     }
@@ -210,6 +309,7 @@ static netmd_error patch_write(netmd_dev_handle *devh, uint32_t addr, uint8_t da
 {
     netmd_error ret = NETMD_ERROR;
     size_t query_sz = 0;
+    uint8_t rsp[255];
     netmd_query_data_t argv[] = {
         {{.u32 = addr                                     }, sizeof(uint32_t)},
         {{.u8  = data_size                                }, sizeof(uint8_t) },
@@ -223,7 +323,7 @@ static netmd_error patch_write(netmd_dev_handle *devh, uint32_t addr, uint8_t da
     if (query != NULL)
     {
         // send ...
-        ret = netmd_exch_message(devh, query, query_sz, _s_buff);
+        ret = netmd_exch_message(devh, query, query_sz, rsp);
 
         // free memory
         free(query);
@@ -319,6 +419,7 @@ static netmd_error netmd_change_memory_state(netmd_dev_handle *devh, uint32_t ad
 {
     netmd_error ret = NETMD_ERROR;
     size_t query_sz = 0;
+    uint8_t rsp[255];
     netmd_query_data_t argv[] = {
         {{.u32 = addr }, sizeof(uint32_t)},
         {{.u8  = sz   }, sizeof(uint8_t) },
@@ -331,7 +432,7 @@ static netmd_error netmd_change_memory_state(netmd_dev_handle *devh, uint32_t ad
     if (query != NULL)
     {
         // send ...
-        ret = netmd_exch_message(devh, query, query_sz, _s_buff);
+        ret = netmd_exch_message(devh, query, query_sz, rsp);
 
         // free memory
         free(query);
@@ -394,13 +495,14 @@ static sony_dev_info_t netmd_get_device_code_ex(netmd_dev_handle *devh)
     uint8_t query[]     = {0x00, 0x18, 0x12, 0xff};
     int idx             = 0;
     uint8_t chip        = 255, hwid = 255, version = 255;
+    uint8_t rsp[255];
 
-    memset(_s_buff, 0xff, 255);
-    netmd_exch_message(devh, query, sizeof(query), _s_buff);
+    memset(rsp, 0xff, sizeof(rsp));
+    netmd_exch_message(devh, query, sizeof(query), rsp);
 
-    chip    = _s_buff[4];
-    hwid    = _s_buff[5];
-    version = _s_buff[7];
+    chip    = rsp[4];
+    hwid    = rsp[5];
+    version = rsp[7];
 
     if ((chip != 255) || (hwid != 255) || (version != 255))
     {
@@ -449,6 +551,31 @@ static sony_dev_info_t netmd_get_device_code_ex(netmd_dev_handle *devh)
     return ret;
 }
 
+//------------------------------------------------------------------------------
+//! @brief      get device code / type; queried once per device handle
+//!
+//! @param[in]  devh      device handle
+//! @param[in]  st        patch state (may be NULL)
+//!
+//! @return     sony_dev_info_t
+//! @see        sony_dev_info_t
+//------------------------------------------------------------------------------
+static sony_dev_info_t patch_device_code(netmd_dev_handle *devh, patch_state_t* st)
+{
+    if (st == NULL)
+    {
+        return netmd_get_device_code_ex(devh);
+    }
+
+    if (!st->devcode_valid)
+    {
+        st->devcode       = netmd_get_device_code_ex(devh);
+        st->devcode_valid = 1;
+    }
+
+    return st->devcode;
+}
+
 //------------------------------------------------------------------------------
 //! @brief      read patch data
 //!
@@ -575,21 +702,47 @@ static void netmd_patch(netmd_dev_handle *devh, uint32_t address, uint8_t data[]
     netmd_clean_write(devh, control, &tmpdata[1], 1);
 }
 
+//------------------------------------------------------------------------------
+//! @brief      check that a patch is (still) loaded in its slot
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  st      patch state
+//! @param[in]  pid     patch id
+//! @param[in]  address expected patch address
+//! @param[in]  data    expected patch data (4 bytes)
+//!
+//! @return     1 -> patch loaded; 0 -> not loaded
+//------------------------------------------------------------------------------
+static int netmd_verify_patch(netmd_dev_handle *devh, const patch_state_t* st, patch_id_t pid,
+                              uint32_t address, const uint8_t data[])
+{
+    patch_data_t patch        = {0, {0,}};
+    int          patch_number = get_used_patch(st, pid);
+
+    if ((patch_number != -1) && (netmd_read_patch(devh, patch_number, &patch) == NETMD_NO_ERROR))
+    {
+        return ((patch.addr == address) && !memcmp(patch.data, data, 4)) ? 1 : 0;
+    }
+
+    return 0;
+}
+
 //------------------------------------------------------------------------------
 //! @brief      undo one patch
 //!
 //! @param[in]  devh  device handle
+//! @param[in]  st    patch state
 //! @param[in]  pid   patch id
 //------------------------------------------------------------------------------
-static void netmd_unpatch(netmd_dev_handle *devh, patch_id_t pid)
+static void netmd_unpatch(netmd_dev_handle *devh, patch_state_t* st, patch_id_t pid)
 {
     int patch_number = -1;
 
     for (int i = 0; i < MAX_PATCH; i++)
     {
-        if (used_patches[i] == pid)
+        if (st->used[i] == pid)
         {
-            used_patches[i] = PID_UNUSED;
+            st->used[i] = PID_UNUSED;
             patch_number = i;
         }
     }
@@ -633,18 +786,24 @@ static void netmd_unpatch(netmd_dev_handle *devh, patch_id_t pid)
 }
 
 //------------------------------------------------------------------------------
-//! @brief      appy safety patch if needed
+//! @brief      appy safety patch if needed; the patch slots are only
+//!             scanned if the safety patch isn't known to be loaded
 //!
 //! @param[in]  devh         device handle
+//! @param[in]  st           patch state
 //------------------------------------------------------------------------------
-static void netmd_safety_patch(netmd_dev_handle *devh)
+static void netmd_safety_patch(netmd_dev_handle *devh, patch_state_t* st)
 {
-    sony_dev_info_t devcode   = netmd_get_device_code_ex(devh);
+    sony_dev_info_t devcode   = patch_device_code(devh, st);
     uint32_t        addr      = get_patch_address(devcode, PID_SAFETY);
     uint8_t*        patch_cnt = get_patch_payload(devcode, PID_SAFETY);
     patch_data_t    patch     = {0, {0,}};
 
-    if ((addr != 0) && (patch_cnt != NULL))
+    if (st->safety)
+    {
+        netmd_log(NETMD_LOG_DEBUG, "Safety patch already loaded.\n");
+    }
+    else if ((addr != 0) && (patch_cnt != NULL))
     {
         int safety_loaded = 0;
 
@@ -655,16 +814,16 @@ static void netmd_safety_patch(netmd_dev_handle *devh)
                 if ((patch.addr == addr) && !memcmp(patch.data, patch_cnt, 4))
                 {
                     netmd_log(NETMD_LOG_DEBUG, "Safety patch found at patch slot #%d\n", i);
-                    safety_loaded   = 1;
-                    used_patches[i] = PID_SAFETY;
+                    safety_loaded = 1;
+                    st->used[i]   = PID_SAFETY;
                 }
 
                 // developer device
                 if ((patch.addr == 0xe6c0) || (patch.addr == 0xe69c))
                 {
                     netmd_log(NETMD_LOG_DEBUG, "Dev patch found at patch slot #%d\n", i);
-                    safety_loaded   = 1;
-                    used_patches[i] = PID_SAFETY;
+                    safety_loaded = 1;
+                    st->used[i]   = PID_SAFETY;
                 }
             }
         }
@@ -672,9 +831,11 @@ static void netmd_safety_patch(netmd_dev_handle *devh)
         if (safety_loaded == 0)
         {
             netmd_patch(devh, addr, patch_cnt, 4,
-                        get_next_free_patch(PID_SAFETY));
+                        get_next_free_patch(st, PID_SAFETY));
             netmd_log(NETMD_LOG_DEBUG, "Safety patch applied.\n");
         }
+
+        st->safety = 1;
     }
 }
 
@@ -692,6 +853,7 @@ static netmd_error netmd_enable_factory(netmd_dev_handle *devh)
     uint8_t     p1[]  = {0x00, 0x18, 0x09, 0x00, 0xff, 0x00, 0x00, 0x00,
                          0x00, 0x00};
     size_t      qsz   = 0;
+    uint8_t     rsp[255];
     uint8_t*    query = netmd_format_query("00 1801 ff0e 4e6574204d442057616c6b6d616e", NULL, 0, &qsz);
 
     if (netmd_change_descriptor_state(devh, discSubunitIndentifier, nda_openread))
@@ -699,16 +861,16 @@ static netmd_error netmd_enable_factory(netmd_dev_handle *devh)
         ret = NETMD_ERROR;
     }
 
-    if (netmd_exch_message(devh, p1, sizeof(p1), _s_buff) < 0)
+    if (netmd_exch_message(devh, p1, sizeof(p1), rsp) < 0)
     {
         ret = NETMD_ERROR;
     }
     
-    netmd_set_factory_write(1);
+    netmd_set_factory_write(devh, 1);
 
     if (query != NULL)
     {
-        if (netmd_exch_message(devh, query, qsz, _s_buff) < 0)
+        if (netmd_exch_message(devh, query, qsz, rsp) < 0)
         {
             ret = NETMD_ERROR;
         }
@@ -718,10 +880,106 @@ static netmd_error netmd_enable_factory(netmd_dev_handle *devh)
     return ret;
 }
 
-// exported functions
+//------------------------------------------------------------------------------
+//! @brief      apply / rewrite the track type patch
+//!
+//! @param[in]  devh         device handle
+//! @param[in]  st           patch state
+//! @param[in]  devcode      device code
+//! @param[in]  chan_no      number of audio channels (1: mono, 2: stereo)
+//------------------------------------------------------------------------------
+static void netmd_track_type_patch(netmd_dev_handle *devh, patch_state_t* st, sony_dev_info_t devcode, int chan_no)
+{
+    uint8_t data[4];
+    int     patch_number;
+
+    memcpy(data, get_patch_payload(devcode, PID_TRACK_TYPE), 4);
+    data[1] = (chan_no == 1) ? 4 : 6; // mono or stereo
+
+    if ((patch_number = get_used_patch(st, PID_TRACK_TYPE)) == -1)
+    {
+        patch_number = get_next_free_patch(st, PID_TRACK_TYPE);
+    }
+
+    netmd_patch(devh, get_patch_address(devcode, PID_TRACK_TYPE), data, 4, patch_number);
+    st->chan_no = chan_no;
+}
 
 //------------------------------------------------------------------------------
-//! @brief      appy SP upload patch
+//! @brief      check loaded SP patches before the next upload of a batch;
+//!             rewrites the track type patch if the channel count changed
+//!
+//! @param[in]  devh         device handle
+//! @param[in]  st           patch state
+//! @param[in]  chan_no      number of audio channels (1: mono, 2: stereo)
+//!
+//! @return     1 -> patches usable; 0 -> patches were lost
+//------------------------------------------------------------------------------
+static int netmd_reuse_sp_patch(netmd_dev_handle *devh, patch_state_t* st, int chan_no)
+{
+    uint8_t data[4];
+
+    // the track type patch is loaded last, so it tells if all patches survived;
+    // check it as loaded before it might be rewritten
+    memcpy(data, get_patch_payload(st->devcode, PID_TRACK_TYPE), 4);
+    data[1] = (st->chan_no == 1) ? 4 : 6;
+
+    if (!netmd_verify_patch(devh, st, PID_TRACK_TYPE,
+                            get_patch_address(st->devcode, PID_TRACK_TYPE), data))
+    {
+        return 0;
+    }
+
+    if (chan_no != st->chan_no)
+    {
+        netmd_log(NETMD_LOG_DEBUG, "=== Rewrite track type patch ===\n");
+        netmd_track_type_patch(devh, st, st->devcode, chan_no);
+    }
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      undo SP upload patches
+//!
+//! @param[in]  devh  device handle
+//! @param[in]  st    patch state
+//------------------------------------------------------------------------------
+static void netmd_undo_sp_patch_state(netmd_dev_handle *devh, patch_state_t* st)
+{
+    // the factory window must not mix with commands of other threads
+    if (netmd_dev_lock(devh) != NETMD_NO_ERROR)
+    {
+        return;
+    }
+
+    netmd_set_factory_write(devh, 1);
+    netmd_log(NETMD_LOG_DEBUG, "=== Undo patch 0 ===\n");
+    netmd_unpatch(devh, st, PID_PATCH_0);
+
+    netmd_log(NETMD_LOG_DEBUG, "=== Undo patch common 1 ===\n");
+    netmd_unpatch(devh, st, PID_PATCH_CMN_1);
+
+    netmd_log(NETMD_LOG_DEBUG, "=== Undo patch common 2 ===\n");
+    netmd_unpatch(devh, st, PID_PATCH_CMN_2);
+
+    netmd_log(NETMD_LOG_DEBUG, "=== Undo prep patch ===\n");
+    netmd_unpatch(devh, st, PID_PREP_PATCH);
+
+    netmd_log(NETMD_LOG_DEBUG, "=== Undo track type patch ===\n");
+    netmd_unpatch(devh, st, PID_TRACK_TYPE);
+    netmd_set_factory_write(devh, 0);
+
+    st->patched = 0;
+    st->chan_no = 0;
+
+    netmd_dev_unlock(devh);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      appy SP upload patch (device locked); in batch mode patches
+//!             which are still loaded from the previous upload are only
+//!             verified
 //!
 //! @param[in]  devh         device handle
 //! @param[in]  chan_no      number of audio channels (1: mono, 2: stereo)
@@ -729,7 +987,7 @@ static netmd_error netmd_enable_factory(netmd_dev_handle *devh)
 //! @return     netmd_error
 //! @see        netmd_error
 //------------------------------------------------------------------------------
-netmd_error netmd_apply_sp_patch(netmd_dev_handle *devh, int chan_no)
+static netmd_error apply_sp_patch(netmd_dev_handle *devh, int chan_no)
 {
     netmd_error ret    = NETMD_NO_ERROR;
     patch_id_t  patch0 = PID_UNUSED;
@@ -737,19 +995,39 @@ netmd_error netmd_apply_sp_patch(netmd_dev_handle *devh, int chan_no)
     size_t      rsz    = 0;
     uint8_t*    reply  = NULL;
     sony_dev_info_t devcode;
+    patch_state_t*  st;
+
+    if ((st = patch_state(devh, 1)) == NULL)
+    {
+        netmd_log(NETMD_LOG_ERROR, "No free patch state!\n");
+        return NETMD_ERROR;
+    }
 
     netmd_log(NETMD_LOG_DEBUG, "Enable factory ...\n");
     ret = netmd_enable_factory(devh);
     if(ret){
-        netmd_set_factory_write(0);
+        netmd_set_factory_write(devh, 0);
         return ret;
     }
 
+    if (st->patched)
+    {
+        if (netmd_reuse_sp_patch(devh, st, chan_no))
+        {
+            netmd_log(NETMD_LOG_DEBUG, "SP patches still loaded.\n");
+            netmd_set_factory_write(devh, 0);
+            return NETMD_NO_ERROR;
+        }
+
+        netmd_log(NETMD_LOG_VERBOSE, "SP patches were lost, apply again ...\n");
+        patch_state_reset(st);
+    }
+
     netmd_log(NETMD_LOG_DEBUG, "Apply safety patch ...\n");
-    netmd_safety_patch(devh);
+    netmd_safety_patch(devh, st);
 
     netmd_log(NETMD_LOG_DEBUG, "Try to get device code ...\n");
-    if ((devcode = netmd_get_device_code_ex(devh)) == SDI_S1200)
+    if ((devcode = patch_device_code(devh, st)) == SDI_S1200)
     {
         patch0 = PID_PATCH_0_B;
     }
@@ -780,28 +1058,27 @@ netmd_error netmd_apply_sp_patch(netmd_dev_handle *devh, int chan_no)
         netmd_log(NETMD_LOG_DEBUG, "=== Apply patch 0 ===\n");
         netmd_patch(devh, get_patch_address(devcode, patch0),
                     get_patch_payload(devcode, PID_PATCH_0), 4,
-                    get_next_free_patch(PID_PATCH_0));
+                    get_next_free_patch(st, PID_PATCH_0));
 
         netmd_log(NETMD_LOG_DEBUG, "=== Apply patch common 1 ===\n");
         netmd_patch(devh, get_patch_address(devcode, PID_PATCH_CMN_1),
                     get_patch_payload(devcode, PID_PATCH_CMN_1), 4,
-                    get_next_free_patch(PID_PATCH_CMN_1));
+                    get_next_free_patch(st, PID_PATCH_CMN_1));
 
         netmd_log(NETMD_LOG_DEBUG, "=== Apply patch common 2 ===\n");
         netmd_patch(devh, get_patch_address(devcode, PID_PATCH_CMN_2),
                     get_patch_payload(devcode, PID_PATCH_CMN_2), 4,
-                    get_next_free_patch(PID_PATCH_CMN_2));
+                    get_next_free_patch(st, PID_PATCH_CMN_2));
 
         netmd_log(NETMD_LOG_DEBUG, "=== Apply prep patch ===\n");
         netmd_patch(devh, get_patch_address(devcode, PID_PREP_PATCH),
                     get_patch_payload(devcode, PID_PREP_PATCH), 4,
-                    get_next_free_patch(PID_PREP_PATCH));
+                    get_next_free_patch(st, PID_PREP_PATCH));
 
         netmd_log(NETMD_LOG_DEBUG, "=== Apply track type patch ===\n");
-        reply    = get_patch_payload(devcode, PID_TRACK_TYPE);
-        reply[1] = (chan_no == 1) ? 4 : 6; // mono or stereo
-        netmd_patch(devh, get_patch_address(devcode, PID_TRACK_TYPE),
-                    reply, 4, get_next_free_patch(PID_TRACK_TYPE));
+        netmd_track_type_patch(devh, st, devcode, chan_no);
+
+        st->patched = 1;
     }
     else
     {
@@ -809,34 +1086,282 @@ netmd_error netmd_apply_sp_patch(netmd_dev_handle *devh, int chan_no)
         netmd_log(NETMD_LOG_ERROR, "Can't figure out patch 0!\n");
     }
 
-    netmd_set_factory_write(0);
+    netmd_set_factory_write(devh, 0);
 
     return ret;
 }
 
+// exported functions
+
 //------------------------------------------------------------------------------
-//! @brief      undo SP upload patch
+//! @brief      appy SP upload patch; in batch mode patches which are still
+//!             loaded from the previous upload are only verified
+//!
+//! @param[in]  devh         device handle
+//! @param[in]  chan_no      number of audio channels (1: mono, 2: stereo)
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_apply_sp_patch(netmd_dev_handle *devh, int chan_no)
+{
+    netmd_error ret;
+
+    // the factory window must not mix with commands of other threads
+    if ((ret = netmd_dev_lock(devh)) == NETMD_NO_ERROR)
+    {
+        ret = apply_sp_patch(devh, chan_no);
+        netmd_dev_unlock(devh);
+    }
+
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      undo SP upload patch; deferred to the end of the batch if
+//!             batch mode is active
 //!
 //! @param[in]  devh  device handle
 //------------------------------------------------------------------------------
 void netmd_undo_sp_patch(netmd_dev_handle *devh)
 {
-    netmd_set_factory_write(1);
-    netmd_log(NETMD_LOG_DEBUG, "=== Undo patch 0 ===\n");
-    netmd_unpatch(devh, PID_PATCH_0);
+    patch_state_t* st = patch_state(devh, 0);
 
-    netmd_log(NETMD_LOG_DEBUG, "=== Undo patch common 1 ===\n");
-    netmd_unpatch(devh, PID_PATCH_CMN_1);
+    if (st == NULL)
+    {
+        return;
+    }
 
-    netmd_log(NETMD_LOG_DEBUG, "=== Undo patch common 2 ===\n");
-    netmd_unpatch(devh, PID_PATCH_CMN_2);
+    if (st->batch && st->patched)
+    {
+        netmd_log(NETMD_LOG_DEBUG, "Keep SP patches for batch.\n");
+        return;
+    }
 
-    netmd_log(NETMD_LOG_DEBUG, "=== Undo prep patch ===\n");
-    netmd_unpatch(devh, PID_PREP_PATCH);
+    netmd_undo_sp_patch_state(devh, st);
+}
 
-    netmd_log(NETMD_LOG_DEBUG, "=== Undo track type patch ===\n");
-    netmd_unpatch(devh, PID_TRACK_TYPE);
-    netmd_set_factory_write(0);
+//------------------------------------------------------------------------------
+//! @brief      start / end a batch of SP uploads
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  enable  1 -> keep patched between uploads; 0 -> end batch
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_sp_patch_batch(netmd_dev_handle *devh, int enable)
+{
+    patch_state_t* st = patch_state(devh, enable);
+
+    if (st == NULL)
+    {
+        return enable ? NETMD_ERROR : NETMD_NO_ERROR;
+    }
+
+    st->batch = enable;
+
+    if (!enable && st->patched)
+    {
+        netmd_undo_sp_patch_state(devh, st);
+    }
+
+    return NETMD_NO_ERROR;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      drop the patch state of a device handle
+//!
+//! @param[in]  devh  device handle
+//------------------------------------------------------------------------------
+void netmd_sp_patch_release(netmd_dev_handle *devh)
+{
+    patch_state_t* st = patch_state(devh, 0);
+
+    if (st != NULL)
+    {
+        if (st->patched)
+        {
+            netmd_undo_sp_patch_state(devh, st);
+        }
+
+        pthread_mutex_lock(&_s_states_lock);
+        memset(st, 0, sizeof(patch_state_t));
+        pthread_mutex_unlock(&_s_states_lock);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      remove loaded SP patches after an aborted upload, also in
+//!             batch mode; the next SP upload patches the device again
+//!
+//! @param[in]  devh  device handle
+//------------------------------------------------------------------------------
+void netmd_sp_patch_abort(netmd_dev_handle *devh)
+{
+    patch_state_t* st = patch_state(devh, 0);
+
+    if ((st != NULL) && st->patched)
+    {
+        netmd_undo_sp_patch_state(devh, st);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      read one chunk of opened device memory into the caller's
+//!             buffer; the request template is filled in place
+//!
+//! @param[in]  devh   device handle
+//! @param[in]  addr   address
+//! @param[in]  buf    buffer for data
+//! @param[in]  sz     size to read (max. NETMD_MEM_READ_MAX)
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+static netmd_error netmd_read_memory_chunk(netmd_dev_handle *devh, uint32_t addr, uint8_t* buf, size_t sz)
+{
+    // 00 1821 ff 00 <addr le> <size>
+    uint8_t  read[]  = {0x00, 0x18, 0x21, 0xff, 0x00, 0, 0, 0, 0, 0};
+    uint8_t* reply   = NULL;
+    int      rsz;
+    netmd_error ret  = NETMD_ERROR;
+
+    for (int i = 0; i < 4; i++)
+    {
+        read[5 + i] = (uint8_t)(addr >> (8 * i));
+    }
+    read[9] = (uint8_t)sz;
+
+    // reply: status 1821 00 xx <addr> <size> xxxx <data> <checksum le>
+    if (((rsz = netmd_exch_message_ex(devh, read, sizeof(read), &reply)) >= (int)(12 + sz + 2))
+        && (reply[0] == NETMD_STATUS_ACCEPTED))
+    {
+        uint16_t chk = (uint16_t)(reply[12 + sz] | (reply[12 + sz + 1] << 8));
+
+        if (chk == (uint16_t)netmd_calculate_checksum(&reply[12], sz))
+        {
+            memcpy(buf, &reply[12], sz);
+            ret = NETMD_NO_ERROR;
+        }
+        else
+        {
+            netmd_log(NETMD_LOG_VERBOSE, "Checksum error reading %zu bytes at 0x%08x\n", sz, addr);
+        }
+    }
+
+    free(reply);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      read a range of device memory
+//!
+//! @param[in]  devh   device handle
+//! @param[in]  addr   start address
+//! @param[out] buf    buffer for data (at least size bytes)
+//! @param[in]  size   number of bytes to read
+//! @param[in]  chunk  bytes per request (0 or > NETMD_MEM_READ_MAX -> max.)
+//! @param[out] done   bytes read (may be NULL)
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_read_memory(netmd_dev_handle *devh, uint32_t addr, uint8_t* buf, size_t size,
+                              size_t chunk, size_t* done)
+{
+    netmd_error ret    = NETMD_NO_ERROR;
+    size_t      pos    = 0;
+    int         tries  = 0;
+    int         opened = 0;  // memory is open for read ...
+    uint32_t    o_addr = 0;  // ... at this address
+    size_t      o_sz   = 0;  // ... with this size
+    int         keep   = 1;  // keep memory open across chunks
+
+    if ((chunk == 0) || (chunk > NETMD_MEM_READ_MAX))
+    {
+        chunk = NETMD_MEM_READ_MAX;
+    }
+
+    if ((ret = netmd_dev_lock(devh)) != NETMD_NO_ERROR)
+    {
+        return ret;
+    }
+
+    netmd_log(NETMD_LOG_DEBUG, "Enable factory ...\n");
+    if ((ret = netmd_enable_factory(devh)) == NETMD_NO_ERROR)
+    {
+        while (pos < size)
+        {
+            size_t sz = ((size - pos) < chunk) ? (size - pos) : chunk;
+
+            // open once, saves two requests per chunk
+            if (!opened)
+            {
+                o_addr = addr + (uint32_t)pos;
+                o_sz   = sz;
+                netmd_change_memory_state(devh, o_addr, o_sz, NETMD_MEM_READ);
+                opened = 1;
+            }
+
+            if (netmd_read_memory_chunk(devh, addr + (uint32_t)pos, buf + pos, sz) == NETMD_NO_ERROR)
+            {
+                pos  += sz;
+                tries = 0;
+
+                if (!keep)
+                {
+                    netmd_change_memory_state(devh, o_addr, o_sz, NETMD_MEM_CLOSE);
+                    opened = 0;
+                }
+                continue;
+            }
+
+            netmd_change_memory_state(devh, o_addr, o_sz, NETMD_MEM_CLOSE);
+            opened = 0;
+
+            if (keep)
+            {
+                // device wants the memory opened for each chunk
+                netmd_log(NETMD_LOG_VERBOSE, "Memory read at 0x%08x failed, open memory per chunk\n",
+                          addr + (uint32_t)pos);
+                keep = 0;
+            }
+            else if (++tries < 2)
+            {
+                continue;
+            }
+            else if (chunk > NETMD_MEM_READ_MIN)
+            {
+                // device doesn't like the request size -> go smaller
+                chunk = (chunk / 2 < NETMD_MEM_READ_MIN) ? NETMD_MEM_READ_MIN : (chunk / 2);
+                tries = 0;
+                netmd_log(NETMD_LOG_VERBOSE, "Memory read failed at 0x%08x, chunk size now %zu\n",
+                          addr + (uint32_t)pos, chunk);
+            }
+            else
+            {
+                netmd_log(NETMD_LOG_ERROR, "Can't read memory at 0x%08x!\n", addr + (uint32_t)pos);
+                ret = NETMD_ERROR;
+                break;
+            }
+        }
+
+        if (opened)
+        {
+            netmd_change_memory_state(devh, o_addr, o_sz, NETMD_MEM_CLOSE);
+        }
+    }
+
+    netmd_set_factory_write(devh, 0);
+    netmd_dev_unlock(devh);
+
+    if (done != NULL)
+    {
+        *done = pos;
+    }
+
+    return ret;
 }
 
 //------------------------------------------------------------------------------
@@ -849,16 +1374,23 @@ void netmd_undo_sp_patch(netmd_dev_handle *devh)
 int netmd_dev_supports_sp_upload(netmd_dev_handle *devh)
 {
     int ret = 0;
+
+    if (netmd_dev_lock(devh) != NETMD_NO_ERROR)
+    {
+        return 0;
+    }
+
     netmd_log(NETMD_LOG_DEBUG, "Enable factory ...\n");
     if (netmd_enable_factory(devh) == NETMD_NO_ERROR)
     {
         netmd_log(NETMD_LOG_DEBUG, "Get extended device info!\n");
-        if (netmd_get_device_code_ex(devh) != SDI_UNKNOWN)
+        if (patch_device_code(devh, patch_state(devh, 1)) != SDI_UNKNOWN)
         {
             netmd_log(NETMD_LOG_DEBUG, "Supported device!\n");
             ret = 1;
         }
     }
-    netmd_set_factory_write(0);
+    netmd_set_factory_write(devh, 0);
+    netmd_dev_unlock(devh);
     return ret;
 }
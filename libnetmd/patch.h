@@ -22,6 +22,12 @@
 
 /* copy start */
 
+//! max. bytes per memory read request (size is a byte in the request)
+#define NETMD_MEM_READ_MAX 0xff
+
+//! min. bytes per memory read request when falling back to smaller requests
+#define NETMD_MEM_READ_MIN 0x10
+
 //------------------------------------------------------------------------------
 //! @brief      appy SP patch
 //!
@@ -40,6 +46,59 @@ netmd_error netmd_apply_sp_patch(netmd_dev_handle *devh, int chan_no);
 //------------------------------------------------------------------------------
 void netmd_undo_sp_patch(netmd_dev_handle *devh);
 
+//------------------------------------------------------------------------------
+//! @brief      start / end a batch of SP uploads. While a batch is active
+//!             netmd_undo_sp_patch() keeps the patches loaded and the next
+//!             netmd_apply_sp_patch() only verifies them (and rewrites the
+//!             track type patch if the channel count changes). Ending the
+//!             batch removes the patches.
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  enable  1 -> start batch; 0 -> end batch
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_sp_patch_batch(netmd_dev_handle *devh, int enable);
+
+//------------------------------------------------------------------------------
+//! @brief      remove loaded SP patches and drop the cached patch state of
+//!             a device handle (called by netmd_close())
+//!
+//! @param[in]  devh  device handle
+//------------------------------------------------------------------------------
+void netmd_sp_patch_release(netmd_dev_handle *devh);
+
+//------------------------------------------------------------------------------
+//! @brief      remove loaded SP patches after an aborted upload, also in
+//!             batch mode; the next SP upload patches the device again
+//!
+//! @param[in]  devh  device handle
+//------------------------------------------------------------------------------
+void netmd_sp_patch_abort(netmd_dev_handle *devh);
+
+//------------------------------------------------------------------------------
+//! @brief      read a range of device memory (e.g. to dump firmware). The
+//!             range is split into requests of chunk bytes; every reply is
+//!             checked against its checksum and copied straight into buf.
+//!             Memory is opened for read once for all requests; if the
+//!             device fails, it is opened and closed around each request.
+//!             Failed requests are retried and the request size is halved
+//!             (down to NETMD_MEM_READ_MIN) if the device keeps failing.
+//!
+//! @param[in]  devh   device handle
+//! @param[in]  addr   start address
+//! @param[out] buf    buffer for data (at least size bytes)
+//! @param[in]  size   number of bytes to read
+//! @param[in]  chunk  bytes per request (0 -> NETMD_MEM_READ_MAX)
+//! @param[out] done   bytes read, also on error (may be NULL)
+//!
+//! @return     netmd_error
+//! @see        netmd_error
+//------------------------------------------------------------------------------
+netmd_error netmd_read_memory(netmd_dev_handle *devh, uint32_t addr, uint8_t* buf, size_t size,
+                              size_t chunk, size_t* done);
+
 //------------------------------------------------------------------------------
 //! @brief      check if device supports sp upload
 //!
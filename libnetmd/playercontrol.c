@@ -25,6 +25,7 @@
 #include "playercontrol.h"
 #include "utils.h"
 #include "const.h"
+#include "libnetmd_intern.h"
 
 
 static netmd_error netmd_playback_control(netmd_dev_handle* dev, unsigned char code)
@@ -128,7 +129,7 @@ netmd_error netmd_change_track(netmd_dev_handle* dev, const uint16_t direction)
     return NETMD_NO_ERROR;
 }
 
-netmd_error netmd_get_track(netmd_dev_handle* dev, uint16_t *track)
+netmd_error netmd_get_track_position(netmd_dev_handle* dev, uint16_t *track, netmd_time* time)
 {
     unsigned char request[] = {0x00, 0x18, 0x09, 0x80, 0x01, 0x04,
                                0x30, 0x88, 0x02, 0x00, 0x30, 0x88,
@@ -137,13 +138,60 @@ netmd_error netmd_get_track(netmd_dev_handle* dev, uint16_t *track)
                                0x00, 0x00, 0x00, 0x00};
     unsigned char buf[255];
 
-    /* TODO: error checking */
-    netmd_exch_message(dev, request, 28, buf);
-    *track = bcd_to_proper(buf + 35, 2) & 0xffff;
+    /* track and position come with the same reply */
+    if (netmd_exch_message(dev, request, sizeof(request), buf) < 41) {
+        return NETMD_ERROR;
+    }
+
+    if (track != NULL) {
+        *track = bcd_to_proper(buf + 35, 2) & 0xffff;
+    }
+
+    if (time != NULL) {
+        time->hour = bcd_to_proper(buf + 37, 1) & 0xff;
+        time->minute = bcd_to_proper(buf + 38, 1) & 0xff;
+        time->second = bcd_to_proper(buf + 39, 1) & 0xff;
+        time->frame = bcd_to_proper(buf + 40, 1) & 0xff;
+    }
 
     return NETMD_NO_ERROR;
 }
 
+netmd_error netmd_get_track(netmd_dev_handle* dev, uint16_t *track)
+{
+    return netmd_get_track_position(dev, track, NULL);
+}
+
+netmd_error netmd_get_operating_status(netmd_dev_handle* dev, uint16_t *status)
+{
+    unsigned char request[] = {0x00, 0x18, 0x09, 0x80, 0x01, 0x03,
+                               0x30, 0x88, 0x02, 0x00, 0x30, 0x88,
+                               0x05, 0x00, 0x30, 0x88, 0x06, 0x00,
+                               0xff, 0x00, 0x00, 0x00, 0x00, 0x00};
+    unsigned char buf[255];
+    netmd_error ret = NETMD_ERROR;
+    int size;
+
+    if (netmd_dev_lock(dev) != NETMD_NO_ERROR) {
+        return NETMD_ERROR;
+    }
+
+    netmd_change_descriptor_state(dev, operatingStatusBlock, nda_openread);
+
+    /* reply: ... 10 00 00 xx 00 00 00 06 88 06 00 02 <status (2 bytes)> */
+    size = netmd_exch_message(dev, request, sizeof(request), buf);
+
+    if ((size >= 32) && (buf[26] == 0x88) && (buf[27] == 0x06)) {
+        *status = (uint16_t)((buf[30] << 8) | buf[31]);
+        ret = NETMD_NO_ERROR;
+    }
+
+    netmd_change_descriptor_state(dev, operatingStatusBlock, nda_close);
+    netmd_dev_unlock(dev);
+
+    return ret;
+}
+
 netmd_error netmd_track_next(netmd_dev_handle* dev)
 {
     return netmd_change_track(dev, NETMD_TRACK_NEXT);
@@ -190,21 +238,7 @@ const netmd_time* netmd_parse_time(unsigned char* src, netmd_time* time)
 
 netmd_error netmd_get_position(netmd_dev_handle* dev, netmd_time* time)
 {
-    unsigned char request[] = {0x00, 0x18, 0x09, 0x80, 0x01, 0x04,
-                               0x30, 0x88, 0x02, 0x00, 0x30, 0x88,
-                               0x05, 0x00, 0x30, 0x00, 0x03, 0x00,
-                               0x30, 0x00, 0x02, 0x00, 0xff, 0x00,
-                               0x00, 0x00, 0x00, 0x00};
-    unsigned char buf[255];
-
-    /* TODO: error checking */
-    netmd_exch_message(dev, request, sizeof(request), buf);
-    time->hour = bcd_to_proper(buf + 37, 1) & 0xff;
-    time->minute = bcd_to_proper(buf + 38, 1) & 0xff;
-    time->second = bcd_to_proper(buf + 39, 1) & 0xff;
-    time->frame = bcd_to_proper(buf + 40, 1) & 0xff;
-
-    return NETMD_NO_ERROR;
+    return netmd_get_track_position(dev, NULL, time);
 }
 
 netmd_error netmd_get_disc_capacity(netmd_dev_handle* dev, netmd_disc_capacity* capacity)
@@ -137,6 +137,25 @@ netmd_error netmd_get_track(netmd_dev_handle* dev, uint16_t *track);
 */
 netmd_error netmd_get_position(netmd_dev_handle* dev, netmd_time* time);
 
+/**
+   Gets the currently playing track and the position within it with one
+   command exchange.
+
+   @param dev Handle to the open minidisc player.
+   @param track Pointer where to save the current track (may be NULL).
+   @param time Pointer to save the current time to (may be NULL).
+*/
+netmd_error netmd_get_track_position(netmd_dev_handle* dev, uint16_t *track,
+                                     netmd_time* time);
+
+/**
+   Gets the operating status (playing, paused, stopped, ...).
+
+   @param dev Handle to the open minidisc player.
+   @param status Pointer to save the status to (NETMD_OPERATING_STATUS_*).
+*/
+netmd_error netmd_get_operating_status(netmd_dev_handle* dev, uint16_t *status);
+
 /**
    Gets the used, total and available disc capacity (total and available
    capacity depend on current recording settings)
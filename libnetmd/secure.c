@@ -34,17 +34,245 @@
 #include <stdio.h>
 #include <libusb-1.0/libusb.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include "secure.h"
 #include "const.h"
 #include "utils.h"
 #include "log.h"
 #include "trackinformation.h"
+#include "netmd_trace.h"
+#include "netmd_dev.h"
 
 
 static const unsigned char secure_header[] = { 0x18, 0x00, 0x08, 0x00, 0x46,
                                                0xf0, 0x03, 0x01, 0x03 };
 
+/* smallest bulk chunk on upload */
+#define NETMD_CHUNK_MIN 0x4000U
+
+/* healthy full size chunks before the chunk size grows */
+#define NETMD_CHUNK_GROW_AFTER 4
+
+/** @brief cipher handle, keyed on demand */
+typedef struct
+{
+    gcry_cipher_hd_t hd;        /**< cipher handle                */
+    int              open;      /**< handle is open               */
+    size_t           keylen;    /**< length of key (0 -> no key)  */
+    unsigned char    key[24];   /**< key the handle is set up with */
+} crypto_slot_t;
+
+/** @brief cipher handles reused for all tracks of a session */
+struct netmd_crypto
+{
+    crypto_slot_t root_ecb;     /**< DES ECB, root key (session key)       */
+    crypto_slot_t root_mac;     /**< 3DES CBC, root key (session key)      */
+    crypto_slot_t kek_ecb;      /**< DES ECB, key encryption key           */
+    crypto_slot_t data_cbc;     /**< DES CBC, track data key               */
+    crypto_slot_t sess_ecb;     /**< DES ECB, session key                  */
+    crypto_slot_t sess_cbc;     /**< DES CBC, session key                  */
+};
+
+//------------------------------------------------------------------------------
+//! @brief      get a cipher handle set up with a key; the handle is opened
+//!             on first use and only re-keyed if the key changed
+//!
+//! @param[in]  slot    cipher slot
+//! @param[in]  algo    cipher algorithm
+//! @param[in]  mode    cipher mode
+//! @param[in]  key     key
+//! @param[in]  keylen  key length
+//!
+//! @return     cipher handle; NULL -> error
+//------------------------------------------------------------------------------
+static gcry_cipher_hd_t crypto_slot(crypto_slot_t* slot, int algo, int mode,
+                                    const unsigned char* key, size_t keylen)
+{
+    if (!slot->open)
+    {
+        if (gcry_cipher_open(&slot->hd, algo, mode, 0) != 0)
+        {
+            return NULL;
+        }
+        slot->open   = 1;
+        slot->keylen = 0;
+    }
+
+    if ((slot->keylen != keylen) || memcmp(slot->key, key, keylen))
+    {
+        /* weak keys are reported but set anyway, as before */
+        gcry_cipher_setkey(slot->hd, key, keylen);
+        memcpy(slot->key, key, keylen);
+        slot->keylen = keylen;
+    }
+
+    return slot->hd;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      close a cipher slot
+//!
+//! @param[in]  slot    cipher slot
+//------------------------------------------------------------------------------
+static void crypto_slot_close(crypto_slot_t* slot)
+{
+    if (slot->open)
+    {
+        gcry_cipher_close(slot->hd);
+    }
+
+    memset(slot, 0, sizeof(crypto_slot_t));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      create a crypto context not bound to a device
+//!
+//! @return     crypto context; NULL -> error
+//------------------------------------------------------------------------------
+netmd_crypto* netmd_crypto_open(void)
+{
+    return (netmd_crypto*)calloc(1, sizeof(netmd_crypto));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      free a crypto context created with netmd_crypto_open()
+//!
+//! @param[in/out] crypto   pointer to crypto context
+//------------------------------------------------------------------------------
+void netmd_crypto_close(netmd_crypto** crypto)
+{
+    netmd_crypto* c;
+
+    if ((crypto == NULL) || ((c = *crypto) == NULL))
+    {
+        return;
+    }
+
+    crypto_slot_close(&c->root_ecb);
+    crypto_slot_close(&c->root_mac);
+    crypto_slot_close(&c->kek_ecb);
+    crypto_slot_close(&c->data_cbc);
+    crypto_slot_close(&c->sess_ecb);
+    crypto_slot_close(&c->sess_cbc);
+
+    /* keys stay in memory otherwise */
+    memset(c, 0, sizeof(netmd_crypto));
+    free(c);
+    *crypto = NULL;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      get the crypto context of a device handle (created on first
+//!             use, freed by netmd_close())
+//!
+//! @param[in]  dev     device handle
+//!
+//! @return     crypto context; NULL -> error
+//------------------------------------------------------------------------------
+netmd_crypto* netmd_crypto_get(netmd_dev_handle* dev)
+{
+    return netmd_dev_crypto(dev);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      calculate the session key (retail MAC of the nonces)
+//!
+//! @param[in]  crypto      crypto context
+//! @param[in]  rootkey     root key (16 bytes)
+//! @param[in]  hostnonce   host nonce (8 bytes)
+//! @param[in]  devnonce    device nonce (8 bytes)
+//! @param[out] sessionkey  session key (8 bytes)
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmd_crypto_session_key(netmd_crypto* crypto, const unsigned char* rootkey,
+                             const unsigned char* hostnonce, const unsigned char* devnonce,
+                             unsigned char* sessionkey)
+{
+    gcry_cipher_hd_t ecb, mac;
+    unsigned char des3_key[24];
+    unsigned char iv[8] = { 0 };
+
+    memcpy(des3_key, rootkey, 16);
+    memcpy(des3_key + 16, rootkey, 8);
+
+    if (((ecb = crypto_slot(&crypto->root_ecb, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_ECB, rootkey, 8)) == NULL)
+        || ((mac = crypto_slot(&crypto->root_mac, GCRY_CIPHER_3DES, GCRY_CIPHER_MODE_CBC, des3_key, 24)) == NULL))
+    {
+        return -1;
+    }
+
+    gcry_cipher_encrypt(ecb, iv, 8, hostnonce, 8);
+    gcry_cipher_setiv(mac, iv, 8);
+    gcry_cipher_encrypt(mac, sessionkey, 8, devnonce, 8);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      create a new track data key. A nonce is good enough here:
+//!             the key only has to differ between tracks of a session.
+//!
+//! @param[in]  crypto              crypto context
+//! @param[in]  key_encryption_key  key encryption key (8 bytes)
+//! @param[out] key                 data key wrapped with the kek (8 bytes)
+//! @param[out] raw_key             data key (8 bytes), see crypto_data()
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int crypto_data_key(netmd_crypto* crypto, const unsigned char* key_encryption_key,
+                           unsigned char* key, unsigned char* raw_key)
+{
+    gcry_cipher_hd_t kek;
+
+    if ((kek = crypto_slot(&crypto->kek_ecb, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_ECB, key_encryption_key, 8)) == NULL)
+    {
+        return -1;
+    }
+
+    gcry_create_nonce(raw_key, 8);
+    gcry_cipher_decrypt(kek, key, 8, raw_key, 8);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      get the track data cipher
+//!
+//! @param[in]  crypto   crypto context
+//! @param[in]  raw_key  data key from crypto_data_key() (8 bytes)
+//!
+//! @return     DES CBC handle set up with the data key; NULL -> error
+//------------------------------------------------------------------------------
+static gcry_cipher_hd_t crypto_data(netmd_crypto* crypto, const unsigned char* raw_key)
+{
+    return crypto_slot(&crypto->data_cbc, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, raw_key, 8);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      get the device's crypto context; falls back to a temporary
+//!             one if the device has none
+//!
+//! @param[in]  dev     device handle (may be NULL)
+//! @param[out] tmp     temporary context (free with netmd_crypto_close())
+//!
+//! @return     crypto context; NULL -> error
+//------------------------------------------------------------------------------
+static netmd_crypto* crypto_acquire(netmd_dev_handle* dev, netmd_crypto** tmp)
+{
+    netmd_crypto* c = NULL;
+
+    *tmp = NULL;
+
+    if ((dev == NULL) || ((c = netmd_crypto_get(dev)) == NULL))
+    {
+        c = *tmp = netmd_crypto_open();
+    }
+
+    return c;
+}
+
 void build_request(unsigned char *request, const unsigned char cmd, unsigned char *data, const size_t data_size)
 {
     size_t header_length;
@@ -318,6 +546,7 @@ netmd_error netmd_secure_setup_download(netmd_dev_handle *dev,
 
     unsigned char iv[8] = { 0 };
     gcry_cipher_hd_t handle;
+    netmd_crypto *crypto, *tmp;
 
     netmd_response response;
     netmd_error error;
@@ -325,11 +554,17 @@ netmd_error netmd_secure_setup_download(netmd_dev_handle *dev,
     memcpy(data + 4, contentid, 20);
     memcpy(data + 24, key_encryption_key, 8);
 
-    gcry_cipher_open(&handle, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, 0);
-    gcry_cipher_setkey(handle, sessionkey, 8);
+    netmd_dev_lock(dev);
+    if (((crypto = crypto_acquire(dev, &tmp)) == NULL)
+        || ((handle = crypto_slot(&crypto->sess_cbc, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, sessionkey, 8)) == NULL)) {
+        netmd_crypto_close(&tmp);
+        netmd_dev_unlock(dev);
+        return NETMD_ERROR;
+    }
     gcry_cipher_setiv(handle, iv, 8);
     gcry_cipher_encrypt(handle, data, sizeof(data), NULL, 0);
-    gcry_cipher_close(handle);
+    netmd_crypto_close(&tmp);
+    netmd_dev_unlock(dev);
 
     memcpy(cmd, cmdhdr, sizeof(cmdhdr));
     memcpy(cmd + sizeof(cmdhdr), data, 32);
@@ -360,69 +595,336 @@ size_t netmd_get_frame_size(netmd_wireformat wireformat)
     return 0;
 }
 
-void netmd_transfer_song_packets(netmd_dev_handle *dev,
-                                 netmd_track_packets *packets,
-                                 size_t full_length)
+//------------------------------------------------------------------------------
+//! @brief      initialize a transfer control
+//!
+//! @param[out] ctl          transfer control
+//! @param[in]  cb           progress callback (may be NULL)
+//! @param[in]  ctx          callback context
+//! @param[in]  interval_ms  min. time between two callbacks in ms
+//------------------------------------------------------------------------------
+void netmd_transfer_ctl_init(netmd_transfer_ctl* ctl, netmd_progress_cb cb, void* ctx,
+                             unsigned int interval_ms)
+{
+    memset(ctl, 0, sizeof(netmd_transfer_ctl));
+    ctl->cb          = cb;
+    ctl->ctx         = ctx;
+    ctl->interval_ms = interval_ms;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      request to abort the transfer using this control; safe to
+//!             call from any thread or a signal handler
+//!
+//! @param[in]  ctl   transfer control
+//------------------------------------------------------------------------------
+void netmd_transfer_cancel(netmd_transfer_ctl* ctl)
+{
+    __atomic_store_n(&ctl->cancel, 1, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      check if the transfer was cancelled
+//!
+//! @param[in]  ctl   transfer control (may be NULL)
+//!
+//! @return     1 -> cancelled; 0 -> not cancelled
+//------------------------------------------------------------------------------
+int netmd_transfer_cancelled(netmd_transfer_ctl* ctl)
+{
+    return (ctl != NULL) && __atomic_load_n(&ctl->cancel, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      start a transfer: reset progress and report 0 bytes
+//!
+//! @param[in]  ctl     transfer control (may be NULL)
+//! @param[in]  total   bytes to transfer
+//------------------------------------------------------------------------------
+static void transfer_start(netmd_transfer_ctl* ctl, uint64_t total)
 {
+    netmd_progress progress = { 0, total, 0.0, 0 };
+
+    if (ctl == NULL)
+    {
+        return;
+    }
+
+    ctl->start_us  = ctl->last_us = netmd_trace_time_us();
+    ctl->last_done = 0;
+
+    if (ctl->cb != NULL)
+    {
+        ctl->cb(ctl->ctx, &progress);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      report transfer progress; the callback is throttled to the
+//!             control's interval, the final report is always passed on
+//!
+//! @param[in]  ctl     transfer control (may be NULL)
+//! @param[in]  done    bytes transferred
+//! @param[in]  total   bytes to transfer
+//------------------------------------------------------------------------------
+static void transfer_progress(netmd_transfer_ctl* ctl, uint64_t done, uint64_t total)
+{
+    netmd_progress progress;
+    uint64_t now;
+
+    if ((ctl == NULL) || (ctl->cb == NULL))
+    {
+        return;
+    }
+
+    now = netmd_trace_time_us();
+
+    if ((done < total) && ((now - ctl->last_us) < (ctl->interval_ms * 1000ull)))
+    {
+        return;
+    }
+
+    progress.done       = done;
+    progress.total      = total;
+    progress.elapsed_us = now - ctl->start_us;
+    progress.rate       = (now > ctl->last_us) ? ((done - ctl->last_done) * 1e6 / (now - ctl->last_us)) : 0.0;
+
+    ctl->last_us   = now;
+    ctl->last_done = done;
+    ctl->cb(ctl->ctx, &progress);
+}
+
+/** @brief read position in the upload stream (header + packet data) */
+typedef struct
+{
+    netmd_track_packets *p;         /**< current packet               */
+    size_t               off;       /**< read offset in packet        */
+    unsigned char        hdr[24];   /**< length, key and iv           */
+    size_t               hdr_off;   /**< header bytes already read    */
+} upload_stream_t;
+
+//------------------------------------------------------------------------------
+//! @brief      bytes left in the current packet (incl. header before the
+//!             first one); the stream continues CBC over packet borders,
+//!             so it may be cut anywhere
+//!
+//! @param[in]  st    upload stream
+//!
+//! @return     number of bytes
+//------------------------------------------------------------------------------
+static size_t upload_stream_packet(const upload_stream_t* st)
+{
+    return (sizeof(st->hdr) - st->hdr_off) + ((st->p != NULL) ? (st->p->length - st->off) : 0);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      copy the next bytes of the upload stream
+//!
+//! @param[in]  st    upload stream
+//! @param[out] buf   buffer
+//! @param[in]  n     bytes wanted
+//!
+//! @return     bytes copied
+//------------------------------------------------------------------------------
+static size_t upload_stream_read(upload_stream_t* st, unsigned char* buf, size_t n)
+{
+    size_t done = 0, len;
+
+    if (st->hdr_off < sizeof(st->hdr)) {
+        len = netmd_min(n, sizeof(st->hdr) - st->hdr_off);
+        memcpy(buf, st->hdr + st->hdr_off, len);
+        st->hdr_off += len;
+        done        += len;
+    }
+
+    while ((done < n) && (st->p != NULL)) {
+        len = netmd_min(n - done, st->p->length - st->off);
+        memcpy(buf + done, st->p->data + st->off, len);
+        st->off += len;
+        done    += len;
+
+        if (st->off == st->p->length) {
+            st->p   = st->p->next;
+            st->off = 0;
+        }
+    }
+
+    return done;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      send one chunk; a timed out or stalled bulk transfer is
+//!             retried with the bytes the device didn't get
+//!
+//! @param[in]  dev       device handle
+//! @param[in]  buf       chunk data
+//! @param[in]  size      chunk size
+//! @param[in]  retries   max. retries
+//! @param[in]  timeout   bulk timeout in ms
+//! @param[in]  ctl       transfer control (may be NULL)
+//! @param[out] stat      chunk statistics (summed up over all tries)
+//!
+//! @return     libusb result of the last try
+//------------------------------------------------------------------------------
+static int upload_chunk(netmd_dev_handle *dev, unsigned char *buf, size_t size, unsigned retries,
+                        unsigned int timeout, netmd_transfer_ctl *ctl, netmd_chunk_stat *stat)
+{
+    netmd_chunk_stat tr;
+    int error, transferred;
+    uint64_t t0, dt;
+
+    memset(stat, 0, sizeof(netmd_chunk_stat));
+    stat->size = size;
+
+    for (;;) {
+        transferred = 0;
+        t0    = netmd_trace_time_us();
+        error = libusb_bulk_transfer((libusb_device_handle*)dev, 2, buf + stat->transferred,
+                                     (int)(size - stat->transferred), &transferred, timeout);
+        netmd_trace_bulk(NETMD_TRACE_BULK_OUT, dev, error, (size_t)transferred, t0);
+
+        dt                 = netmd_trace_time_us() - t0;
+        stat->transferred += (size_t)transferred;
+        stat->duration_us += dt;
+        stat->result       = error;
+
+        /* callback gets this try's duration */
+        if ((ctl != NULL) && (ctl->chunk_cb != NULL)) {
+            tr             = *stat;
+            tr.duration_us = dt;
+            ctl->chunk_cb(ctl->ctx, &tr);
+        }
+
+        if ((error == LIBUSB_SUCCESS) || (stat->retries >= retries) || netmd_transfer_cancelled(ctl)
+            || ((error != LIBUSB_ERROR_TIMEOUT) && (error != LIBUSB_ERROR_PIPE))) {
+            break;
+        }
+
+        netmd_log(NETMD_LOG_WARNING, "bulk transfer failed after %zu of %zu bytes (%s), retry\n",
+                  stat->transferred, size, libusb_strerror(error));
+
+        if (error == LIBUSB_ERROR_PIPE) {
+            libusb_clear_halt((libusb_device_handle*)dev, 2);
+        }
+
+        stat->retries++;
+    }
+
+    return error;
+}
+
+netmd_error netmd_transfer_song_packets(netmd_dev_handle *dev,
+                                        netmd_track_packets *packets,
+                                        size_t full_length,
+                                        netmd_transfer_ctl *ctl)
+{
+    const netmd_dev_profile *profile = netmd_dev_profile_get(dev);
     netmd_track_packets *p;
+    netmd_chunk_stat stat;
+    upload_stream_t st;
     unsigned char *packet, *buf;
     size_t packet_size, total_transferred = 0, display_length = full_length + 24;
+    size_t chunk = 0, max_chunk, buf_size;
+    unsigned healthy = 0, retries = 0;
+    double rate, avg_rate = 0.0;
     int error = 0;
-    int transferred = 0;
-    int first_packet = 1;
     time_t start_time = time(NULL), duration;
+    netmd_error result = NETMD_NO_ERROR;
+
+    /* chunk sizes are multiples of 16 KiB, as the packet sizes */
+    max_chunk = profile->max_chunk & ~(size_t)0x3fffU;
+    if (max_chunk < NETMD_CHUNK_MIN)
+        max_chunk = NETMD_CHUNK_MIN;
+
+    /* adaptive: start at a safe size and grow while transfers stay healthy;
+     * otherwise one bulk transfer per packet */
+    if (profile->start_chunk != 0) {
+        chunk = profile->start_chunk & ~(size_t)0x3fffU;
+        chunk = (chunk < NETMD_CHUNK_MIN) ? NETMD_CHUNK_MIN : netmd_min(chunk, max_chunk);
+    }
 
-    p = packets;
-    while (p != NULL) {
-        /* length + key + iv + data */
-        if(first_packet)                                     // length, key and iv in first packet only
-            packet_size = 8 + 8 + 8 + p->length;
-        else
-            packet_size = p->length;
-
-        packet = malloc(packet_size);
-        buf = packet;
-
-        /* build packet... */
-        if(first_packet) {                                   // lenght, key and iv in first packet only
-            netmd_copy_quadword_to_buffer(&buf, full_length);
-            memcpy(buf, p->key, 8);
-            memcpy(buf + 8, p->iv, 8);
-            memcpy(buf + 16, p->data, p->length);
-        }
-        else {
-            memcpy(buf, p->data, p->length);
-        }
+    /* the last packet may be a bit larger due to frame padding */
+    buf_size = max_chunk;
+    for (p = packets; p != NULL; p = p->next)
+        if ((p->length + 24) > buf_size)
+            buf_size = p->length + 24;
+
+    if ((packet = malloc(buf_size)) == NULL)
+        return NETMD_ERROR;
+
+    memset(&st, 0, sizeof(st));
+    st.p = packets;
+    buf  = st.hdr;
+    netmd_copy_quadword_to_buffer(&buf, full_length);
+    if (packets != NULL) {
+        memcpy(buf, packets->key, 8);
+        memcpy(buf + 8, packets->iv, 8);
+    }
 
-        /* ... send it */
-        error = libusb_bulk_transfer((libusb_device_handle*)dev, 2, packet, (int)packet_size, &transferred, 80000);
-        total_transferred += (size_t) transferred;
+    transfer_start(ctl, display_length);
 
-        if (error != LIBUSB_SUCCESS)
-            netmd_log(NETMD_LOG_ERROR, "USB transfer error after %zu of %zu total bytes (%d of %d bytes in packet): %s\n",
-                total_transferred, display_length, transferred, packet_size, libusb_strerror(error));
-        else
-            netmd_log(NETMD_LOG_VERBOSE, "%zu of %zu bytes (%zu%%) transferred (%d of %d bytes in packet)\n",
-                total_transferred, display_length, (total_transferred * 100 / display_length), transferred, packet_size);
+    while (upload_stream_packet(&st) > 0) {
+        /* chunks are independent bulk transfers; stop between two */
+        if (netmd_transfer_cancelled(ctl)) {
+            netmd_log(NETMD_LOG_WARNING, "transfer cancelled after %zu of %zu bytes\n", total_transferred, display_length);
+            result = NETMD_CANCELLED;
+            break;
+        }
 
-        /* cleanup */
-        free(packet);
-        buf = NULL;
+        packet_size = upload_stream_read(&st, packet, (chunk != 0) ? chunk : upload_stream_packet(&st));
 
-        if (error >= 0) {
-            p = p->next;
-            first_packet = 0;
-        }
-        else {
+        error = upload_chunk(dev, packet, packet_size, profile->bulk_retries, profile->bulk_timeout_ms, ctl, &stat);
+        total_transferred += stat.transferred;
+        retries           += stat.retries;
+
+        if (error != LIBUSB_SUCCESS) {
+            netmd_log(NETMD_LOG_ERROR, "USB transfer error after %zu of %zu total bytes (%zu of %zu bytes in packet): %s\n",
+                total_transferred, display_length, stat.transferred, packet_size, libusb_strerror(error));
+            result = netmd_transfer_cancelled(ctl) ? NETMD_CANCELLED : NETMD_USB_ERROR;
             break;
         }
+
+        /* adapt chunk size: only full chunks tell something about the
+         * throughput; the average restarts with each size change */
+        if ((chunk != 0) && (packet_size == chunk)) {
+            rate = (stat.duration_us > 0) ? (packet_size * 1e6 / stat.duration_us) : 0.0;
+
+            if ((stat.retries > 0) || ((avg_rate > 0.0) && (rate < (avg_rate / 2.0)))) {
+                /* stall: back off */
+                chunk    = ((chunk / 2) < NETMD_CHUNK_MIN) ? NETMD_CHUNK_MIN : ((chunk / 2) & ~(size_t)0x3fffU);
+                healthy  = 0;
+                avg_rate = 0.0;
+            }
+            else if ((++healthy >= NETMD_CHUNK_GROW_AFTER) && (chunk < max_chunk)) {
+                chunk    = netmd_min(chunk * 2, max_chunk);
+                healthy  = 0;
+                avg_rate = 0.0;
+            }
+            else {
+                avg_rate = (avg_rate > 0.0) ? ((avg_rate * 3.0 + rate) / 4.0) : rate;
+            }
+        }
+
+        netmd_log(NETMD_LOG_VERBOSE, "%zu of %zu bytes (%zu%%) transferred (%zu bytes in %.1f ms, next chunk %zu)\n",
+            total_transferred, display_length, (total_transferred * 100 / display_length), packet_size,
+            stat.duration_us / 1000.0, (chunk != 0) ? chunk : upload_stream_packet(&st));
+
+        transfer_progress(ctl, total_transferred, display_length);
     }
 
+    free(packet);
+
     /* report statistics on successful transfer */
     duration = time(NULL) - start_time;
-    if (error >= 0 && duration > 0)
+    if (result == NETMD_NO_ERROR && duration > 0)
         netmd_log(NETMD_LOG_VERBOSE, "netmd_transfer_song_packets : transfer took %d seconds (%d kB/sec)\n",
             duration, (display_length / (size_t)duration / 1024));
+
+    if (chunk != 0)
+        netmd_log(NETMD_LOG_VERBOSE, "netmd_transfer_song_packets : adaptive chunk size ended at %zu bytes, %u retries\n",
+            chunk, retries);
+
+    return result;
 }
 
 netmd_error netmd_prepare_packets(unsigned char* data, size_t data_length,
@@ -430,118 +932,226 @@ netmd_error netmd_prepare_packets(unsigned char* data, size_t data_length,
                                   size_t *packet_count, unsigned int *frames, size_t channels, size_t *packet_length,
                                   unsigned char *key_encryption_key, netmd_wireformat format)
 {
-    size_t position = 0;
+    return netmd_prepare_packets_ex(data, data_length, packets, packet_count, frames, channels, packet_length,
+                                    key_encryption_key, format, 0x00100000U, NULL);
+}
+
+/** @brief packets prepared from data arriving in blocks */
+struct netmd_packet_writer
+{
+    netmd_crypto        *crypto;        /**< crypto context               */
+    netmd_crypto        *tmp;           /**< temporary context (or NULL)  */
+    unsigned char        raw_key[8];    /**< data key                     */
+    unsigned char        key[8];        /**< data key wrapped with kek    */
+    unsigned char        iv[8];         /**< CBC chaining value           */
+    size_t               first_chunk;   /**< packet size                  */
+    size_t               frame_size;    /**< frame size on the wire       */
+    netmd_track_packets *packets;       /**< packet list                  */
+    netmd_track_packets *tail;          /**< last packet in list          */
+    netmd_track_packets *last;          /**< packet being filled (or NULL)*/
+    size_t               fill;          /**< bytes in last packet         */
+    size_t               count;         /**< finished packets             */
+    size_t               position;      /**< bytes in finished packets    */
+    netmd_error          error;         /**< sticky error                 */
+};
+
+netmd_packet_writer* netmd_packet_writer_open(unsigned char *key_encryption_key, netmd_wireformat format,
+                                              size_t channels, size_t max_chunk, netmd_crypto *crypto)
+{
+    netmd_packet_writer *w;
+
+    if ((w = calloc(1, sizeof(netmd_packet_writer))) == NULL)
+        return NULL;
+
     /* Limit chunksize to multiple of 16384 bytes (incl. 24 byte header data for first packet).
      * Large sizes cause instability in some players especially with ATRAC3 files. */
-    size_t chunksize, packet_data_length, first_chunk = 0x00100000U;
-    size_t frame_size = netmd_get_frame_size(format);
-    size_t frame_padding = 0;
-    netmd_track_packets *last = NULL;
-    netmd_track_packets *next = NULL;
+    w->first_chunk = max_chunk & ~(size_t)0x3fffU;
+    w->frame_size  = netmd_get_frame_size(format);
 
-    gcry_cipher_hd_t key_handle;
-    gcry_cipher_hd_t data_handle;
+    if (w->first_chunk < 0x4000U)
+        w->first_chunk = 0x4000U;
+
+    if(channels == NETMD_CHANNELS_MONO)
+        w->frame_size /= 2;
+
+    if ((crypto == NULL) && ((crypto = w->tmp = netmd_crypto_open()) == NULL)) {
+        free(w);
+        return NULL;
+    }
+
+    w->crypto = crypto;
 
     /* We have no use for "security" (= DRM) so just use constant IV.
      * However, the key has to be randomized, because the device apparently checks
      * during track commit that the same key is not re-used during a single session. */
-    unsigned char iv[8] = { 0, 0, 0, 0, 0, 0, 0 ,0 };
-    unsigned char raw_key[8] = { 0 }; /* data encryption key */
-    unsigned char key[8] = { 0 }; /* data encryption key wrapped with session key */
+    if (crypto_data_key(crypto, key_encryption_key, w->key, w->raw_key) != 0) {
+        netmd_crypto_close(&w->tmp);
+        free(w);
+        return NULL;
+    }
 
-    netmd_error error = NETMD_NO_ERROR;
+    return w;
+}
 
-    if(channels == NETMD_CHANNELS_MONO)
-        frame_size /= 2;
+//------------------------------------------------------------------------------
+//! @brief      encrypt the packet being filled and chain the next one
+//!
+//! @param[in]  w     packet writer
+//!
+//! @return     netmd_error
+//------------------------------------------------------------------------------
+static netmd_error packet_writer_seal(netmd_packet_writer *w)
+{
+    netmd_track_packets *p = w->last;
+    gcry_cipher_hd_t data_handle;
 
-    gcry_cipher_open(&key_handle, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_ECB, 0);
-    gcry_cipher_open(&data_handle, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, 0);
-    gcry_cipher_setkey(key_handle, key_encryption_key, 8);
+    /* the context may have been used for other keys in between */
+    if ((data_handle = crypto_data(w->crypto, w->raw_key)) == NULL)
+        return NETMD_ERROR;
 
-    /* generate key, use same key for all packets */
-    gcry_randomize(raw_key, sizeof(raw_key), GCRY_STRONG_RANDOM);
-    gcry_cipher_decrypt(key_handle, key, 8, raw_key, sizeof(raw_key));
-    gcry_cipher_setkey(data_handle, raw_key, sizeof(raw_key));
+    /* crypt data in place */
+    memcpy(p->iv, w->iv, 8);
+    memcpy(p->key, w->key, 8);
+    gcry_cipher_setiv(data_handle, w->iv, 8);
+    gcry_cipher_encrypt(data_handle, p->data, p->length, NULL, 0);
 
-    *packet_count = 0;
-    while (position < data_length) {
+    /* use last encrypted block as iv for the next packet so we keep
+     * on Cipher Block Chaining */
+    memcpy(w->iv, p->data + p->length - 8, 8);
 
-         /* Decrease chunksize by 24 (length, iv and key) for 1st packet to keep packet size constant. */
-        if ((*packet_count) > 0)
-            chunksize = first_chunk;
-        else
-            chunksize = first_chunk - 24U;
+    /* next packet */
+    w->position += p->length;
+    w->count++;
+    w->last = NULL;
+    netmd_log(NETMD_LOG_VERBOSE, "generating packet %zu : %zu bytes\n", w->count, p->length);
 
-        packet_data_length = chunksize;
+    return NETMD_NO_ERROR;
+}
 
-        if ((data_length - position) < chunksize) { /* last packet */
-            packet_data_length = data_length - position;
+netmd_error netmd_packet_writer_add(netmd_packet_writer *w, const unsigned char *data, size_t length)
+{
+    netmd_track_packets *next;
+    size_t n;
+
+    while ((w->error == NETMD_NO_ERROR) && (length > 0)) {
+
+        if (w->last == NULL) {
+            /* alloc memory */
+            if ((next = calloc(1, sizeof(netmd_track_packets))) == NULL) {
+                w->error = NETMD_ERROR;
+                break;
+            }
+
+            /* Decrease chunksize by 24 (length, iv and key) for 1st packet to keep packet size constant. */
+            next->length = (w->count > 0) ? w->first_chunk : (w->first_chunk - 24U);
+            next->data   = malloc(next->length);
+            next->iv     = malloc(8);
+            next->key    = malloc(8);
+
+            /* linked list */
+            if (w->tail != NULL) {
+                w->tail->next = next;
+            }
+            else {
+                w->packets = next;
+            }
+
+            w->tail = next;
+            w->last = next;
+            w->fill = 0;
+
+            if ((next->data == NULL) || (next->iv == NULL) || (next->key == NULL)) {
+                w->error = NETMD_ERROR;
+                break;
+            }
+        }
 
-            /* If input data is not an even multiple of the frame size, pad to frame size.
-             * Since all frame sizes are divisible by 8, cipher padding is a non-issue.
-             * Under rare circumstances the padding may lead to the last packet being slightly
-             * larger than first_chunk; this should not matter. */
-            if((data_length % frame_size) != 0)
-                frame_padding = frame_size - (data_length % frame_size);
+        n = netmd_min(length, w->last->length - w->fill);
+        memcpy(w->last->data + w->fill, data, n);
+        w->fill += n;
+        data    += n;
+        length  -= n;
 
-            chunksize = packet_data_length + frame_padding;
-            netmd_log(NETMD_LOG_VERBOSE, "last packet: packet_data_length=%d + frame_padding=%d = chunksize=%d\n",
-                packet_data_length, frame_padding, chunksize);
+        if (w->fill == w->last->length) {
+            w->error = packet_writer_seal(w);
         }
+    }
 
-        /* alloc memory */
-        next = malloc(sizeof(netmd_track_packets));
-        next->length = chunksize;
-        next->data = malloc(next->length);
-        memset(next->data, 0, next->length);
-        next->iv = malloc(8);
-        next->key = malloc(8);
-        next->next = NULL;
-
-        /* linked list */
-        if (last != NULL) {
-            last->next = next;
-        }
-        else {
-            *packets = next;
-        }
+    return w->error;
+}
 
-        /* crypt data */
-        memcpy(next->iv, iv, 8);
-        memcpy(next->key, key, 8);
-        gcry_cipher_setiv(data_handle, iv, 8);
-
-        if (chunksize > packet_data_length) {
-            /* If last frame is padded, copy plaintext to chunk buffer and encrypt in place.
-             * This avoids calling gcry_cipher_encrypt() with outsize > insize, which leads
-             * to noise at end of track. */
-            memcpy(next->data, data + position, packet_data_length);
-            gcry_cipher_encrypt(data_handle, next->data, chunksize, NULL, 0);
+netmd_error netmd_packet_writer_close(netmd_packet_writer **w, netmd_track_packets **packets,
+                                      size_t *packet_count, unsigned int *frames, size_t *packet_length)
+{
+    netmd_packet_writer *pw;
+    netmd_track_packets *p;
+    netmd_error error;
+    size_t total, frame_padding = 0;
+    unsigned char *padded;
+
+    if ((w == NULL) || ((pw = *w) == NULL))
+        return NETMD_ERROR;
+
+    if ((pw->error == NETMD_NO_ERROR) && ((p = pw->last) != NULL)) { /* last packet */
+        /* If input data is not an even multiple of the frame size, pad to frame size.
+         * Since all frame sizes are divisible by 8, cipher padding is a non-issue.
+         * Under rare circumstances the padding may lead to the last packet being slightly
+         * larger than first_chunk; this should not matter. */
+        total = pw->position + pw->fill;
+        if((total % pw->frame_size) != 0)
+            frame_padding = pw->frame_size - (total % pw->frame_size);
+
+        netmd_log(NETMD_LOG_VERBOSE, "last packet: packet_data_length=%zu + frame_padding=%zu = chunksize=%zu\n",
+            pw->fill, frame_padding, pw->fill + frame_padding);
+
+        if ((padded = realloc(p->data, pw->fill + frame_padding)) == NULL) {
+            pw->error = NETMD_ERROR;
         }
         else {
-            gcry_cipher_encrypt(data_handle, next->data, chunksize, data + position, packet_data_length);
+            memset(padded + pw->fill, 0, frame_padding);
+            p->data   = padded;
+            p->length = pw->fill + frame_padding;
+            pw->error = packet_writer_seal(pw);
         }
+    }
 
-        /* use last encrypted block as iv for the next packet so we keep
-         * on Cipher Block Chaining */
-        memcpy(iv, next->data + chunksize - 8, 8);
+    error = pw->error;
 
-        /* next packet */
-        position = position + chunksize;
-        (*packet_count)++;
-        last = next;
-        netmd_log(NETMD_LOG_VERBOSE, "generating packet %d : %d bytes\n", *packet_count, chunksize);
+    if ((error == NETMD_NO_ERROR) && (packets != NULL)) {
+        *packets = pw->packets;
+        if (packet_count != NULL)
+            *packet_count = pw->count;
+        if (frames != NULL)
+            *frames = (unsigned int) (pw->position / pw->frame_size);
+        if (packet_length != NULL)
+            *packet_length = pw->position;
+    }
+    else {
+        netmd_cleanup_packets(&pw->packets);
     }
 
-    gcry_cipher_close(key_handle);
-    gcry_cipher_close(data_handle);
-
-    *frames = (unsigned int) (position/frame_size);
-    *packet_length = position;
+    netmd_crypto_close(&pw->tmp);
+    free(pw);
+    *w = NULL;
 
     return error;
 }
 
+netmd_error netmd_prepare_packets_ex(unsigned char* data, size_t data_length,
+                                     netmd_track_packets **packets,
+                                     size_t *packet_count, unsigned int *frames, size_t channels, size_t *packet_length,
+                                     unsigned char *key_encryption_key, netmd_wireformat format, size_t max_chunk,
+                                     netmd_crypto *crypto)
+{
+    netmd_packet_writer *w;
+
+    if ((w = netmd_packet_writer_open(key_encryption_key, format, channels, max_chunk, crypto)) == NULL)
+        return NETMD_ERROR;
+
+    netmd_packet_writer_add(w, data, data_length);
+    return netmd_packet_writer_close(&w, packets, packet_count, frames, packet_length);
+}
+
 void netmd_cleanup_packets(netmd_track_packets **packets)
 {
     netmd_track_packets *current = *packets;
@@ -569,6 +1179,21 @@ netmd_error netmd_secure_send_track(netmd_dev_handle *dev,
 
                                     uint16_t *track, unsigned char *uuid,
                                     unsigned char *content_id)
+{
+    return netmd_secure_send_track_ex(dev, wireformat, discformat, frames, packets, packet_length,
+                                      sessionkey, track, uuid, content_id, NULL);
+}
+
+netmd_error netmd_secure_send_track_ex(netmd_dev_handle *dev,
+                                       netmd_wireformat wireformat,
+                                       unsigned char discformat,
+                                       unsigned int frames,
+                                       netmd_track_packets *packets,
+                                       size_t packet_length,
+                                       unsigned char *sessionkey,
+                                       uint16_t *track, unsigned char *uuid,
+                                       unsigned char *content_id,
+                                       netmd_transfer_ctl *ctl)
 {
     unsigned char cmdhdr[] = {0x00, 0x01, 0x00, 0x10, 0x01};
     unsigned char cmd[sizeof(cmdhdr) + 13];
@@ -579,6 +1204,7 @@ netmd_error netmd_secure_send_track(netmd_dev_handle *dev,
     netmd_error error;
 
     gcry_cipher_hd_t handle;
+    netmd_crypto *crypto, *tmp;
     unsigned char encryptedreply[32] = { 0 };
     unsigned char iv[8] = { 0 };
 
@@ -601,8 +1227,10 @@ netmd_error netmd_secure_send_track(netmd_dev_handle *dev,
     netmd_check_response(&response, 0x00, &error);
 
     if (error == NETMD_NO_ERROR) {
-        netmd_transfer_song_packets(dev, packets, packet_length);
+        error = netmd_transfer_song_packets(dev, packets, packet_length, ctl);
+    }
 
+    if (error == NETMD_NO_ERROR) {
         error = netmd_recv_secure_msg(dev, 0x28, &response, NETMD_STATUS_ACCEPTED);
         netmd_check_response_bulk(&response, cmdhdr, sizeof(cmdhdr), &error);
         *track = netmd_read_word(&response);
@@ -613,40 +1241,70 @@ netmd_error netmd_secure_send_track(netmd_dev_handle *dev,
     }
 
     if (error == NETMD_NO_ERROR) {
-        gcry_cipher_open(&handle, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, 0);
-        gcry_cipher_setiv(handle, iv, 8);
-        gcry_cipher_setkey(handle, sessionkey, 8);
-        gcry_cipher_decrypt(handle, encryptedreply, sizeof(encryptedreply), NULL, 0);
-        gcry_cipher_close(handle);
-
-        memcpy(uuid, encryptedreply, 8);
-        memcpy(content_id, encryptedreply + 12, 20);
+        netmd_dev_lock(dev);
+        if (((crypto = crypto_acquire(dev, &tmp)) != NULL)
+            && ((handle = crypto_slot(&crypto->sess_cbc, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, sessionkey, 8)) != NULL)) {
+            gcry_cipher_setiv(handle, iv, 8);
+            gcry_cipher_decrypt(handle, encryptedreply, sizeof(encryptedreply), NULL, 0);
+
+            memcpy(uuid, encryptedreply, 8);
+            memcpy(content_id, encryptedreply + 12, 20);
+        }
+        else {
+            error = NETMD_ERROR;
+        }
+        netmd_crypto_close(&tmp);
+        netmd_dev_unlock(dev);
     }
 
     return error;
 }
 
-netmd_error netmd_secure_real_recv_track(netmd_dev_handle *dev, uint32_t length, FILE *file, size_t chunksize)
+//------------------------------------------------------------------------------
+//! @brief      read track data from the device
+//!
+//! @param[in]  dev        device handle
+//! @param[in]  length     bytes to read
+//! @param[in]  file       output file
+//! @param[in]  chunksize  bytes per bulk transfer
+//! @param[in]  ctl        transfer control (may be NULL)
+//!
+//! @return     netmd_error
+//------------------------------------------------------------------------------
+static netmd_error secure_recv_track_data(netmd_dev_handle *dev, uint32_t length, FILE *file, size_t chunksize,
+                                          netmd_transfer_ctl *ctl)
 {
     uint32_t done = 0;
     int32_t transferred = 0;
     unsigned char *data;
     int status;
+    uint64_t t0;
     netmd_error error = NETMD_NO_ERROR;
 
     data = malloc(chunksize);
-    while (done < length) {
+    transfer_start(ctl, length);
+
+    while ((done < length) && (error == NETMD_NO_ERROR)) {
+        if (netmd_transfer_cancelled(ctl)) {
+            netmd_log(NETMD_LOG_WARNING, "transfer cancelled after %u of %u bytes\n", done, length);
+            error = NETMD_CANCELLED;
+            break;
+        }
+
         if ((length - done) < chunksize) {
             chunksize = length - done;
         }
 
+        t0     = netmd_trace_time_us();
         status = libusb_bulk_transfer((libusb_device_handle*)dev, 0x81, data, (int)chunksize, &transferred, 10000);
+        netmd_trace_bulk(NETMD_TRACE_BULK_IN, dev, status, (size_t)transferred, t0);
 
         if (status >= 0) {
             done += transferred;
             fwrite(data, (size_t) transferred, 1, file);
 
             netmd_log(NETMD_LOG_VERBOSE, "%.1f%%\n", (double)done/(double)length * 100);
+            transfer_progress(ctl, done, length);
         }
         else if (status != -LIBUSB_ERROR_TIMEOUT) {
             error = NETMD_USB_ERROR;
@@ -657,6 +1315,11 @@ netmd_error netmd_secure_real_recv_track(netmd_dev_handle *dev, uint32_t length,
     return error;
 }
 
+netmd_error netmd_secure_real_recv_track(netmd_dev_handle *dev, uint32_t length, FILE *file, size_t chunksize)
+{
+    return secure_recv_track_data(dev, length, file, chunksize, NULL);
+}
+
 uint8_t netmd_get_channel_count(unsigned char channel)
 {
     if (channel == NETMD_CHANNELS_MONO) {
@@ -752,8 +1415,8 @@ void netmd_write_wav_header(unsigned char format, uint32_t bytes, FILE *f)
     fwrite(header, sizeof(header), 1, f);
 }
 
-netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
-                                    FILE* file)
+static netmd_error secure_recv_track(netmd_dev_handle *dev, uint16_t track,
+                                     FILE* file, netmd_transfer_ctl *ctl)
 {
     unsigned char cmdhdr[] = {0x00, 0x10, 0x01};
     unsigned char cmd[sizeof(cmdhdr) + sizeof(track)] = { 0 };
@@ -796,7 +1459,7 @@ netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
     }
 
     if (error == NETMD_NO_ERROR) {
-        error = netmd_secure_real_recv_track(dev, length, file, 0x10000);
+        error = secure_recv_track_data(dev, length, file, 0x10000, ctl);
     }
 
     if (error == NETMD_NO_ERROR) {
@@ -817,6 +1480,7 @@ netmd_error netmd_secure_commit_track(netmd_dev_handle *dev, uint16_t track,
     unsigned char *buf;
 
     gcry_cipher_hd_t handle;
+    netmd_crypto *crypto, *tmp;
     unsigned char hash[8] = { 0 };
 
     netmd_response response;
@@ -827,11 +1491,17 @@ netmd_error netmd_secure_commit_track(netmd_dev_handle *dev, uint16_t track,
     buf += sizeof(cmdhdr);
     netmd_copy_word_to_buffer(&buf, track, 0);
 
-    gcry_cipher_open(&handle, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_ECB, 0);
-    gcry_cipher_setkey(handle, sessionkey, 8);
+    netmd_dev_lock(dev);
+    if (((crypto = crypto_acquire(dev, &tmp)) == NULL)
+        || ((handle = crypto_slot(&crypto->sess_ecb, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_ECB, sessionkey, 8)) == NULL)) {
+        netmd_crypto_close(&tmp);
+        netmd_dev_unlock(dev);
+        return NETMD_ERROR;
+    }
     gcry_cipher_encrypt(handle, buf, sizeof(hash), hash, sizeof(hash));
     buf += sizeof(hash);
-    gcry_cipher_close(handle);
+    netmd_crypto_close(&tmp);
+    netmd_dev_unlock(dev);
 
     /* Make sure that the device is well and truly finished with
      * what it was doing. Fixes USB interface crashes on at least
@@ -908,3 +1578,23 @@ netmd_error netmd_secure_set_track_protection(netmd_dev_handle *dev,
 
     return error;
 }
+
+netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
+                                    FILE* file)
+{
+    return netmd_secure_recv_track_ex(dev, track, file, NULL);
+}
+
+netmd_error netmd_secure_recv_track_ex(netmd_dev_handle *dev, uint16_t track,
+                                       FILE* file, netmd_transfer_ctl *ctl)
+{
+    netmd_error error;
+
+    /* keep other threads off the device while the track is read */
+    if ((error = netmd_dev_lock(dev)) == NETMD_NO_ERROR) {
+        error = secure_recv_track(dev, track, file, ctl);
+        netmd_dev_unlock(dev);
+    }
+
+    return error;
+}
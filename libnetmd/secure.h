@@ -9,6 +9,158 @@
 
 /* copy start */
 
+/**
+   Crypto context: DES / 3DES cipher handles which are opened and keyed
+   once and reused for all tracks of a session. Each device handle gets
+   one on first use (see netmd_crypto_get()); it's freed by netmd_close().
+   A context must not be used by several threads at the same time; the
+   library uses a device's context with the device locked only.
+*/
+typedef struct netmd_crypto netmd_crypto;
+
+/**
+   Create a crypto context not bound to a device.
+
+   @return crypto context; NULL on error
+*/
+netmd_crypto* netmd_crypto_open(void);
+
+/**
+   Free a crypto context created with netmd_crypto_open().
+
+   @param crypto pointer to crypto context, set to NULL
+*/
+void netmd_crypto_close(netmd_crypto** crypto);
+
+/**
+   Get the crypto context of a device handle, created on first use.
+
+   @param dev device handle
+   @return crypto context; NULL on error
+*/
+netmd_crypto* netmd_crypto_get(netmd_dev_handle* dev);
+
+/**
+   Calculate the session key from the exchanged nonces (retail MAC).
+
+   @param crypto crypto context
+   @param rootkey root key (16 bytes)
+   @param hostnonce host nonce (8 bytes)
+   @param devnonce device nonce (8 bytes)
+   @param sessionkey buffer for session key (8 bytes)
+   @return 0 -> ok; -1 -> error
+*/
+int netmd_crypto_session_key(netmd_crypto* crypto, const unsigned char* rootkey,
+                             const unsigned char* hostnonce, const unsigned char* devnonce,
+                             unsigned char* sessionkey);
+
+/**
+   Track transfer progress as passed to the progress callback.
+*/
+typedef struct {
+    /** bytes transferred so far */
+    uint64_t done;
+
+    /** bytes to transfer */
+    uint64_t total;
+
+    /** transfer rate in bytes/s since the last report */
+    double rate;
+
+    /** time since the transfer started in us */
+    uint64_t elapsed_us;
+} netmd_progress;
+
+/**
+   Progress callback, called from the transferring thread.
+
+   @param ctx callback context
+   @param progress current progress
+*/
+typedef void (*netmd_progress_cb)(void* ctx, const netmd_progress* progress);
+
+/**
+   Statistics of one upload chunk (bulk transfer), passed to the chunk
+   callback after every try.
+*/
+typedef struct {
+    /** chunk size in bytes */
+    size_t size;
+
+    /** bytes the device took */
+    size_t transferred;
+
+    /** duration of the bulk transfer(s) in us */
+    uint64_t duration_us;
+
+    /** retries so far */
+    unsigned retries;
+
+    /** libusb result */
+    int result;
+} netmd_chunk_stat;
+
+/**
+   Chunk callback, called from the transferring thread.
+
+   @param ctx callback context
+   @param stat chunk statistics
+*/
+typedef void (*netmd_chunk_cb)(void* ctx, const netmd_chunk_stat* stat);
+
+/**
+   Progress and cancel control for track transfers. Initialize with
+   netmd_transfer_ctl_init(); netmd_transfer_cancel() may be called from
+   any thread (and from a signal handler). Cancellation is checked
+   between bulk transfers; an aborted transfer returns NETMD_CANCELLED.
+*/
+typedef struct {
+    /** progress callback (may be NULL) */
+    netmd_progress_cb cb;
+
+    /** callback context */
+    void* ctx;
+
+    /** min. time between two callbacks in ms (0 -> after every packet) */
+    unsigned int interval_ms;
+
+    /** upload chunk callback (may be NULL), e.g. to find a deck's best
+        chunk size; gets the same context as the progress callback */
+    netmd_chunk_cb chunk_cb;
+
+    /** cancel flag, set by netmd_transfer_cancel() */
+    int cancel;
+
+    /** internal: time stamps and bytes of the last report */
+    uint64_t start_us, last_us, last_done;
+} netmd_transfer_ctl;
+
+/**
+   Initialize a transfer control.
+
+   @param ctl transfer control
+   @param cb progress callback (may be NULL)
+   @param ctx callback context
+   @param interval_ms min. time between two callbacks in ms
+*/
+void netmd_transfer_ctl_init(netmd_transfer_ctl* ctl, netmd_progress_cb cb, void* ctx,
+                             unsigned int interval_ms);
+
+/**
+   Request to abort the transfer using this control.
+
+   @param ctl transfer control
+*/
+void netmd_transfer_cancel(netmd_transfer_ctl* ctl);
+
+/**
+   Check if the transfer was cancelled.
+
+   @param ctl transfer control (may be NULL)
+   @return 1 -> cancelled; 0 -> not cancelled
+*/
+int netmd_transfer_cancelled(netmd_transfer_ctl* ctl);
+
 /**
    linked list to store a list of 16-byte keys
 */
@@ -154,9 +306,33 @@ netmd_error netmd_secure_send_track(netmd_dev_handle *dev,
                                     uint16_t *track, unsigned char *uuid,
                                     unsigned char *content_id);
 
+/**
+   Like netmd_secure_send_track(), with progress and cancel control.
+
+   @param ctl transfer control (may be NULL)
+*/
+netmd_error netmd_secure_send_track_ex(netmd_dev_handle *dev,
+                                       netmd_wireformat wireformat,
+                                       unsigned char discformat,
+                                       unsigned int frames,
+                                       netmd_track_packets *packets,
+                                       size_t packet_length,
+                                       unsigned char *sessionkey,
+                                       uint16_t *track, unsigned char *uuid,
+                                       unsigned char *content_id,
+                                       netmd_transfer_ctl *ctl);
+
 netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
                                     FILE* file);
 
+/**
+   Like netmd_secure_recv_track(), with progress and cancel control.
+
+   @param ctl transfer control (may be NULL)
+*/
+netmd_error netmd_secure_recv_track_ex(netmd_dev_handle *dev, uint16_t track,
+                                       FILE* file, netmd_transfer_ctl *ctl);
+
 
 /**
    Commit a track. The idea is that this command tells the device hat the license
@@ -195,6 +371,60 @@ netmd_error netmd_prepare_packets(unsigned char* data, size_t data_lenght,
                                   size_t *packet_count, unsigned int *frames, size_t channels, size_t *packet_length,
                                   unsigned char *key_encryption_key, netmd_wireformat format);
 
+/**
+   Like netmd_prepare_packets(), but with a device specific packet size
+   (see netmd_dev_profile.max_chunk); rounded down to a multiple of 16384.
+
+   @param crypto crypto context to reuse (NULL -> temporary context)
+*/
+netmd_error netmd_prepare_packets_ex(unsigned char* data, size_t data_length,
+                                     netmd_track_packets **packets,
+                                     size_t *packet_count, unsigned int *frames, size_t channels, size_t *packet_length,
+                                     unsigned char *key_encryption_key, netmd_wireformat format, size_t max_chunk,
+                                     netmd_crypto *crypto);
+
+/** packets prepared from data arriving in blocks */
+typedef struct netmd_packet_writer netmd_packet_writer;
+
+/**
+   Start preparing packets from data arriving in blocks (e.g. converted
+   PCM), so the plain data never has to be held in full. The packets are
+   the same netmd_prepare_packets_ex() builds from one buffer.
+
+   @param key_encryption_key key encryption key (8 bytes)
+   @param format wire format
+   @param channels NETMD_CHANNELS_MONO or NETMD_CHANNELS_STEREO
+   @param max_chunk packet size, see netmd_prepare_packets_ex()
+   @param crypto crypto context to reuse (NULL -> temporary context)
+   @return writer; NULL -> error
+*/
+netmd_packet_writer* netmd_packet_writer_open(unsigned char *key_encryption_key, netmd_wireformat format,
+                                              size_t channels, size_t max_chunk, netmd_crypto *crypto);
+
+/**
+   Append data; full packets are encrypted right away.
+
+   @param w writer
+   @param data data in wire format (device byte order)
+   @param length data length in bytes
+   @return NETMD_NO_ERROR; errors stick until netmd_packet_writer_close()
+*/
+netmd_error netmd_packet_writer_add(netmd_packet_writer *w, const unsigned char *data, size_t length);
+
+/**
+   Pad and encrypt the last packet, hand over the packet list and free the
+   writer.
+
+   @param w pointer to writer, set to NULL
+   @param packets buffer for the packet list (NULL -> discard packets)
+   @param packet_count buffer for the number of packets (may be NULL)
+   @param frames buffer for the number of frames (may be NULL)
+   @param packet_length buffer for the total length (may be NULL)
+   @return NETMD_NO_ERROR; on error no packets are handed over
+*/
+netmd_error netmd_packet_writer_close(netmd_packet_writer **w, netmd_track_packets **packets,
+                                      size_t *packet_count, unsigned int *frames, size_t *packet_length);
+
 void netmd_cleanup_packets(netmd_track_packets **packets);
 
 netmd_error netmd_secure_set_track_protection(netmd_dev_handle *dev,
@@ -118,5 +118,6 @@ int netmd_request_title(netmd_dev_handle* dev, const uint16_t track, char* buffe
     memset(buffer, 0, size);
     memcpy(buffer, title_text, required_size);
 
+    netmd_dev_title_size_set(dev, track, (int)required_size);
     return required_size;
 }
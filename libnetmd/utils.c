@@ -518,31 +518,28 @@ unsigned int netmd_calculate_checksum(unsigned char data[], size_t size)
 }
 
 //------------------------------------------------------------------------------
-//! @brief      format a netmd device query
+//! @brief      format a netmd device query into a caller provided buffer
 //!
 //! @param[in]  format    format string
 //! @param[in]  argv      arguments array
 //! @param[in]  argc      argument count
-//! @param[in]  query_sz  buffer for query size
+//! @param[out] out       query buffer
+//! @param[in]  size      size of query buffer
 //!
-//! @return     formatted byte array (you MUST call free() if not NULL);
-//!             NULL on error
+//! @return     query size; 0 on error
 //------------------------------------------------------------------------------
-uint8_t* netmd_format_query(const char* format, const netmd_query_data_t argv[], int argc, size_t* query_sz)
+size_t netmd_format_query_buf(const char* format, const netmd_query_data_t argv[], int argc, uint8_t* out, size_t size)
 {
-#define mBUFFSZ 2048
 #define mSZ_CHECK                                                                                        \
     do                                                                                                   \
     {                                                                                                    \
-        if ((argv[argno].size + byteIdx) > mBUFFSZ)                                                      \
+        if ((argv[argno].size + byteIdx) > size)                                                         \
         {                                                                                                \
             netmd_log(NETMD_LOG_ERROR, "Error: Data size exceeds prepared memory in %s!", __FUNCTION__); \
-            return ret;                                                                                  \
+            return 0;                                                                                    \
         }                                                                                                \
     } while(0)
 
-    uint8_t* ret = NULL;
-    uint8_t out[mBUFFSZ];
     uint8_t b;
     size_t byteIdx     = 0;
     char   tok[3]     = {'\0',};
@@ -550,16 +547,15 @@ uint8_t* netmd_format_query(const char* format, const netmd_query_data_t argv[],
     int    argno      = 0;
     int    esc        = 0;
     netmd_endianess_t endian = netmd_no_convert;
-    *query_sz         = 0;
 
     // remove spaces
     while (*format != '\0')
     {
         // add some kind of sanity check
-        if ((argno > argc) || (byteIdx > (mBUFFSZ - 1)))
+        if ((argno > argc) || (byteIdx >= size))
         {
             netmd_log(NETMD_LOG_ERROR, "Error sanity check in %s!", __FUNCTION__);
-            return ret;
+            return 0;
         }
 
         if (!esc)
@@ -588,7 +584,7 @@ uint8_t* netmd_format_query(const char* format, const netmd_query_data_t argv[],
                     {
                         // can't convert char* to number
                         netmd_log(NETMD_LOG_ERROR, "Can't convert token '%s' into hex number in %s!", tok, __FUNCTION__);
-                        return ret;
+                        return 0;
                     }
 
                     tokIdx = 0;
@@ -680,7 +676,7 @@ uint8_t* netmd_format_query(const char* format, const netmd_query_data_t argv[],
 
             default:
                 netmd_log(NETMD_LOG_ERROR, "Unsupported format option '%c' used in %s!", c, __FUNCTION__);
-                return ret;
+                return 0;
                 break;
             }
         }
@@ -689,18 +685,39 @@ uint8_t* netmd_format_query(const char* format, const netmd_query_data_t argv[],
 
     if (byteIdx)
     {
-        *query_sz = byteIdx;
-        if ((ret = malloc(byteIdx)) != NULL)
+        netmd_log(NETMD_LOG_DEBUG, "Created query: ");
+        netmd_log_hex(NETMD_LOG_DEBUG, out, byteIdx);
+    }
+
+    return byteIdx;
+#undef mSZ_CHECK
+}
+
+//------------------------------------------------------------------------------
+//! @brief      format a netmd device query
+//!
+//! @param[in]  format    format string
+//! @param[in]  argv      arguments array
+//! @param[in]  argc      argument count
+//! @param[in]  query_sz  buffer for query size
+//!
+//! @return     formatted byte array (you MUST call free() if not NULL);
+//!             NULL on error
+//------------------------------------------------------------------------------
+uint8_t* netmd_format_query(const char* format, const netmd_query_data_t argv[], int argc, size_t* query_sz)
+{
+    uint8_t* ret = NULL;
+    uint8_t  out[2048];
+
+    if ((*query_sz = netmd_format_query_buf(format, argv, argc, out, sizeof(out))) > 0)
+    {
+        if ((ret = malloc(*query_sz)) != NULL)
         {
-            memcpy(ret, out, byteIdx);
-            netmd_log(NETMD_LOG_DEBUG, "Created query: ");
-            netmd_log_hex(NETMD_LOG_DEBUG, ret, byteIdx);
+            memcpy(ret, out, *query_sz);
         }
     }
 
     return ret;
-#undef mSZ_CHECK
-#undef mBUFFSZ
 }
 
 //------------------------------------------------------------------------------
@@ -226,6 +226,19 @@ unsigned int netmd_calculate_checksum(unsigned char data[], size_t size);
 //------------------------------------------------------------------------------
 uint8_t* netmd_format_query(const char* format, const netmd_query_data_t argv[], int argc, size_t* query_sz);
 
+//------------------------------------------------------------------------------
+//! @brief      format a netmd device query into a caller provided buffer
+//!
+//! @param[in]  format    format string
+//! @param[in]  argv      arguments array
+//! @param[in]  argc      argument count
+//! @param[out] out       query buffer
+//! @param[in]  size      size of query buffer
+//!
+//! @return     query size; 0 on error
+//------------------------------------------------------------------------------
+size_t netmd_format_query_buf(const char* format, const netmd_query_data_t argv[], int argc, uint8_t* out, size_t size);
+
 //------------------------------------------------------------------------------
 //! @brief      scan data for format options
 //!
@@ -0,0 +1,856 @@
+/* netmd_bench.c
+ *
+ * Offline microbenchmarks for libnetmd host side code paths. No device
+ * is needed; results are printed as one JSON object per line. Save the
+ * output of a run and pass it with --baseline to a later run to flag
+ * regressions (exit code 1).
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gcrypt.h>
+#include <libnetmd_intern.h>
+#include <secure.h>
+#include <netmd_trace.h>
+#include <netmd_transfer.h>
+#include <netmd_pcm.h>
+#include <CMDiscHeader.h>
+#include <utils.h>
+
+/* min. run time per benchmark */
+#define BENCH_MIN_US 200000u
+
+/* one LP2 frame: smallest upload, so per track setup dominates */
+#define BENCH_SETUP_DATA 192
+
+/* audio payload: multiple of all frame sizes (2048, 192, 152, 96), so
+   no format gets a padded last packet */
+#define BENCH_AUDIO_DATA (8u * 116736u)
+
+/* SP upload: ATRAC1 file header + 400 sectors (~ 23 s of audio) */
+#define BENCH_SP_HEADER  2048u
+#define BENCH_SP_SECTORS 400u
+#define BENCH_SP_DATA    (BENCH_SP_HEADER + BENCH_SP_SECTORS * 2332u)
+
+/* wave file: tagged files carry a LIST chunk between fmt and data */
+#define BENCH_WAV_LIST   4096u
+#define BENCH_WAV_DATA   (44u + 8u + BENCH_WAV_LIST + 65536u)
+
+/* disc header: groups with 4 tracks each */
+#define BENCH_HDR_GROUPS 16
+
+/* PCM conversion: 1 s of 96 kHz stereo input at most, converted in
+   blocks as on upload */
+#define BENCH_PCM_FRAMES 96000u
+#define BENCH_PCM_BLOCK  4096u
+
+/* max. baseline entries */
+#define BENCH_MAX_BASE   64
+
+#ifdef _WIN32
+    #define BENCH_NULL_DEV "NUL"
+#else
+    #define BENCH_NULL_DEV "/dev/null"
+#endif
+
+//! benchmark function: run the measured code 'iterations' times
+typedef void (*bench_fn)(void* ctx, unsigned long iterations);
+
+//! one benchmark
+typedef struct {
+    const char* name;   //!< benchmark name
+    bench_fn    fn;     //!< benchmark function
+    void*       ctx;    //!< benchmark context
+    size_t      bytes;  //!< bytes processed per iteration (0 -> n/a)
+    size_t      samples;//!< input samples per iteration (0 -> n/a)
+} bench_t;
+
+//! packet preparation context
+typedef struct {
+    netmd_crypto*    crypto;    //!< crypto context
+    netmd_wireformat format;    //!< wire format
+} packets_ctx_t;
+
+//! PCM conversion context
+typedef struct {
+    netmd_pcm_conv*      conv;          //!< converter
+    const unsigned char* data;          //!< input samples
+    size_t               frames;        //!< input frames (1 s)
+    size_t               frame_size;    //!< bytes per input frame
+} pcm_ctx_t;
+
+//! baseline result
+typedef struct {
+    char   name[64];            //!< benchmark name
+    double ns;                  //!< ns per op
+} baseline_t;
+
+static const unsigned char _s_rootkey[] = { 0x13, 0x37, 0x13, 0x37, 0x13, 0x37, 0x13, 0x37,
+                                            0x13, 0x37, 0x13, 0x37, 0x13, 0x37, 0x13, 0x37 };
+static unsigned char _s_kek[] = { 0x14, 0xe3, 0x83, 0x4e, 0xe2, 0xd3, 0xcc, 0xa5 };
+static unsigned char _s_setup_data[BENCH_SETUP_DATA];
+static unsigned char _s_audio_data[BENCH_AUDIO_DATA];
+static unsigned char _s_sp_data[BENCH_SP_DATA];
+static unsigned char _s_wav_data[BENCH_WAV_DATA];
+static char          _s_hdr_string[2048];
+static unsigned char _s_pcm_in[BENCH_PCM_FRAMES * 2 * 4];
+static unsigned char _s_pcm_out[BENCH_PCM_BLOCK * 2 * 2];
+static unsigned char _s_pcm_f32[BENCH_PCM_FRAMES * 2 * 4];
+
+static baseline_t    _s_base[BENCH_MAX_BASE];
+static size_t        _s_base_count = 0;
+static double        _s_threshold  = 10.0;
+static int           _s_check_fail = 0;
+
+//------------------------------------------------------------------------------
+//! @brief      cipher operation with its own handle, as every secure
+//!             command did before the crypto context existed
+//!
+//! @param[in]  algo    cipher algorithm
+//! @param[in]  mode    cipher mode
+//! @param[in]  key     key
+//! @param[in]  keylen  key length
+//! @param[in]  iv      IV (NULL -> none)
+//! @param[in]  buf     data (en-/decrypted in place)
+//! @param[in]  len     data length
+//------------------------------------------------------------------------------
+static void oneshot_cipher(int algo, int mode, const unsigned char* key, size_t keylen,
+                           const unsigned char* iv, unsigned char* buf, size_t len)
+{
+    gcry_cipher_hd_t hd;
+
+    gcry_cipher_open(&hd, algo, mode, 0);
+    gcry_cipher_setkey(hd, key, keylen);
+    if (iv != NULL)
+    {
+        gcry_cipher_setiv(hd, iv, 8);
+    }
+    gcry_cipher_encrypt(hd, buf, len, NULL, 0);
+    gcry_cipher_close(hd);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      per track crypto setup without context: session key, setup
+//!             download, strong random data key, reply and commit, each
+//!             with its own cipher handle
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of tracks
+//------------------------------------------------------------------------------
+static void bench_setup_oneshot(void* ctx, unsigned long iterations)
+{
+    unsigned char des3_key[24], iv[8], nonce[8], sessionkey[8], raw_key[8], block[32];
+    netmd_track_packets* packets;
+    size_t         count, length;
+    unsigned int   frames;
+    unsigned long  i;
+
+    (void)ctx;
+    memcpy(des3_key, _s_rootkey, 16);
+    memcpy(des3_key + 16, _s_rootkey, 8);
+
+    for (i = 0; i < iterations; i++)
+    {
+        /* session key */
+        gcry_create_nonce(nonce, sizeof(nonce));
+        memcpy(iv, nonce, 8);
+        oneshot_cipher(GCRY_CIPHER_DES, GCRY_CIPHER_MODE_ECB, _s_rootkey, 8, NULL, iv, 8);
+        memcpy(sessionkey, nonce, 8);
+        oneshot_cipher(GCRY_CIPHER_3DES, GCRY_CIPHER_MODE_CBC, des3_key, 24, iv, sessionkey, 8);
+
+        /* setup download */
+        memset(block, 0, sizeof(block));
+        memset(iv, 0, sizeof(iv));
+        oneshot_cipher(GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, sessionkey, 8, iv, block, sizeof(block));
+
+        /* data key and packets */
+        gcry_randomize(raw_key, sizeof(raw_key), GCRY_STRONG_RANDOM);
+        oneshot_cipher(GCRY_CIPHER_DES, GCRY_CIPHER_MODE_ECB, _s_kek, 8, NULL, raw_key, 8);
+        netmd_prepare_packets(_s_setup_data, sizeof(_s_setup_data), &packets, &count, &frames,
+                              NETMD_CHANNELS_STEREO, &length, _s_kek, NETMD_WIREFORMAT_LP2);
+        netmd_cleanup_packets(&packets);
+
+        /* send reply and commit */
+        oneshot_cipher(GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, sessionkey, 8, iv, block, sizeof(block));
+        oneshot_cipher(GCRY_CIPHER_DES, GCRY_CIPHER_MODE_ECB, sessionkey, 8, NULL, block, 8);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      per track crypto setup with a crypto context reused for all
+//!             tracks (the session key ops are part of the library calls)
+//!
+//! @param[in]  ctx         crypto context
+//! @param[in]  iterations  number of tracks
+//------------------------------------------------------------------------------
+static void bench_setup_ctx(void* ctx, unsigned long iterations)
+{
+    netmd_crypto*        crypto = (netmd_crypto*)ctx;
+    unsigned char        hostnonce[8], devnonce[8] = { 0 }, sessionkey[8];
+    netmd_track_packets* packets;
+    size_t         count, length;
+    unsigned int   frames;
+    unsigned long  i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        gcry_create_nonce(hostnonce, sizeof(hostnonce));
+        netmd_crypto_session_key(crypto, _s_rootkey, hostnonce, devnonce, sessionkey);
+        netmd_prepare_packets_ex(_s_setup_data, sizeof(_s_setup_data), &packets, &count, &frames,
+                                 NETMD_CHANNELS_STEREO, &length, _s_kek, NETMD_WIREFORMAT_LP2,
+                                 0x00100000U, crypto);
+        netmd_cleanup_packets(&packets);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      encrypt audio into packets as done for every upload
+//!
+//! @param[in]  ctx         packets context
+//! @param[in]  iterations  number of tracks
+//------------------------------------------------------------------------------
+static void bench_prepare_packets(void* ctx, unsigned long iterations)
+{
+    packets_ctx_t*       pctx = (packets_ctx_t*)ctx;
+    netmd_track_packets* packets;
+    size_t         count, length;
+    unsigned int   frames;
+    unsigned long  i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        netmd_prepare_packets_ex(_s_audio_data, sizeof(_s_audio_data), &packets, &count, &frames,
+                                 NETMD_CHANNELS_STEREO, &length, _s_kek, pctx->format,
+                                 0x00100000U, pctx->crypto);
+        netmd_cleanup_packets(&packets);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      wave to device byte order for PCM uploads
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_pcm_byteswap(void* ctx, unsigned long iterations)
+{
+    unsigned long i;
+
+    (void)ctx;
+    for (i = 0; i < iterations; i++)
+    {
+        netmd_pcm_byteswap(_s_audio_data, sizeof(_s_audio_data));
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      SP sector padding; the function consumes its input, so
+//!             every run includes one copy of the file
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_sp_upload_prep(void* ctx, unsigned long iterations)
+{
+    uint8_t*      data;
+    size_t        size;
+    unsigned long i;
+
+    (void)ctx;
+    for (i = 0; i < iterations; i++)
+    {
+        size = sizeof(_s_sp_data);
+        if ((data = malloc(size)) == NULL)
+        {
+            return;
+        }
+        memcpy(data, _s_sp_data, size);
+        if (netmd_prepare_audio_sp_upload(&data, &size) == NETMD_NO_ERROR)
+        {
+            free(data);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      wave header check
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_audio_supported(void* ctx, unsigned long iterations)
+{
+    netmd_wireformat wireformat;
+    unsigned char    diskformat;
+    audio_patch_t    patch;
+    size_t           channels, headersize;
+    unsigned long    i;
+
+    (void)ctx;
+    for (i = 0; i < iterations; i++)
+    {
+        netmd_audio_supported(_s_wav_data, sizeof(_s_wav_data), &wireformat, &diskformat,
+                              &patch, &channels, &headersize);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      data chunk search across a LIST chunk
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_wav_data_position(void* ctx, unsigned long iterations)
+{
+    unsigned long i;
+
+    (void)ctx;
+    for (i = 0; i < iterations; i++)
+    {
+        netmd_wav_data_position(_s_wav_data, 36, sizeof(_s_wav_data));
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      build a patch write command (allocating)
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_format_query(void* ctx, unsigned long iterations)
+{
+    uint8_t            payload[16] = { 0 };
+    size_t             query_sz;
+    uint8_t*           query;
+    unsigned long      i;
+    netmd_query_data_t argv[] = {
+        {{.u32 = 0x03802000}, sizeof(uint32_t)},
+        {{.u8  = 16        }, sizeof(uint8_t) },
+        {{.pu8 = payload   }, sizeof(payload) },
+        {{.u16 = 0x1234    }, sizeof(uint16_t)},
+    };
+
+    (void)ctx;
+    for (i = 0; i < iterations; i++)
+    {
+        if ((query = netmd_format_query("00 1822 ff 00 %<d %b 0000 %* %<w", argv, 4, &query_sz)) != NULL)
+        {
+            free(query);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      build a patch write command into a caller buffer
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_format_query_buf(void* ctx, unsigned long iterations)
+{
+    uint8_t            payload[16] = { 0 };
+    uint8_t            query[64];
+    unsigned long      i;
+    netmd_query_data_t argv[] = {
+        {{.u32 = 0x03802000}, sizeof(uint32_t)},
+        {{.u8  = 16        }, sizeof(uint8_t) },
+        {{.pu8 = payload   }, sizeof(payload) },
+        {{.u16 = 0x1234    }, sizeof(uint16_t)},
+    };
+
+    (void)ctx;
+    for (i = 0; i < iterations; i++)
+    {
+        netmd_format_query_buf("00 1822 ff 00 %<d %b 0000 %* %<w", argv, 4, query, sizeof(query));
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      parse a patch read reply
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_scan_query(void* ctx, unsigned long iterations)
+{
+    uint8_t reply[12 + 16 + 2] = { 0x09, 0x18, 0x21, 0x00, 0xff, 0x00, 0x20, 0x80, 0x03, 0x10, 0x00, 0x00 };
+    netmd_capture_data_t* cap_argv;
+    int                   cap_argc, j;
+    unsigned long         i;
+
+    (void)ctx;
+    for (i = 12; i < sizeof(reply); i++)
+    {
+        reply[i] = (uint8_t)i;
+    }
+
+    for (i = 0; i < iterations; i++)
+    {
+        cap_argv = NULL;
+        cap_argc = 0;
+        netmd_scan_query(reply, sizeof(reply), "%? 1821 00 %? %?%?%?%? %? %?%? %*", &cap_argv, &cap_argc);
+        if (cap_argv != NULL)
+        {
+            for (j = 0; j < cap_argc; j++)
+            {
+                if (cap_argv[j].tp == netmd_fmt_barray)
+                {
+                    free(cap_argv[j].data.pu8);
+                }
+            }
+            free(cap_argv);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      parse a disc header with groups
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_disc_header_from_string(void* ctx, unsigned long iterations)
+{
+    HndMdHdr      hdr;
+    unsigned long i;
+
+    (void)ctx;
+    for (i = 0; i < iterations; i++)
+    {
+        hdr = create_md_header(_s_hdr_string);
+        free_md_header(&hdr);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      render a changed disc header
+//!
+//! @param[in]  ctx         disc header
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_disc_header_to_string(void* ctx, unsigned long iterations)
+{
+    HndMdHdr      hdr = (HndMdHdr)ctx;
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        /* title change makes the cached string stale */
+        md_header_set_disc_title(hdr, (i & 1) ? "Mix Tape A" : "Mix Tape B");
+        md_header_to_string(hdr);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      fill a new (empty) group; the group must move in front of
+//!             groups with higher track numbers
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_disc_header_group_add(void* ctx, unsigned long iterations)
+{
+    HndMdHdr      hdr;
+    unsigned long i;
+    int           gid;
+
+    (void)ctx;
+    for (i = 0; i < iterations; i++)
+    {
+        hdr = create_md_header("0;Disc//5-6;G1//");
+        gid = md_header_add_group(hdr, "New", -1, -1);
+
+        if ((gid < 0) || (md_header_add_track_to_group(hdr, gid, 2) != 0)
+            || strcmp(md_header_to_string(hdr), "0;Disc//2;New//5-6;G1//"))
+        {
+            if (!_s_check_fail)
+            {
+                fprintf(stderr, "disc_header_group_add: unexpected header '%s'\n", md_header_to_string(hdr));
+            }
+            _s_check_fail = 1;
+        }
+        free_md_header(&hdr);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      BCD round trip as used for track times
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_bcd(void* ctx, unsigned long iterations)
+{
+    unsigned char     bcd[4];
+    volatile unsigned sum = 0;
+    unsigned long     i;
+
+    (void)ctx;
+    for (i = 0; i < iterations; i++)
+    {
+        proper_to_bcd((unsigned int)(i % 100000000ul), bcd, sizeof(bcd));
+        sum += bcd_to_proper(bcd, sizeof(bcd));
+        sum += bcd_to_proper_single(proper_to_bcd_single((unsigned char)(i % 100)));
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      convert 1 s of stereo PCM to 44.1 kHz / 16 bit in blocks;
+//!             the converter streams on across runs
+//!
+//! @param[in]  ctx         PCM context
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_pcm_conv(void* ctx, unsigned long iterations)
+{
+    pcm_ctx_t*    pctx = (pcm_ctx_t*)ctx;
+    size_t        pos, used;
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (pos = 0; pos < pctx->frames; pos += used)
+        {
+            netmd_pcm_conv_run(pctx->conv, pctx->data + pos * pctx->frame_size,
+                               ((pctx->frames - pos) < BENCH_PCM_BLOCK) ? (pctx->frames - pos) : BENCH_PCM_BLOCK,
+                               &used, _s_pcm_out, BENCH_PCM_BLOCK);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      hex dump of a typical command with debug log enabled; the
+//!             output goes to the null device
+//!
+//! @param[in]  ctx         unused
+//! @param[in]  iterations  number of runs
+//------------------------------------------------------------------------------
+static void bench_log_hex(void* ctx, unsigned long iterations)
+{
+    unsigned long i;
+
+    (void)ctx;
+    netmd_set_log_level(NETMD_LOG_DEBUG);
+    for (i = 0; i < iterations; i++)
+    {
+        (netmd_log_hex)(NETMD_LOG_DEBUG, _s_audio_data, 64);
+    }
+    netmd_set_log_level(NETMD_LOG_NONE);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      create synthetic inputs
+//------------------------------------------------------------------------------
+static void bench_init_data(void)
+{
+    unsigned char* w = _s_wav_data;
+    size_t         i, pos;
+
+    for (i = 0; i < sizeof(_s_setup_data); i++)
+    {
+        _s_setup_data[i] = (unsigned char)(i * 7);
+    }
+
+    for (i = 0; i < sizeof(_s_audio_data); i++)
+    {
+        _s_audio_data[i] = (unsigned char)((i * 31) ^ (i >> 8));
+    }
+
+    /* ATRAC1 file: header marker at byte 1, stereo at byte 264 */
+    for (i = 0; i < sizeof(_s_sp_data); i++)
+    {
+        _s_sp_data[i] = (unsigned char)(i * 13);
+    }
+    _s_sp_data[1]   = 8;
+    _s_sp_data[264] = 2;
+
+    /* 44.1 kHz, 16 bit stereo PCM wave with a LIST chunk */
+    memcpy(w, "RIFF", 4);
+    w[4] = (unsigned char)((sizeof(_s_wav_data) - 8) & 0xff);
+    w[5] = (unsigned char)(((sizeof(_s_wav_data) - 8) >> 8) & 0xff);
+    w[6] = (unsigned char)(((sizeof(_s_wav_data) - 8) >> 16) & 0xff);
+    memcpy(w + 8, "WAVEfmt ", 8);
+    w[16] = 16;                                 /* fmt chunk size     */
+    w[20] = 1;                                  /* PCM                */
+    w[22] = 2;                                  /* channels           */
+    w[24] = 0x44; w[25] = 0xac;                 /* 44100 Hz           */
+    w[28] = 0x10; w[29] = 0xb1; w[30] = 0x02;   /* 176400 bytes / s   */
+    w[32] = 4;                                  /* block align        */
+    w[34] = 16;                                 /* bits per sample    */
+    memcpy(w + 36, "LIST", 4);
+    w[40] = BENCH_WAV_LIST & 0xff;
+    w[41] = (BENCH_WAV_LIST >> 8) & 0xff;
+    for (i = 0; i < BENCH_WAV_LIST; i++)
+    {
+        w[44 + i] = (unsigned char)('A' + (i % 26));
+    }
+    pos = 44 + BENCH_WAV_LIST;
+    memcpy(w + pos, "data", 4);
+    w[pos + 6] = 1;                             /* 65536 bytes        */
+
+    /* integer PCM input: reads as a noise like signal, fine for timing */
+    for (i = 0; i < sizeof(_s_pcm_in); i++)
+    {
+        _s_pcm_in[i] = (unsigned char)(((i * 37) >> 4) ^ (i & 0x0f));
+    }
+
+    /* float PCM input: saw tooth, finite and in range */
+    for (i = 0; i < (sizeof(_s_pcm_in) / 4); i++)
+    {
+        float v = (float)((int)(i % 200) - 100) / 128.0f;
+        memcpy(_s_pcm_f32 + i * 4, &v, 4);
+    }
+
+    /* disc title and groups of 4 tracks each */
+    pos = (size_t)snprintf(_s_hdr_string, sizeof(_s_hdr_string), "0;Mix Tape//");
+    for (i = 0; i < BENCH_HDR_GROUPS; i++)
+    {
+        pos += (size_t)snprintf(_s_hdr_string + pos, sizeof(_s_hdr_string) - pos, "%zu-%zu;Album Number %zu//",
+                                i * 4 + 1, i * 4 + 4, i + 1);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      load baseline results (output of an earlier run)
+//!
+//! @param[in]  fname  file name
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int bench_load_baseline(const char* fname)
+{
+    char        line[512];
+    const char* p;
+    FILE*       f;
+    baseline_t* b;
+
+    if ((f = fopen(fname, "r")) == NULL)
+    {
+        return -1;
+    }
+
+    while ((_s_base_count < BENCH_MAX_BASE) && (fgets(line, sizeof(line), f) != NULL))
+    {
+        b = &_s_base[_s_base_count];
+        if (((p = strstr(line, "\"bench\":\"")) != NULL)
+            && (sscanf(p + 9, "%63[^\"]", b->name) == 1)
+            && ((p = strstr(line, "\"ns_per_op\":")) != NULL)
+            && (sscanf(p + 12, "%lf", &b->ns) == 1)
+            && (b->ns > 0.0))
+        {
+            _s_base_count++;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      find baseline result
+//!
+//! @param[in]  name  benchmark name
+//!
+//! @return     ns per op; 0 -> no baseline
+//------------------------------------------------------------------------------
+static double bench_baseline(const char* name)
+{
+    size_t i;
+
+    for (i = 0; i < _s_base_count; i++)
+    {
+        if (!strcmp(_s_base[i].name, name))
+        {
+            return _s_base[i].ns;
+        }
+    }
+    return 0.0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      run one benchmark; iterations double until it runs long
+//!             enough to be measured
+//!
+//! @param[in]  b     benchmark
+//!
+//! @return     0 -> ok; 1 -> slower than baseline + threshold
+//------------------------------------------------------------------------------
+static int bench_run(const bench_t* b)
+{
+    unsigned long n = 1;
+    uint64_t      t0, us;
+    double        ns, base;
+    int           ret = 0;
+
+    /* warm up */
+    b->fn(b->ctx, 1);
+
+    for (;;)
+    {
+        t0 = netmd_trace_time_us();
+        b->fn(b->ctx, n);
+        us = netmd_trace_time_us() - t0;
+
+        if ((us >= BENCH_MIN_US) || (n >= (1ul << 30)))
+        {
+            break;
+        }
+        n *= 2;
+    }
+
+    ns = (us * 1000.0) / n;
+    printf("{\"bench\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.1f", b->name, n, ns);
+    if (b->bytes > 0)
+    {
+        printf(",\"mib_per_s\":%.2f", (ns > 0.0) ? ((b->bytes / (1024.0 * 1024.0)) / (ns / 1e9)) : 0.0);
+    }
+    if (b->samples > 0)
+    {
+        printf(",\"samples_per_s\":%.0f", (ns > 0.0) ? (b->samples / (ns / 1e9)) : 0.0);
+    }
+    if ((base = bench_baseline(b->name)) > 0.0)
+    {
+        printf(",\"baseline_ns\":%.1f,\"delta_pct\":%.1f", base, ((ns - base) * 100.0) / base);
+        if (ns > (base * (1.0 + _s_threshold / 100.0)))
+        {
+            printf(",\"regression\":true");
+            ret = 1;
+        }
+    }
+    printf("}\n");
+    fflush(stdout);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    netmd_crypto* crypto;
+    HndMdHdr      hdr;
+    FILE*         null_dev;
+    const char*   prefix = NULL;
+    size_t        i;
+    int           ret = 0;
+
+    for (i = 1; i < (size_t)argc; i++)
+    {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+        {
+            printf("Usage: %s [--baseline <file>] [--threshold <percent>] [<name prefix>]\n", argv[0]);
+            printf("  --baseline   compare with the output of an earlier run, exit 1 on regression\n");
+            printf("  --threshold  allowed slow down in percent (default %.0f)\n", _s_threshold);
+            return 0;
+        }
+        else if (!strcmp(argv[i], "--baseline") && ((i + 1) < (size_t)argc))
+        {
+            if (bench_load_baseline(argv[++i]) != 0)
+            {
+                fprintf(stderr, "Can't read baseline %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--threshold") && ((i + 1) < (size_t)argc))
+        {
+            _s_threshold = atof(argv[++i]);
+        }
+        else
+        {
+            prefix = argv[i];
+        }
+    }
+
+    netmd_set_log_level(NETMD_LOG_NONE);
+
+    if ((crypto = netmd_crypto_open()) == NULL)
+    {
+        fprintf(stderr, "Can't create crypto context\n");
+        return 1;
+    }
+
+    if ((null_dev = fopen(BENCH_NULL_DEV, "w")) == NULL)
+    {
+        fprintf(stderr, "Can't open %s\n", BENCH_NULL_DEV);
+        netmd_crypto_close(&crypto);
+        return 1;
+    }
+    netmd_log_set_fd(null_dev);
+
+    bench_init_data();
+    hdr = create_md_header(_s_hdr_string);
+
+    {
+        packets_ctx_t pcm   = {crypto, NETMD_WIREFORMAT_PCM};
+        packets_ctx_t sp    = {crypto, NETMD_WIREFORMAT_105KBPS};
+        packets_ctx_t lp2   = {crypto, NETMD_WIREFORMAT_LP2};
+        packets_ctx_t lp4   = {crypto, NETMD_WIREFORMAT_LP4};
+        pcm_ctx_t     pcm48 = {netmd_pcm_conv_open(48000, 2, NETMD_PCM_S24), _s_pcm_in,  48000, 6};
+        pcm_ctx_t     pcm96 = {netmd_pcm_conv_open(96000, 2, NETMD_PCM_F32), _s_pcm_f32, 96000, 8};
+        pcm_ctx_t     pcm44 = {netmd_pcm_conv_open(44100, 2, NETMD_PCM_S24), _s_pcm_in,  44100, 6};
+
+        const bench_t benches[] = {
+            {"crypto_track_setup_oneshot",  bench_setup_oneshot,           NULL,   0, 0},
+            {"crypto_track_setup_ctx",      bench_setup_ctx,               crypto, 0, 0},
+            {"prepare_packets_pcm",         bench_prepare_packets,         &pcm,   BENCH_AUDIO_DATA, 0},
+            {"prepare_packets_105kbps",     bench_prepare_packets,         &sp,    BENCH_AUDIO_DATA, 0},
+            {"prepare_packets_lp2",         bench_prepare_packets,         &lp2,   BENCH_AUDIO_DATA, 0},
+            {"prepare_packets_lp4",         bench_prepare_packets,         &lp4,   BENCH_AUDIO_DATA, 0},
+            {"pcm_byteswap",                bench_pcm_byteswap,            NULL,   BENCH_AUDIO_DATA, 0},
+            {"sp_upload_prep",              bench_sp_upload_prep,          NULL,   BENCH_SP_DATA, 0},
+            {"audio_supported",             bench_audio_supported,         NULL,   0, 0},
+            {"wav_data_position",           bench_wav_data_position,       NULL,   0, 0},
+            {"format_query",                bench_format_query,            NULL,   0, 0},
+            {"format_query_buf",            bench_format_query_buf,        NULL,   0, 0},
+            {"scan_query",                  bench_scan_query,              NULL,   0, 0},
+            {"disc_header_from_string",     bench_disc_header_from_string, NULL,   0, 0},
+            {"disc_header_to_string",       bench_disc_header_to_string,   hdr,    0, 0},
+            {"disc_header_group_add",       bench_disc_header_group_add,   NULL,   0, 0},
+            {"bcd_round_trip",              bench_bcd,                     NULL,   0, 0},
+            {"log_hex",                     bench_log_hex,                 NULL,   64, 0},
+            {"pcm_conv_48k_s24",            bench_pcm_conv,                &pcm48, 48000 * 6, 48000 * 2},
+            {"pcm_conv_96k_f32",            bench_pcm_conv,                &pcm96, 96000 * 8, 96000 * 2},
+            {"pcm_conv_44k_s24",            bench_pcm_conv,                &pcm44, 44100 * 6, 44100 * 2},
+        };
+
+        if ((pcm48.conv == NULL) || (pcm96.conv == NULL) || (pcm44.conv == NULL))
+        {
+            fprintf(stderr, "Can't create PCM converter\n");
+            ret = 1;
+        }
+        else
+        {
+            for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+            {
+                if ((prefix == NULL) || !strncmp(benches[i].name, prefix, strlen(prefix)))
+                {
+                    ret |= bench_run(&benches[i]);
+                }
+            }
+        }
+
+        netmd_pcm_conv_close(&pcm48.conv);
+        netmd_pcm_conv_close(&pcm96.conv);
+        netmd_pcm_conv_close(&pcm44.conv);
+    }
+
+    if (_s_check_fail)
+    {
+        ret = 1;
+    }
+
+    free_md_header(&hdr);
+    netmd_log_set_fd(stdout);
+    fclose(null_dev);
+    netmd_crypto_close(&crypto);
+    return ret;
+}
@@ -0,0 +1,384 @@
+/* netmd_bench_async.cpp
+ *
+ * Thread per device vs. coroutine reactor on simulated decks. A simulated
+ * deck answers control and bulk transfers after a fixed USB latency and
+ * needs some time to process a command, so the poll back-off is exercised
+ * the same way as with real hardware. Results are printed as one JSON
+ * object per line (see netmd_bench.c).
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <netmdco.h>
+
+using namespace netmd;
+using Clock = Reactor::Clock;
+
+namespace
+{
+    //! latency of one control transfer
+    constexpr auto CONTROL_LATENCY = std::chrono::microseconds(250);
+
+    //! command processing time of the deck
+    constexpr auto BUSY_TIME = std::chrono::milliseconds(3);
+
+    //! bulk throughput of the deck (bytes per ms)
+    constexpr size_t BULK_BYTES_PER_MS = 1400;
+
+    //! per deck workload
+    constexpr int    EXCHANGES  = 8;
+    constexpr int    BULKS      = 4;
+    constexpr size_t BULK_CHUNK = 0x4000;
+
+    const uint8_t STATUS_CMD[] = { 0x00, 0x18, 0x09, 0x80, 0x01, 0x03, 0x30, 0x88, 0x02, 0x00 };
+
+    //--------------------------------------------------------------------------
+    //! @brief      state of a simulated deck
+    //--------------------------------------------------------------------------
+    struct SimDeck_t
+    {
+        Clock::time_point mReadyAt;         //!< response ready at
+        bool              mPending = false; //!< response pending
+        uint8_t           mRsp[16];         //!< response
+        size_t            mRspLen  = 0;     //!< response length
+    };
+
+    //--------------------------------------------------------------------------
+    //! @brief      deck side of a control transfer
+    //!
+    //! @param[in]  deck     simulated deck
+    //! @param[in]  request  vendor request
+    //! @param[in]  data     transfer data
+    //! @param[in]  now      time the transfer reaches the deck
+    //!
+    //! @return     transferred bytes
+    //--------------------------------------------------------------------------
+    int simControl(SimDeck_t& deck, uint8_t request, MutableByteView data, Clock::time_point now)
+    {
+        switch (request)
+        {
+        case 0x01:  // poll
+            memset(data.data(), 0, data.size());
+            if (deck.mPending && (now >= deck.mReadyAt))
+            {
+                data[0] = 0x01;
+                data[1] = 0x81;
+                data[2] = static_cast<uint8_t>(deck.mRspLen);
+            }
+            return static_cast<int>(data.size());
+
+        case 0x80:  // command
+            deck.mRspLen = (data.size() < sizeof(deck.mRsp)) ? data.size() : sizeof(deck.mRsp);
+            memcpy(deck.mRsp, data.data(), deck.mRspLen);
+            deck.mRsp[0]  = NETMD_STATUS_ACCEPTED;
+            deck.mPending = true;
+            deck.mReadyAt = now + BUSY_TIME;
+            return static_cast<int>(data.size());
+
+        default:    // response
+            memcpy(data.data(), deck.mRsp, deck.mRspLen);
+            deck.mPending = false;
+            return static_cast<int>(deck.mRspLen);
+        }
+    }
+
+    //--------------------------------------------------------------------------
+    //! @brief      duration of a bulk transfer
+    //!
+    //! @param[in]  size  transfer size
+    //!
+    //! @return     duration
+    //--------------------------------------------------------------------------
+    Clock::duration bulkTime(size_t size)
+    {
+        return std::chrono::microseconds((size * 1000) / BULK_BYTES_PER_MS);
+    }
+
+    //--------------------------------------------------------------------------
+    //! @brief      simulated deck for the reactor; completions are timers
+    //--------------------------------------------------------------------------
+    class SimTransport : public Transport
+    {
+    public:
+        explicit SimTransport(Reactor& r) : mR(r) {}
+
+        int control(uint8_t, uint8_t request, uint16_t, uint16_t, MutableByteView data,
+                    unsigned, Transfer_t& xfer) override
+        {
+            Clock::time_point when = Clock::now() + CONTROL_LATENCY;
+            xfer.mResult = simControl(mDeck, request, data, when);
+            mR.at(when, xfer.mWaiter);
+            return 0;
+        }
+
+        int bulk(uint8_t, MutableByteView data, unsigned, Transfer_t& xfer) override
+        {
+            xfer.mResult = static_cast<int>(data.size());
+            mR.at(Clock::now() + bulkTime(data.size()), xfer.mWaiter);
+            return 0;
+        }
+
+        const netmd_dev_profile* profile() const override { return netmd_dev_profile_get(nullptr); }
+
+    private:
+        Reactor&  mR;
+        SimDeck_t mDeck;
+    };
+
+    //--------------------------------------------------------------------------
+    //! @brief      simulated deck driven the blocking way (one thread each),
+    //!             same protocol and back-off as AsyncDevice
+    //--------------------------------------------------------------------------
+    class SimBlocking
+    {
+    public:
+        int control(uint8_t request, MutableByteView data)
+        {
+            std::this_thread::sleep_for(CONTROL_LATENCY);
+            return simControl(mDeck, request, data, Clock::now());
+        }
+
+        int poll(uint8_t* buf, int tries)
+        {
+            const netmd_dev_profile* prof = netmd_dev_profile_get(nullptr);
+            unsigned sleepytime = prof->poll_first_ms;
+
+            for (int i = 0; i < tries; i++)
+            {
+                control(0x01, MutableByteView(buf, 4));
+                if (buf[0] != 0)
+                {
+                    return buf[2];
+                }
+                if (i > 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(sleepytime));
+                    sleepytime = prof->poll_ms;
+                }
+                if (i > static_cast<int>(prof->poll_slow_after))
+                {
+                    sleepytime = prof->poll_slow_ms;
+                }
+            }
+            return 0;
+        }
+
+        int exchange(ByteView cmd, MutableByteView rsp)
+        {
+            uint8_t pollbuf[4];
+            int     len;
+
+            if (poll(pollbuf, 1) != 0)
+            {
+                return NETMDERR_NOTREADY;
+            }
+            control(0x80, MutableByteView(const_cast<uint8_t*>(cmd.data()), cmd.size()));
+
+            if ((len = poll(pollbuf, 30)) <= 0)
+            {
+                return NETMDERR_TIMEOUT;
+            }
+            return control(pollbuf[1], rsp.subspan(0, static_cast<size_t>(len)));
+        }
+
+        int bulkSend(ByteView data)
+        {
+            std::this_thread::sleep_for(bulkTime(data.size()));
+            return static_cast<int>(data.size());
+        }
+
+    private:
+        SimDeck_t mDeck;
+    };
+
+    //! one benchmark result
+    struct Result_t
+    {
+        double mWallNs = 0;
+        double mCpuNs  = 0;
+        int    mErrors = 0;
+    };
+
+    //--------------------------------------------------------------------------
+    //! @brief      workload of one deck, thread per device
+    //--------------------------------------------------------------------------
+    void deckBlocking(SimBlocking* dev, const uint8_t* chunk, int* errors)
+    {
+        uint8_t rsp[32];
+
+        for (int i = 0; i < EXCHANGES; i++)
+        {
+            if (dev->exchange(ByteView(STATUS_CMD, sizeof(STATUS_CMD)), MutableByteView(rsp, sizeof(rsp))) <= 0)
+            {
+                (*errors)++;
+            }
+        }
+
+        for (int i = 0; i < BULKS; i++)
+        {
+            if (dev->bulkSend(ByteView(chunk, BULK_CHUNK)) != static_cast<int>(BULK_CHUNK))
+            {
+                (*errors)++;
+            }
+        }
+    }
+
+    //--------------------------------------------------------------------------
+    //! @brief      workload of one deck, coroutine on the reactor
+    //--------------------------------------------------------------------------
+    Task<void> deckAsync(AsyncDevice* dev, const uint8_t* chunk, int* errors)
+    {
+        uint8_t rsp[32];
+
+        for (int i = 0; i < EXCHANGES; i++)
+        {
+            if (co_await dev->exchange(ByteView(STATUS_CMD, sizeof(STATUS_CMD)), MutableByteView(rsp, sizeof(rsp))) <= 0)
+            {
+                (*errors)++;
+            }
+        }
+
+        for (int i = 0; i < BULKS; i++)
+        {
+            if (co_await dev->bulkSend(ByteView(chunk, BULK_CHUNK)) != static_cast<int>(BULK_CHUNK))
+            {
+                (*errors)++;
+            }
+        }
+    }
+
+    //--------------------------------------------------------------------------
+    //! @brief      run all decks with one thread each
+    //!
+    //! @param[in]  decks  number of decks
+    //! @param[in]  chunk  bulk data
+    //!
+    //! @return     result
+    //--------------------------------------------------------------------------
+    Result_t runThreads(int decks, const uint8_t* chunk)
+    {
+        std::vector<SimBlocking> devs(static_cast<size_t>(decks));
+        std::vector<std::thread> threads;
+        std::vector<int>         errors(static_cast<size_t>(decks), 0);
+        Result_t r;
+
+        std::clock_t      c0 = std::clock();
+        Clock::time_point t0 = Clock::now();
+
+        for (int i = 0; i < decks; i++)
+        {
+            threads.emplace_back(deckBlocking, &devs[i], chunk, &errors[i]);
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+
+        r.mWallNs = std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+        r.mCpuNs  = (std::clock() - c0) * (1e9 / CLOCKS_PER_SEC);
+        for (int e : errors)
+        {
+            r.mErrors += e;
+        }
+        return r;
+    }
+
+    //--------------------------------------------------------------------------
+    //! @brief      run all decks as coroutines on one reactor thread
+    //!
+    //! @param[in]  decks  number of decks
+    //! @param[in]  chunk  bulk data
+    //!
+    //! @return     result
+    //--------------------------------------------------------------------------
+    Result_t runReactor(int decks, const uint8_t* chunk)
+    {
+        Reactor reactor;
+        std::vector<std::unique_ptr<SimTransport>> transports;
+        std::vector<std::unique_ptr<AsyncDevice>>  devs;
+        int      errors = 0;
+        Result_t r;
+
+        for (int i = 0; i < decks; i++)
+        {
+            transports.push_back(std::make_unique<SimTransport>(reactor));
+            devs.push_back(std::make_unique<AsyncDevice>(reactor, *transports.back()));
+        }
+
+        std::clock_t      c0 = std::clock();
+        Clock::time_point t0 = Clock::now();
+
+        for (auto& d : devs)
+        {
+            reactor.spawn(deckAsync(d.get(), chunk, &errors));
+        }
+
+        if (reactor.run() != 0)
+        {
+            errors++;
+        }
+
+        r.mWallNs = std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+        r.mCpuNs  = (std::clock() - c0) * (1e9 / CLOCKS_PER_SEC);
+        r.mErrors = errors;
+        return r;
+    }
+
+    //--------------------------------------------------------------------------
+    //! @brief      print one result
+    //--------------------------------------------------------------------------
+    void print(const char* name, int decks, int threads, const Result_t& r)
+    {
+        unsigned long ops = static_cast<unsigned long>(decks) * (EXCHANGES + BULKS);
+        double bytes = static_cast<double>(decks) * BULKS * BULK_CHUNK;
+
+        printf("{\"bench\":\"%s_d%d\",\"iterations\":%lu,\"ns_per_op\":%.1f,\"cpu_ns_per_op\":%.1f,"
+               "\"threads\":%d,\"errors\":%d,\"mib_per_s\":%.2f}\n",
+               name, decks, ops, r.mWallNs / ops, r.mCpuNs / ops, threads, r.mErrors,
+               (bytes / (1024.0 * 1024.0)) / (r.mWallNs / 1e9));
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const int decks[] = { 1, 8, 32, 128 };
+    std::vector<uint8_t> chunk(BULK_CHUNK, 0x5a);
+
+    if ((argc > 1) && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")))
+    {
+        printf("Usage: %s [<name prefix>]\n", argv[0]);
+        return 0;
+    }
+
+    netmd_set_log_level(NETMD_LOG_NONE);
+
+    for (int d : decks)
+    {
+        if ((argc < 2) || !strncmp("async_threads", argv[1], strlen(argv[1])))
+        {
+            print("async_threads", d, d, runThreads(d, chunk.data()));
+        }
+        if ((argc < 2) || !strncmp("async_reactor", argv[1], strlen(argv[1])))
+        {
+            print("async_reactor", d, 1, runReactor(d, chunk.data()));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,404 @@
+/* m3u.c
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <netmd_queue.h>
+#include "m3u.h"
+
+/* Max title length we support in M3U files... should match MD TOC max */
+#define M3U_TITLE_MAX   128
+
+/* Max line length (file names may be longer than titles) */
+#define M3U_LINE_MAX    1024
+
+/* Min "usable" audio file size (1 frame Atrac LP4)
+   = 52 (RIFF/WAVE header Atrac LP) + 8 ("data" + length) + 92 (1 frame LP4) */
+#define MIN_WAV_LENGTH  152
+
+//! one playlist entry
+typedef struct {
+    char* path;                         //!< audio file (relative to playlist)
+    char  title[M3U_TITLE_MAX + 1];     //!< track title
+} m3u_entry_t;
+
+//! parsed playlist
+typedef struct {
+    m3u_entry_t* entries;   //!< entries
+    int          count;     //!< number of entries
+    int          size;      //!< allocated entries
+    char*        dir;       //!< playlist directory (NULL -> current)
+} m3u_list_t;
+
+//------------------------------------------------------------------------------
+//! @brief      free a parsed playlist
+//!
+//! @param[in]  list  playlist
+//------------------------------------------------------------------------------
+static void m3u_free(m3u_list_t* list)
+{
+    int i;
+
+    for (i = 0; i < list->count; i++)
+    {
+        free(list->entries[i].path);
+    }
+
+    free(list->entries);
+    free(list->dir);
+    memset(list, 0, sizeof(*list));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      add an entry to the playlist
+//!
+//! @param[in]  list   playlist
+//! @param[in]  path   audio file
+//! @param[in]  title  track title
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int m3u_add(m3u_list_t* list, const char* path, const char* title)
+{
+    m3u_entry_t* e;
+
+    if (list->count == list->size)
+    {
+        int sz = list->size ? (list->size * 2) : 32;
+
+        if ((e = realloc(list->entries, sz * sizeof(m3u_entry_t))) == NULL)
+        {
+            return -1;
+        }
+        list->entries = e;
+        list->size    = sz;
+    }
+
+    e = &list->entries[list->count];
+
+    if ((e->path = strdup(path)) == NULL)
+    {
+        return -1;
+    }
+
+    strncpy(e->title, title, M3U_TITLE_MAX);
+    e->title[M3U_TITLE_MAX] = '\0';
+    list->count++;
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      parse a whole playlist
+//!
+//! @param[in]  file  playlist file
+//! @param[out] list  playlist (free with m3u_free())
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int m3u_parse(const char* file, m3u_list_t* list)
+{
+    FILE* fp;
+    char  buffer[M3U_LINE_MAX + 1];
+    char  title[M3U_TITLE_MAX + 1];
+    char* s;
+    int   have_title = 0, ret = 0;
+
+    memset(list, 0, sizeof(*list));
+
+    if ((fp = fopen(file, "r")) == NULL)
+    {
+        printf("Unable to open file %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    if (!fgets(buffer, sizeof(buffer), fp))
+    {
+        printf("File Read error\n");
+        fclose(fp);
+        return -1;
+    }
+
+    if (strcmp(buffer, "#EXTM3U\n") && strcmp(buffer, "#EXTM3U\r\n"))
+    {
+        printf("Invalid M3U playlist\n");
+        fclose(fp);
+        return -1;
+    }
+
+    /* file names are relative to the playlist */
+    if (((s = strrchr(file, '/')) != NULL) || ((s = strrchr(file, '\\')) != NULL))
+    {
+        if ((list->dir = malloc(s - file + 2)) != NULL)
+        {
+            memcpy(list->dir, file, s - file + 1);
+            list->dir[s - file + 1] = '\0';
+        }
+    }
+
+    while ((ret == 0) && (fgets(buffer, sizeof(buffer), fp) != NULL))
+    {
+        /* Chomp newlines */
+        if ((s = strpbrk(buffer, "\r\n")) != NULL)
+        {
+            *s = '\0';
+        }
+
+        if (buffer[0] == '\0')
+        {
+            continue;
+        }
+
+        if (buffer[0] == '#')
+        {
+            /* comment, ext3inf etc... we only care about ext3inf */
+            if (strncmp(buffer, "#EXTINF:", 8))
+            {
+                printf("Skip: %s\n", buffer);
+            }
+            else if ((s = strchr(buffer, ',')) == NULL)
+            {
+                printf("M3U Syntax error! %s\n", buffer);
+            }
+            else
+            {
+                strncpy(title, s + 1, M3U_TITLE_MAX);
+                title[M3U_TITLE_MAX] = '\0';
+                have_title = 1;     /* don't fallback to titling by filename */
+            }
+        }
+        else
+        {
+            if (!have_title)
+            {
+                /* Try and generate a title from the track name */
+                if (((s = strrchr(buffer, '/')) == NULL) && ((s = strrchr(buffer, '\\')) == NULL))
+                {
+                    s = buffer;
+                }
+                else
+                {
+                    s++;
+                }
+
+                strncpy(title, s, M3U_TITLE_MAX);
+                title[M3U_TITLE_MAX] = '\0';
+
+                /* Isolate extension */
+                if ((s = strrchr(title, '.')) != NULL)
+                {
+                    *s = '\0';
+                }
+            }
+
+            ret        = m3u_add(list, buffer, title);
+            have_title = 0;
+        }
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      build the path of an audio file referenced in the playlist
+//!
+//! @param[in]  list  playlist
+//! @param[in]  e     entry
+//! @param[out] buf   path buffer
+//! @param[in]  sz    buffer size
+//!
+//! @return     buf
+//------------------------------------------------------------------------------
+static const char* m3u_path(const m3u_list_t* list, const m3u_entry_t* e, char* buf, size_t sz)
+{
+    const char* p = e->path;
+
+    if ((list->dir == NULL) || (p[0] == '/') || (p[0] == '\\')
+        || (((p[0] | 0x20) >= 'a') && ((p[0] | 0x20) <= 'z') && (p[1] == ':')))
+    {
+        snprintf(buf, sz, "%s", p);
+    }
+    else
+    {
+        snprintf(buf, sz, "%s%s", list->dir, p);
+    }
+
+    return buf;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      write all titles to the tracks on disc in one title session
+//!
+//! @param[in]  devh  device handle
+//! @param[in]  list  playlist
+//!
+//! @return     0 -> ok; 1 -> error
+//------------------------------------------------------------------------------
+static int m3u_write_titles(netmd_dev_handle* devh, const m3u_list_t* list)
+{
+    netmd_title_session_t* ts;
+    unsigned long cmds = 0;
+    int i, ret = 0;
+
+    if ((ts = netmd_title_session_open(devh)) == NULL)
+    {
+        printf("Can't open title session!\n");
+        return 1;
+    }
+
+    for (i = 0; i < list->count; i++)
+    {
+        printf("Title track %d - %s\n", i, list->entries[i].title);
+
+        if (netmd_title_session_write(ts, i & 0xffff, list->entries[i].title) != 0)
+        {
+            printf("Can't set title of track %d!\n", i);
+            ret = 1;
+        }
+    }
+
+    if (netmd_title_session_close(&ts, &cmds) != NETMD_NO_ERROR)
+    {
+        ret = 1;
+    }
+
+    netmd_log(NETMD_LOG_VERBOSE, "m3u: %d title(s) written with %lu command(s)\n", list->count, cmds);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      upload queue callback: report a track
+//!
+//! @param[in]  ctx       playlist
+//! @param[in]  index     track index
+//! @param[in]  filename  audio file
+//! @param[in]  err       upload result
+//------------------------------------------------------------------------------
+static void m3u_upload_done(void* ctx, size_t index, const char* filename, netmd_error err)
+{
+    const m3u_list_t* list = (const m3u_list_t*)ctx;
+
+    if (err == NETMD_NO_ERROR)
+    {
+        printf("Sent track %d - %s (%s)\n", (int)index, list->entries[index].title, filename);
+    }
+    else
+    {
+        printf("Can't send %s: %s\n", filename, netmd_strerror(err));
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      upload all referenced audio files with their titles; the
+//!             next files are prepared on worker threads while the current
+//!             one is sent
+//!
+//! @param[in]  devh  device handle
+//! @param[in]  list  playlist
+//! @param[in]  otf   on the fly conversion
+//!
+//! @return     0 -> ok; 1 -> error
+//------------------------------------------------------------------------------
+static int m3u_upload(netmd_dev_handle* devh, const m3u_list_t* list, unsigned char otf)
+{
+    char                  path[M3U_LINE_MAX * 2];
+    struct stat           st;
+    netmd_upload_queue_t* q;
+    netmd_queue_stats_t   stats;
+    int                   i, ret = 0;
+
+    /* check all files before the first upload starts */
+    for (i = 0; i < list->count; i++)
+    {
+        m3u_path(list, &list->entries[i], path, sizeof(path));
+
+        if ((stat(path, &st) != 0) || (st.st_size < MIN_WAV_LENGTH))
+        {
+            printf("Missing or unusable audio file: %s\n", path);
+            ret = 1;
+        }
+    }
+
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    if ((q = netmd_upload_queue_open(0, 0)) == NULL)
+    {
+        printf("Can't create upload queue!\n");
+        return 1;
+    }
+
+    for (i = 0; (i < list->count) && (ret == 0); i++)
+    {
+        m3u_path(list, &list->entries[i], path, sizeof(path));
+
+        if (netmd_upload_queue_add(q, path, list->entries[i].title, otf) != 0)
+        {
+            printf("Can't queue %s!\n", path);
+            ret = 1;
+        }
+    }
+
+    if ((ret == 0) && (netmd_upload_queue_run(q, devh, NULL, m3u_upload_done, (void*)list) != NETMD_NO_ERROR))
+    {
+        ret = 1;
+    }
+
+    netmd_upload_queue_stats(q, &stats);
+    netmd_log(NETMD_LOG_VERBOSE, "m3u: %zu sent, %zu failed, %u worker(s), prepare %llu ms, send %llu ms, "
+              "waited %llu ms, peak memory %zu bytes\n", stats.sent, stats.failed, stats.threads,
+              (unsigned long long)(stats.prepare_us / 1000), (unsigned long long)(stats.send_us / 1000),
+              (unsigned long long)(stats.wait_us / 1000), stats.peak_mem);
+
+    netmd_upload_queue_close(&q);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      import an M3U playlist
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  file    playlist file
+//! @param[in]  upload  1 -> upload referenced audio files
+//! @param[in]  otf     on the fly conversion (upload only)
+//!
+//! @return     0 -> ok; 1 -> error
+//------------------------------------------------------------------------------
+int m3u_import(netmd_dev_handle* devh, const char* file, int upload, unsigned char otf)
+{
+    m3u_list_t list;
+    int ret;
+
+    if (file == NULL)
+    {
+        printf("No filename specified\n");
+        return 1;
+    }
+
+    if (m3u_parse(file, &list) != 0)
+    {
+        m3u_free(&list);
+        return 1;
+    }
+
+    ret = upload ? m3u_upload(devh, &list, otf) : m3u_write_titles(devh, &list);
+
+    m3u_free(&list);
+    return ret;
+}
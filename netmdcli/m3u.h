@@ -0,0 +1,37 @@
+/* m3u.h
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef M3U_H
+#define M3U_H
+
+#include <libnetmd_intern.h>
+
+//------------------------------------------------------------------------------
+//! @brief      import an M3U playlist. The whole playlist is parsed before
+//!             the device is touched. Without upload the titles are written
+//!             to the tracks on disc (playlist order) in one title session.
+//!             With upload the referenced audio files are sent with their
+//!             titles; the next file is read ahead while the current one
+//!             is transferred.
+//!
+//! @param[in]  devh    device handle
+//! @param[in]  file    playlist file
+//! @param[in]  upload  1 -> upload referenced audio files
+//! @param[in]  otf     on the fly conversion (upload only)
+//!
+//! @return     0 -> ok; 1 -> error
+//------------------------------------------------------------------------------
+int m3u_import(netmd_dev_handle* devh, const char* file, int upload, unsigned char otf);
+
+#endif /* M3U_H */
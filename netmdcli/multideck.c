@@ -0,0 +1,411 @@
+/* multideck.c
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <utils.h>
+#include "multideck.h"
+
+//! max. number of decks driven in parallel
+#define MULTIDECK_MAX 32
+
+//! interval for the aggregated progress line
+#define MULTIDECK_PROGRESS_MS 2000
+
+//! one deck in multi deck mode
+typedef struct {
+    int               index;        //!< index in device list
+    netmd_device*     dev;          //!< device
+    netmd_dev_handle* devh;         //!< device handle (NULL -> not opened)
+    unsigned char     otf;          //!< on the fly conversion for this deck
+    const char**      files;        //!< files to upload
+    int               count;        //!< number of files
+    pthread_t         thread;       //!< upload thread
+    int               running;      //!< thread was started
+
+    /* progress, guarded by _s_lock */
+    int               done;         //!< uploaded tracks
+    int               failed;       //!< failed tracks
+    uint64_t          bytes;        //!< uploaded bytes (finished tracks)
+    uint64_t          cur_size;     //!< size of the track being uploaded
+    uint64_t          cur;          //!< uploaded bytes of that track
+    uint64_t          total;        //!< bytes to upload
+    double            start;        //!< start time stamp (ms)
+    double            end;          //!< end time stamp (ms)
+    int               finished;     //!< all files processed
+} multideck_t;
+
+//! guards progress data of all decks
+static pthread_mutex_t _s_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//------------------------------------------------------------------------------
+//! @brief      monotonic time stamp in ms
+//!
+//! @return     time in ms
+//------------------------------------------------------------------------------
+static double multideck_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      get file size
+//!
+//! @param[in]  file  file name
+//!
+//! @return     file size; 0 on error
+//------------------------------------------------------------------------------
+static uint64_t multideck_file_size(const char* file)
+{
+    struct stat st;
+    return (stat(file, &st) == 0) ? (uint64_t)st.st_size : 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      parse deck selection
+//!
+//! @param[in]  decks  "all" or comma separated deck indices
+//! @param[in]  avail  number of available decks
+//! @param[out] sel    selection flags (MULTIDECK_MAX entries)
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int multideck_select(const char* decks, int avail, int sel[])
+{
+    const char* p = decks;
+    char* end;
+    long  idx;
+
+    memset(sel, 0, MULTIDECK_MAX * sizeof(int));
+
+    if (!strcmp(decks, "all"))
+    {
+        for (idx = 0; idx < avail; idx++)
+        {
+            sel[idx] = 1;
+        }
+        return 0;
+    }
+
+    while (*p != '\0')
+    {
+        idx = strtol(p, &end, 10);
+
+        if ((end == p) || (idx < 0) || (idx >= avail) || ((*end != ',') && (*end != '\0')))
+        {
+            netmd_log(NETMD_LOG_ERROR, "invalid deck selection '%s' (%d deck(s) found)\n", decks, avail);
+            return -1;
+        }
+
+        sel[idx] = 1;
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      progress of the track being uploaded; scaled to the file
+//!             size, so it adds up with the sizes of finished tracks
+//!
+//! @param[in]  ctx       deck
+//! @param[in]  progress  transfer progress
+//------------------------------------------------------------------------------
+static void multideck_progress(void* ctx, const netmd_progress* progress)
+{
+    multideck_t* d = (multideck_t*)ctx;
+
+    pthread_mutex_lock(&_s_lock);
+    d->cur = (progress->total > 0) ? (d->cur_size * progress->done) / progress->total : 0;
+    pthread_mutex_unlock(&_s_lock);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      upload thread of one deck; SP patch state and factory write
+//!             are kept per device handle, so decks don't wait for each
+//!             other
+//!
+//! @param[in]  arg   deck
+//!
+//! @return     NULL
+//------------------------------------------------------------------------------
+static void* multideck_worker(void* arg)
+{
+    multideck_t*       d = (multideck_t*)arg;
+    netmd_transfer_ctl ctl;
+    netmd_error        err;
+    int                i;
+
+    /* SP files: patch once per deck, not for every track */
+    netmd_sp_patch_batch(d->devh, 1);
+
+    for (i = 0; i < d->count; i++)
+    {
+        pthread_mutex_lock(&_s_lock);
+        d->cur_size = multideck_file_size(d->files[i]);
+        d->cur      = 0;
+        pthread_mutex_unlock(&_s_lock);
+
+        netmd_transfer_ctl_init(&ctl, multideck_progress, d, 250);
+        err = netmd_send_track_ex(d->devh, d->files[i], NULL, d->otf, &ctl);
+
+        if (err != NETMD_NO_ERROR)
+        {
+            netmd_log(NETMD_LOG_ERROR, "deck %d: can't upload %s: %s\n", d->index, d->files[i], netmd_strerror(err));
+        }
+
+        pthread_mutex_lock(&_s_lock);
+        if (err == NETMD_NO_ERROR)
+        {
+            d->done++;
+            d->bytes += d->cur_size;
+        }
+        else
+        {
+            d->failed++;
+        }
+        d->cur_size = 0;
+        d->cur      = 0;
+        pthread_mutex_unlock(&_s_lock);
+    }
+
+    netmd_sp_patch_batch(d->devh, 0);
+
+    pthread_mutex_lock(&_s_lock);
+    d->end      = multideck_now_ms();
+    d->finished = 1;
+    pthread_mutex_unlock(&_s_lock);
+
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print throughput
+//!
+//! @param[in]  bytes  transferred bytes
+//! @param[in]  ms     time in ms
+//------------------------------------------------------------------------------
+static void multideck_print_rate(uint64_t bytes, double ms)
+{
+    printf("%.1f MiB in %.1f s, %.1f KiB/s", bytes / 1048576.0, ms / 1000.0,
+           (ms > 0.0) ? ((bytes / 1024.0) / (ms / 1000.0)) : 0.0);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print all discovered devices
+//!
+//! @param[in]  device_list  device list as filled by netmd_init()
+//!
+//! @return     number of devices
+//------------------------------------------------------------------------------
+int multideck_list(netmd_device* device_list)
+{
+    netmd_device* dev;
+    int i = 0;
+
+    for (dev = device_list; dev != NULL; dev = dev->link, i++)
+    {
+        printf("%2d: %s (on the fly conversion: %s)\n", i, dev->model ? dev->model : "unknown",
+               dev->otf_conv ? "yes" : "no");
+    }
+
+    return i;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      upload tracks to several decks in parallel
+//!
+//! @param[in]  device_list  device list as filled by netmd_init()
+//! @param[in]  decks        "all" or comma separated deck indices
+//! @param[in]  argc         number of file arguments
+//! @param[in]  argv         file arguments
+//! @param[in]  otf          on the fly conversion
+//!
+//! @return     0 -> all uploads ok; 1 -> at least one upload failed
+//------------------------------------------------------------------------------
+int multideck_send(netmd_device* device_list, const char* decks, int argc, char* argv[], unsigned char otf)
+{
+    multideck_t   deck[MULTIDECK_MAX];
+    int           sel[MULTIDECK_MAX];
+    netmd_device* dev;
+    netmd_error   err;
+    int           avail = 0, i, j, target = -1, ret = 0;
+    int           finished, done, failed, tracks, last_done = -1;
+    uint64_t      bytes, total;
+    double        start, last = 0.0, now, secs, rate[MULTIDECK_MAX];
+
+    memset(deck, 0, sizeof(deck));
+
+    for (dev = device_list; (dev != NULL) && (avail < MULTIDECK_MAX); dev = dev->link, avail++)
+    {
+        deck[avail].index = avail;
+        deck[avail].dev   = dev;
+        deck[avail].otf   = dev->otf_conv ? otf : NO_ONTHEFLY_CONVERSION;
+    }
+
+    if (multideck_select(decks, avail, sel) != 0)
+    {
+        return 1;
+    }
+
+    /* distribute files: "@<n>" switches to deck n */
+    for (i = 0; i < avail; i++)
+    {
+        if (sel[i] && ((deck[i].files = calloc(argc, sizeof(char*))) == NULL))
+        {
+            ret = 1;
+        }
+    }
+
+    for (i = 0; (ret == 0) && (i < argc); i++)
+    {
+        if (argv[i][0] == '@')
+        {
+            target = atoi(&argv[i][1]);
+
+            if ((target < 0) || (target >= avail) || !sel[target])
+            {
+                netmd_log(NETMD_LOG_ERROR, "deck %s isn't selected\n", &argv[i][1]);
+                ret = 1;
+            }
+            continue;
+        }
+
+        for (j = 0; j < avail; j++)
+        {
+            if (sel[j] && ((target == -1) || (target == j)))
+            {
+                deck[j].files[deck[j].count++] = argv[i];
+                deck[j].total += multideck_file_size(argv[i]);
+            }
+        }
+    }
+
+    /* open all decks before the first upload starts */
+    for (i = 0; (ret == 0) && (i < avail); i++)
+    {
+        if (sel[i] && (deck[i].count > 0))
+        {
+            if ((err = netmd_open(deck[i].dev, &deck[i].devh)) != NETMD_NO_ERROR)
+            {
+                printf("deck %d: error opening netmd\n%s\n", i, netmd_strerror(err));
+                deck[i].devh = NULL;
+                ret = 1;
+            }
+        }
+    }
+
+    start = multideck_now_ms();
+
+    for (i = 0; (ret == 0) && (i < avail); i++)
+    {
+        if (deck[i].devh != NULL)
+        {
+            deck[i].start = start;
+            if (pthread_create(&deck[i].thread, NULL, multideck_worker, &deck[i]) == 0)
+            {
+                deck[i].running = 1;
+            }
+            else
+            {
+                netmd_log(NETMD_LOG_ERROR, "deck %d: can't start upload thread\n", i);
+                ret = 1;
+            }
+        }
+    }
+
+    /* aggregated progress */
+    do
+    {
+        netmd_sleep(200);
+
+        finished = 1;
+        done     = failed = tracks = 0;
+        bytes    = total  = 0;
+        now      = multideck_now_ms();
+
+        pthread_mutex_lock(&_s_lock);
+        for (i = 0; i < avail; i++)
+        {
+            if (deck[i].running)
+            {
+                finished &= deck[i].finished;
+                done     += deck[i].done;
+                failed   += deck[i].failed;
+                tracks   += deck[i].count;
+                bytes    += deck[i].bytes + deck[i].cur;
+                secs      = ((deck[i].finished ? deck[i].end : now) - start) / 1000.0;
+                rate[i]   = (secs > 0.0) ? (((deck[i].bytes + deck[i].cur) / 1024.0) / secs) : 0.0;
+                total    += deck[i].total;
+            }
+        }
+        pthread_mutex_unlock(&_s_lock);
+
+        if ((tracks > 0) && (((done + failed) != last_done) || ((now - last) >= MULTIDECK_PROGRESS_MS)))
+        {
+            printf("progress: %d/%d tracks (%d failed), %.1f/%.1f MiB, ", done + failed, tracks,
+                   failed, bytes / 1048576.0, total / 1048576.0);
+            multideck_print_rate(bytes, now - start);
+
+            for (i = 0; i < avail; i++)
+            {
+                if (deck[i].running)
+                {
+                    printf("; deck %d: %.1f KiB/s", i, rate[i]);
+                }
+            }
+            printf("\n");
+            fflush(stdout);
+            last_done = done + failed;
+            last      = now;
+        }
+    }
+    while (!finished);
+
+    /* per deck summary */
+    for (i = 0; i < avail; i++)
+    {
+        if (deck[i].running)
+        {
+            pthread_join(deck[i].thread, NULL);
+
+            printf("deck %d (%s): %d/%d tracks, ", i, deck[i].dev->model ? deck[i].dev->model : "unknown",
+                   deck[i].done, deck[i].count);
+            multideck_print_rate(deck[i].bytes, deck[i].end - deck[i].start);
+            printf("\n");
+
+            if (deck[i].failed > 0)
+            {
+                ret = 1;
+            }
+        }
+
+        if (deck[i].devh != NULL)
+        {
+            netmd_close(deck[i].devh);
+        }
+
+        free(deck[i].files);
+    }
+
+    return ret;
+}
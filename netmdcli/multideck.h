@@ -0,0 +1,47 @@
+/* multideck.h
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef MULTIDECK_H
+#define MULTIDECK_H
+
+#include <libnetmd_intern.h>
+
+//------------------------------------------------------------------------------
+//! @brief      print all discovered devices with the index used to select
+//!             them in multi deck mode
+//!
+//! @param[in]  device_list  device list as filled by netmd_init()
+//!
+//! @return     number of devices
+//------------------------------------------------------------------------------
+int multideck_list(netmd_device* device_list);
+
+//------------------------------------------------------------------------------
+//! @brief      upload tracks to several decks in parallel (one thread per
+//!             deck). Files given before the first "@<deck>" argument go
+//!             to all selected decks, files after "@<deck>" only to that
+//!             deck.
+//!
+//! @param[in]  device_list  device list as filled by netmd_init()
+//! @param[in]  decks        "all" or comma separated deck indices
+//! @param[in]  argc         number of file arguments
+//! @param[in]  argv         file arguments
+//! @param[in]  otf          on the fly conversion (used on decks
+//!                          supporting it only)
+//!
+//! @return     0 -> all uploads ok; 1 -> at least one upload failed
+//------------------------------------------------------------------------------
+int multideck_send(netmd_device* device_list, const char* decks, int argc, char* argv[], unsigned char otf);
+
+#endif /* MULTIDECK_H */
@@ -25,13 +25,20 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
+#include <signal.h>
 #include <libnetmd_intern.h>
 #include <utils.h>
+#include <netmd_trace.h>
+#include <netmd_monitor.h>
+#include "netmdd.h"
+#include "multideck.h"
+#include "snapshot.h"
+#include "m3u.h"
 
 void print_disc_info(netmd_dev_handle* devh, HndMdHdr md);
 void print_current_track_info(netmd_dev_handle* devh);
 void print_syntax();
-void import_m3u_playlist(netmd_dev_handle* devh, const char *file);
 
 /* Max line length we support in M3U files... should match MD TOC max */
 #define M3U_LINE_MAX	128
@@ -40,6 +47,12 @@ void import_m3u_playlist(netmd_dev_handle* devh, const char *file);
    = 52 (RIFF/WAVE header Atrac LP) + 8 ("data" + length) + 92 (1 frame LP4) */
 #define MIN_WAV_LENGTH 152
 
+//! output JSON lines instead of text (disc_info, status, capacity)
+static int _s_json = 0;
+
+//! transfer in progress, cancelled on SIGINT
+static netmd_transfer_ctl* volatile _s_xfer = NULL;
+
 #if 0
 static void handle_secure_cmd(netmd_dev_handle* devh, int cmdid, int track)
 {
@@ -183,190 +196,22 @@ static size_t wav_data_position(const unsigned char * data, size_t offset, size_
 
 void print_current_track_info(netmd_dev_handle* devh)
 {
-    uint16_t track;
-    char buffer[256];
-    netmd_time time;
-
-    /* TODO: error checking */
-    netmd_get_position(devh, &time);
-    netmd_get_track(devh, &track);
-    netmd_request_title(devh, track, buffer, 256);
-
-    printf("Current track: %s \n", buffer);
-    printf("Current playback position: ");
-    print_time(&time);
-    printf("\n");
+    snapshot_status_t snap;
 
+    snapshot_status(devh, &snap);
+    snapshot_print_status(&snap, _s_json);
 }
 
 void print_disc_info(netmd_dev_handle* devh, HndMdHdr md)
 {
-    uint16_t tc = 0;
-    uint16_t i = 0;
-    int16_t group = 0, lastgroup = 9858;
-    const char* group_name;
-    unsigned char bitrate_id;
-    unsigned char flags;
-    unsigned char channel;
-    char *name, buffer[256];
-    struct netmd_track time;
-    struct netmd_pair const *trprot, *bitrate;
-
-    trprot = bitrate = 0;
-
-    printf("Disc Title: %s\n", md_header_disc_title(md));
-
-    netmd_disc_capacity capacity;
-    netmd_get_disc_capacity(devh, &capacity);
-    printf("Disc Length: %.02d:%.02d:%.02d.%.03d\n", 
-        capacity.total.hour, capacity.total.minute,
-        capacity.total.second, capacity.total.frame);
-
-    printf("Time used: %.02d:%.02d:%.02d.%.03d\n", 
-        capacity.recorded.hour, capacity.recorded.minute,
-        capacity.recorded.second, capacity.recorded.frame);
-
-    printf("Time available: %.02d:%.02d:%.02d.%.03d\n", 
-        capacity.available.hour, capacity.available.minute,
-        capacity.available.second, capacity.available.frame);
-
-    netmd_request_track_count(devh, &tc);
-
-    for(i = 0; i < tc; i++)
-    {
-        netmd_request_title(devh, i, buffer, 256);
-
-        group_name = md_header_track_group(md, i + 1, &group);
-
-        if (group != lastgroup)
-        {
-            lastgroup = group;
-
-            if (group != -1)
-            {
-                printf(" [ %s ]\n", group_name);
-            }
-        }
-
-        netmd_request_track_time(devh, i, &time);
-        netmd_request_track_flags(devh, i, &flags);
-        netmd_request_track_bitrate(devh, i, &bitrate_id, &channel);
-
-        trprot = find_pair(flags, trprot_settings);
-        bitrate = find_pair(bitrate_id, bitrates);
-
-        /* Skip 'LP:' prefix... the codec type shows up in the list anyway*/
-        if( strncmp( buffer, "LP:", 3 ))
-        {
-            name = buffer;
-        } else {
-            name = buffer + 3;
-        }
-
-        // Format track time
-        char time_buf[9];
-        sprintf(time_buf, "%02i:%02i:%02i", time.minute, time.second, time.tenth);
-
-        if (group != -1)
-        {
-            printf("    ");
-        }
-
-        printf("%.2d) %s (%s; %s; %s)\n",
-            i + 1, name, time_buf, 
-            trprot->name, bitrate->name);
-    }
-}
-
-void import_m3u_playlist(netmd_dev_handle* devh, const char *file)
-{
-    FILE *fp;
-    char buffer[M3U_LINE_MAX + 1];
-    char *s;
-    uint8_t track;
-    int discard;
-
-    if( file == NULL )
-    {
-        printf( "No filename specified\n" );
-        print_syntax();
-        return;
-    }
+    snapshot_disc_t snap;
 
-    if( (fp = fopen( file, "r" )) == NULL )
+    /* gather everything first, print afterwards */
+    if (snapshot_disc(devh, md, &snap) == 0)
     {
-        printf( "Unable to open file %s: %s\n", file, strerror( errno ));
-        return;
-    }
-
-    if( ! fgets( buffer, M3U_LINE_MAX, fp )) {
-        printf( "File Read error\n" );
-        return;
-    }
-    if( strcmp( buffer, "#EXTM3U\n" )) {
-        printf( "Invalid M3U playlist\n" );
-        return;
-    }
-
-    track = 0;
-    discard = 0;
-    while( fgets( buffer, M3U_LINE_MAX, fp) != NULL ) {
-        /* Chomp newlines */
-        s = strchr( buffer, '\n' );
-        if( s )
-            *s = '\0';
-
-        if( buffer[0] == '#' )
-        {
-            /* comment, ext3inf etc... we only care about ext3inf */
-            if( strncmp( buffer, "#EXTINF:", 8 ))
-            {
-                printf( "Skip: %s\n", buffer );
-            }
-            else
-            {
-                s = strchr( buffer, ',' );
-                if( !s )
-                {
-                    printf( "M3U Syntax error! %s\n", buffer );
-                }
-                else
-                {
-                    s++;
-                    printf( "Title track %d - %s\n", track, s );
-                    netmd_set_title(devh, track, s); /* XXX Handle errors */
-                    discard = 1;	/* don't fallback to titling by filename */
-                }
-            }
-        }
-        else
-        {
-            /* Filename line */
-            if( discard )
-            {
-                /* printf( "Discard: %s\n", buffer ); */
-                discard = 0;
-            }
-            else
-            {
-                /* Try and generate a title from the track name */
-                s = strrchr( buffer, '.' ); /* Isolate extension */
-                if( s )
-                    *s = 0;
-                s = strrchr( buffer, '/' ); /* Isolate basename */
-                if( !s )
-                    s = strrchr( buffer, '\\' ); /* Handle DOS paths? */
-                if( !s )
-                    s = buffer;
-                else
-                    s++;
-
-                printf( "Title track %d - %s\n", track, s );
-                netmd_set_title(devh, track, s); /* XXX Handle errors */
-            }
-            track++;
-        }
+        snapshot_print_disc(&snap, _s_json);
     }
+    snapshot_disc_free(&snap);
 }
 
 void print_syntax()
@@ -376,7 +221,10 @@ void print_syntax()
     puts("Options:");
     puts("      -v show debug messages");
     puts("      -t enable tracing of USB command and response data");
-    puts("      -d [lp2|lp4] ATRAC3 on the fly encoding\n");
+    puts("      -d [lp2|lp4] ATRAC3 on the fly encoding");
+    puts("      -j print disc_info, status and capacity as JSON lines (with query time in ms)");
+    puts("      -T <file> write protocol trace to <file> on error and at exit (decode with netmdtrace)");
+    puts("      -S <socket> send command to a running netmdcli daemon\n");
     puts("Commands:");
     puts("disc_info - print disc info in plain text");
     puts("add_group <title> <first group track> <last group track> - add a new group and place a track range");
@@ -395,14 +243,17 @@ void print_syntax()
     puts("restart - restarts current track");
     puts("pause - pause the unit");
     puts("stop - stop the unit");
-    puts("delete #1 [#2] - delete track (or tracks in range #1-#2 if #2 given)");
-    puts("del_track #1 - delete track and update groups if needed");
+    puts("delete #1 [#2] - delete track (or tracks in range #1-#2 if #2 given) and update groups");
+    puts("del_track #1 [#2 ...] - delete track(s) and update groups if needed");
     puts("erase [force] - erase the disc (the argument 'force' must be given to actually do it)");
-    puts("m3uimport <file> - import song and disc title from a playlist");
+    puts("m3uimport <file> [send] - import song titles from a playlist (titles tracks on disc in playlist order);");
+    puts("      with 'send' the audio files referenced in the playlist are uploaded with their titles");
     puts("send <file> [<string>] - send WAV format audio file to the device and set title to <string> (optional)");
     puts("      Supported file formats: 16 bit pcm (stereo or mono) @44100Hz or");
     puts("         Atrac LP2/LP4 data stored in a WAV container.");
+    puts("      Other pcm (8 - 192 kHz, 16/24/32 bit or float) is converted to 44100Hz / 16 bit.");
     puts("      Title defaults to file name if not specified.");
+    puts("      Progress is shown on a terminal; Ctrl+C cancels the upload (also for recv).");
     puts("raw - send raw command (hex)");
     puts("setplaymode (single, repeat, shuffle) - set play mode");
     puts("newgroup <string> - create a new group named <string>");
@@ -427,402 +278,1119 @@ void print_syntax()
     puts("  0x23 = get hash id for track #");
     puts("  0x40 = secure delete track #");
 #endif
+    puts("batch <file> - run commands from script <file> ('-' -> stdin) in one session, one command per line;");
+    puts("      metadata edits (rename, move, group, ...) share one TOC write and one header write");
+    puts("daemon <socket> - keep device open and serve commands on Unix domain socket <socket>");
+    puts("      (use -S <socket> to send commands, 'reload' re-reads disc header, 'quit' stops daemon)");
+    puts("memdump <addr> <size> <file> [<chunk>] - dump device memory (e.g. firmware) to <file>;");
+    puts("      numbers may be given in hex (0x...), <chunk> is the size per request (max. 255)");
+    puts("monitor [<interval>] [<seconds>] - print track, position and play state on change;");
+    puts("      polls every <interval> ms (default 500) for <seconds> s (default 10)");
+    puts("decks - list all NetMD devices found, with the index used by multisend");
+    puts("multisend <decks> <file> ... [@<deck> <file> ...] - upload to several decks in parallel;");
+    puts("      <decks> is 'all' or a comma separated list of deck indices, files before the first");
+    puts("      '@<deck>' go to all selected decks, files after it only to that deck");
     puts("help - show this message\n");
 }
 
-int main(int argc, char* argv[])
+//------------------------------------------------------------------------------
+//! @brief      dump device memory to a file
+//!
+//! @param[in]  devh   device handle
+//! @param[in]  addr   start address (string)
+//! @param[in]  size   number of bytes (string)
+//! @param[in]  file   output file
+//! @param[in]  chunk  bytes per request (string, may be NULL)
+//!
+//! @return     0 -> ok; 1 -> error
+//------------------------------------------------------------------------------
+static int dump_memory(netmd_dev_handle* devh, const char* addr, const char* size, const char* file, const char* chunk)
 {
-    netmd_dev_handle* devh;
-    HndMdHdr md = NULL;
-    netmd_device *device_list, *netmd;
-    long unsigned int i = 0;
-    long unsigned int j = 0;
-    char name[16];
-    uint16_t track, playmode;
-    netmd_time time;
-    netmd_error error;
-    FILE *f;
-    int exit_code = 0;
-    unsigned char onTheFlyConvert = NO_ONTHEFLY_CONVERSION;
+    uint32_t a  = (uint32_t)strtoul(addr, NULL, 0);
+    size_t   sz = (size_t)strtoul(size, NULL, 0);
+    size_t   done = 0;
+    uint8_t* buf;
+    uint64_t t0;
+    double   ms;
+    FILE*    f;
+    int      ret = 0;
+
+    if ((sz == 0) || ((buf = malloc(sz)) == NULL))
+    {
+        netmd_log(NETMD_LOG_ERROR, "Error: invalid dump size '%s'\n", size);
+        return 1;
+    }
 
-    /* by default, log only errors */
-    netmd_set_log_level(NETMD_LOG_ERROR);
+    t0 = netmd_trace_time_us();
 
-    /* parse parameters */
+    if (netmd_read_memory(devh, a, buf, sz, (chunk != NULL) ? (size_t)strtoul(chunk, NULL, 0) : 0, &done) != NETMD_NO_ERROR)
     {
-        int c;
-        opterr = 0;
-        optind = 1;
+        ret = 1;
+    }
+
+    ms = (netmd_trace_time_us() - t0) / 1000.0;
 
-        while ((c = getopt (argc, argv, "tvd:Y")) != -1)
+    if (done > 0)
+    {
+        if (((f = fopen(file, "wb")) == NULL) || (fwrite(buf, 1, done, f) != done))
         {
-            switch (c)
-            {
-            case 't':
-                netmd_set_log_level(NETMD_LOG_ALL);
-                break;
-            case 'v':
-                netmd_set_log_level(NETMD_LOG_VERBOSE);
-                break;
-            case 'd':
-                if (!strcmp(optarg, "lp2"))
-                {
-                    onTheFlyConvert = NETMD_DISKFORMAT_LP2;
-                }
-                else if (!strcmp(optarg, "lp4"))
-                {
-                    onTheFlyConvert = NETMD_DISKFORMAT_LP4;
-                }
-                break;
-            case '?':
-                if (optopt == 'd')
-                {
-                    netmd_log(NETMD_LOG_ERROR, "Option -%c requires an argument.\n", optopt);
-                }
-                else if (isprint (optopt))
-                {
-                    netmd_log(NETMD_LOG_ERROR, "Unknown option `-%c'.\n", optopt);
-                }
-                else
-                {
-                    netmd_log(NETMD_LOG_ERROR, "Unknown option character `\\x%x'.\n", optopt);
-                }
-            // fall through
-            default:
-                return 1;
-            }
+            netmd_log(NETMD_LOG_ERROR, "Error: can't write %s\n", file);
+            ret = 1;
+        }
+
+        if (f != NULL)
+        {
+            fclose(f);
         }
     }
 
-    /* update argv and argc after parsing options */
-    argv = &argv[optind - 1];
-    argc -= (optind - 1);
+    printf("%zu of %zu bytes from 0x%08x in %.1f s (%.1f KiB/s)\n", done, sz, a, ms / 1000.0,
+           (ms > 0.0) ? ((done / 1024.0) / (ms / 1000.0)) : 0.0);
 
-    /* don't require device init to show help */
-    if ((argc == 1) || ((argc > 1 && strcmp("help", argv[1]) == 0)))
+    free(buf);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      SIGINT handler while a track is transferred
+//!
+//! @param[in]  sig   signal number
+//------------------------------------------------------------------------------
+static void cancel_transfer(int sig)
+{
+    netmd_transfer_ctl* ctl = _s_xfer;
+
+    (void)sig;
+    if (ctl != NULL)
     {
-        print_syntax();
-        return 0;
+        netmd_transfer_cancel(ctl);
     }
+}
 
-    error = netmd_init(&device_list, NULL);
-    if (error != NETMD_NO_ERROR) {
-        printf("Error initializing netmd\n%s\n", netmd_strerror(error));
-        return 1;
+//------------------------------------------------------------------------------
+//! @brief      progress callback: print a status line to stderr
+//!
+//! @param[in]  ctx       unused
+//! @param[in]  progress  transfer progress
+//------------------------------------------------------------------------------
+static void print_progress(void* ctx, const netmd_progress* progress)
+{
+    (void)ctx;
+
+    fprintf(stderr, "\r%5.1f%% %llu of %llu bytes, %.1f KiB/s   ",
+            (progress->total > 0) ? (progress->done * 100.0 / progress->total) : 0.0,
+            (unsigned long long)progress->done, (unsigned long long)progress->total, progress->rate / 1024.0);
+
+    if (progress->done >= progress->total)
+    {
+        fputc('\n', stderr);
     }
+}
 
-    if (device_list == NULL) {
-        puts("Found no NetMD device(s).");
+//------------------------------------------------------------------------------
+//! @brief      send or receive a track; progress is shown on a terminal and
+//!             Ctrl+C cancels the transfer
+//!
+//! @param[in]  devh      device handle
+//! @param[in]  filename  audio file
+//! @param[in]  title     track title (send only, may be NULL)
+//! @param[in]  otf       on the fly conversion (send only)
+//! @param[in]  track     track number (receive only)
+//! @param[in]  send      1 -> send; 0 -> receive
+//!
+//! @return     0 -> ok; 1 -> error
+//------------------------------------------------------------------------------
+static int transfer_track(netmd_dev_handle* devh, const char* filename, const char* title,
+                          unsigned char otf, uint16_t track, int send)
+{
+    netmd_transfer_ctl ctl;
+    netmd_error        err;
+    void             (*prev)(int);
+    FILE*              f = NULL;
+
+    if (!send && ((f = fopen(filename, "wb")) == NULL))
+    {
+        netmd_log(NETMD_LOG_ERROR, "Error: can't open %s\n", filename);
         return 1;
     }
 
-    /* pick first available device */
-    netmd = device_list;
+    netmd_transfer_ctl_init(&ctl, isatty(fileno(stderr)) ? print_progress : NULL, NULL, 250);
+    _s_xfer = &ctl;
+    prev    = signal(SIGINT, cancel_transfer);
 
-    error = netmd_open(netmd, &devh);
-    if(error != NETMD_NO_ERROR)
+    err = send ? netmd_send_track_ex(devh, filename, title, otf, &ctl)
+               : netmd_secure_recv_track_ex(devh, track, f, &ctl);
+
+    signal(SIGINT, (prev == SIG_ERR) ? SIG_DFL : prev);
+    _s_xfer = NULL;
+
+    if (f != NULL)
     {
-        printf("Error opening netmd\n%s\n", netmd_strerror(error));
-        return 1;
+        fclose(f);
+    }
+
+    if (err == NETMD_CANCELLED)
+    {
+        fprintf(stderr, "\nTransfer cancelled\n");
+    }
+
+    return (err == NETMD_NO_ERROR) ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      monitor subscriber: print the changed status
+//!
+//! @param[in]  ctx      unused
+//! @param[in]  status   current status
+//! @param[in]  changed  change flags
+//------------------------------------------------------------------------------
+static void print_monitor_status(void* ctx, const netmd_status_t* status, unsigned changed)
+{
+    const char* state;
+
+    (void)ctx;
+    (void)changed;
+
+    if (status->err != NETMD_NO_ERROR)
+    {
+        printf("status: %s\n", netmd_strerror(status->err));
+        return;
+    }
+
+    switch (status->state)
+    {
+    case NETMD_OPERATING_STATUS_PLAYING: state = "playing"; break;
+    case NETMD_OPERATING_STATUS_PAUSED:  state = "paused";  break;
+    case NETMD_OPERATING_STATUS_STOPPED: state = "stopped"; break;
+    default:                             state = "busy";    break;
     }
 
-    error = netmd_get_devname(devh, name, 16);
-    if (error != NETMD_NO_ERROR)
+    printf("track %02u %02u:%02u:%02u.%02u %s\n", status->track + 1, status->position.hour,
+           status->position.minute, status->position.second, status->position.frame, state);
+    fflush(stdout);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      watch the device status for a while
+//!
+//! @param[in]  devh      device handle
+//! @param[in]  interval  poll interval in ms (string, may be NULL)
+//! @param[in]  seconds   run time in s (string, may be NULL)
+//!
+//! @return     0 -> ok; 1 -> error
+//------------------------------------------------------------------------------
+static int watch_status(netmd_dev_handle* devh, const char* interval, const char* seconds)
+{
+    netmd_monitor_t* mon;
+    unsigned         secs = (seconds != NULL) ? (unsigned)strtoul(seconds, NULL, 10) : 10;
+
+    if ((mon = netmd_monitor_start(devh, (interval != NULL) ? (unsigned)strtoul(interval, NULL, 10) : 0)) == NULL)
     {
-        printf("Could not get device name\n%s\n", netmd_strerror(error));
+        netmd_log(NETMD_LOG_ERROR, "Error: can't start status monitor\n");
         return 1;
     }
 
-    netmd_initialize_disc_info(devh, &md);
+    netmd_monitor_subscribe(mon, NETMD_MONITOR_ALL, print_monitor_status, NULL);
+    sleep(secs);
+    netmd_monitor_stop(&mon);
+    return 0;
+}
 
-    /* parse commands */
-    if(argc > 1)
+//------------------------------------------------------------------------------
+//! @brief      run one netmdcli command
+//!
+//! @param[in]     devh             device handle
+//! @param[in/out] md               disc header (loaded on first use)
+//! @param[in]     argc             argument count (argv[1] is the command)
+//! @param[in]     argv             arguments
+//! @param[in]     onTheFlyConvert  on the fly conversion for send
+//!
+//! @return        exit code
+//------------------------------------------------------------------------------
+static int run_command(netmd_dev_handle* devh, HndMdHdr* md, int argc, char* argv[], unsigned char onTheFlyConvert)
+{
+    long unsigned int i = 0;
+    long unsigned int j = 0;
+    uint16_t track, playmode;
+    netmd_time time;
+    netmd_error error;
+    int exit_code = 0;
+
+    if(strcmp("disc_info", argv[1]) == 0)
+    {
+        print_disc_info(devh, netmd_disc_header(devh, md));
+    }
+    else if(strcmp("rename", argv[1]) == 0)
     {
-        if(strcmp("disc_info", argv[1]) == 0)
+        if (!check_args(argc, 3, "rename")) return -1;
+        i = strtoul(argv[2], NULL, 10);
+        netmd_title_session_t* ts = netmd_title_session_open(devh);
+        netmd_title_session_write(ts, i & 0xffff, argv[3]);
+        if (netmd_title_session_close(&ts, NULL) != NETMD_NO_ERROR)
         {
-            print_disc_info(devh, md);  
+            exit_code = 1;
         }
-        else if(strcmp("rename", argv[1]) == 0)
+    }
+    else if(strcmp("move", argv[1]) == 0)
+    {
+        if (!check_args(argc, 3, "move")) return -1;
+        i = strtoul(argv[2], NULL, 10);
+        j = strtoul(argv[3], NULL, 10);
+        netmd_move_track(devh, i & 0xffff, j & 0xffff);
+    }
+    else if(strcmp("write", argv[1]) == 0)
+    {
+        // Probably non-functional for most use cases
+        if (!check_args(argc, 2, "write")) return -1;
+        if(netmd_write_track(devh, argv[2]) < 0)
         {
-            if (!check_args(argc, 3, "rename")) return -1;
-            i = strtoul(argv[2], NULL, 10);
-            netmd_cache_toc(devh);
-            netmd_set_title(devh, i & 0xffff, argv[3]);
-            netmd_sync_toc(devh);
+            fprintf(stderr, "Error writing track %i\n", errno);
         }
-        else if(strcmp("move", argv[1]) == 0)
+    }
+    else if(strcmp("newgroup", argv[1]) == 0)
+    {
+        if (!check_args(argc, 2, "newgroup")) return -1;
+        netmd_create_group(devh, netmd_disc_header(devh, md), argv[2], -1, -1);
+    }
+    else if(strcmp("settitle", argv[1]) == 0)
+    {
+        if (!check_args(argc, 2, "settitle")) return -1;
+        // netmd_cache_toc(devh);
+        if (netmd_set_disc_title(devh, argv[2], strlen(argv[2])) < 0)
         {
-            if (!check_args(argc, 3, "move")) return -1;
-            i = strtoul(argv[2], NULL, 10);
-            j = strtoul(argv[3], NULL, 10);
-            netmd_move_track(devh, i & 0xffff, j & 0xffff);
+            /* don't know what's stored now */
+            free_md_header(md);
         }
-        else if(strcmp("write", argv[1]) == 0)
+        else if (*md != NULL)
         {
-            // Probably non-functional for most use cases
-            if (!check_args(argc, 2, "write")) return -1;
-            if(netmd_write_track(devh, argv[2]) < 0)
-            {
-                fprintf(stderr, "Error writing track %i\n", errno);
-            }
+            /* keep loaded header in line with what's stored now */
+            free_md_header(md);
+            *md = create_md_header(argv[2]);
+            md_header_set_stored_size(*md, strlen(argv[2]));
         }
-        else if(strcmp("newgroup", argv[1]) == 0)
+        // netmd_sync_toc(devh);
+    }
+    else if(strcmp("add_group", argv[1]) == 0)
+    {
+        if (!check_args(argc, 4, "add_group")) return -1;
+        i = strtoul(argv[3], NULL, 10);
+        j = strtoul(argv[4], NULL, 10);
+        if (md_header_add_group(netmd_disc_header(devh, md), argv[2], i, j) > 0)
         {
-            if (!check_args(argc, 2, "newgroup")) return -1;
-            netmd_create_group(devh, md, argv[2], -1, -1);
+            netmd_write_disc_header(devh, *md);
         }
-        else if(strcmp("settitle", argv[1]) == 0)
+    }
+    else if(strcmp("rename_disc", argv[1]) == 0)
+    {
+        if (!check_args(argc, 2, "rename_disc")) return -1;
+        if (md_header_set_disc_title(netmd_disc_header(devh, md), argv[2]) == 0)
         {
-            if (!check_args(argc, 2, "settitle")) return -1;
-            // netmd_cache_toc(devh);
-            netmd_set_disc_title(devh, argv[2], strlen(argv[2]));
-            // netmd_sync_toc(devh);
+            netmd_write_disc_header(devh, *md);
         }
-        else if(strcmp("add_group", argv[1]) == 0)
+    }
+    else if(strcmp("group", argv[1]) == 0)
+    {
+        if (!check_args(argc, 3, "group")) return -1;
+        i = strtoul(argv[2], NULL, 10);
+        j = strtoul(argv[3], NULL, 10);
+        if(!netmd_put_track_in_group(devh, netmd_disc_header(devh, md), i & 0xffff, j & 0xffff))
         {
-            if (!check_args(argc, 4, "add_group")) return -1;
-            i = strtoul(argv[3], NULL, 10);
-            j = strtoul(argv[4], NULL, 10);
-            if (md_header_add_group(md, argv[2], i, j) > 0)
-            {
-                netmd_write_disc_header(devh, md);
-            }
+            printf("Something screwy happened\n");
+        }
+    }
+    else if(strcmp("retitle", argv[1]) == 0)
+    {
+        if (!check_args(argc, 3, "retitle")) return -1;
+        i = strtoul(argv[2], NULL, 10);
+        netmd_set_group_title(devh, netmd_disc_header(devh, md), (unsigned int) i, argv[3]);
+    }
+    else if(strcmp("play", argv[1]) == 0)
+    {
+        if( argc > 2 ) {
+            i = strtoul(argv[2],NULL, 10);
+            netmd_set_track( devh, i & 0xffff );
         }
-        else if(strcmp("rename_disc", argv[1]) == 0)
+        netmd_play(devh);
+    }
+    else if(strcmp("stop", argv[1]) == 0)
+    {
+        netmd_stop(devh);
+    }
+    else if(strcmp("pause", argv[1]) == 0)
+    {
+        netmd_pause(devh);
+    }
+    else if(strcmp("fforward", argv[1]) == 0)
+    {
+        netmd_fast_forward(devh);
+    }
+    else if(strcmp("rewind", argv[1]) == 0)
+    {
+        netmd_rewind(devh);
+    }
+    else if(strcmp("next", argv[1]) == 0)
+    {
+        netmd_track_next(devh);
+    }
+    else if(strcmp("previous", argv[1]) == 0)
+    {
+        netmd_track_previous(devh);
+    }
+    else if(strcmp("restart", argv[1]) == 0)
+    {
+        netmd_track_restart(devh);
+    }
+    else if(strcmp("settime", argv[1]) == 0)
+    {
+        if (!check_args(argc, 4, "settime")) return -1;
+        track = strtoul(argv[2], (char **) NULL, 10) & 0xffff;
+        if (argc > 6)
         {
-            if (!check_args(argc, 2, "rename_disc")) return -1;
-            if (md_header_set_disc_title(md, argv[2]) == 0)
-            {
-                netmd_write_disc_header(devh, md);
-            }
+            time.hour = strtoul(argv[3], (char **) NULL, 10) & 0xffff;
+            time.minute = strtoul(argv[4], (char **) NULL, 10) & 0xff;
+            time.second = strtoul(argv[5], (char **) NULL, 10) & 0xff;
+            time.frame = strtoul(argv[6], (char **) NULL, 10) & 0xff;
         }
-        else if(strcmp("group", argv[1]) == 0)
+        else
         {
-            if (!check_args(argc, 3, "group")) return -1;
-            i = strtoul(argv[2], NULL, 10);
-            j = strtoul(argv[3], NULL, 10);
-            if(!netmd_put_track_in_group(devh, md, i & 0xffff, j & 0xffff))
+            time.hour = 0;
+            time.minute = strtoul(argv[3], (char **) NULL, 10) & 0xff;
+            time.second = strtoul(argv[4], (char **) NULL, 10) & 0xff;
+            if (argc > 5)
+            {
+                time.frame = strtoul(argv[5], (char **) NULL, 10) & 0xff;;
+            }
+            else
             {
-                printf("Something screwy happened\n");
+                time.frame = 0;
             }
         }
-        else if(strcmp("retitle", argv[1]) == 0)
+
+        netmd_set_time(devh, track, &time);
+    }
+    else if(strcmp("m3uimport", argv[1]) == 0)
+    {
+        if (!check_args(argc, 2, "m3uimport")) return -1;
+        exit_code = m3u_import(devh, argv[2], (argc > 3) && !strcmp(argv[3], "send"), onTheFlyConvert);
+    }
+    else if(strcmp("del_track", argv[1]) == 0)
+    {
+        if (!check_args(argc, 2, "del_track")) return -1;
+        uint16_t tracks[argc - 2];
+
+        for (int t = 2; t < argc; t++)
         {
-            if (!check_args(argc, 3, "retitle")) return -1;
-            i = strtoul(argv[2], NULL, 10);
-            netmd_set_group_title(devh, md, (unsigned int) i, argv[3]);
+            tracks[t - 2] = strtoul(argv[t], NULL, 10) & 0xffff;
         }
-        else if(strcmp("play", argv[1]) == 0)
+
+        if (netmd_delete_tracks(devh, netmd_disc_header(devh, md), tracks, argc - 2, NULL) != NETMD_NO_ERROR)
         {
-            if( argc > 2 ) {
-                i = strtoul(argv[2],NULL, 10);
-                netmd_set_track( devh, i & 0xffff );
-            }
-            netmd_play(devh);
-        }
-        else if(strcmp("stop", argv[1]) == 0)
-        {
-            netmd_stop(devh);
-        }
-        else if(strcmp("pause", argv[1]) == 0)
-        {
-            netmd_pause(devh);
+            netmd_log(NETMD_LOG_ERROR, "del_track: can't delete track(s)\n");
+            exit_code = 1;
         }
-        else if(strcmp("fforward", argv[1]) == 0)
-        {
-            netmd_fast_forward(devh);
+    }
+    else if(strcmp("delete", argv[1]) == 0)
+    {
+        if (!check_args(argc, 2, "delete")) return -1;
+        i = strtoul(argv[2], NULL, 10);
+        if (argc > 3)
+            j = strtoul(argv[3], NULL, 10);
+        else
+            j = i;
+
+        if (j < i || j >= 0xffff || i >= 0xffff) {
+            netmd_log(NETMD_LOG_ERROR, "delete: invalid track number\n");
+            exit_code = 1;
         }
-        else if(strcmp("rewind", argv[1]) == 0)
-        {
-            netmd_rewind(devh);
+        else {
+            uint16_t tracks[j - i + 1];
+
+            for (track = 0; track <= (j - i); track++)
+            {
+                tracks[track] = i + track;
+            }
+
+            if (netmd_delete_tracks(devh, netmd_disc_header(devh, md), tracks, j - i + 1, NULL) != NETMD_NO_ERROR)
+            {
+                netmd_log(NETMD_LOG_ERROR, "delete: can't delete track(s)\n");
+                exit_code = 1;
+            }
         }
-        else if(strcmp("next", argv[1]) == 0)
-        {
-            netmd_track_next(devh);
+    }
+    else if(strcmp("erase", argv[1]) == 0)
+    {
+      if (!check_args(argc, 2, "erase")) return -1;
+
+      if (strcmp("force", argv[2]) != 0) {
+        netmd_log(NETMD_LOG_ERROR, "erase: 'force' must be given as argument to proceed\n");
+        exit_code = 1;
+      } else {
+        netmd_log(NETMD_LOG_VERBOSE, "erase: executing erase\n");
+        netmd_erase_disc(devh);
+      }
+    }
+    else if(strcmp("deletegroup", argv[1]) == 0)
+    {
+        if (!check_args(argc, 2, "deletegroup")) return -1;
+        i = strtoul(argv[2], NULL, 10);
+        netmd_delete_group(devh, netmd_disc_header(devh, md), i & 0xffff);
+    }
+    else if(strcmp("status", argv[1]) == 0) {
+        print_current_track_info(devh);
+    }
+    else if (strcmp("raw", argv[1]) == 0) {
+        if (!check_args(argc, 2, "raw")) return -1;
+        send_raw_message(devh, argv[2]);
+    }
+    else if (strcmp("setplaymode", argv[1]) == 0) {
+        playmode = 0;
+        int i;
+        for (i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "single") == 0) {
+                playmode |= NETMD_PLAYMODE_SINGLE;
+            }
+            else if (strcmp(argv[i], "repeat") == 0) {
+                playmode |= NETMD_PLAYMODE_REPEAT;
+            }
+            else if (strcmp(argv[i], "shuffle") == 0) {
+                playmode |= NETMD_PLAYMODE_SHUFFLE;
+            }
         }
-        else if(strcmp("previous", argv[1]) == 0)
+        printf("%x\n", playmode);
+        netmd_set_playmode(devh, playmode);
+    }
+    else if (strcmp("capacity", argv[1]) == 0) {
+        snapshot_capacity_t capacity;
+        snapshot_capacity(devh, &capacity);
+        snapshot_print_capacity(&capacity, _s_json);
+    }
+    else if (strcmp("recv", argv[1]) == 0) {
+        if (!check_args(argc, 3, "recv")) return -1;
+        i = strtoul(argv[2], NULL, 10);
+        exit_code = transfer_track(devh, argv[3], NULL, 0, i & 0xffff, 0);
+    }
+    else if (strcmp("send", argv[1]) == 0) {
+        if (!check_args(argc, 2, "send")) return -1;
+
+        const char *filename = argv[2];
+        char *title = NULL;
+        if (argc > 3)
+            title = argv[3];
+
+        exit_code = transfer_track(devh, filename, title, onTheFlyConvert, 0, 1);
+    } else if (strcmp("memdump", argv[1]) == 0) {
+        if (!check_args(argc, 4, "memdump")) return -1;
+        exit_code = dump_memory(devh, argv[2], argv[3], argv[4], (argc > 5) ? argv[5] : NULL);
+    } else if (strcmp("monitor", argv[1]) == 0) {
+        exit_code = watch_status(devh, (argc > 2) ? argv[2] : NULL, (argc > 3) ? argv[3] : NULL);
+    } else if (strcmp("leave", argv[1]) == 0) {
+      error = netmd_secure_leave_session(devh);
+      netmd_log(NETMD_LOG_VERBOSE, "netmd_secure_leave_session : %s\n", netmd_strerror(error));
+    }
+    else {
+        netmd_log(NETMD_LOG_ERROR, "Unknown command '%s'; use 'help' for list of commands\n", argv[1]);
+        exit_code = 1;
+    }
+
+    return exit_code;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      check if a command changes the disc behind the header's back,
+//!             so a cached header must be read again
+//!
+//! @param[in]  cmd   command
+//!
+//! @return     1 -> yes; 0 -> no
+//------------------------------------------------------------------------------
+static int invalidates_header(const char* cmd)
+{
+    return (netmdd_cmd_flags(cmd) & NETMDD_CMD_DIRTY) ? 1 : 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      monotonic time stamp in ms
+//!
+//! @return     time in ms
+//------------------------------------------------------------------------------
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      split a batch script line into arguments (in place);
+//!             arguments are separated by white space, double quotes
+//!             group words, \" is a literal quote
+//!
+//! @param[in]  line  script line
+//! @param[out] argv  argument buffer (argv[0] is set to "netmdcli")
+//! @param[in]  max   size of argument buffer
+//!
+//! @return     argument count
+//------------------------------------------------------------------------------
+static int split_line(char* line, char* argv[], int max)
+{
+    int argc = 1, quoted;
+    char *r = line, *w;
+
+    argv[0] = "netmdcli";
+
+    while (argc < (max - 1))
+    {
+        while (isspace((unsigned char)*r))
         {
-            netmd_track_previous(devh);
+            r++;
         }
-        else if(strcmp("restart", argv[1]) == 0)
+
+        if (*r == '\0')
         {
-            netmd_track_restart(devh);
+            break;
         }
-        else if(strcmp("settime", argv[1]) == 0)
+
+        argv[argc++] = w = r;
+        quoted = 0;
+
+        while (*r && (quoted || !isspace((unsigned char)*r)))
         {
-            if (!check_args(argc, 4, "settime")) return -1;
-            track = strtoul(argv[2], (char **) NULL, 10) & 0xffff;
-            if (argc > 6)
+            if ((*r == '\\') && (r[1] == '"'))
+            {
+                *w++ = '"';
+                r += 2;
+            }
+            else if (*r == '"')
             {
-                time.hour = strtoul(argv[3], (char **) NULL, 10) & 0xffff;
-                time.minute = strtoul(argv[4], (char **) NULL, 10) & 0xff;
-                time.second = strtoul(argv[5], (char **) NULL, 10) & 0xff;
-                time.frame = strtoul(argv[6], (char **) NULL, 10) & 0xff;
+                quoted = !quoted;
+                r++;
             }
             else
             {
-                time.hour = 0;
-                time.minute = strtoul(argv[3], (char **) NULL, 10) & 0xff;
-                time.second = strtoul(argv[4], (char **) NULL, 10) & 0xff;
-                if (argc > 5)
-                {
-                    time.frame = strtoul(argv[5], (char **) NULL, 10) & 0xff;;
-                }
-                else
-                {
-                    time.frame = 0;
-                }
+                *w++ = *r++;
             }
+        }
 
-            netmd_set_time(devh, track, &time);
+        if (*r)
+        {
+            r++;
         }
-        else if(strcmp("m3uimport", argv[1]) == 0)
+        *w = '\0';
+    }
+
+    argv[argc] = NULL;
+    return argc;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      compare function to sort track numbers descending
+//!
+//! @param[in]  a     track a
+//! @param[in]  b     track b
+//!
+//! @return     < 0 if a is larger than b
+//------------------------------------------------------------------------------
+static int compare_desc(const void* a, const void* b)
+{
+    return (int)*(const uint16_t*)b - (int)*(const uint16_t*)a;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      check if a command is a metadata edit batch mode can queue
+//!
+//! @param[in]  cmd   command
+//!
+//! @return     1 -> yes; 0 -> no
+//------------------------------------------------------------------------------
+static int is_batch_edit(const char* cmd)
+{
+    static const char* const edits[] = {"rename", "move", "group", "retitle", "rename_disc",
+                                        "newgroup", "add_group", "deletegroup", "delete",
+                                        "del_track", NULL};
+    int i;
+
+    for (i = 0; edits[i] != NULL; i++)
+    {
+        if (!strcmp(edits[i], cmd))
         {
-            if (!check_args(argc, 2, "m3uimport")) return -1;
-            import_m3u_playlist(devh, argv[2]);
+            return 1;
         }
-        else if(strcmp("del_track", argv[1]) == 0)
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      queue a metadata edit into the batch transaction
+//!
+//! @param[in]  txn   transaction
+//! @param[in]  argc  argument count (argv[1] is the command)
+//! @param[in]  argv  arguments
+//!
+//! @return     1 -> queued; 0 -> no metadata edit; -1 -> error
+//------------------------------------------------------------------------------
+static int batch_queue(netmd_txn_t* txn, int argc, char* argv[])
+{
+    const char* cmd = argv[1];
+    long i, j;
+
+    if (!strcmp("rename", cmd))
+    {
+        if (!check_args(argc, 3, cmd)) return -1;
+        return netmd_txn_set_title(txn, strtoul(argv[2], NULL, 10) & 0xffff, argv[3]) ? -1 : 1;
+    }
+    else if (!strcmp("move", cmd))
+    {
+        if (!check_args(argc, 3, cmd)) return -1;
+        return netmd_txn_move_track(txn, strtoul(argv[2], NULL, 10) & 0xffff,
+                                    strtoul(argv[3], NULL, 10) & 0xffff) ? -1 : 1;
+    }
+    else if (!strcmp("group", cmd))
+    {
+        if (!check_args(argc, 3, cmd)) return -1;
+        return netmd_txn_put_track_in_group(txn, strtoul(argv[2], NULL, 10) & 0xffff,
+                                            strtoul(argv[3], NULL, 10)) ? -1 : 1;
+    }
+    else if (!strcmp("retitle", cmd))
+    {
+        if (!check_args(argc, 3, cmd)) return -1;
+        return netmd_txn_set_group_title(txn, strtoul(argv[2], NULL, 10), argv[3]) ? -1 : 1;
+    }
+    else if (!strcmp("rename_disc", cmd))
+    {
+        if (!check_args(argc, 2, cmd)) return -1;
+        return netmd_txn_set_disc_title(txn, argv[2]) ? -1 : 1;
+    }
+    else if (!strcmp("newgroup", cmd))
+    {
+        if (!check_args(argc, 2, cmd)) return -1;
+        return (netmd_txn_create_group(txn, argv[2], -1, -1) < 0) ? -1 : 1;
+    }
+    else if (!strcmp("add_group", cmd))
+    {
+        if (!check_args(argc, 4, cmd)) return -1;
+        return (netmd_txn_create_group(txn, argv[2], strtoul(argv[3], NULL, 10),
+                                       strtoul(argv[4], NULL, 10)) < 0) ? -1 : 1;
+    }
+    else if (!strcmp("deletegroup", cmd))
+    {
+        if (!check_args(argc, 2, cmd)) return -1;
+        return netmd_txn_delete_group(txn, strtoul(argv[2], NULL, 10)) ? -1 : 1;
+    }
+    else if (!strcmp("delete", cmd) || !strcmp("del_track", cmd))
+    {
+        if (!check_args(argc, 2, cmd)) return -1;
+        uint16_t* tracks;
+        int cnt = 0, ret = 1;
+
+        if (!strcmp("delete", cmd))
         {
-            if (!check_args(argc, 2, "del_track")) return -1;
             i = strtoul(argv[2], NULL, 10);
-            uint16_t tc = 0;
-            netmd_request_track_count(devh, &tc);
+            j = (argc > 3) ? (long)strtoul(argv[3], NULL, 10) : i;
 
-            if (i < tc)
+            if ((j < i) || (j >= 0xffff))
             {
-                netmd_cache_toc(devh);
-                netmd_delete_track(devh, i);
-                netmd_wait_for_sync(devh);
-                netmd_sync_toc(devh);
+                /* invalid range -> let the command report it */
+                return 0;
+            }
 
-                if (md_header_del_track(md, i + 1) == 0)
-                {
-                    netmd_write_disc_header(devh, md);
-                }
+            if ((tracks = malloc((j - i + 1) * sizeof(uint16_t))) == NULL)
+            {
+                return -1;
             }
-            else
+
+            for (; i <= j; i++)
             {
-                netmd_log(NETMD_LOG_ERROR, "del_track: invalid track number %d\n", i);
+                tracks[cnt++] = i;
             }
         }
-        else if(strcmp("delete", argv[1]) == 0)
+        else
         {
-            if (!check_args(argc, 2, "delete")) return -1;
-            i = strtoul(argv[2], NULL, 10);
-            if (argc > 3)
-                j = strtoul(argv[3], NULL, 10);
-            else
-                j = i;
+            if ((tracks = malloc(argc * sizeof(uint16_t))) == NULL)
+            {
+                return -1;
+            }
 
-            if (j < i || j >= 0xffff || i >= 0xffff) {
-                netmd_log(NETMD_LOG_ERROR, "delete: invalid track number\n");
-                exit_code = 1;
+            for (i = 2; i < argc; i++)
+            {
+                tracks[cnt++] = strtoul(argv[i], NULL, 10) & 0xffff;
             }
-            else {
-                netmd_cache_toc(devh);
+        }
 
-                uint16_t track = j;
+        /* queue in descending order, so track numbers stay valid */
+        qsort(tracks, cnt, sizeof(uint16_t), compare_desc);
 
-                while (track >= i)
-                {
-                    netmd_log(NETMD_LOG_VERBOSE, "delete: removing track %d\n", track);
+        for (i = 0; i < cnt; i++)
+        {
+            if (((i == 0) || (tracks[i] != tracks[i - 1])) && netmd_txn_delete_track(txn, tracks[i]))
+            {
+                ret = -1;
+                break;
+            }
+        }
 
-                    netmd_delete_track(devh, track);
-                    netmd_wait_for_sync(devh);
+        free(tracks);
+        return ret;
+    }
 
-                    if (track == 0)
-                    {
-                        break;
-                    }
-                    track --;
-                }
+    return 0;
+}
 
-                netmd_sync_toc(devh);
-            }
-        }
-        else if(strcmp("erase", argv[1]) == 0)
+//------------------------------------------------------------------------------
+//! @brief      commit and free the batch transaction (if any)
+//!
+//! @param[in/out] txn   transaction
+//!
+//! @return     0 -> ok; 1 -> error
+//------------------------------------------------------------------------------
+static int batch_commit(netmd_txn_t** txn)
+{
+    netmd_txn_stats_t st;
+    netmd_error err;
+    double t0;
+
+    if (*txn == NULL)
+    {
+        return 0;
+    }
+
+    t0  = now_ms();
+    err = netmd_txn_commit(*txn, &st);
+    netmd_txn_free(txn);
+
+    if (st.edits == 0)
+    {
+        return (err == NETMD_NO_ERROR) ? 0 : 1;
+    }
+
+    printf("     commit: %u edit(s), %lu command(s), %lu saved %10.2f ms%s\n",
+           st.edits, st.cmds_sent, st.cmds_saved, now_ms() - t0,
+           (err == NETMD_NO_ERROR) ? "" : " FAILED");
+
+    return (err == NETMD_NO_ERROR) ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      run a batch script: metadata edits are collected in one
+//!             transaction (one TOC window, one header write) which is
+//!             committed before any other command and at the end
+//!
+//! @param[in]     devh             device handle
+//! @param[in/out] md               disc header (loaded on first use)
+//! @param[in]     file             script file name ("-" -> stdin)
+//! @param[in]     onTheFlyConvert  on the fly conversion for send
+//!
+//! @return        exit code
+//------------------------------------------------------------------------------
+static int run_batch(netmd_dev_handle* devh, HndMdHdr* md, const char* file, unsigned char onTheFlyConvert)
+{
+    char line[M3U_LINE_MAX * 8];
+    char* argv[64];
+    netmd_txn_t* txn = NULL;
+    int argc, ret, c, lineno = 0, exit_code = 0;
+    double t0, start = now_ms();
+    FILE* in;
+
+    if ((in = strcmp(file, "-") ? fopen(file, "r") : stdin) == NULL)
+    {
+        netmd_log(NETMD_LOG_ERROR, "batch: can't open %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        lineno++;
+
+        if ((strchr(line, '\n') == NULL) && !feof(in))
         {
-          if (!check_args(argc, 2, "erase")) return -1;
+            /* the rest of the line mustn't run as a command of its own */
+            while (((c = fgetc(in)) != EOF) && (c != '\n')) ;
 
-          if (strcmp("force", argv[2]) != 0) {
-            netmd_log(NETMD_LOG_ERROR, "erase: 'force' must be given as argument to proceed\n");
+            printf("%4d %-12s %-8s\n", lineno, "(too long)", "FAILED");
             exit_code = 1;
-          } else {
-            netmd_log(NETMD_LOG_VERBOSE, "erase: executing erase\n");
-            netmd_erase_disc(devh);
-          }
+            continue;
         }
-        else if(strcmp("deletegroup", argv[1]) == 0)
+
+        argc = split_line(line, argv, 64);
+
+        if ((argc < 2) || (argv[1][0] == '#'))
         {
-            if (!check_args(argc, 2, "deletegroup")) return -1;
-            i = strtoul(argv[2], NULL, 10);
-            netmd_delete_group(devh, md, i & 0xffff);
+            continue;
         }
-        else if(strcmp("status", argv[1]) == 0) {
-            print_current_track_info(devh);
+
+        t0  = now_ms();
+        ret = 0;
+
+        if (is_batch_edit(argv[1]))
+        {
+            if ((txn == NULL) && ((txn = netmd_txn_create(devh, netmd_disc_header(devh, md))) == NULL))
+            {
+                exit_code = 1;
+                break;
+            }
+            ret = batch_queue(txn, argc, argv);
         }
-        else if (strcmp("raw", argv[1]) == 0) {
-            if (!check_args(argc, 2, "raw")) return -1;
-            send_raw_message(devh, argv[2]);
+
+        if (ret == 0)
+        {
+            /* no metadata edit -> run queued edits first */
+            if (batch_commit(&txn))
+            {
+                exit_code = 1;
+            }
+
+            t0  = now_ms();
+            ret = run_command(devh, md, argc, argv, onTheFlyConvert);
+
+            if (invalidates_header(argv[1]))
+            {
+                free_md_header(md);
+            }
+
+            printf("%4d %-12s %-8s %10.2f ms\n", lineno, argv[1], ret ? "FAILED" : "done", now_ms() - t0);
+        }
+        else
+        {
+            printf("%4d %-12s %-8s %10.2f ms\n", lineno, argv[1], (ret < 0) ? "FAILED" : "queued", now_ms() - t0);
+            ret = (ret < 0) ? 1 : 0;
+        }
+
+        if (ret != 0)
+        {
+            exit_code = 1;
         }
-        else if (strcmp("setplaymode", argv[1]) == 0) {
-            playmode = 0;
-            int i;
-            for (i = 2; i < argc; i++) {
-                if (strcmp(argv[i], "single") == 0) {
-                    playmode |= NETMD_PLAYMODE_SINGLE;
+    }
+
+    if (batch_commit(&txn))
+    {
+        exit_code = 1;
+    }
+
+    printf("batch: %d line(s) in %.2f ms\n", lineno, now_ms() - start);
+
+    if (in != stdin)
+    {
+        fclose(in);
+    }
+
+    return exit_code;
+}
+
+//! device of the daemon's header cache
+typedef struct {
+    netmd_dev_handle* devh;             //!< device handle
+    unsigned char     onTheFlyConvert;  //!< on the fly conversion for send
+} daemon_dev_t;
+
+//------------------------------------------------------------------------------
+//! @brief      disc check for the daemon's header cache
+//!
+//! @param[in]  dev     daemon device
+//! @param[out] tracks  track count
+//!
+//! @return     0 -> ok; -1 -> error (e.g. no disc)
+//------------------------------------------------------------------------------
+static int daemon_track_count(void* dev, uint16_t* tracks)
+{
+    return netmd_request_track_count(((daemon_dev_t*)dev)->devh, tracks);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      disc may have changed: forget title sizes of the old disc
+//!
+//! @param[in]  dev     daemon device
+//------------------------------------------------------------------------------
+static void daemon_reset(void* dev)
+{
+    netmd_dev_title_sizes_clear(((daemon_dev_t*)dev)->devh);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      run a daemon request
+//!
+//! @param[in]     dev   daemon device
+//! @param[in/out] md    cached disc header
+//! @param[in]     argc  argument count (argv[1] is the command)
+//! @param[in]     argv  arguments
+//!
+//! @return        exit code
+//------------------------------------------------------------------------------
+static int daemon_run(void* dev, HndMdHdr* md, int argc, char* argv[])
+{
+    daemon_dev_t* dd = (daemon_dev_t*)dev;
+
+    if (strcmp("help", argv[1]) == 0)
+    {
+        print_syntax();
+        return 0;
+    }
+
+    return run_command(dd->devh, md, argc, argv, dd->onTheFlyConvert);
+}
+
+int main(int argc, char* argv[])
+{
+    netmd_dev_handle* devh;
+    HndMdHdr md = NULL;
+    netmd_device *device_list, *netmd;
+    netmd_error error;
+    int exit_code = 0;
+    unsigned char onTheFlyConvert = NO_ONTHEFLY_CONVERSION;
+    const char *daemon_sock = NULL;
+    const char *trace_file = NULL;
+
+    /* by default, log only errors */
+    netmd_set_log_level(NETMD_LOG_ERROR);
+
+    /* parse parameters */
+    {
+        int c;
+        opterr = 0;
+        optind = 1;
+
+        while ((c = getopt (argc, argv, "tvd:YS:jT:")) != -1)
+        {
+            switch (c)
+            {
+            case 't':
+                netmd_set_log_level(NETMD_LOG_ALL);
+                break;
+            case 'v':
+                netmd_set_log_level(NETMD_LOG_VERBOSE);
+                break;
+            case 'd':
+                if (!strcmp(optarg, "lp2"))
+                {
+                    onTheFlyConvert = NETMD_DISKFORMAT_LP2;
+                }
+                else if (!strcmp(optarg, "lp4"))
+                {
+                    onTheFlyConvert = NETMD_DISKFORMAT_LP4;
+                }
+                break;
+            case 'S':
+                daemon_sock = optarg;
+                break;
+            case 'j':
+                _s_json = 1;
+                break;
+            case 'T':
+                trace_file = optarg;
+                netmd_trace_set_dump_path(trace_file);
+                break;
+            case '?':
+                if ((optopt == 'd') || (optopt == 'S') || (optopt == 'T'))
+                {
+                    netmd_log(NETMD_LOG_ERROR, "Option -%c requires an argument.\n", optopt);
                 }
-                else if (strcmp(argv[i], "repeat") == 0) {
-                    playmode |= NETMD_PLAYMODE_REPEAT;
+                else if (isprint (optopt))
+                {
+                    netmd_log(NETMD_LOG_ERROR, "Unknown option `-%c'.\n", optopt);
                 }
-                else if (strcmp(argv[i], "shuffle") == 0) {
-                    playmode |= NETMD_PLAYMODE_SHUFFLE;
+                else
+                {
+                    netmd_log(NETMD_LOG_ERROR, "Unknown option character `\\x%x'.\n", optopt);
                 }
+            // fall through
+            default:
+                return 1;
             }
-            printf("%x\n", playmode);
-            netmd_set_playmode(devh, playmode);
-        }
-        else if (strcmp("capacity", argv[1]) == 0) {
-            netmd_disc_capacity capacity;
-            netmd_get_disc_capacity(devh, &capacity);
-
-            printf("Recorded:  ");
-            print_time(&capacity.recorded);
-            printf("\nTotal:     ");
-            print_time(&capacity.total);
-            printf("\nAvailable: ");
-            print_time(&capacity.available);
-            printf("\n");
-        }
-        else if (strcmp("recv", argv[1]) == 0) {
-            if (!check_args(argc, 3, "recv")) return -1;
-            i = strtoul(argv[2], NULL, 10);
-            f = fopen(argv[3], "wb");
-            netmd_secure_recv_track(devh, i & 0xffff, f);
-            fclose(f);
         }
-        else if (strcmp("send", argv[1]) == 0) {
-            if (!check_args(argc, 2, "send")) return -1;
+    }
 
-            const char *filename = argv[2];
-            char *title = NULL;
-            if (argc > 3)
-                title = argv[3];
+    /* update argv and argc after parsing options */
+    argv = &argv[optind - 1];
+    argc -= (optind - 1);
 
-            exit_code = netmd_send_track(devh, filename, title, onTheFlyConvert) == NETMD_NO_ERROR ? 0 : 1;
-        } else if (strcmp("leave", argv[1]) == 0) {
-          error = netmd_secure_leave_session(devh);
-          netmd_log(NETMD_LOG_VERBOSE, "netmd_secure_leave_session : %s\n", netmd_strerror(error));
-        }
-        else {
-            netmd_log(NETMD_LOG_ERROR, "Unknown command '%s'; use 'help' for list of commands\n", argv[1]);
+    /* don't require device init to show help */
+    if ((argc == 1) || ((argc > 1 && strcmp("help", argv[1]) == 0)))
+    {
+        print_syntax();
+        return 0;
+    }
+
+    /* let a running daemon do the work */
+    if (daemon_sock != NULL)
+    {
+        exit_code = netmdd_request(daemon_sock, argc - 1, &argv[1]);
+        return (exit_code < 0) ? 1 : exit_code;
+    }
+
+    error = netmd_init(&device_list, NULL);
+    if (error != NETMD_NO_ERROR) {
+        printf("Error initializing netmd\n%s\n", netmd_strerror(error));
+        return 1;
+    }
+
+    if (device_list == NULL) {
+        puts("Found no NetMD device(s).");
+        return 1;
+    }
+
+    /* multi deck commands open the devices on their own */
+    if (strcmp("decks", argv[1]) == 0)
+    {
+        multideck_list(device_list);
+        netmd_clean(&device_list);
+        return 0;
+    }
+    else if (strcmp("multisend", argv[1]) == 0)
+    {
+        if (!check_args(argc, 3, "multisend"))
+        {
             exit_code = 1;
         }
+        else
+        {
+            exit_code = multideck_send(device_list, argv[2], argc - 3, &argv[3], onTheFlyConvert);
+        }
+        netmd_clean(&device_list);
+
+        if (trace_file != NULL)
+        {
+            netmd_trace_dump_file(trace_file);
+        }
+        return exit_code;
+    }
+
+    /* pick first available device */
+    netmd = device_list;
+
+    error = netmd_open(netmd, &devh);
+    if(error != NETMD_NO_ERROR)
+    {
+        printf("Error opening netmd\n%s\n", netmd_strerror(error));
+        return 1;
+    }
+
+    /* disc header is loaded on first use (see netmd_disc_header()),
+       transport commands don't need it */
+
+    /* parse commands */
+    if ((argc > 2) && (strcmp("daemon", argv[1]) == 0))
+    {
+        static const netmdd_dev_ops ops = {daemon_track_count, daemon_run, daemon_reset};
+        daemon_dev_t dd = {devh, onTheFlyConvert};
+        netmdd_cache dc = {&ops, &dd, NULL, 0};
+        exit_code = (netmdd_serve(argv[2], netmdd_cache_handler, &dc) == 0) ? 0 : 1;
+        free_md_header(&dc.md);
+    }
+    else if ((argc > 2) && (strcmp("batch", argv[1]) == 0))
+    {
+        exit_code = run_batch(devh, &md, argv[2], onTheFlyConvert);
+    }
+    else if(argc > 1)
+    {
+        exit_code = run_command(devh, &md, argc, argv, onTheFlyConvert);
     }
 
     free_md_header(&md);
     netmd_close(devh);
     netmd_clean(&device_list);
 
+    if (trace_file != NULL)
+    {
+        netmd_trace_dump_file(trace_file);
+    }
+
     return exit_code;
 }
\ No newline at end of file
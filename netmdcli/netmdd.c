@@ -0,0 +1,564 @@
+/* netmdd.c
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <log.h>
+#include "netmdd.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+//! @brief set by signal handler to stop the daemon
+static volatile sig_atomic_t _s_stop = 0;
+
+//------------------------------------------------------------------------------
+//! @brief      signal handler for SIGINT / SIGTERM
+//!
+//! @param[in]  sig   signal number
+//------------------------------------------------------------------------------
+static void netmdd_signal(int sig)
+{
+    (void)sig;
+    _s_stop = 1;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      write a whole buffer to a socket
+//!
+//! @param[in]  fd    socket
+//! @param[in]  buf   data
+//! @param[in]  len   data length
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+static int netmdd_write_all(int fd, const char* buf, size_t len)
+{
+    ssize_t sent;
+
+    while (len > 0)
+    {
+        if ((sent = write(fd, buf, len)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      read a request line; a line that doesn't fit into the buffer
+//!             is read up to its end and reported as too long
+//!
+//! @param[in]  in    client stream
+//! @param[out] line  line buffer
+//! @param[in]  size  size of line buffer
+//!
+//! @return     1 -> line read; 0 -> line too long; -1 -> client gone or
+//!             read timed out
+//------------------------------------------------------------------------------
+static int netmdd_read_line(FILE* in, char* line, size_t size)
+{
+    int c;
+
+    if (fgets(line, size, in) == NULL)
+    {
+        return -1;
+    }
+
+    if ((strchr(line, '\n') != NULL) || feof(in))
+    {
+        return 1;
+    }
+
+    if (ferror(in))
+    {
+        return -1;
+    }
+
+    /* drop the rest, it must not run as a request of its own */
+    while ((c = fgetc(in)) != '\n')
+    {
+        if (c == EOF)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      split a request line into arguments (in place)
+//!
+//! @param[in]  line  request line (TAB separated, LF is stripped)
+//! @param[out] argv  argument buffer (argv[0] is set to "netmdcli")
+//! @param[in]  max   size of argument buffer
+//!
+//! @return     argument count
+//------------------------------------------------------------------------------
+static int netmdd_split(char* line, char* argv[], int max)
+{
+    int   argc = 1;
+    char* p;
+
+    if ((p = strpbrk(line, "\r\n")) != NULL)
+    {
+        *p = '\0';
+    }
+
+    argv[0] = "netmdcli";
+
+    if (*line == '\0')
+    {
+        return argc;
+    }
+
+    for (p = line; (p != NULL) && (argc < (max - 1)); argc++)
+    {
+        argv[argc] = p;
+
+        if ((p = strchr(p, '\t')) != NULL)
+        {
+            *p++ = '\0';
+        }
+    }
+
+    argv[argc] = NULL;
+    return argc;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      run one request, capture the command's stdout and send the
+//!             response
+//!
+//! @param[in]  fd       client socket
+//! @param[in]  line     request line
+//! @param[in]  handler  command handler
+//! @param[in]  ctx      handler context
+//!
+//! @return     0 -> ok; -1 -> client gone
+//------------------------------------------------------------------------------
+static int netmdd_handle(int fd, char* line, netmdd_handler handler, void* ctx)
+{
+    char* argv[NETMDD_ARGS_MAX];
+    char  head[32];
+    char* out  = NULL;
+    long  olen = 0;
+    int   argc, saved, ret = 0, rc = -1;
+    FILE* cap;
+
+    argc = netmdd_split(line, argv, NETMDD_ARGS_MAX);
+
+    if ((cap = tmpfile()) == NULL)
+    {
+        netmd_log(NETMD_LOG_ERROR, "netmdd: can't create capture file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* everything the command prints goes to the client */
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    dup2(fileno(cap), STDOUT_FILENO);
+
+    if (argc > 1)
+    {
+        ret = handler(ctx, argc, argv);
+    }
+    else
+    {
+        printf("empty request\n");
+        ret = 1;
+    }
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    if (((olen = ftell(cap)) > 0) && ((out = malloc(olen)) != NULL))
+    {
+        rewind(cap);
+        olen = (long)fread(out, 1, olen, cap);
+    }
+    else
+    {
+        olen = 0;
+    }
+    fclose(cap);
+
+    snprintf(head, sizeof(head), "%d %ld\n", ret, olen);
+
+    if ((netmdd_write_all(fd, head, strlen(head)) == 0)
+        && (netmdd_write_all(fd, out, olen) == 0))
+    {
+        rc = 0;
+    }
+
+    free(out);
+    return rc;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      serve requests on a Unix domain socket until "quit" is
+//!             received or the daemon gets SIGINT / SIGTERM; the handler
+//!             doesn't need a real device, so the daemon can be driven
+//!             against a simulated one
+//!
+//! @param[in]  path     socket path (an existing socket file is replaced)
+//! @param[in]  handler  command handler
+//! @param[in]  ctx      handler context
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmdd_serve(const char* path, netmdd_handler handler, void* ctx)
+{
+    struct sockaddr_un addr;
+    struct sigaction   sa;
+    char               line[NETMDD_LINE_MAX];
+    struct timeval     tmo = {NETMDD_READ_TIMEOUT, 0};
+    int                srv, cli, rd;
+    FILE*              in;
+    static const char  too_long[] = "request too long\n";
+
+    if ((path == NULL) || (strlen(path) >= sizeof(addr.sun_path)))
+    {
+        netmd_log(NETMD_LOG_ERROR, "netmdd: invalid socket path\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((srv = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        netmd_log(NETMD_LOG_ERROR, "netmdd: socket(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+
+    if ((bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(srv, 4) < 0))
+    {
+        netmd_log(NETMD_LOG_ERROR, "netmdd: can't listen on %s: %s\n", path, strerror(errno));
+        close(srv);
+        return -1;
+    }
+
+    /* no SA_RESTART: accept() must return on signal */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = netmdd_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    netmd_log(NETMD_LOG_VERBOSE, "netmdd: listening on %s\n", path);
+
+    while (!_s_stop)
+    {
+        if ((cli = accept(srv, NULL, NULL)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            netmd_log(NETMD_LOG_ERROR, "netmdd: accept(): %s\n", strerror(errno));
+            break;
+        }
+
+        /* a client which doesn't send (a whole line) mustn't block the daemon */
+        setsockopt(cli, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof(tmo));
+
+        if ((in = fdopen(cli, "r")) == NULL)
+        {
+            close(cli);
+            continue;
+        }
+
+        /* one device -> one client at a time */
+        while (!_s_stop && ((rd = netmdd_read_line(in, line, sizeof(line))) >= 0))
+        {
+            if (rd == 0)
+            {
+                netmd_log(NETMD_LOG_ERROR, "netmdd: request too long, rejected\n");
+                snprintf(line, sizeof(line), "1 %u\n%s", (unsigned)strlen(too_long), too_long);
+                if (netmdd_write_all(cli, line, strlen(line)) != 0)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            if (!strcmp(line, "quit\n") || !strcmp(line, "quit"))
+            {
+                netmdd_write_all(cli, "0 0\n", 4);
+                _s_stop = 1;
+                break;
+            }
+
+            if (netmdd_handle(cli, line, handler, ctx) != 0)
+            {
+                break;
+            }
+        }
+
+        /* closes cli as well */
+        fclose(in);
+    }
+
+    close(srv);
+    unlink(path);
+
+    netmd_log(NETMD_LOG_VERBOSE, "netmdd: stopped\n");
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      send one request to a running daemon and print its output
+//!
+//! @param[in]  path  socket path
+//! @param[in]  argc  argument count (argv[0] is the command)
+//! @param[in]  argv  arguments
+//!
+//! @return     exit code of the command; -1 -> communication error
+//------------------------------------------------------------------------------
+int netmdd_request(const char* path, int argc, char* argv[])
+{
+    struct sockaddr_un addr;
+    char               line[NETMDD_LINE_MAX];
+    char               buf[4096];
+    size_t             len = 0, l;
+    long               olen = 0;
+    int                i, fd, ret = -1;
+    FILE*              in;
+
+    if ((path == NULL) || (strlen(path) >= sizeof(addr.sun_path)))
+    {
+        return -1;
+    }
+
+    /* build request line */
+    line[0] = '\0';
+    for (i = 0; i < argc; i++)
+    {
+        l = strlen(argv[i]);
+
+        if (strpbrk(argv[i], "\t\r\n") || ((len + l + 2) > sizeof(line)))
+        {
+            netmd_log(NETMD_LOG_ERROR, "netmdd: invalid argument '%s'\n", argv[i]);
+            return -1;
+        }
+
+        if (i > 0)
+        {
+            line[len++] = '\t';
+        }
+        memcpy(&line[len], argv[i], l);
+        len += l;
+    }
+    line[len++] = '\n';
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        netmd_log(NETMD_LOG_ERROR, "netmdd: can't connect to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if ((netmdd_write_all(fd, line, len) != 0) || ((in = fdopen(fd, "r")) == NULL))
+    {
+        close(fd);
+        return -1;
+    }
+
+    if ((fgets(buf, sizeof(buf), in) != NULL) && (sscanf(buf, "%d %ld", &ret, &olen) == 2))
+    {
+        while ((olen > 0) && ((l = fread(buf, 1, ((size_t)olen < sizeof(buf)) ? (size_t)olen : sizeof(buf), in)) > 0))
+        {
+            fwrite(buf, 1, l, stdout);
+            olen -= l;
+        }
+    }
+    else
+    {
+        netmd_log(NETMD_LOG_ERROR, "netmdd: invalid response\n");
+        ret = -1;
+    }
+
+    fclose(in);
+    return ret;
+}
+
+#else // _WIN32
+
+int netmdd_serve(const char* path, netmdd_handler handler, void* ctx)
+{
+    (void)path; (void)handler; (void)ctx;
+    netmd_log(NETMD_LOG_ERROR, "netmdd: daemon mode isn't supported on this platform\n");
+    return -1;
+}
+
+int netmdd_request(const char* path, int argc, char* argv[])
+{
+    (void)path; (void)argc; (void)argv;
+    netmd_log(NETMD_LOG_ERROR, "netmdd: daemon mode isn't supported on this platform\n");
+    return -1;
+}
+
+#endif // _WIN32
+
+//------------------------------------------------------------------------------
+//! @brief      get flags of a netmdcli command
+//!
+//! @param[in]  cmd   command
+//!
+//! @return     ORed netmdd_cmd_flag values
+//------------------------------------------------------------------------------
+unsigned netmdd_cmd_flags(const char* cmd)
+{
+    static const struct {
+        const char* cmd;
+        unsigned    flags;
+    } cmds[] = {
+        {"disc_info",   NETMDD_CMD_HEADER},
+        {"newgroup",    NETMDD_CMD_HEADER},
+        {"settitle",    NETMDD_CMD_HEADER},
+        {"add_group",   NETMDD_CMD_HEADER},
+        {"rename_disc", NETMDD_CMD_HEADER},
+        {"group",       NETMDD_CMD_HEADER},
+        {"retitle",     NETMDD_CMD_HEADER},
+        {"deletegroup", NETMDD_CMD_HEADER},
+        {"del_track",   NETMDD_CMD_HEADER | NETMDD_CMD_TRACKS},
+        {"delete",      NETMDD_CMD_HEADER | NETMDD_CMD_TRACKS},
+        {"send",        NETMDD_CMD_TRACKS},
+        {"write",       NETMDD_CMD_TRACKS},
+        {"m3uimport",   NETMDD_CMD_TRACKS},
+        {"erase",       NETMDD_CMD_DIRTY},
+        {"raw",         NETMDD_CMD_DIRTY},
+        {"reload",      NETMDD_CMD_RELOAD},
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++)
+    {
+        if (!strcmp(cmds[i].cmd, cmd))
+        {
+            return cmds[i].flags;
+        }
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      drop the cached header and what the device caches per disc
+//!
+//! @param[in]  c     netmdd_cache
+//------------------------------------------------------------------------------
+static void netmdd_cache_drop(netmdd_cache* c)
+{
+    free_md_header(&c->md);
+
+    if (c->ops->reset != NULL)
+    {
+        c->ops->reset(c->dev);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      command handler keeping the disc header warm; before a
+//!             command which uses the header the track count is checked
+//!             (one round trip), a changed count drops the header. A disc
+//!             swapped for one with the same track count isn't detected,
+//!             send "reload" after such a swap.
+//!
+//! @param[in]  ctx   netmdd_cache
+//! @param[in]  argc  argument count (argv[1] is the command)
+//! @param[in]  argv  arguments
+//!
+//! @return     exit code of the command
+//------------------------------------------------------------------------------
+int netmdd_cache_handler(void* ctx, int argc, char* argv[])
+{
+    netmdd_cache* c     = (netmdd_cache*)ctx;
+    unsigned      flags = netmdd_cmd_flags(argv[1]);
+    uint16_t      tracks;
+    int           ret;
+
+    if (flags & NETMDD_CMD_RELOAD)
+    {
+        netmdd_cache_drop(c);
+        return 0;
+    }
+
+    if (flags & NETMDD_CMD_HEADER)
+    {
+        if (c->ops->track_count(c->dev, &tracks) != 0)
+        {
+            netmdd_cache_drop(c);
+        }
+        else
+        {
+            if ((c->md != NULL) && (tracks != c->tracks))
+            {
+                netmd_log(NETMD_LOG_VERBOSE, "netmdd: disc changed, header will be read again\n");
+                netmdd_cache_drop(c);
+            }
+            c->tracks = tracks;
+        }
+    }
+
+    ret = c->ops->run(c->dev, &c->md, argc, argv);
+
+    if ((ret != 0) || (flags & NETMDD_CMD_DIRTY))
+    {
+        netmdd_cache_drop(c);
+    }
+    else if ((flags & NETMDD_CMD_TRACKS) && (c->md != NULL))
+    {
+        /* own edit, header is up to date -> take over the new count */
+        if (c->ops->track_count(c->dev, &tracks) != 0)
+        {
+            netmdd_cache_drop(c);
+        }
+        else
+        {
+            c->tracks = tracks;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,158 @@
+/* netmdd.h
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef NETMDD_H
+#define NETMDD_H
+#include <stdint.h>
+#include <CMDiscHeader.h>
+
+/*
+ * netmdcli daemon protocol (Unix domain socket, stream):
+ *
+ * request:  one line, arguments separated by TAB, terminated by LF
+ *           e.g. "rename\t2\tNew Title\n"
+ * response: "<exit code> <output length>\n" followed by <output length>
+ *           bytes of command output (what netmdcli prints to stdout)
+ *
+ * Several requests can be sent over one connection. The request "quit"
+ * stops the daemon, "reload" drops the cached disc header. A request line longer than NETMDD_LINE_MAX is
+ * rejected as a whole; a client that doesn't complete a request within
+ * NETMDD_READ_TIMEOUT seconds is disconnected.
+ */
+
+//! max. length of a request line
+#define NETMDD_LINE_MAX 4096
+
+//! seconds the daemon waits for a (complete) request line
+#define NETMDD_READ_TIMEOUT 10
+
+//! max. number of arguments in a request
+#define NETMDD_ARGS_MAX 64
+
+//------------------------------------------------------------------------------
+//! @brief      command handler called by the daemon for every request
+//!
+//! @param[in]  ctx   handler context as given to netmdd_serve()
+//! @param[in]  argc  argument count (argv[0] is "netmdcli", argv[1] is
+//!                   the command)
+//! @param[in]  argv  arguments
+//!
+//! @return     exit code of the command
+//------------------------------------------------------------------------------
+typedef int (*netmdd_handler)(void* ctx, int argc, char* argv[]);
+
+//! command flags, see netmdd_cmd_flags()
+typedef enum {
+    NETMDD_CMD_HEADER  = 0x01,  //!< uses the disc header
+    NETMDD_CMD_TRACKS  = 0x02,  //!< changes the track count
+    NETMDD_CMD_DIRTY   = 0x04,  //!< changes the disc behind the header's back
+    NETMDD_CMD_RELOAD  = 0x08,  //!< drops the cached header ("reload")
+} netmdd_cmd_flag;
+
+//------------------------------------------------------------------------------
+//! @brief      disc check of the header cache: read the track count (one
+//!             AV/C round trip)
+//!
+//! @param[in]  dev     device as given in netmdd_cache
+//! @param[out] tracks  track count
+//!
+//! @return     0 -> ok; -1 -> error (e.g. no disc)
+//------------------------------------------------------------------------------
+typedef int (*netmdd_track_count_fn)(void* dev, uint16_t* tracks);
+
+//------------------------------------------------------------------------------
+//! @brief      run a command for the header cache
+//!
+//! @param[in]     dev   device as given in netmdd_cache
+//! @param[in/out] md    cached disc header (NULL -> read on first use)
+//! @param[in]     argc  argument count (argv[1] is the command)
+//! @param[in]     argv  arguments
+//!
+//! @return        exit code of the command
+//------------------------------------------------------------------------------
+typedef int (*netmdd_run_fn)(void* dev, HndMdHdr* md, int argc, char* argv[]);
+
+//------------------------------------------------------------------------------
+//! @brief      disc may have changed: drop state cached for the device
+//!
+//! @param[in]  dev   device as given in netmdd_cache
+//------------------------------------------------------------------------------
+typedef void (*netmdd_reset_fn)(void* dev);
+
+//! device access of the header cache; netmdcli plugs in the real device,
+//! a test can plug in a simulated one
+typedef struct {
+    netmdd_track_count_fn track_count;  //!< disc check
+    netmdd_run_fn         run;          //!< run a command
+    netmdd_reset_fn       reset;        //!< drop device state (may be NULL)
+} netmdd_dev_ops;
+
+//! disc header kept warm between requests (context of netmdd_cache_handler())
+typedef struct {
+    const netmdd_dev_ops* ops;      //!< device access
+    void*                 dev;      //!< device, passed to ops
+    HndMdHdr              md;       //!< cached disc header
+    int                   tracks;   //!< track count the header belongs to
+} netmdd_cache;
+
+//------------------------------------------------------------------------------
+//! @brief      get flags of a netmdcli command
+//!
+//! @param[in]  cmd   command
+//!
+//! @return     ORed netmdd_cmd_flag values
+//------------------------------------------------------------------------------
+unsigned netmdd_cmd_flags(const char* cmd);
+
+//------------------------------------------------------------------------------
+//! @brief      command handler keeping the disc header warm; before a
+//!             command which uses the header the track count is checked
+//!             (one round trip), a changed count drops the header. A disc
+//!             swapped for one with the same track count isn't detected,
+//!             send "reload" after such a swap.
+//!
+//! @param[in]  ctx   netmdd_cache
+//! @param[in]  argc  argument count (argv[1] is the command)
+//! @param[in]  argv  arguments
+//!
+//! @return     exit code of the command
+//------------------------------------------------------------------------------
+int netmdd_cache_handler(void* ctx, int argc, char* argv[]);
+
+//------------------------------------------------------------------------------
+//! @brief      serve requests on a Unix domain socket until "quit" is
+//!             received or the daemon gets SIGINT / SIGTERM; the handler
+//!             doesn't need a real device, so the daemon can be driven
+//!             against a simulated one
+//!
+//! @param[in]  path     socket path (an existing socket file is replaced)
+//! @param[in]  handler  command handler
+//! @param[in]  ctx      handler context
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int netmdd_serve(const char* path, netmdd_handler handler, void* ctx);
+
+//------------------------------------------------------------------------------
+//! @brief      send one request to a running daemon and print its output
+//!
+//! @param[in]  path  socket path
+//! @param[in]  argc  argument count (argv[0] is the command)
+//! @param[in]  argv  arguments
+//!
+//! @return     exit code of the command; -1 -> communication error
+//------------------------------------------------------------------------------
+int netmdd_request(const char* path, int argc, char* argv[]);
+
+#endif /* NETMDD_H */
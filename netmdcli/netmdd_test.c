@@ -0,0 +1,224 @@
+/* netmdd_test.c
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Runs the daemon's header cache against a simulated device: counts disc
+ * checks and header reads per request and serves a request over the
+ * socket.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <log.h>
+#include "netmdd.h"
+
+//! simulated device
+typedef struct {
+    uint16_t    tracks;     //!< track count on disc
+    const char* header;     //!< disc header on disc
+    int         checks;     //!< disc checks (track count requests)
+    int         reads;      //!< header reads
+    int         resets;     //!< dropped device states
+} sim_dev_t;
+
+static int _s_failed = 0;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond))                                                  \
+        {                                                             \
+            fprintf(stderr, "%s:%d: check failed: %s\n",              \
+                    __FILE__, __LINE__, #cond);                       \
+            _s_failed = 1;                                            \
+        }                                                             \
+    } while (0)
+
+//------------------------------------------------------------------------------
+//! @brief      simulated disc check
+//!
+//! @param[in]  dev     simulated device
+//! @param[out] tracks  track count
+//!
+//! @return     0
+//------------------------------------------------------------------------------
+static int sim_track_count(void* dev, uint16_t* tracks)
+{
+    sim_dev_t* sim = (sim_dev_t*)dev;
+    sim->checks++;
+    *tracks = sim->tracks;
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      simulated device state reset
+//!
+//! @param[in]  dev     simulated device
+//------------------------------------------------------------------------------
+static void sim_reset(void* dev)
+{
+    ((sim_dev_t*)dev)->resets++;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      simulated command; the header is read on first use like
+//!             netmd_disc_header() does
+//!
+//! @param[in]     dev   simulated device
+//! @param[in/out] md    cached disc header
+//! @param[in]     argc  argument count (argv[1] is the command)
+//! @param[in]     argv  arguments
+//!
+//! @return        exit code
+//------------------------------------------------------------------------------
+static int sim_run(void* dev, HndMdHdr* md, int argc, char* argv[])
+{
+    sim_dev_t* sim = (sim_dev_t*)dev;
+    (void)argc;
+
+    if ((netmdd_cmd_flags(argv[1]) & NETMDD_CMD_HEADER) && (*md == NULL))
+    {
+        *md = create_md_header(sim->header);
+        sim->reads++;
+    }
+
+    if (!strcmp(argv[1], "disc_info"))
+    {
+        printf("%s\n", md_header_to_string(*md));
+    }
+    else if (!strcmp(argv[1], "send"))
+    {
+        sim->tracks++;
+    }
+    else if (!strcmp(argv[1], "fail"))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      run one request through the cache handler
+//!
+//! @param[in]  c     header cache
+//! @param[in]  cmd   command
+//!
+//! @return     exit code
+//------------------------------------------------------------------------------
+static int request(netmdd_cache* c, const char* cmd)
+{
+    char* argv[] = {"netmdcli", (char*)cmd, NULL};
+    return netmdd_cache_handler(c, 2, argv);
+}
+
+//! daemon thread argument
+typedef struct {
+    const char*   path;     //!< socket path
+    netmdd_cache* cache;    //!< header cache
+    int           ret;      //!< netmdd_serve() result
+} serve_arg_t;
+
+//------------------------------------------------------------------------------
+//! @brief      daemon thread
+//!
+//! @param[in]  arg   serve_arg_t
+//!
+//! @return     NULL
+//------------------------------------------------------------------------------
+static void* serve_thread(void* arg)
+{
+    serve_arg_t* sa = (serve_arg_t*)arg;
+    sa->ret = netmdd_serve(sa->path, netmdd_cache_handler, sa->cache);
+    return NULL;
+}
+
+int main(void)
+{
+    static const netmdd_dev_ops ops = {sim_track_count, sim_run, sim_reset};
+    sim_dev_t    sim = {2, "0;Disc//1-2;Group//", 0, 0, 0};
+    netmdd_cache c   = {&ops, &sim, NULL, 0};
+    char         path[64];
+    char*        req[] = {"disc_info", NULL};
+    char*        quit[] = {"quit", NULL};
+    serve_arg_t  sa;
+    pthread_t    thr;
+    int          i, ret = -1, reads;
+
+    netmd_set_log_level(NETMD_LOG_NONE);
+
+    /* transport commands don't touch the device for the cache */
+    CHECK(request(&c, "play") == 0);
+    CHECK((sim.checks == 0) && (sim.reads == 0));
+
+    /* one disc check per header command, header read once */
+    CHECK(request(&c, "disc_info") == 0);
+    CHECK(request(&c, "disc_info") == 0);
+    CHECK((sim.checks == 2) && (sim.reads == 1));
+
+    /* own track count change is taken over, header stays warm */
+    CHECK(request(&c, "send") == 0);
+    CHECK((sim.checks == 3) && (c.tracks == 3));
+    CHECK(request(&c, "disc_info") == 0);
+    CHECK((sim.checks == 4) && (sim.reads == 1) && (sim.resets == 0));
+
+    /* disc swapped -> header is read again before the command runs */
+    sim.tracks = 5;
+    sim.header = "0;Other//1-5;Group//";
+    CHECK(request(&c, "rename_disc") == 0);
+    CHECK((sim.reads == 2) && !strcmp(md_header_to_string(c.md), "0;Other//1-5;Group//"));
+    CHECK(sim.resets == 1);
+
+    /* explicit reload and failed commands drop the header */
+    CHECK(request(&c, "reload") == 0);
+    CHECK((c.md == NULL) && (sim.resets == 2));
+    CHECK(request(&c, "disc_info") == 0);
+    CHECK(request(&c, "fail") == 1);
+    CHECK(c.md == NULL);
+
+    /* same through the socket */
+    snprintf(path, sizeof(path), "/tmp/netmdd_test.%d", (int)getpid());
+    sa.path  = path;
+    sa.cache = &c;
+    sa.ret   = -1;
+
+    if (pthread_create(&thr, NULL, serve_thread, &sa) != 0)
+    {
+        fprintf(stderr, "can't start daemon thread\n");
+        return 1;
+    }
+
+    /* wait until the daemon listens */
+    reads = sim.reads;
+    for (i = 0; (i < 100) && ((ret = netmdd_request(path, 1, req)) < 0); i++)
+    {
+        usleep(10000);
+    }
+    CHECK(ret == 0);
+    CHECK(sim.reads == (reads + 1));
+    CHECK(netmdd_request(path, 1, quit) == 0);
+
+    pthread_join(thr, NULL);
+    CHECK(sa.ret == 0);
+
+    free_md_header(&c.md);
+
+    if (!_s_failed)
+    {
+        printf("netmdd_test: all checks passed\n");
+    }
+    return _s_failed;
+}
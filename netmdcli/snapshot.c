@@ -0,0 +1,429 @@
+/* snapshot.c
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "snapshot.h"
+
+//------------------------------------------------------------------------------
+//! @brief      monotonic time stamp in ms
+//!
+//! @return     time in ms
+//------------------------------------------------------------------------------
+static double snapshot_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      wall clock time
+//!
+//! @return     seconds since epoch
+//------------------------------------------------------------------------------
+static double snapshot_wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      length of a valid UTF-8 sequence
+//!
+//! @param[in]  s     string
+//!
+//! @return     sequence length (2 .. 4); 0 -> no valid sequence
+//------------------------------------------------------------------------------
+static int utf8_len(const unsigned char* s)
+{
+    int      len, i;
+    uint32_t cp;
+
+    if ((s[0] & 0xe0) == 0xc0)      { len = 2; cp = s[0] & 0x1f; }
+    else if ((s[0] & 0xf0) == 0xe0) { len = 3; cp = s[0] & 0x0f; }
+    else if ((s[0] & 0xf8) == 0xf0) { len = 4; cp = s[0] & 0x07; }
+    else                            { return 0; }
+
+    for (i = 1; i < len; i++)
+    {
+        if ((s[i] & 0xc0) != 0x80)
+        {
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+
+    /* overlong forms, surrogates and values beyond unicode are invalid */
+    if ((cp < ((len == 2) ? 0x80u : (len == 3) ? 0x800u : 0x10000u))
+        || ((cp >= 0xd800) && (cp <= 0xdfff)) || (cp > 0x10ffff))
+    {
+        return 0;
+    }
+
+    return len;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print a JSON string (quoted and escaped); valid UTF-8 is
+//!             passed through, other bytes >= 0x80 are taken as Latin-1
+//!             and escaped as \u00XX
+//!
+//! @param[in]  key   key name
+//! @param[in]  s     string (NULL -> null)
+//------------------------------------------------------------------------------
+static void json_str(const char* key, const char* s)
+{
+    int len;
+
+    printf("\"%s\":", key);
+
+    if (s == NULL)
+    {
+        printf("null");
+        return;
+    }
+
+    putchar('"');
+    for (; *s != '\0'; s++)
+    {
+        switch (*s)
+        {
+        case '"':  printf("\\\""); break;
+        case '\\': printf("\\\\"); break;
+        case '\n': printf("\\n");  break;
+        case '\r': printf("\\r");  break;
+        case '\t': printf("\\t");  break;
+        default:
+            if ((unsigned char)*s < 0x20)
+            {
+                printf("\\u%04x", (unsigned char)*s);
+            }
+            else if ((unsigned char)*s < 0x80)
+            {
+                putchar(*s);
+            }
+            else if ((len = utf8_len((const unsigned char*)s)) > 0)
+            {
+                fwrite(s, 1, len, stdout);
+                s += len - 1;
+            }
+            else
+            {
+                printf("\\u%04x", (unsigned char)*s);
+            }
+            break;
+        }
+    }
+    putchar('"');
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print a netmd_time as JSON string "hh:mm:ss.ff"
+//!
+//! @param[in]  key   key name
+//! @param[in]  t     time
+//------------------------------------------------------------------------------
+static void json_time(const char* key, const netmd_time* t)
+{
+    printf("\"%s\":\"%02d:%02d:%02d.%02d\"", key, t->hour, t->minute, t->second, t->frame);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print the common record head
+//!
+//! @param[in]  type  record type
+//! @param[in]  ts    wall clock time of snapshot
+//! @param[in]  ms    time spent gathering
+//------------------------------------------------------------------------------
+static void json_head(const char* type, double ts, double ms)
+{
+    printf("{\"type\":\"%s\",\"ts\":%.3f,\"ms\":%.3f", type, ts, ms);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      take a disc snapshot (disc title, capacity, all tracks)
+//!
+//! @param[in]  devh  device handle
+//! @param[in]  md    disc header
+//! @param[out] snap  snapshot (free with snapshot_disc_free())
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int snapshot_disc(netmd_dev_handle* devh, HndMdHdr md, snapshot_disc_t* snap)
+{
+    const char*       s;
+    snapshot_track_t* t;
+    double            start, t0;
+    uint16_t          i;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->ts = snapshot_wall_time();
+    start    = snapshot_now_ms();
+
+    s = md_header_disc_title(md);
+    snap->title  = strdup((s != NULL) ? s : "");
+    snap->cap_ok = (netmd_get_disc_capacity(devh, &snap->capacity) == NETMD_NO_ERROR);
+
+    if (netmd_request_track_count(devh, &snap->track_count) < 0)
+    {
+        snap->track_count = 0;
+    }
+
+    if ((snap->track_count > 0)
+        && ((snap->tracks = calloc(snap->track_count, sizeof(snapshot_track_t))) == NULL))
+    {
+        snap->track_count = 0;
+        return -1;
+    }
+
+    snap->ms = snapshot_now_ms() - start;
+
+    for (i = 0; i < snap->track_count; i++)
+    {
+        t  = &snap->tracks[i];
+        t0 = snapshot_now_ms();
+
+        netmd_request_title(devh, i, t->title, sizeof(t->title));
+
+        if ((s = md_header_track_group(md, i + 1, &t->group)) != NULL)
+        {
+            t->group_name = strdup(s);
+        }
+
+        netmd_request_track_time(devh, i, &t->time);
+        netmd_request_track_flags(devh, i, &t->flags);
+        netmd_request_track_bitrate(devh, i, &t->bitrate_id, &t->channel);
+
+        t->ms = snapshot_now_ms() - t0;
+    }
+
+    snap->total_ms = snapshot_now_ms() - start;
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      free data of a disc snapshot
+//!
+//! @param[in]  snap  snapshot
+//------------------------------------------------------------------------------
+void snapshot_disc_free(snapshot_disc_t* snap)
+{
+    uint16_t i;
+
+    for (i = 0; (snap->tracks != NULL) && (i < snap->track_count); i++)
+    {
+        free(snap->tracks[i].group_name);
+    }
+
+    free(snap->tracks);
+    free(snap->title);
+    memset(snap, 0, sizeof(*snap));
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print a disc snapshot
+//!
+//! @param[in]  snap  snapshot
+//! @param[in]  json  1 -> JSON lines; 0 -> text
+//------------------------------------------------------------------------------
+void snapshot_print_disc(const snapshot_disc_t* snap, int json)
+{
+    const snapshot_track_t* t;
+    struct netmd_pair const *trprot, *bitrate;
+    const char* name;
+    int16_t     lastgroup = 9858;
+    char        time_buf[16];
+    uint16_t    i;
+
+    if (json)
+    {
+        json_head("disc", snap->ts, snap->ms);
+        printf(",\"total_ms\":%.3f,", snap->total_ms);
+        json_str("title", snap->title);
+        printf(",\"tracks\":%u", snap->track_count);
+        if (snap->cap_ok)
+        {
+            printf(",");
+            json_time("total", &snap->capacity.total);
+            printf(",");
+            json_time("recorded", &snap->capacity.recorded);
+            printf(",");
+            json_time("available", &snap->capacity.available);
+        }
+        printf("}\n");
+    }
+    else
+    {
+        printf("Disc Title: %s\n", snap->title);
+
+        printf("Disc Length: %.02d:%.02d:%.02d.%.03d\n",
+            snap->capacity.total.hour, snap->capacity.total.minute,
+            snap->capacity.total.second, snap->capacity.total.frame);
+
+        printf("Time used: %.02d:%.02d:%.02d.%.03d\n",
+            snap->capacity.recorded.hour, snap->capacity.recorded.minute,
+            snap->capacity.recorded.second, snap->capacity.recorded.frame);
+
+        printf("Time available: %.02d:%.02d:%.02d.%.03d\n",
+            snap->capacity.available.hour, snap->capacity.available.minute,
+            snap->capacity.available.second, snap->capacity.available.frame);
+    }
+
+    for (i = 0; i < snap->track_count; i++)
+    {
+        t       = &snap->tracks[i];
+        trprot  = find_pair(t->flags, trprot_settings);
+        bitrate = find_pair(t->bitrate_id, bitrates);
+
+        /* Skip 'LP:' prefix... the codec type shows up in the list anyway*/
+        name = strncmp(t->title, "LP:", 3) ? t->title : (t->title + 3);
+
+        sprintf(time_buf, "%02i:%02i:%02i", t->time.minute, t->time.second, t->time.tenth);
+
+        if (json)
+        {
+            json_head("track", snap->ts, t->ms);
+            printf(",\"no\":%d,", i + 1);
+            json_str("title", name);
+            printf(",\"group\":%d,", t->group);
+            json_str("group_name", (t->group != -1) ? t->group_name : NULL);
+            printf(",\"time\":\"%s\",\"protection\":\"%s\",\"bitrate\":\"%s\",\"channel\":%u}\n",
+                   time_buf, trprot->name, bitrate->name, t->channel);
+            continue;
+        }
+
+        if (t->group != lastgroup)
+        {
+            lastgroup = t->group;
+
+            if (t->group != -1)
+            {
+                printf(" [ %s ]\n", t->group_name);
+            }
+        }
+
+        if (t->group != -1)
+        {
+            printf("    ");
+        }
+
+        printf("%.2d) %s (%s; %s; %s)\n",
+            i + 1, name, time_buf,
+            trprot->name, bitrate->name);
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      take a capacity snapshot
+//!
+//! @param[in]  devh  device handle
+//! @param[out] snap  snapshot
+//------------------------------------------------------------------------------
+void snapshot_capacity(netmd_dev_handle* devh, snapshot_capacity_t* snap)
+{
+    double start;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->ts  = snapshot_wall_time();
+    start     = snapshot_now_ms();
+    snap->err = netmd_get_disc_capacity(devh, &snap->capacity);
+    snap->ms  = snapshot_now_ms() - start;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print a capacity snapshot
+//!
+//! @param[in]  snap  snapshot
+//! @param[in]  json  1 -> JSON lines; 0 -> text
+//------------------------------------------------------------------------------
+void snapshot_print_capacity(const snapshot_capacity_t* snap, int json)
+{
+    const netmd_time* t;
+
+    if (json)
+    {
+        json_head("capacity", snap->ts, snap->ms);
+        printf(",");
+        json_str("error", (snap->err != NETMD_NO_ERROR) ? netmd_strerror(snap->err) : NULL);
+        printf(",");
+        json_time("recorded", &snap->capacity.recorded);
+        printf(",");
+        json_time("total", &snap->capacity.total);
+        printf(",");
+        json_time("available", &snap->capacity.available);
+        printf("}\n");
+        return;
+    }
+
+    t = &snap->capacity.recorded;
+    printf("Recorded:  %02d:%02d:%02d.%02d\n", t->hour, t->minute, t->second, t->frame);
+    t = &snap->capacity.total;
+    printf("Total:     %02d:%02d:%02d.%02d\n", t->hour, t->minute, t->second, t->frame);
+    t = &snap->capacity.available;
+    printf("Available: %02d:%02d:%02d.%02d\n", t->hour, t->minute, t->second, t->frame);
+}
+
+//------------------------------------------------------------------------------
+//! @brief      take a status snapshot (current track, title, position)
+//!
+//! @param[in]  devh  device handle
+//! @param[out] snap  snapshot
+//------------------------------------------------------------------------------
+void snapshot_status(netmd_dev_handle* devh, snapshot_status_t* snap)
+{
+    double start;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->ts = snapshot_wall_time();
+    start    = snapshot_now_ms();
+
+    /* track and position come with one command exchange */
+    if ((snap->err = netmd_get_track_position(devh, &snap->track, &snap->position)) == NETMD_NO_ERROR)
+    {
+        netmd_request_title(devh, snap->track, snap->title, sizeof(snap->title));
+    }
+
+    snap->ms = snapshot_now_ms() - start;
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print a status snapshot
+//!
+//! @param[in]  snap  snapshot
+//! @param[in]  json  1 -> JSON lines; 0 -> text
+//------------------------------------------------------------------------------
+void snapshot_print_status(const snapshot_status_t* snap, int json)
+{
+    const netmd_time* t = &snap->position;
+
+    if (json)
+    {
+        json_head("status", snap->ts, snap->ms);
+        printf(",");
+        json_str("error", (snap->err != NETMD_NO_ERROR) ? netmd_strerror(snap->err) : NULL);
+        printf(",\"track\":%u,", snap->track + 1);
+        json_str("title", snap->title);
+        printf(",");
+        json_time("position", t);
+        printf("}\n");
+        return;
+    }
+
+    printf("Current track: %s \n", snap->title);
+    printf("Current playback position: %02d:%02d:%02d.%02d\n", t->hour, t->minute, t->second, t->frame);
+}
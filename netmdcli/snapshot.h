@@ -0,0 +1,128 @@
+/* snapshot.h
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <libnetmd_intern.h>
+
+/*
+ * The views below are gathered in one pass (device I/O only) into a
+ * snapshot and printed afterwards, either as text or as JSON lines
+ * (one JSON object per line). Every record carries the time in ms the
+ * device queries for it took ("ms") and the wall clock time the
+ * snapshot was taken ("ts", seconds since epoch).
+ */
+
+//! one track in a disc snapshot
+typedef struct {
+    char              title[256];   //!< track title
+    int16_t           group;        //!< group id (-1 -> no group)
+    char*             group_name;   //!< group name (NULL -> no group)
+    struct netmd_track time;        //!< track length
+    unsigned char     flags;        //!< protection flags
+    unsigned char     bitrate_id;   //!< encoding
+    unsigned char     channel;      //!< channels
+    double            ms;           //!< time spent gathering this track
+} snapshot_track_t;
+
+//! disc snapshot
+typedef struct {
+    double              ts;             //!< wall clock time of snapshot
+    char*               title;          //!< disc title
+    netmd_disc_capacity capacity;       //!< disc capacity
+    int                 cap_ok;         //!< capacity could be read
+    uint16_t            track_count;    //!< number of tracks
+    snapshot_track_t*   tracks;         //!< tracks
+    double              ms;             //!< time spent gathering disc data
+    double              total_ms;       //!< time spent for the whole snapshot
+} snapshot_disc_t;
+
+//! capacity snapshot
+typedef struct {
+    double              ts;         //!< wall clock time of snapshot
+    netmd_disc_capacity capacity;   //!< disc capacity
+    netmd_error         err;        //!< query result
+    double              ms;         //!< time spent gathering
+} snapshot_capacity_t;
+
+//! status snapshot
+typedef struct {
+    double      ts;             //!< wall clock time of snapshot
+    uint16_t    track;          //!< current track (zero based)
+    char        title[256];     //!< current track title
+    netmd_time  position;       //!< playback position
+    netmd_error err;            //!< query result
+    double      ms;             //!< time spent gathering
+} snapshot_status_t;
+
+//------------------------------------------------------------------------------
+//! @brief      take a disc snapshot (disc title, capacity, all tracks)
+//!
+//! @param[in]  devh  device handle
+//! @param[in]  md    disc header
+//! @param[out] snap  snapshot (free with snapshot_disc_free())
+//!
+//! @return     0 -> ok; -1 -> error
+//------------------------------------------------------------------------------
+int snapshot_disc(netmd_dev_handle* devh, HndMdHdr md, snapshot_disc_t* snap);
+
+//------------------------------------------------------------------------------
+//! @brief      free data of a disc snapshot
+//!
+//! @param[in]  snap  snapshot
+//------------------------------------------------------------------------------
+void snapshot_disc_free(snapshot_disc_t* snap);
+
+//------------------------------------------------------------------------------
+//! @brief      print a disc snapshot
+//!
+//! @param[in]  snap  snapshot
+//! @param[in]  json  1 -> JSON lines; 0 -> text
+//------------------------------------------------------------------------------
+void snapshot_print_disc(const snapshot_disc_t* snap, int json);
+
+//------------------------------------------------------------------------------
+//! @brief      take a capacity snapshot
+//!
+//! @param[in]  devh  device handle
+//! @param[out] snap  snapshot
+//------------------------------------------------------------------------------
+void snapshot_capacity(netmd_dev_handle* devh, snapshot_capacity_t* snap);
+
+//------------------------------------------------------------------------------
+//! @brief      print a capacity snapshot
+//!
+//! @param[in]  snap  snapshot
+//! @param[in]  json  1 -> JSON lines; 0 -> text
+//------------------------------------------------------------------------------
+void snapshot_print_capacity(const snapshot_capacity_t* snap, int json);
+
+//------------------------------------------------------------------------------
+//! @brief      take a status snapshot (current track, title, position)
+//!
+//! @param[in]  devh  device handle
+//! @param[out] snap  snapshot
+//------------------------------------------------------------------------------
+void snapshot_status(netmd_dev_handle* devh, snapshot_status_t* snap);
+
+//------------------------------------------------------------------------------
+//! @brief      print a status snapshot
+//!
+//! @param[in]  snap  snapshot
+//! @param[in]  json  1 -> JSON lines; 0 -> text
+//------------------------------------------------------------------------------
+void snapshot_print_status(const snapshot_status_t* snap, int json);
+
+#endif /* SNAPSHOT_H */
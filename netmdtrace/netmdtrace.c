@@ -0,0 +1,196 @@
+/* netmdtrace.c
+ *
+ * Offline decoder for libnetmd binary trace dumps (see netmd_trace.h).
+ *
+ * This file is part of libnetmd.
+ *
+ * libnetmd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Libnetmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netmd_trace.h>
+
+//------------------------------------------------------------------------------
+//! @brief      name of a record type
+//!
+//! @param[in]  type  record type
+//!
+//! @return     name
+//------------------------------------------------------------------------------
+static const char* type_name(uint16_t type)
+{
+    switch (type)
+    {
+    case NETMD_TRACE_CMD:      return "CMD";
+    case NETMD_TRACE_RSP:      return "RSP";
+    case NETMD_TRACE_POLL:     return "POLL";
+    case NETMD_TRACE_BULK_OUT: return "BULK>";
+    case NETMD_TRACE_BULK_IN:  return "BULK<";
+    case NETMD_TRACE_ERROR:    return "ERROR";
+    default:                   return "?";
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      name of an AV/C ctype / response code
+//!
+//! @param[in]  code  first byte of command / response
+//!
+//! @return     name
+//------------------------------------------------------------------------------
+static const char* avc_name(uint8_t code)
+{
+    switch (code)
+    {
+    case 0x00: return "control";
+    case 0x01: return "status";
+    case 0x03: return "notify";
+    case 0x08: return "not implemented";
+    case 0x09: return "accepted";
+    case 0x0a: return "rejected";
+    case 0x0c: return "implemented";
+    case 0x0f: return "interim";
+    default:   return "";
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print stored payload as hex
+//!
+//! @param[in]  rec   trace record
+//------------------------------------------------------------------------------
+static void print_data(const netmd_trace_rec_t* rec)
+{
+    uint16_t i;
+
+    for (i = 0; (i < rec->len) && (i < NETMD_TRACE_DATA); i++)
+    {
+        printf("%02x ", rec->data[i]);
+    }
+
+    if (rec->size > rec->len)
+    {
+        printf("...");
+    }
+}
+
+//------------------------------------------------------------------------------
+//! @brief      print one record
+//!
+//! @param[in]  rec    trace record
+//! @param[in]  first  time stamp of first record
+//! @param[in]  prev   time stamp of previous record
+//------------------------------------------------------------------------------
+static void print_record(const netmd_trace_rec_t* rec, uint64_t first, uint64_t prev)
+{
+    uint32_t dur = 0;
+
+    printf("%8llu %12.3f %+10.3f %08x %-5s ", (unsigned long long)rec->seq,
+           (rec->ts_us - first) / 1000.0, (rec->ts_us - prev) / 1000.0,
+           rec->dev, type_name(rec->type));
+
+    switch (rec->type)
+    {
+    case NETMD_TRACE_CMD:
+    case NETMD_TRACE_RSP:
+        printf("ret=%-6d len=%-4u [%s] ", rec->value, rec->size,
+               (rec->len > 0) ? avc_name(rec->data[0]) : "");
+        print_data(rec);
+        break;
+
+    case NETMD_TRACE_POLL:
+        printf("ret=%-6d ", rec->value);
+        print_data(rec);
+        break;
+
+    case NETMD_TRACE_BULK_OUT:
+    case NETMD_TRACE_BULK_IN:
+        if (rec->len >= sizeof(dur))
+        {
+            memcpy(&dur, rec->data, sizeof(dur));
+        }
+        printf("ret=%-6d %u bytes in %.3f ms (%.1f KiB/s)", rec->value, rec->size, dur / 1000.0,
+               (dur > 0) ? ((rec->size / 1024.0) / (dur / 1000000.0)) : 0.0);
+        break;
+
+    case NETMD_TRACE_ERROR:
+        printf("err=%d", rec->value);
+        break;
+
+    default:
+        printf("value=%d size=%u ", rec->value, rec->size);
+        print_data(rec);
+        break;
+    }
+
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    netmd_trace_file_t hdr;
+    netmd_trace_rec_t  rec;
+    uint64_t first = 0, prev = 0;
+    uint32_t i;
+    FILE*    f;
+    int      ret = 0;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <trace dump>\n", argv[0]);
+        return 1;
+    }
+
+    if ((f = fopen(argv[1], "rb")) == NULL)
+    {
+        fprintf(stderr, "Can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    if ((fread(&hdr, sizeof(hdr), 1, f) != 1) || memcmp(hdr.magic, NETMD_TRACE_MAGIC, sizeof(hdr.magic)))
+    {
+        fprintf(stderr, "%s is no trace dump\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+
+    if (hdr.rec_size != sizeof(netmd_trace_rec_t))
+    {
+        fprintf(stderr, "Record size %u doesn't match %u (dump from another version or platform?)\n",
+                hdr.rec_size, (unsigned)sizeof(netmd_trace_rec_t));
+        fclose(f);
+        return 1;
+    }
+
+    printf("%8s %12s %10s %8s %-5s\n", "seq", "time[ms]", "delta[ms]", "device", "type");
+
+    for (i = 0; i < hdr.count; i++)
+    {
+        if (fread(&rec, sizeof(rec), 1, f) != 1)
+        {
+            fprintf(stderr, "Dump truncated after %u of %u records\n", i, hdr.count);
+            ret = 1;
+            break;
+        }
+
+        if (i == 0)
+        {
+            first = prev = rec.ts_us;
+        }
+
+        print_record(&rec, first, prev);
+        prev = rec.ts_us;
+    }
+
+    fclose(f);
+    return ret;
+}